@@ -28,6 +28,17 @@ public:
 
         return m_instance;
     }
+    /* 首次获取实例时用给定的参数构造*/
+    template< typename A1, typename A2 >
+    static T* GetInstance( A1 a1, A2 a2 )
+    {
+        if( m_instance == NULL )
+        {
+            m_instance = new T( a1, a2 );
+        }
+
+        return m_instance;
+    }
     ~Singleton()
     {
         if( m_instance != NULL )
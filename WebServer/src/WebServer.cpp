@@ -15,30 +15,67 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <cassert>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "./locker.h"
 #include "./threadpool.h"
 #include "./http_conn.h"
 #include "../static/parse_cfg/parse_configure_file.h"
 #include "./Singleton.h"
+#include "./resp_cache.h"
+#include "./server_config.h"
+#include "./reactor.h"
+#include "./cpu_affinity.h"
+#include "./async_log.h"
+#include "./tls.h"
+#include "./upstream.h"
+#include "./trace.h"
+#include "./prefork.h"
+#include "./cgi_cache.h"
+#include "./alloc_count.h"
 
 
-#define MAX_FD 65536
-
-/* 最大监听事件数*/
-#define MAX_EVENT_NUMBER 10000
-
 /* 最大路径长度*/
+#ifndef PATH_MAX
 #define PATH_MAX 1024
+#endif
 
 /* 程序配置文件路径*/
 #define CONF_PATH  "../etc/web.cfg"
 
 char conf_path[ PATH_MAX ] = {0};
+/* 程序所在目录, 配置中的相对路径以它为起点*/
+static char exe_dir[ PATH_MAX ] = {0};
+/* 程序自身的绝对路径, 热升级时exec这个路径上(已被替换)的新程序*/
+static char exe_path[ PATH_MAX ] = {0};
+/* 启动参数, 热升级时原样传给新程序*/
+static char **g_argv = NULL;
+
+/* 热升级时通过环境变量告诉新进程: 继承的监听套接字, 以及就绪后通知旧进程的管道*/
+#define ENV_LISTEN_FDS "WEBSERVER_LISTEN_FDS"
+#define ENV_TLS_LISTEN_FDS "WEBSERVER_TLS_LISTEN_FDS"
+#define ENV_READY_FD   "WEBSERVER_READY_FD"
 
 extern int addfd( int epollfd, int fd, bool one_shot );
 extern int removefd( int epollfd, int fd );
+extern int get_root_path( char *root_path );
+extern int setnonblocking( int fd );
+
+/* 信号管道: 信号处理函数只往管道里写入信号值, 由主循环统一处理*/
+static int sig_pipefd[ 2 ];
+
+/* 信号处理函数*/
+void sig_handler( int sig )
+{
+    /* 保留原来的errno, 在函数最后恢复, 以保证函数的可重入性*/
+    int save_errno = errno;
+    int msg = sig;
+    send( sig_pipefd[ 1 ], ( char* )&msg, 1, 0 );
+    errno = save_errno;
+}
 
 /* 注册信号及其信号处理函数*/
 void addsig( int sig, void( handler )(int) )
@@ -52,14 +89,6 @@ void addsig( int sig, void( handler )(int) )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
-/* 输出错误信息, 并将该信息发送给服务器，然后关闭连接*/
-void show_error( int connfd, const char *info )
-{
-    printf( "%s", info );
-    write( connfd, info, strlen( info ) );
-    close( connfd );
-}
-
 /* 获取当前运行程序的所在路径, 是为了得到配置文件的绝对路径*/
 static int get_path()
 {
@@ -68,11 +97,12 @@ static int get_path()
     char *ptr = NULL;
 
     /* 通过/proc/self/exe文件获取当前程序的运行绝对路径，并将路径放到 buff 中*/
-    ret = readlink("/proc/self/exe", buff, PATH_MAX);
+    ret = readlink("/proc/self/exe", buff, PATH_MAX - 1);
     if (ret < 0)
     {
         return -1;
     }
+    strcpy( exe_path, buff );
 
     /* 刚才获取的绝对路径包含了程序名，而我们需要的是当前程序所在的目录，所以不需要程序名( 找到最后一个'/', 并将其后面的部分截断 )*/
     ptr = strrchr(buff, '/');
@@ -80,6 +110,7 @@ static int get_path()
     {
         *ptr = '\0';
     }
+    strcpy( exe_dir, buff );
 
     /* 将配置文件路径组装好并填充到 conf_path 中*/
     snprintf(conf_path, PATH_MAX, "%s/%s", buff, CONF_PATH);
@@ -87,166 +118,962 @@ static int get_path()
     return 0;
 }
 
-int get_ip_port(char *conf_path, char *ip, int *port)
+/* 把配置中的相对路径转换为以程序所在目录为起点的路径, 空路径保持为空*/
+static void resolve_path( const char *path, char *resolved )
 {
-    if( conf_path == NULL )
+    int n;
+    if( path[ 0 ] == '\0' || path[ 0 ] == '/' )
     {
-        printf("init_data arguments error!\n");
-        return -1;
+        n = snprintf( resolved, PATH_MAX, "%s", path );
+    }
+    else
+    {
+        n = snprintf( resolved, PATH_MAX, "%s/%s", exe_dir, path );
+    }
+    if( n >= PATH_MAX )
+    {
+        printf( "path too long, truncated: %s\n", path );
+    }
+}
+
+/* 工作线程池, 信号处理时使用*/
+static threadpool< pool_task > *g_pool = NULL;
+
+/* 所有反应堆, 热升级和优雅退出时使用*/
+static reactor **g_reactors = NULL;
+static int g_reactor_number = 0;
+/* 正在启动的新进程, 以及等待它就绪的管道读端*/
+static pid_t g_upgrade_pid = -1;
+static int g_upgrade_ready_fd = -1;
+/* 热升级启动时旧进程的就绪管道写端, 本进程开始accept后写入, -1表示不是热升级启动的*/
+static int g_notify_fd = -1;
+
+/* prefork模式(web_server_info.worker_processes大于0): master进程创建所有监听套接字并拉起工作进程,
+ * 自己不处理连接, 只负责重新拉起退出的工作进程、转发信号和热升级;
+ * 每个工作进程都是一个完整的单进程服务器(日志、线程池、缓存、上游连接池、反应堆), 互不共享
+ */
+struct worker_process
+{
+    pid_t pid;                 /* 0表示没有在运行*/
+    long long spawned_ms;      /* 启动的时间(单调时钟, 毫秒)*/
+    long long respawn_ms;      /* 退出后在该时间之后重新拉起*/
+    int backoff_ms;            /* 连续启动失败时重新拉起的间隔, 每次加倍*/
+};
+static int g_worker_processes = 0;          /* 工作进程数, 0表示单进程模式*/
+static int g_worker_index = -1;             /* 本进程是第几个工作进程, 单进程模式和master中为-1*/
+static pid_t g_master_pid = 0;
+static worker_process *g_workers = NULL;
+static bool g_master_draining = false;
+static long long g_master_deadline = 0;     /* 超过该时间还没退出的工作进程强制结束*/
+/* master持有的监听套接字, 第w个工作进程使用其中[w * reactor_number, (w + 1) * reactor_number)的部分;
+ * 工作进程退出后重新拉起的进程接着使用同样的套接字, 排队的连接不会丢失
+ */
+static int g_listen_fds[ MAX_LISTEN_FDS ];
+static int g_listen_count = 0;
+static int g_tls_listen_fds[ MAX_LISTEN_FDS ];
+static int g_tls_listen_count = 0;
+
+/* 按配置设置线程池的各个调度类: 静态请求和CGI请求分别排队, 各有自己的线程数范围和nice值*/
+static bool apply_pool_config( threadpool< pool_task > *pool, const server_config *cfg )
+{
+    bool ok = pool->set_class( http_conn::SCHED_STATIC, "static", cfg->thread_number,
+                               cfg->max_thread_number, cfg->max_requests, cfg->nice )
+           && pool->set_class( http_conn::SCHED_CGI, "cgi", cfg->cgi_thread_number,
+                               cfg->cgi_max_thread_number, cfg->cgi_max_requests, cfg->cgi_nice );
+    pool->set_adaptive( cfg->queue_delay_target_us, cfg->idle_timeout_ms );
+    pool->set_shedding( cfg->shed_target_us, cfg->shed_interval_ms );
+    pool->set_cpu_affinity( cfg->worker_cpus, cfg->worker_cpu_count );
+    return ok;
+}
+
+/* 生成服务器的运行状态: 连接数、路由条数、线程池各调度类的队列长度和排队时间等, 返回长度
+ * SIGUSR1的统计输出和内置的状态页(路由的handler="status")共用
+ */
+int server_status( char *buf, int size )
+{
+    int len = 0;
+#define STATUS_APPEND( ... ) \
+    do { \
+        int n = snprintf( buf + len, size - len, __VA_ARGS__ ); \
+        len += n < size - len ? n : size - len - 1; \
+    } while( 0 )
+
+    STATUS_APPEND( "connections: %d\n", __atomic_load_n( &http_conn::m_user_count, __ATOMIC_RELAXED ) );
+    STATUS_APPEND( "routes: %d\n", current_config()->routes->size() );
+    /* 请求临时内存向堆申请的累计次数, 稳态下应该保持不变*/
+    STATUS_APPEND( "arena heap allocations: %lld\n", arena::heap_allocs() );
+    /* 以ALLOC_COUNT编译时统计整个进程的堆分配次数, 长连接上的请求不应该让它增长*/
+    if( alloc_count() >= 0 )
+    {
+        STATUS_APPEND( "heap allocations: %lld\n", alloc_count() );
+    }
+    /* prefork模式下各工作进程的连接数和请求数(共享内存中的统计)*/
+    len += prefork_status( buf + len, size - len );
+    len += upstream_status( buf + len, size - len );
+    len += Singleton< cgi_cache >::GetInstance()->status( buf + len, size - len );
+    /* 各反应堆事件循环的轮数、每轮处理时间和accept/拒绝的连接数*/
+    if( g_reactor_number > 0 && size - len > 1 )
+    {
+        len += reactor::status_header( buf + len, size - len );
+        for( int i = 0; i < g_reactor_number && size - len > 1; ++i )
+        {
+            len += g_reactors[ i ]->status( buf + len, size - len );
+        }
+    }
+    STATUS_APPEND( "%-8s %7s %7s %7s %12s %12s %12s %12s %6s %12s %10s %10s %10s\n", "class", "threads",
+                   "busy", "queued", "oldest_us", "avg_wait_us", "max_wait_us", "avg_serv_us", "util",
+                   "completed", "rejected", "shed", "overloaded" );
+    int count = g_pool ? g_pool->class_count() : 0;
+    for( int i = 0; i < count; ++i )
+    {
+        threadpool_stats st;
+        if( ! g_pool->get_stats( i, &st ) )
+        {
+            continue;
+        }
+        STATUS_APPEND( "%-8s %7d %7d %7d %12lld %12lld %12lld %12lld %5.1f%% %12lld %10lld %10lld %10s\n",
+                       g_pool->class_name( i ), st.live_threads, st.busy_threads, st.queued,
+                       st.oldest_wait_us, st.avg_wait_us, st.max_wait_us, st.avg_service_us,
+                       st.utilization * 100, st.completed, st.rejected, st.shed,
+                       st.overloaded ? "yes" : "no" );
+    }
+#undef STATUS_APPEND
+    return len;
+}
+
+/* 输出服务器状态(收到SIGUSR1时调用)*/
+static void dump_pool_stats()
+{
+    char buf[ 8192 ];
+    server_status( buf, sizeof( buf ) );
+    fputs( buf, stdout );
+    fflush( stdout );
+}
+
+/* 重新加载配置文件(收到SIGHUP时调用)
+ * 生成新的配置快照并原子地发布, 然后把新参数应用到线程池和缓存上;
+ * 各反应堆在下一轮事件循环中自行调整listen队列长度和事件数组, 已有连接不受影响
+ */
+static void reload_config()
+{
+    server_config *cfg = load_server_config( conf_path );
+    if( ! cfg )
+    {
+        printf( "reload config failed, keep the current config\n" );
+        return;
+    }
+
+    /* 监听地址、连接数组大小、反应堆及CPU绑定、缓存开关只能在启动时确定, 保持原值*/
+    const server_config *old = current_config();
+    if( strcmp( cfg->ip, old->ip ) != 0 || cfg->port != old->port
+        || cfg->max_fd != old->max_fd || cfg->cache_enable != old->cache_enable
+        || cfg->reactor_number != old->reactor_number || cfg->worker_processes != old->worker_processes
+        || cfg->tls_enable != old->tls_enable
+        || cfg->tls_port != old->tls_port || strcmp( cfg->tls_cert_file, old->tls_cert_file ) != 0
+        || strcmp( cfg->tls_key_file, old->tls_key_file ) != 0 || cfg->tls_ktls != old->tls_ktls )
+    {
+        printf( "ip, port, max_fd, reactor_number, worker_processes, response_cache.enable and tls "
+                "take effect after restart\n" );
+    }
+    /* 上游服务器组带着各反应堆的连接池和健康检查线程, 同样只在启动时创建*/
+    if( cfg->upstream_count != old->upstream_count
+        || memcmp( cfg->upstreams, old->upstreams, cfg->upstream_count * sizeof( upstream_config ) ) != 0 )
+    {
+        printf( "upstreams take effect after restart\n" );
+    }
+    /* 路由按名字引用上游服务器组, 新解析出的列表用完即可释放*/
+    delete [] cfg->upstreams;
+    cfg->upstreams = old->upstreams;
+    cfg->upstream_count = old->upstream_count;
+    cfg->slow_ring_size = old->slow_ring_size;
+    strcpy( cfg->ip, old->ip );
+    cfg->port = old->port;
+    cfg->max_fd = old->max_fd;
+    cfg->reactor_number = old->reactor_number;
+    cfg->worker_processes = old->worker_processes;
+    cfg->cache_enable = old->cache_enable;
+    cfg->tls_enable = old->tls_enable;
+    cfg->tls_port = old->tls_port;
+    strcpy( cfg->tls_cert_file, old->tls_cert_file );
+    strcpy( cfg->tls_key_file, old->tls_key_file );
+    cfg->tls_ktls = old->tls_ktls;
+
+    publish_config( cfg );
+    /* prefork模式的master没有线程池和缓存, 只保存新快照, 之后重新拉起的工作进程使用它*/
+    if( ! g_pool )
+    {
+        return;
+    }
+
+    /* 配合外部的日志轮转工具: 日志文件被移走后重新打开*/
+    log_reopen();
+    trace_set_threshold( cfg->slow_request_ms );
+
+    apply_pool_config( g_pool, cfg );
+    if( cfg->cache_enable )
+    {
+        Singleton< resp_cache >::GetInstance()->configure( cfg->cache_max_file_size,
+                                                           cfg->cache_max_total_bytes );
+    }
+    Singleton< cgi_cache >::GetInstance()->configure( cfg->cgi_cache_max_bytes, cfg->cgi_cache_max_entry );
+    printf( "config reloaded: static threads %d-%d, cgi threads %d-%d, backlog %d, events %d, "
+            "read_buf %d, write_buf %d\n", cfg->thread_number, cfg->max_thread_number,
+            cfg->cgi_thread_number, cfg->cgi_max_thread_number, cfg->listen_backlog,
+            cfg->max_event_number, cfg->read_buffer_size, cfg->write_buffer_size );
+}
+
+/* 给所有在运行的工作进程发送信号*/
+static void signal_workers( int sig )
+{
+    for( int i = 0; i < g_worker_processes; ++i )
+    {
+        if( g_workers[ i ].pid > 0 )
+        {
+            kill( g_workers[ i ].pid, sig );
+        }
+    }
+}
+
+/* master开始优雅退出: 关闭自己持有的监听套接字, 让各工作进程优雅退出, 它们都退出后master退出*/
+static void master_drain()
+{
+    if( g_master_draining )
+    {
+        return;
+    }
+    g_master_draining = true;
+    /* 工作进程的drain_timeout_ms之后再多等一会儿, 仍未退出的强制结束*/
+    g_master_deadline = reactor::now_ms() + current_config()->drain_timeout_ms + 5000;
+    /* 工作进程停止accept时会关闭自己的副本, master的副本也要关闭, 监听套接字才会真正关闭*/
+    for( int i = 0; i < g_listen_count; ++i )
+    {
+        close( g_listen_fds[ i ] );
+    }
+    for( int i = 0; i < g_tls_listen_count; ++i )
+    {
+        close( g_tls_listen_fds[ i ] );
+    }
+    g_listen_count = g_tls_listen_count = 0;
+    printf( "draining worker processes\n" );
+    signal_workers( SIGQUIT );
+}
+
+/* 开始优雅退出: 所有反应堆停止accept、关闭空闲连接, 在drain_timeout_ms内等待其余连接处理完*/
+static void begin_drain()
+{
+    if( g_worker_processes > 0 && g_worker_index < 0 )
+    {
+        master_drain();
+        return;
+    }
+    if( __atomic_exchange_n( &http_conn::m_draining, 1, __ATOMIC_SEQ_CST ) )
+    {
+        return;
+    }
+    int timeout = current_config()->drain_timeout_ms;
+    printf( "draining %d connections, timeout %d ms\n", http_conn::m_user_count, timeout );
+    long long deadline = reactor::now_ms() + timeout;
+    for( int i = 0; i < g_reactor_number; ++i )
+    {
+        g_reactors[ i ]->begin_drain( deadline );
+    }
+}
+
+/* 新进程就绪管道可读: 读到就绪通知则旧进程开始退出, 读到文件结束说明新进程启动失败*/
+static bool on_upgrade_ready( int fd )
+{
+    char c;
+    int ret = read( fd, &c, 1 );
+    if( ret < 0 && errno == EAGAIN )
+    {
+        return true;
+    }
+    if( ret == 1 )
+    {
+        printf( "new process %d is ready\n", g_upgrade_pid );
+        begin_drain();
+    }
+    else
+    {
+        printf( "new process %d failed to start, keep serving\n", g_upgrade_pid );
+        waitpid( g_upgrade_pid, NULL, 0 );
+    }
+    g_upgrade_pid = -1;
+    return false;
+}
+
+/* 热升级: fork并exec程序路径上的新程序, 通过继承的描述符把所有监听套接字交给它
+ * 新进程监听就绪后写就绪管道, 旧进程收到通知后才停止accept, 期间不会有连接被拒绝
+ */
+static void start_upgrade()
+{
+    if( g_worker_index >= 0 )
+    {
+        printf( "worker %d: hot upgrade is driven by the master process\n", g_worker_index );
+        return;
+    }
+    if( g_upgrade_pid > 0 || http_conn::m_draining || g_master_draining )
+    {
+        printf( "upgrade already in progress\n" );
+        return;
+    }
+
+    /* 两端都是close-on-exec的, 以免同时fork的CGI进程持有写端, 使新进程失败时读不到文件结束*/
+    int ready[ 2 ];
+    if( pipe2( ready, O_CLOEXEC ) < 0 )
+    {
+        perror( "pipe:" );
+        return;
+    }
+    setnonblocking( ready[ 0 ] );
+
+    /* 要交给新进程的监听套接字: prefork模式下是master持有的全部, 否则是各反应堆的*/
+    if( g_worker_processes == 0 )
+    {
+        g_listen_count = g_tls_listen_count = 0;
+        for( int i = 0; i < g_reactor_number; ++i )
+        {
+            g_listen_fds[ g_listen_count++ ] = g_reactors[ i ]->listen_fd();
+            if( g_reactors[ i ]->tls_listen_fd() >= 0 )
+            {
+                g_tls_listen_fds[ g_tls_listen_count++ ] = g_reactors[ i ]->tls_listen_fd();
+            }
+        }
+    }
+
+    /* fork之后的子进程中只能调用异步信号安全的函数, 所以先把新的环境变量表准备好*/
+    static char listen_env[ 64 + 12 * MAX_LISTEN_FDS ];
+    static char tls_listen_env[ 64 + 12 * MAX_LISTEN_FDS ];
+    static char ready_env[ 64 ];
+    int len = snprintf( listen_env, sizeof( listen_env ), "%s=", ENV_LISTEN_FDS );
+    int tls_len = snprintf( tls_listen_env, sizeof( tls_listen_env ), "%s=", ENV_TLS_LISTEN_FDS );
+    for( int i = 0; i < g_listen_count; ++i )
+    {
+        len += snprintf( listen_env + len, sizeof( listen_env ) - len, i ? ",%d" : "%d", g_listen_fds[ i ] );
+    }
+    for( int i = 0; i < g_tls_listen_count; ++i )
+    {
+        tls_len += snprintf( tls_listen_env + tls_len, sizeof( tls_listen_env ) - tls_len,
+                             i ? ",%d" : "%d", g_tls_listen_fds[ i ] );
+    }
+    snprintf( ready_env, sizeof( ready_env ), "%s=%d", ENV_READY_FD, ready[ 1 ] );
+
+    int env_count = 0;
+    while( environ[ env_count ] )
+    {
+        env_count++;
+    }
+    char **envp = new char*[ env_count + 4 ];
+    int n = 0;
+    for( int i = 0; i < env_count; ++i )
+    {
+        if( strncmp( environ[ i ], "WEBSERVER_", 10 ) != 0 )
+        {
+            envp[ n++ ] = environ[ i ];
+        }
+    }
+    envp[ n++ ] = listen_env;
+    envp[ n++ ] = tls_listen_env;
+    envp[ n++ ] = ready_env;
+    envp[ n ] = NULL;
+
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        /* 监听套接字和就绪管道写端是close-on-exec的, 在子进程中清除该标志, 让新程序继承它们*/
+        for( int i = 0; i < g_listen_count; ++i )
+        {
+            fcntl( g_listen_fds[ i ], F_SETFD, 0 );
+        }
+        for( int i = 0; i < g_tls_listen_count; ++i )
+        {
+            fcntl( g_tls_listen_fds[ i ], F_SETFD, 0 );
+        }
+        fcntl( ready[ 1 ], F_SETFD, 0 );
+        execve( exe_path, g_argv, envp );
+        _exit( 1 );
+    }
+    delete [] envp;
+    close( ready[ 1 ] );
+    if( pid < 0 )
+    {
+        perror( "fork:" );
+        close( ready[ 0 ] );
+        return;
+    }
+
+    printf( "upgrading: started %s as process %d\n", exe_path, pid );
+    g_upgrade_pid = pid;
+    /* master没有反应堆, 在自己的监督循环中等待*/
+    if( g_worker_processes > 0 )
+    {
+        g_upgrade_ready_fd = ready[ 0 ];
+    }
+    else
+    {
+        g_reactors[ 0 ]->set_watch_fd( ready[ 0 ], on_upgrade_ready );
+    }
+}
+
+/* 解析从旧进程继承的监听套接字列表(环境变量name), 返回个数*/
+static int inherited_listen_fds( const char *name, int *fds, int max )
+{
+    const char *env = getenv( name );
+    int count = 0;
+    while( env && *env && count < max )
+    {
+        char *end = NULL;
+        int fd = strtol( env, &end, 10 );
+        if( end == env )
+        {
+            break;
+        }
+        fds[ count++ ] = fd;
+        env = ( *end == ',' ) ? end + 1 : end;
+    }
+    return count;
+}
+
+/* 主反应堆收到信号后的处理*/
+static void on_signal( int sig )
+{
+    if( sig == SIGHUP )
+    {
+        reload_config();
+    }
+    else if( sig == SIGUSR1 )
+    {
+        dump_pool_stats();
+    }
+    else if( sig == SIGUSR2 )
+    {
+        start_upgrade();
     }
+    else if( sig == SIGQUIT || sig == SIGTERM )
+    {
+        begin_drain();
+    }
+}
 
-    /* 打开配置文件*/
-    if( open_conf( conf_path ) < 0 )
+/* 运行一个服务进程: 打开日志, 创建线程池和各反应堆并运行事件循环, 直到优雅退出
+ * 单进程模式下就是整个服务器; prefork模式下是一个工作进程, 监听套接字都来自master
+ * @inherited, @inherited_tls : 继承来的监听套接字, 依次交给各反应堆, 不够时新建, 多出的关闭
+ * @cpu_offset : 第i个反应堆绑定到第(cpu_offset + i)个反应堆CPU上, 使各工作进程的反应堆错开
+ */
+static int run_server( const server_config *cfg, int *inherited, int inherited_count,
+                       int *inherited_tls, int inherited_tls_count, int cpu_offset )
+{
+    /* 打开访问日志和错误日志, 此后各线程的日志都由后台线程异步写出*/
+    char access_log[ PATH_MAX ] = {0};
+    char error_log[ PATH_MAX ] = {0};
+    resolve_path( cfg->access_log, access_log );
+    resolve_path( cfg->error_log, error_log );
+    if( ! log_open( access_log, error_log, cfg->log_ring_size, cfg->log_flush_interval_ms,
+                    cfg->log_rotate_size, cfg->log_rotate_keep ) )
+    {
+        printf( "open log failed\n" );
+        return -1;
+    }
+    /* 校准请求阶段计时用的时钟, 分配慢请求环形缓冲区*/
+    if( ! trace_init( cfg->slow_ring_size ) )
     {
+        printf( "init request tracing failed\n" );
         return -1;
     }
+    trace_set_threshold( cfg->slow_request_ms );
+
+    /* 加载HTTPS的证书和私钥*/
+    if( cfg->tls_enable )
+    {
+        char cert_file[ PATH_MAX ] = {0};
+        char key_file[ PATH_MAX ] = {0};
+        resolve_path( cfg->tls_cert_file, cert_file );
+        resolve_path( cfg->tls_key_file, key_file );
+        if( ! tls_init( cert_file, key_file, cfg->tls_ktls, cfg->http2_enable ) )
+        {
+            printf( "load tls certificate %s failed\n", cert_file );
+            return -1;
+        }
+    }
+
+    /* 初始化热点小文件的完整响应缓存*/
+    if( cfg->cache_enable )
+    {
+        char root_path[ PATH_MAX ] = {0};
+        get_root_path( root_path );
+        Singleton< resp_cache >::GetInstance()->init( root_path, cfg->cache_max_file_size,
+                                                      cfg->cache_max_total_bytes, cfg->cache_warm_up );
+    }
 
-    const char *temp = "web_server_info.ip";
-    /* 获取ip*/
-    if( get_val_single( temp, ip, TYPE_STRING ) < 0 )
+    /* 可缓存的CGI路由的输出缓存*/
+    Singleton< cgi_cache >::GetInstance()->configure( cfg->cgi_cache_max_bytes, cfg->cgi_cache_max_entry );
+
+    /* 创建反向代理的上游服务器组, 每个反应堆一个空闲连接池*/
+    if( ! upstream_init( cfg->upstreams, cfg->upstream_count, cfg->reactor_number ) )
     {
+        printf( "init upstreams failed\n" );
         return -1;
     }
-    /* 获取端口号*/
-    const char *temp2 = "web_server_info.port";
-    if( get_val_single( temp2, port, TYPE_INT ) < 0 )
+
+    /* 创建线程池及其调度类, 并把工作线程绑定到配置的CPU集合上*/
+    threadpool< pool_task > *pool =
+        Singleton< threadpool< pool_task > >::GetInstance( cfg->thread_number, cfg->max_requests );
+    if( ! apply_pool_config( pool, cfg ) )
     {
+        printf( "create thread pool classes failed\n" );
         return -1;
     }
+    g_pool = pool;
+
+    /* 以描述符为下标的连接表, 连接对象本身由接受它的反应堆从自己的连接池中分配*/
+    int max_fd = cfg->max_fd;
+    http_conn **users = new http_conn*[ max_fd ];
+    assert( users );
+    memset( users, 0, sizeof( http_conn* ) * max_fd );
+
+    /* 确定各反应堆绑定的CPU: 优先使用配置的reactor_cpus, 否则使用网卡中断所在的CPU*/
+    int reactor_cpus[ MAX_CONFIG_CPUS ];
+    int reactor_cpu_count = cfg->reactor_cpu_count;
+    memcpy( reactor_cpus, cfg->reactor_cpus, sizeof( int ) * reactor_cpu_count );
+    if( reactor_cpu_count == 0 && cfg->nic[ 0 ] )
+    {
+        reactor_cpu_count = nic_irq_cpus( cfg->nic, reactor_cpus, MAX_CONFIG_CPUS );
+        printf( "%s interrupts are served by %d cpus\n", cfg->nic, reactor_cpu_count );
+    }
+
+    /* 继承的个数与反应堆数不同时, 多出的反应堆新建套接字(要求旧进程也使用了SO_REUSEPORT,
+     * 即反应堆数都大于1), 多出的继承套接字关闭; 新配置关闭了HTTPS时, 继承来的HTTPS监听套接字全部关闭
+     */
+    int tls_number = cfg->tls_enable ? cfg->reactor_number : 0;
+    bool reuseport = cfg->reactor_number > 1 || g_worker_index >= 0;
+
+    /* 创建反应堆, 多个反应堆时各自用SO_REUSEPORT监听同一端口*/
+    int reactor_number = cfg->reactor_number;
+    reactor **reactors = new reactor*[ reactor_number ];
+    for( int i = 0; i < reactor_number; ++i )
+    {
+        int cpu = reactor_cpu_count > 0 ? reactor_cpus[ ( cpu_offset + i ) % reactor_cpu_count ] : -1;
+        int fd = i < inherited_count ? inherited[ i ] : -1;
+        reactors[ i ] = new reactor( i, pool, users, max_fd );
+        if( ! reactors[ i ]->listen_on( cfg, cpu, reuseport, fd ) )
+        {
+            printf( "reactor %d listen on %s:%d failed\n", i, cfg->ip, cfg->port );
+            return -1;
+        }
+        fd = i < inherited_tls_count ? inherited_tls[ i ] : -1;
+        if( i < tls_number && ! reactors[ i ]->listen_tls_on( cfg, reuseport, fd ) )
+        {
+            printf( "reactor %d listen on %s:%d failed\n", i, cfg->ip, cfg->tls_port );
+            return -1;
+        }
+    }
+    for( int i = reactor_number; i < inherited_count; ++i )
+    {
+        close( inherited[ i ] );
+    }
+    for( int i = tls_number; i < inherited_tls_count; ++i )
+    {
+        close( inherited_tls[ i ] );
+    }
+    g_reactors = reactors;
+    g_reactor_number = reactor_number;
+
+    /* 创建信号管道, 由主反应堆处理: SIGHUP重新加载配置, SIGUSR1输出线程池统计,
+     * SIGUSR2热升级, SIGQUIT/SIGTERM优雅退出
+     */
+    int ret = socketpair( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sig_pipefd );
+    assert( ret != -1 );
+    setnonblocking( sig_pipefd[ 1 ] );
+    reactors[ 0 ]->set_signal_pipe( sig_pipefd[ 0 ], on_signal );
+    addsig( SIGHUP, sig_handler );
+    addsig( SIGUSR1, sig_handler );
+    addsig( SIGUSR2, sig_handler );
+    addsig( SIGQUIT, sig_handler );
+    addsig( SIGTERM, sig_handler );
+
+    /* 其余反应堆在各自的线程中运行, 主反应堆在主线程中运行*/
+    for( int i = 1; i < reactor_number; ++i )
+    {
+        if( ! reactors[ i ]->start() )
+        {
+            printf( "start reactor %d failed\n", i );
+            return -1;
+        }
+    }
 
-    /* 关闭配置文件并释放资源*/
-    close_conf();
+    /* 所有反应堆都已在监听, 通知旧进程可以停止accept了; prefork模式下由master在所有工作进程就绪后通知*/
+    if( g_notify_fd >= 0 )
+    {
+        write( g_notify_fd, "1", 1 );
+        close( g_notify_fd );
+        g_notify_fd = -1;
+    }
+    prefork_ready();
+
+    reactors[ 0 ]->run();
+
+    /* 优雅退出: 等其余反应堆也结束事件循环, 再销毁线程池(等待工作线程退出)*/
+    for( int i = 1; i < reactor_number; ++i )
+    {
+        reactors[ i ]->join();
+    }
+    printf( "exit with %d connections left\n", http_conn::m_user_count );
+    close( sig_pipefd[ 0 ] );
+    close( sig_pipefd[ 1 ] );
+    delete [] users;
+    delete pool;
+    log_close();
     return 0;
 }
 
-int main(int argc, char* argv[])
+/* 第index个工作进程: 在fork出的子进程中运行, 返回进程的退出码*/
+static int worker_main( int index )
 {
-    /* 从配置文件中获取ip地址和端口*/
-    char ip[33] = {0};
-    int port;
-    get_path();
+    g_worker_index = index;
+    /* master意外退出时工作进程也优雅退出, 不留下没人监督的进程*/
+    prctl( PR_SET_PDEATHSIG, SIGQUIT );
+    if( getppid() != g_master_pid )
+    {
+        return 0;
+    }
+    addsig( SIGCHLD, SIG_DFL );
 
-    if( get_ip_port(conf_path, ip, &port) < 0 )
+    /* master的信号管道、热升级管道, 以及其他工作进程的监听套接字都与本进程无关*/
+    close( sig_pipefd[ 0 ] );
+    close( sig_pipefd[ 1 ] );
+    if( g_upgrade_ready_fd >= 0 )
     {
-        printf(" get ip and port error!\n");
-        return -1;
+        close( g_upgrade_ready_fd );
+        g_upgrade_ready_fd = -1;
+    }
+    if( g_notify_fd >= 0 )
+    {
+        close( g_notify_fd );
+        g_notify_fd = -1;
+    }
+    const server_config *cfg = current_config();
+    int per_worker = g_listen_count / g_worker_processes;
+    int tls_per_worker = g_tls_listen_count / g_worker_processes;
+    for( int i = 0; i < g_listen_count; ++i )
+    {
+        if( i / per_worker != index )
+        {
+            close( g_listen_fds[ i ] );
+        }
+    }
+    for( int i = 0; tls_per_worker > 0 && i < g_tls_listen_count; ++i )
+    {
+        if( i / tls_per_worker != index )
+        {
+            close( g_tls_listen_fds[ i ] );
+        }
     }
 
-    printf("ip: %s\nport: %d\n", ip, port);
+    prefork_attach( index );
+    return run_server( cfg, g_listen_fds + index * per_worker, per_worker,
+                       g_tls_listen_fds + index * tls_per_worker, tls_per_worker, index * per_worker );
+}
 
-    /* 忽略SIGPIPE信号*/
-    addsig( SIGPIPE, SIG_IGN );
+/* 启动(或重新拉起)第index个工作进程*/
+static void spawn_worker( int index )
+{
+    worker_process *w = &g_workers[ index ];
+    /* 统计槽位在fork之前重置, 以免覆盖工作进程随后写入的就绪标志*/
+    worker_slot *slot = prefork_slot( index );
+    if( slot->started )
+    {
+        slot->restarts++;
+    }
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    slot->started = now.tv_sec;
+    __atomic_store_n( &slot->ready, 0, __ATOMIC_RELEASE );
 
-    /* 创建线程池*/
-    threadpool< http_conn > *pool = Singleton< threadpool< http_conn > >::GetInstance();
+    /* 避免缓冲区中还没输出的内容在子进程中再输出一遍*/
+    fflush( stdout );
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        exit( worker_main( index ) );
+    }
+    w->spawned_ms = reactor::now_ms();
+    if( pid < 0 )
+    {
+        perror( "fork:" );
+        w->respawn_ms = w->spawned_ms + 1000;
+        return;
+    }
+    w->pid = pid;
+    __atomic_store_n( &slot->pid, pid, __ATOMIC_RELAXED );
+    printf( "worker %d started as process %d\n", index, pid );
+}
 
-    /* 预先为每个可能的客户连接分配一个http_conn对象*/
-    http_conn *users = new http_conn[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
-
-    /* 创建监听套接字*/
-    int listenfd = socket( AF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
-
-    int op = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
-
-    /* 绑定监听套接字到指定地址和端口*/
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
-
-    ret = listen( listenfd, 5 );
-    assert( ret >= 0 );
-
-    /* 创建epoll监听集合，并将监听套接字加入该集合*/
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( MAX_EVENT_NUMBER );
-    assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
-
-    
-    while( true )
+/* 回收退出的子进程, 退出的工作进程安排重新拉起*/
+static void reap_workers()
+{
+    int status;
+    pid_t pid;
+    while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 )
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ))
+        int index = 0;
+        while( index < g_worker_processes && g_workers[ index ].pid != pid )
         {
-            printf( "epoll failure\n" );
-            break;
+            index++;
+        }
+        /* 不是工作进程, 而是热升级启动的新进程, 由就绪管道的文件结束来处理*/
+        if( index == g_worker_processes )
+        {
+            continue;
         }
 
-        for( int i = 0; i < number; i++ )
+        worker_process *w = &g_workers[ index ];
+        worker_slot *slot = prefork_slot( index );
+        w->pid = 0;
+        __atomic_store_n( &slot->pid, 0, __ATOMIC_RELAXED );
+        __atomic_store_n( &slot->ready, 0, __ATOMIC_RELAXED );
+        __atomic_store_n( &slot->connections, 0, __ATOMIC_RELAXED );
+        if( WIFSIGNALED( status ) )
         {
-            int sockfd = events[i].data.fd;
+            printf( "worker %d (process %d) killed by signal %d\n", index, pid, WTERMSIG( status ) );
+        }
+        else
+        {
+            printf( "worker %d (process %d) exited with status %d\n", index, pid, WEXITSTATUS( status ) );
+        }
+        if( g_master_draining )
+        {
+            continue;
+        }
 
-            /* 有新连接到来*/
-            if( sockfd == listenfd )
-            {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address,
-                                     &client_addrlength);
-                if ( connfd < 0 )
-                {
-                    printf( "errno is: %d\n", errno );
-                    perror("accept:");
-                    continue;
-                }
-                if( http_conn::m_user_count >= MAX_FD )
-                {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
-                }
-
-                /* 初始化客户连接*/
-                users[ connfd ].init( connfd, client_address );
-            }
+        /* 启动后很快就退出(比如证书加载失败)时, 推迟重新拉起, 连续失败时间隔加倍, 以免空转*/
+        long long now = reactor::now_ms();
+        if( now - w->spawned_ms < 1000 )
+        {
+            w->backoff_ms = w->backoff_ms ? w->backoff_ms * 2 : 1000;
+            w->backoff_ms = w->backoff_ms < 30000 ? w->backoff_ms : 30000;
+        }
+        else
+        {
+            w->backoff_ms = 0;
+        }
+        w->respawn_ms = now + w->backoff_ms;
+    }
+}
 
+/* master收到信号后的处理: 自己需要处理的处理完再转发给各工作进程*/
+static void on_master_signal( int sig )
+{
+    if( sig == SIGCHLD )
+    {
+        reap_workers();
+    }
+    else if( sig == SIGHUP )
+    {
+        reload_config();
+        signal_workers( SIGHUP );
+    }
+    else if( sig == SIGUSR1 )
+    {
+        char buf[ 16384 ];
+        prefork_status( buf, sizeof( buf ) );
+        fputs( buf, stdout );
+        fflush( stdout );
+        signal_workers( SIGUSR1 );
+    }
+    else if( sig == SIGUSR2 )
+    {
+        start_upgrade();
+    }
+    else if( sig == SIGQUIT || sig == SIGTERM )
+    {
+        begin_drain();
+    }
+}
 
-            /* 客户端有数据到来*/
-            else if( events[i].events & EPOLLIN )
+/* master的监督循环: 处理信号, 重新拉起退出的工作进程, 等待热升级的新进程就绪; 优雅退出时等所有工作进程退出后返回*/
+static void master_loop()
+{
+    while( true )
+    {
+        long long now = reactor::now_ms();
+        int alive = 0;
+        int ready = 0;
+        for( int i = 0; i < g_worker_processes; ++i )
+        {
+            worker_process *w = &g_workers[ i ];
+            if( w->pid == 0 && ! g_master_draining && now >= w->respawn_ms )
             {
-                /* 根据读的结果，决定是将任务添加到线程池，还是关闭连接*/
-                if( users[ sockfd ].read_request() )
-                {
-                    pool->append( users + sockfd );
-                }
-                else
-                {
-                    users[ sockfd ].close_conn();
-                }
+                spawn_worker( i );
             }
-
-            /* 可写*/
-            else if( events[ i ].events & EPOLLOUT )
+            alive += w->pid > 0;
+            ready += w->pid > 0 && __atomic_load_n( &prefork_slot( i )->ready, __ATOMIC_ACQUIRE );
+        }
+        if( g_master_draining )
+        {
+            if( alive == 0 )
             {
-                /* 客户端连接已经可写，这时，将对客户端的响应写到客户端连接中*/
-                if( !users[ sockfd ].write_response() )
-                {
-                    /* 根据写的结果，决定是否关闭连接*/
-                    users[ sockfd ].close_conn();
-                }
+                break;
             }
+            if( g_master_deadline && now >= g_master_deadline )
+            {
+                printf( "%d worker processes did not exit in time, killing them\n", alive );
+                signal_workers( SIGKILL );
+                g_master_deadline = 0;
+            }
+        }
 
-            /* 如果有异常发生, 直接关闭连接*/
-            else 
+        /* 热升级启动时, 所有工作进程都开始accept后才通知旧进程停止accept*/
+        if( g_notify_fd >= 0 && ready == g_worker_processes )
+        {
+            write( g_notify_fd, "1", 1 );
+            close( g_notify_fd );
+            g_notify_fd = -1;
+        }
+
+        /* master的输出不多, 及时写出, 不和工作进程的输出搅在一起*/
+        fflush( stdout );
+        struct pollfd fds[ 2 ];
+        int nfds = 1;
+        fds[ 0 ].fd = sig_pipefd[ 0 ];
+        fds[ 0 ].events = POLLIN;
+        if( g_upgrade_ready_fd >= 0 )
+        {
+            fds[ nfds ].fd = g_upgrade_ready_fd;
+            fds[ nfds++ ].events = POLLIN;
+        }
+        if( poll( fds, nfds, g_notify_fd >= 0 ? 100 : 1000 ) <= 0 )
+        {
+            continue;
+        }
+        if( fds[ 0 ].revents & POLLIN )
+        {
+            char signals[ 1024 ];
+            int ret = recv( sig_pipefd[ 0 ], signals, sizeof( signals ), 0 );
+            for( int i = 0; i < ret; ++i )
             {
-                users[sockfd].close_conn();
+                on_master_signal( signals[ i ] );
             }
         }
+        if( nfds > 1 && fds[ 1 ].revents && ! on_upgrade_ready( g_upgrade_ready_fd ) )
+        {
+            close( g_upgrade_ready_fd );
+            g_upgrade_ready_fd = -1;
+        }
     }
+}
 
-    close( epollfd );
-    close( listenfd );
-    delete [] users;
-    delete pool;
+/* prefork模式的master: 创建每个工作进程每个反应堆的监听套接字(都使用SO_REUSEPORT), 拉起工作进程并监督它们*/
+static int run_master( const server_config *cfg, int *inherited, int inherited_count,
+                       int *inherited_tls, int inherited_tls_count )
+{
+    g_worker_processes = cfg->worker_processes;
+    g_master_pid = getpid();
+    g_listen_count = cfg->worker_processes * cfg->reactor_number;
+    g_tls_listen_count = cfg->tls_enable ? g_listen_count : 0;
+    for( int i = 0; i < g_listen_count; ++i )
+    {
+        g_listen_fds[ i ] = i < inherited_count ? inherited[ i ]
+                          : reactor::create_listener( cfg, cfg->port, true, -1, cfg->listen_backlog );
+        if( g_listen_fds[ i ] < 0 )
+        {
+            printf( "listen on %s:%d failed\n", cfg->ip, cfg->port );
+            return -1;
+        }
+        fcntl( g_listen_fds[ i ], F_SETFD, FD_CLOEXEC );
+    }
+    for( int i = 0; i < g_tls_listen_count; ++i )
+    {
+        g_tls_listen_fds[ i ] = i < inherited_tls_count ? inherited_tls[ i ]
+                              : reactor::create_listener( cfg, cfg->tls_port, true, -1, cfg->listen_backlog );
+        if( g_tls_listen_fds[ i ] < 0 )
+        {
+            printf( "listen on %s:%d failed\n", cfg->ip, cfg->tls_port );
+            return -1;
+        }
+        fcntl( g_tls_listen_fds[ i ], F_SETFD, FD_CLOEXEC );
+    }
+    for( int i = g_listen_count; i < inherited_count; ++i )
+    {
+        close( inherited[ i ] );
+    }
+    for( int i = g_tls_listen_count; i < inherited_tls_count; ++i )
+    {
+        close( inherited_tls[ i ] );
+    }
+
+    /* 各工作进程的统计放在共享内存中, 状态页和SIGUSR1的输出能看到所有工作进程*/
+    if( ! prefork_init( g_worker_processes ) )
+    {
+        printf( "create shared worker stats failed\n" );
+        return -1;
+    }
+    g_workers = new worker_process[ g_worker_processes ];
+    memset( g_workers, 0, sizeof( worker_process ) * g_worker_processes );
+
+    /* master的信号同样经过信号管道, 在监督循环中处理; SIGCHLD用于发现退出的工作进程*/
+    int ret = socketpair( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sig_pipefd );
+    assert( ret != -1 );
+    setnonblocking( sig_pipefd[ 0 ] );
+    setnonblocking( sig_pipefd[ 1 ] );
+    addsig( SIGCHLD, sig_handler );
+    addsig( SIGHUP, sig_handler );
+    addsig( SIGUSR1, sig_handler );
+    addsig( SIGUSR2, sig_handler );
+    addsig( SIGQUIT, sig_handler );
+    addsig( SIGTERM, sig_handler );
+
+    printf( "master process %d: %d worker processes, %d reactors each\n", g_master_pid,
+            g_worker_processes, cfg->reactor_number );
+    master_loop();
+    printf( "master process exit\n" );
     return 0;
 }
+
+int main(int argc, char* argv[])
+{
+    g_argv = argv;
+
+    /* 从配置文件中加载运行参数*/
+    get_path();
+    server_config *cfg = load_server_config( conf_path );
+    if( ! cfg )
+    {
+        printf(" load config error!\n");
+        return -1;
+    }
+    publish_config( cfg );
+
+    printf("ip: %s\nport: %d\n", cfg->ip, cfg->port);
+    if( cfg->tls_enable )
+    {
+        printf( "tls port: %d\n", cfg->tls_port );
+    }
+
+    /* 忽略SIGPIPE信号*/
+    addsig( SIGPIPE, SIG_IGN );
+
+    /* 热升级启动时, 从旧进程继承监听套接字, 监听就绪后通过管道通知旧进程*/
+    static int inherited[ MAX_LISTEN_FDS ];
+    int inherited_count = inherited_listen_fds( ENV_LISTEN_FDS, inherited, MAX_LISTEN_FDS );
+    static int inherited_tls[ MAX_LISTEN_FDS ];
+    int inherited_tls_count = inherited_listen_fds( ENV_TLS_LISTEN_FDS, inherited_tls, MAX_LISTEN_FDS );
+    if( inherited_count > 0 )
+    {
+        printf( "inherited %d listening sockets, %d tls\n", inherited_count, inherited_tls_count );
+    }
+    const char *ready_env = getenv( ENV_READY_FD );
+    if( ready_env )
+    {
+        g_notify_fd = atoi( ready_env );
+        fcntl( g_notify_fd, F_SETFD, FD_CLOEXEC );
+    }
+    unsetenv( ENV_LISTEN_FDS );
+    unsetenv( ENV_TLS_LISTEN_FDS );
+    unsetenv( ENV_READY_FD );
+
+    if( cfg->worker_processes > 0 )
+    {
+        return run_master( cfg, inherited, inherited_count, inherited_tls, inherited_tls_count );
+    }
+    return run_server( cfg, inherited, inherited_count, inherited_tls, inherited_tls_count, 0 );
+}
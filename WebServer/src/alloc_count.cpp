@@ -0,0 +1,154 @@
+/*************************************************************************
+	> File Name: alloc_count.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 16时08分19秒
+ ************************************************************************/
+#include "./alloc_count.h"
+
+#ifdef ALLOC_COUNT
+
+#include <stdlib.h>
+#include <errno.h>
+#include <new>
+
+/* glibc导出的真正的分配函数, 替换后的版本计数之后转给它们; free不需要替换*/
+extern "C"
+{
+    void* __libc_malloc( size_t size );
+    void* __libc_calloc( size_t n, size_t size );
+    void* __libc_realloc( void *ptr, size_t size );
+    void* __libc_memalign( size_t align, size_t size );
+    void* __libc_valloc( size_t size );
+}
+
+static long long s_allocs = 0;
+
+static inline void count_one()
+{
+    __atomic_add_fetch( &s_allocs, 1, __ATOMIC_RELAXED );
+}
+
+long long alloc_count()
+{
+    return __atomic_load_n( &s_allocs, __ATOMIC_RELAXED );
+}
+
+/* 可执行文件中定义的malloc等会覆盖libc中的同名函数, 共享库(libstdc++、OpenSSL等)的分配也经过这里*/
+extern "C"
+{
+    void* malloc( size_t size )
+    {
+        count_one();
+        return __libc_malloc( size );
+    }
+
+    void* calloc( size_t n, size_t size )
+    {
+        count_one();
+        return __libc_calloc( n, size );
+    }
+
+    void* realloc( void *ptr, size_t size )
+    {
+        count_one();
+        return __libc_realloc( ptr, size );
+    }
+
+    void* memalign( size_t align, size_t size )
+    {
+        count_one();
+        return __libc_memalign( align, size );
+    }
+
+    void* aligned_alloc( size_t align, size_t size )
+    {
+        count_one();
+        return __libc_memalign( align, size );
+    }
+
+    void* valloc( size_t size )
+    {
+        count_one();
+        return __libc_valloc( size );
+    }
+
+    int posix_memalign( void **ptr, size_t align, size_t size )
+    {
+        if( align < sizeof( void* ) || ( align & ( align - 1 ) ) != 0 )
+        {
+            return EINVAL;
+        }
+        count_one();
+        void *p = __libc_memalign( align, size );
+        if( ! p )
+        {
+            return ENOMEM;
+        }
+        *ptr = p;
+        return 0;
+    }
+}
+
+/* operator new直接计数并向libc申请, 不依赖libstdc++内部是否经过malloc*/
+static void* counted_new( size_t size )
+{
+    count_one();
+    void *p = __libc_malloc( size ? size : 1 );
+    if( ! p )
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new( size_t size )
+{
+    return counted_new( size );
+}
+
+void* operator new[]( size_t size )
+{
+    return counted_new( size );
+}
+
+void* operator new( size_t size, const std::nothrow_t & ) throw()
+{
+    count_one();
+    return __libc_malloc( size ? size : 1 );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t & ) throw()
+{
+    count_one();
+    return __libc_malloc( size ? size : 1 );
+}
+
+void operator delete( void *ptr ) throw()
+{
+    free( ptr );
+}
+
+void operator delete[]( void *ptr ) throw()
+{
+    free( ptr );
+}
+
+void operator delete( void *ptr, size_t ) throw()
+{
+    free( ptr );
+}
+
+void operator delete[]( void *ptr, size_t ) throw()
+{
+    free( ptr );
+}
+
+#else
+
+long long alloc_count()
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,17 @@
+/*************************************************************************
+	> File Name: alloc_count.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 16时05分41秒
+ ************************************************************************/
+
+#ifndef _ALLOC_COUNT_H
+#define _ALLOC_COUNT_H
+
+/* 进程启动以来向堆申请内存(malloc、calloc、realloc、memalign族和operator new)的总次数,
+ * 用来检查稳态下处理请求是否还会分配内存。只有定义了ALLOC_COUNT(make ALLOC_COUNT=1)时
+ * 才替换这些分配函数并计数, 否则不做任何替换, 返回-1
+ */
+long long alloc_count();
+
+#endif
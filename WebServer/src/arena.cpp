@@ -0,0 +1,81 @@
+/*************************************************************************
+	> File Name: arena.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 23时58分14秒
+ ************************************************************************/
+#include "./arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+long long arena::s_heap_allocs = 0;
+
+arena::arena()
+    :m_block( NULL ), m_used( 0 ), m_chunks( NULL )
+{
+}
+
+arena::~arena()
+{
+    reset();
+    free( m_block );
+}
+
+void* arena::alloc( size_t size )
+{
+    size = ( size + 7 ) & ~( size_t )7;
+    if( ! m_block )
+    {
+        m_block = ( char* )malloc( BLOCK_SIZE );
+        if( ! m_block )
+        {
+            return NULL;
+        }
+        __atomic_add_fetch( &s_heap_allocs, 1, __ATOMIC_RELAXED );
+    }
+    if( size <= BLOCK_SIZE - m_used )
+    {
+        void *p = m_block + m_used;
+        m_used += size;
+        return p;
+    }
+
+    /* 固定块放不下, 单独申请一块, 请求结束时释放*/
+    chunk *c = ( chunk* )malloc( sizeof( chunk ) + size );
+    if( ! c )
+    {
+        return NULL;
+    }
+    __atomic_add_fetch( &s_heap_allocs, 1, __ATOMIC_RELAXED );
+    c->next = m_chunks;
+    m_chunks = c;
+    return c + 1;
+}
+
+char* arena::dup( const char *s, size_t len )
+{
+    char *p = ( char* )alloc( len + 1 );
+    if( p )
+    {
+        memcpy( p, s, len );
+        p[ len ] = '\0';
+    }
+    return p;
+}
+
+/* 通常没有溢出块, 只是把偏移归零*/
+void arena::reset()
+{
+    m_used = 0;
+    while( m_chunks )
+    {
+        chunk *next = m_chunks->next;
+        free( m_chunks );
+        m_chunks = next;
+    }
+}
+
+long long arena::heap_allocs()
+{
+    return __atomic_load_n( &s_heap_allocs, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,52 @@
+/*************************************************************************
+	> File Name: arena.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 23时52分37秒
+ ************************************************************************/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* 每个连接的bump分配器, 用于处理一个请求期间的临时内存(解码后的URL、CGI的转发缓冲区等)
+ * 分配只是移动一个偏移, 请求结束时reset一次性归还所有内存, 不需要逐个释放。
+ * 固定块在第一次分配时申请, 之后随连接对象一起留在连接池中被后续连接复用,
+ * 所以稳态下处理请求不会再向堆申请内存; 固定块放不下时才临时申请溢出块, reset时释放。
+ * 一个连接同一时刻只由一个线程处理, 不需要加锁
+ */
+class arena
+{
+public:
+    /* 固定块的大小*/
+    static const size_t BLOCK_SIZE = 16384;
+
+    arena();
+    ~arena();
+
+    /* 分配size字节(按8字节对齐), 内容未初始化, 失败返回NULL*/
+    void* alloc( size_t size );
+    /* 复制len个字节并在末尾补'\0'*/
+    char* dup( const char *s, size_t len );
+    /* 归还本请求分配的所有内存, 保留固定块*/
+    void reset();
+
+    /* 所有arena累计向堆申请内存的次数(固定块和溢出块), 稳态下应该不再增长*/
+    static long long heap_allocs();
+
+private:
+    /* 溢出块, 内存紧跟在块头之后*/
+    struct chunk
+    {
+        chunk *next;
+    };
+
+    char *m_block;        /* 固定块*/
+    size_t m_used;        /* 固定块中已经分配的字节数*/
+    chunk *m_chunks;      /* 本请求申请的溢出块*/
+
+    static long long s_heap_allocs;
+};
+
+#endif
@@ -0,0 +1,491 @@
+/*************************************************************************
+	> File Name: async_log.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 20时21分47秒
+ ************************************************************************/
+
+#include "./async_log.h"
+#include "./locker.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+
+/* 最大路径长度*/
+#define LOG_PATH_MAX 1024
+/* 每个日志文件的格式化缓冲区大小, 写满或每轮结束时一次write写出*/
+#define LOG_BUF_SIZE ( 256 * 1024 )
+/* 一行日志格式化后的最大长度(URL中的每个字符转义后最多占4个字节)*/
+#define LOG_LINE_MAX ( LOG_TEXT_LEN * 4 + 256 )
+
+/* 一个线程的环形缓冲区
+ * head只由写日志的线程修改, tail只由后台线程修改, 二者放在不同的缓存行上, 互不干扰;
+ * head - tail即缓冲区中尚未写出的记录数
+ */
+struct log_ring
+{
+    log_record *records;
+    unsigned int mask;           /* 容量 - 1, 容量是2的幂*/
+    int owned;                   /* 是否有线程正在使用, 线程退出后可被新线程接管*/
+    log_ring *next;              /* 所有缓冲区串成一个只增不减的链表*/
+    unsigned long long reported; /* 后台线程已经报告过的丢弃数*/
+
+    unsigned int head __attribute__(( aligned( 64 ) ));  /* 下一条记录的写入位置*/
+    unsigned long long dropped;                           /* 缓冲区满时丢弃的记录数*/
+
+    unsigned int tail __attribute__(( aligned( 64 ) ));  /* 下一条待写出记录的位置*/
+};
+
+/* 日志文件及其格式化缓冲区, 只由后台线程访问*/
+struct log_file
+{
+    char path[ LOG_PATH_MAX ];   /* 为空表示写到标准错误*/
+    int fd;
+    long long size;              /* 当前文件大小, 用于判断是否轮转*/
+    char *buf;
+    int len;
+};
+
+/* 所有线程的环形缓冲区, 新建缓冲区时加锁插入链表头, 后台线程无锁遍历*/
+static log_ring *g_rings = NULL;
+static locker g_rings_lock;
+/* 本线程的环形缓冲区, 线程退出时通过g_ring_key的析构函数释放给其他线程*/
+static __thread log_ring *t_ring = NULL;
+static pthread_key_t g_ring_key;
+
+static int g_opened = 0;
+static bool g_access_enabled = false;
+static unsigned int g_ring_size = 0;
+static int g_flush_interval_ms = 100;
+static long long g_rotate_size = 0;
+static int g_rotate_keep = 0;
+static log_file g_access;
+static log_file g_error;
+
+/* 后台线程及其停止、重新打开文件的标志*/
+static pthread_t g_flusher;
+static sem g_wake;
+static int g_stop = 0;
+static int g_reopen = 0;
+
+/* 线程退出时释放它的环形缓冲区, 未写出的记录仍由后台线程写出*/
+static void release_ring( void *arg )
+{
+    log_ring *ring = ( log_ring* )arg;
+    __atomic_store_n( &ring->owned, 0, __ATOMIC_RELEASE );
+}
+
+/* 获取本线程的环形缓冲区: 优先接管已退出线程留下的缓冲区, 没有则新建一个*/
+static log_ring* get_ring()
+{
+    if( t_ring )
+    {
+        return t_ring;
+    }
+    for( log_ring *r = __atomic_load_n( &g_rings, __ATOMIC_ACQUIRE ); r; r = r->next )
+    {
+        int expected = 0;
+        if( __atomic_compare_exchange_n( &r->owned, &expected, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+        {
+            t_ring = r;
+            break;
+        }
+    }
+    if( ! t_ring )
+    {
+        log_ring *r = new log_ring;
+        r->records = new log_record[ g_ring_size ];
+        r->mask = g_ring_size - 1;
+        r->owned = 1;
+        r->reported = 0;
+        r->head = 0;
+        r->dropped = 0;
+        r->tail = 0;
+
+        g_rings_lock.lock();
+        r->next = g_rings;
+        __atomic_store_n( &g_rings, r, __ATOMIC_RELEASE );
+        g_rings_lock.unlock();
+        t_ring = r;
+    }
+    pthread_setspecific( g_ring_key, t_ring );
+    return t_ring;
+}
+
+/* 在本线程的环形缓冲区中预留一条记录, 缓冲区满时计数并返回NULL*/
+static log_record* reserve( int type )
+{
+    log_ring *r = get_ring();
+    unsigned int tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+    if( r->head - tail > r->mask )
+    {
+        __atomic_store_n( &r->dropped, r->dropped + 1, __ATOMIC_RELAXED );
+        return NULL;
+    }
+    log_record *rec = &r->records[ r->head & r->mask ];
+    rec->type = type;
+    clock_gettime( CLOCK_REALTIME_COARSE, &rec->time );
+    return rec;
+}
+
+bool log_access_enabled()
+{
+    return g_access_enabled;
+}
+
+log_record* log_reserve()
+{
+    if( ! g_access_enabled )
+    {
+        return NULL;
+    }
+    return reserve( LOG_ACCESS );
+}
+
+void log_commit( log_record * )
+{
+    /* 记录内容对后台线程可见之后再移动head*/
+    unsigned int head = t_ring->head + 1;
+    __atomic_store_n( &t_ring->head, head, __ATOMIC_RELEASE );
+
+    /* 突发流量下不必等到下一个写日志周期: 缓冲区刚好用到一半时唤醒后台线程*/
+    unsigned int tail = __atomic_load_n( &t_ring->tail, __ATOMIC_RELAXED );
+    if( head - tail == ( t_ring->mask + 1 ) / 2 )
+    {
+        g_wake.post();
+    }
+}
+
+void log_error( const char *format, ... )
+{
+    int save_errno = errno;
+    va_list ap;
+    va_start( ap, format );
+    if( ! __atomic_load_n( &g_opened, __ATOMIC_ACQUIRE ) )
+    {
+        vfprintf( stderr, format, ap );
+        fputc( '\n', stderr );
+        va_end( ap );
+        return;
+    }
+
+    log_record *rec = reserve( LOG_ERROR );
+    if( rec )
+    {
+        /* %m要用调用者的errno*/
+        errno = save_errno;
+        vsnprintf( rec->text, LOG_TEXT_LEN, format, ap );
+        log_commit( rec );
+    }
+    va_end( ap );
+    errno = save_errno;
+}
+
+/* 打开日志文件, 所在目录不存在时创建一级目录*/
+static bool file_open( log_file *f )
+{
+    f->size = 0;
+    if( f->path[ 0 ] == '\0' )
+    {
+        f->fd = STDERR_FILENO;
+        return true;
+    }
+    f->fd = open( f->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if( f->fd < 0 && errno == ENOENT )
+    {
+        char dir[ LOG_PATH_MAX ];
+        strcpy( dir, f->path );
+        char *slash = strrchr( dir, '/' );
+        if( slash && slash != dir )
+        {
+            *slash = '\0';
+            mkdir( dir, 0755 );
+        }
+        f->fd = open( f->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    }
+    if( f->fd < 0 )
+    {
+        fprintf( stderr, "open log %s: %s\n", f->path, strerror( errno ) );
+        return false;
+    }
+    struct stat st;
+    if( fstat( f->fd, &st ) == 0 )
+    {
+        f->size = st.st_size;
+    }
+    return true;
+}
+
+static void file_close( log_file *f )
+{
+    if( f->fd >= 0 && f->fd != STDERR_FILENO )
+    {
+        close( f->fd );
+    }
+    f->fd = -1;
+}
+
+/* 轮转日志文件: path.(n-1) -> path.n, ..., path -> path.1, 然后重新打开path
+ * 可能有多个进程写同一个日志文件(prefork的各工作进程, 热升级期间的新旧进程), 所以先对文件加锁,
+ * 拿到锁后path仍是自己打开的文件才执行轮转; 否则别的进程已经轮转过了, 只需重新打开
+ */
+static void file_rotate( log_file *f )
+{
+    char from[ LOG_PATH_MAX + 16 ];
+    char to[ LOG_PATH_MAX + 16 ];
+    flock( f->fd, LOCK_EX );
+    struct stat opened, current;
+    if( fstat( f->fd, &opened ) == 0 && stat( f->path, &current ) == 0
+        && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino )
+    {
+        for( int i = g_rotate_keep - 1; i >= 1; --i )
+        {
+            snprintf( from, sizeof( from ), "%s.%d", f->path, i );
+            snprintf( to, sizeof( to ), "%s.%d", f->path, i + 1 );
+            rename( from, to );
+        }
+        if( g_rotate_keep > 0 )
+        {
+            snprintf( to, sizeof( to ), "%s.1", f->path );
+            rename( f->path, to );
+        }
+        else
+        {
+            unlink( f->path );
+        }
+    }
+    /* 关闭描述符即释放锁*/
+    file_close( f );
+    file_open( f );
+}
+
+/* 把格式化缓冲区写入文件, 写入前检查是否需要轮转*/
+static void file_flush( log_file *f )
+{
+    if( f->len == 0 )
+    {
+        return;
+    }
+    if( f->fd != STDERR_FILENO && g_rotate_size > 0 && f->size > 0
+        && f->size + f->len > g_rotate_size )
+    {
+        file_rotate( f );
+    }
+    int written = 0;
+    while( f->fd >= 0 && written < f->len )
+    {
+        int ret = write( f->fd, f->buf + written, f->len - written );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            break;
+        }
+        written += ret;
+    }
+    /* 以追加方式写入, 写完后的偏移就是文件当前的大小, 其中也包括其他进程写入的内容*/
+    off_t end = g_rotate_size > 0 && f->fd != STDERR_FILENO ? lseek( f->fd, 0, SEEK_CUR ) : -1;
+    f->size = end >= 0 ? end : f->size + written;
+    f->len = 0;
+}
+
+/* 保证格式化缓冲区中至少还能放下一行, 返回写入位置*/
+static char* file_space( log_file *f )
+{
+    if( f->len + LOG_LINE_MAX > LOG_BUF_SIZE )
+    {
+        file_flush( f );
+    }
+    return f->buf + f->len;
+}
+
+/* 格式化时间, 形如2026-10-19T20:05:12.123+0800; 同一秒内的记录复用上次的结果*/
+static int format_time( char *buf, const struct timespec *ts )
+{
+    static time_t cached_sec = -1;
+    static char cached_time[ 32 ];
+    static char cached_zone[ 8 ];
+    if( ts->tv_sec != cached_sec )
+    {
+        struct tm tm;
+        localtime_r( &ts->tv_sec, &tm );
+        strftime( cached_time, sizeof( cached_time ), "%Y-%m-%dT%H:%M:%S", &tm );
+        strftime( cached_zone, sizeof( cached_zone ), "%z", &tm );
+        cached_sec = ts->tv_sec;
+    }
+    return sprintf( buf, "%s.%03ld%s", cached_time, ts->tv_nsec / 1000000, cached_zone );
+}
+
+/* 以双引号括起的形式输出字符串, 引号、反斜杠和控制字符转义为\xHH*/
+static int format_quoted( char *buf, const char *text )
+{
+    char *p = buf;
+    *p++ = '"';
+    for( int i = 0; i < LOG_TEXT_LEN && text[ i ]; ++i )
+    {
+        unsigned char c = text[ i ];
+        if( c < 0x20 || c == '"' || c == '\\' || c >= 0x7f )
+        {
+            p += sprintf( p, "\\x%02x", c );
+        }
+        else
+        {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    return p - buf;
+}
+
+/* 访问日志每行是一组key=value*/
+static void format_access( const log_record *rec )
+{
+    char *buf = file_space( &g_access );
+    char *p = buf;
+    char ip[ INET_ADDRSTRLEN ] = "-";
+    inet_ntop( AF_INET, &rec->peer.sin_addr, ip, sizeof( ip ) );
+
+    p += sprintf( p, "time=" );
+    p += format_time( p, &rec->time );
+    p += sprintf( p, " peer=%s:%d method=%s url=", ip, ntohs( rec->peer.sin_port ),
+                  rec->method ? rec->method : "-" );
+    p += format_quoted( p, rec->text );
+    p += sprintf( p, " status=%d bytes=%lld read_us=%d queue_us=%d process_us=%d write_us=%d\n",
+                  rec->status, rec->bytes, rec->stage_us[ LOG_STAGE_READ ],
+                  rec->stage_us[ LOG_STAGE_QUEUE ], rec->stage_us[ LOG_STAGE_PROCESS ],
+                  rec->stage_us[ LOG_STAGE_WRITE ] );
+    g_access.len += p - buf;
+}
+
+static void format_error( const log_record *rec )
+{
+    char *buf = file_space( &g_error );
+    char *p = buf;
+    p += sprintf( p, "time=" );
+    p += format_time( p, &rec->time );
+    p += sprintf( p, " msg=" );
+    p += format_quoted( p, rec->text );
+    *p++ = '\n';
+    g_error.len += p - buf;
+}
+
+/* 取出所有环形缓冲区中的记录写入日志文件, 并报告新的丢弃数*/
+static void flush_rings()
+{
+    for( log_ring *r = __atomic_load_n( &g_rings, __ATOMIC_ACQUIRE ); r; r = r->next )
+    {
+        unsigned int head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+        unsigned int tail = r->tail;
+        for( ; tail != head; ++tail )
+        {
+            const log_record *rec = &r->records[ tail & r->mask ];
+            if( rec->type == LOG_ACCESS )
+            {
+                format_access( rec );
+            }
+            else
+            {
+                format_error( rec );
+            }
+        }
+        /* 记录格式化完毕后才把位置还给生产者*/
+        __atomic_store_n( &r->tail, tail, __ATOMIC_RELEASE );
+
+        unsigned long long dropped = __atomic_load_n( &r->dropped, __ATOMIC_RELAXED );
+        if( dropped != r->reported )
+        {
+            char *buf = file_space( &g_error );
+            g_error.len += sprintf( buf, "msg=\"log ring full, %llu records dropped\"\n",
+                                    dropped - r->reported );
+            r->reported = dropped;
+        }
+    }
+    file_flush( &g_access );
+    file_flush( &g_error );
+}
+
+/* 后台写日志线程*/
+static void* flusher_entry( void * )
+{
+    while( ! __atomic_load_n( &g_stop, __ATOMIC_ACQUIRE ) )
+    {
+        g_wake.timedwait( g_flush_interval_ms );
+        if( __atomic_exchange_n( &g_reopen, 0, __ATOMIC_ACQ_REL ) )
+        {
+            file_close( &g_access );
+            file_close( &g_error );
+            if( g_access_enabled )
+            {
+                file_open( &g_access );
+            }
+            file_open( &g_error );
+        }
+        flush_rings();
+    }
+    flush_rings();
+    return NULL;
+}
+
+bool log_open( const char *access_path, const char *error_path, int ring_size,
+               int flush_interval_ms, long long rotate_size, int rotate_keep )
+{
+    g_ring_size = 1;
+    while( g_ring_size < ( unsigned int )ring_size )
+    {
+        g_ring_size <<= 1;
+    }
+    g_flush_interval_ms = flush_interval_ms;
+    g_rotate_size = rotate_size;
+    g_rotate_keep = rotate_keep;
+
+    strncpy( g_access.path, access_path, LOG_PATH_MAX - 1 );
+    strncpy( g_error.path, error_path, LOG_PATH_MAX - 1 );
+    g_access.fd = -1;
+    g_error.fd = -1;
+    g_access_enabled = access_path[ 0 ] != '\0';
+    if( ( g_access_enabled && ! file_open( &g_access ) ) || ! file_open( &g_error ) )
+    {
+        file_close( &g_access );
+        file_close( &g_error );
+        return false;
+    }
+    g_access.buf = new char[ LOG_BUF_SIZE ];
+    g_error.buf = new char[ LOG_BUF_SIZE ];
+
+    if( pthread_key_create( &g_ring_key, release_ring ) != 0
+        || pthread_create( &g_flusher, NULL, flusher_entry, NULL ) != 0 )
+    {
+        return false;
+    }
+    __atomic_store_n( &g_opened, 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+void log_reopen()
+{
+    __atomic_store_n( &g_reopen, 1, __ATOMIC_RELEASE );
+}
+
+void log_close()
+{
+    if( ! __atomic_exchange_n( &g_opened, 0, __ATOMIC_ACQ_REL ) )
+    {
+        return;
+    }
+    g_access_enabled = false;
+    __atomic_store_n( &g_stop, 1, __ATOMIC_RELEASE );
+    g_wake.post();
+    pthread_join( g_flusher, NULL );
+    file_close( &g_access );
+    file_close( &g_error );
+}
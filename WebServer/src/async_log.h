@@ -0,0 +1,92 @@
+/*************************************************************************
+	> File Name: async_log.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 20时05分12秒
+ ************************************************************************/
+
+#ifndef _ASYNC_LOG_H
+#define _ASYNC_LOG_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+/* 异步日志: 访问日志和错误日志
+ * 每个线程第一次写日志时得到一个自己的环形缓冲区(单生产者单消费者, 无锁), 写日志只是把一条
+ * 定长记录填进环形缓冲区, 不格式化、不加锁、不做系统调用; 后台线程定期取出各缓冲区中的记录,
+ * 格式化后用大块write写入日志文件, 并按大小轮转。缓冲区写满时丢弃新记录并计数, 绝不阻塞
+ */
+
+/* 访问日志中记录的请求处理阶段*/
+enum LOG_STAGE
+{
+    LOG_STAGE_READ = 0,     /* 读到第一个字节到读完请求*/
+    LOG_STAGE_QUEUE,        /* 读完请求到开始处理(在线程池中排队)*/
+    LOG_STAGE_PROCESS,      /* 解析请求并填充应答*/
+    LOG_STAGE_WRITE,        /* 填充完应答到发送完毕*/
+    LOG_STAGE_NUMBER
+};
+
+/* 日志记录的类型*/
+enum LOG_TYPE
+{
+    LOG_ACCESS = 0,
+    LOG_ERROR
+};
+
+/* 记录中URL或错误信息的最大长度, 超出部分被截断*/
+#define LOG_TEXT_LEN 192
+
+/* 环形缓冲区中的一条定长记录*/
+struct log_record
+{
+    int type;                          /* LOG_TYPE*/
+    int status;                        /* 应答状态码*/
+    struct timespec time;              /* 写入记录时的时间*/
+    struct sockaddr_in peer;           /* 客户端地址*/
+    const char *method;                /* 请求方法, 指向静态字符串*/
+    long long bytes;                   /* 发送的字节数*/
+    int stage_us[ LOG_STAGE_NUMBER ];  /* 各阶段耗时(微秒)*/
+    char text[ LOG_TEXT_LEN ];         /* URL或错误信息*/
+};
+
+/* 打开日志并启动后台写日志线程
+ * @access_path : 访问日志文件, 为空则不记录访问日志
+ * @error_path : 错误日志文件, 为空则写到标准错误
+ * @ring_size : 每个线程的环形缓冲区能容纳的记录数, 向上取为2的幂
+ * @flush_interval_ms : 后台线程写日志的间隔
+ * @rotate_size : 日志文件超过该字节数后轮转, 0表示不轮转
+ * @rotate_keep : 轮转时保留的旧文件个数
+ */
+bool log_open( const char *access_path, const char *error_path, int ring_size,
+               int flush_interval_ms, long long rotate_size, int rotate_keep );
+
+/* 停止后台线程, 写出所有剩余记录并关闭日志文件*/
+void log_close();
+
+/* 让后台线程重新打开日志文件(外部工具移走日志文件后, 收到SIGHUP时调用)*/
+void log_reopen();
+
+/* 是否记录访问日志*/
+bool log_access_enabled();
+
+/* 在本线程的环形缓冲区中预留一条访问日志记录, 缓冲区满或未开启访问日志时返回NULL;
+ * 调用者填好记录后必须调用log_commit
+ */
+log_record* log_reserve();
+void log_commit( log_record *rec );
+
+/* 写一条错误日志, 格式同printf(支持%m输出errno对应的错误信息)
+ * 日志尚未打开时直接写到标准错误
+ */
+void log_error( const char *format, ... ) __attribute__(( format( printf, 1, 2 ) ));
+
+/* 单调时钟的当前时间(纳秒), 用于计算各阶段耗时*/
+static inline long long log_now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,301 @@
+/*************************************************************************
+	> File Name: cgi_cache.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 08时47分39秒
+ ************************************************************************/
+#include "./cgi_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* 结果的状态*/
+enum CGI_RESULT_STATE
+{
+    RESULT_RUNNING = 0,     /* CGI程序正在执行*/
+    RESULT_READY,           /* 已完成, 可以使用*/
+    RESULT_FAILED           /* 执行失败或结果不可缓存*/
+};
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+cgi_cache::cgi_cache()
+    :m_max_total_bytes( 0 ), m_max_entry_size( 0 ), m_total_bytes( 0 ), m_entries( 0 ),
+     m_lru_head( NULL ), m_lru_tail( NULL ), m_hits( 0 ), m_misses( 0 ), m_coalesced( 0 ), m_bypassed( 0 )
+{
+    memset( m_buckets, 0, sizeof( m_buckets ) );
+}
+
+void cgi_cache::configure( size_t max_total_bytes, int max_entry_size )
+{
+    m_lock.lock();
+    m_max_total_bytes = max_total_bytes;
+    m_max_entry_size = max_entry_size;
+    evict_locked();
+    m_lock.unlock();
+}
+
+char* cgi_cache::make_key( const char *program, const char *protocol, const char *method, const char *query,
+                           const char *vary, int vary_len, const char *body, int body_len, int *key_len )
+{
+    const char *parts[] = { program, protocol, method, query ? query : "" };
+    int part_len[ 4 ];
+    int len = vary_len + body_len;
+    for( int i = 0; i < 4; ++i )
+    {
+        part_len[ i ] = strlen( parts[ i ] );
+        len += part_len[ i ] + 1;
+    }
+    char *key = ( char* )malloc( len + 1 );
+    if( ! key )
+    {
+        return NULL;
+    }
+    /* 各部分以'\0'分隔, 不会因为拼接而把不同的请求拼成相同的键*/
+    char *p = key;
+    for( int i = 0; i < 4; ++i )
+    {
+        memcpy( p, parts[ i ], part_len[ i ] + 1 );
+        p += part_len[ i ] + 1;
+    }
+    memcpy( p, vary, vary_len );
+    p += vary_len;
+    *p++ = '\0';
+    memcpy( p, body, body_len );
+    *key_len = len + 1;
+    return key;
+}
+
+bool cgi_cache::varies( const char *vary, const char *name, int name_len )
+{
+    const char *p = vary;
+    while( *p )
+    {
+        p += strspn( p, " ," );
+        int len = strcspn( p, " ," );
+        if( len == name_len && strncasecmp( p, name, len ) == 0 )
+        {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+/* FNV-1a哈希*/
+unsigned int cgi_cache::hash_key( const char *key, int key_len )
+{
+    unsigned int h = 2166136261u;
+    for( int i = 0; i < key_len; ++i )
+    {
+        h ^= ( unsigned char )key[ i ];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+cgi_result* cgi_cache::find_locked( const char *key, int key_len, unsigned int hash )
+{
+    for( cgi_result *r = m_buckets[ hash % BUCKETS ]; r; r = r->hnext )
+    {
+        if( r->hash == hash && r->key_len == key_len && memcmp( r->key, key, key_len ) == 0 )
+        {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* 将结果从哈希表(以及LRU链表)中摘除, 并释放缓存本身持有的引用*/
+void cgi_cache::unlink_locked( cgi_result *r )
+{
+    cgi_result **pp = &m_buckets[ r->hash % BUCKETS ];
+    while( *pp && *pp != r )
+    {
+        pp = &( *pp )->hnext;
+    }
+    if( *pp )
+    {
+        *pp = r->hnext;
+    }
+
+    if( r->state == RESULT_READY )
+    {
+        ( r->lprev ? r->lprev->lnext : m_lru_head ) = r->lnext;
+        ( r->lnext ? r->lnext->lprev : m_lru_tail ) = r->lprev;
+        m_total_bytes -= r->len;
+        m_entries--;
+    }
+    release( r );
+}
+
+/* 超出总字节数上限时从LRU链表尾部淘汰*/
+void cgi_cache::evict_locked()
+{
+    while( m_lru_tail && m_total_bytes > m_max_total_bytes )
+    {
+        unlink_locked( m_lru_tail );
+    }
+}
+
+cgi_cache::LOOKUP cgi_cache::acquire( const char *key, int key_len, pool_task *task, cgi_result **result )
+{
+    unsigned int hash = hash_key( key, key_len );
+    m_lock.lock();
+    if( ! enabled() )
+    {
+        m_lock.unlock();
+        return BYPASS;
+    }
+    cgi_result *r = find_locked( key, key_len, hash );
+    if( r && r->state == RESULT_READY && r->expires_ms <= now_ms() )
+    {
+        unlink_locked( r );
+        r = NULL;
+    }
+
+    /* 命中: 移到LRU链表头部*/
+    if( r && r->state == RESULT_READY )
+    {
+        if( r != m_lru_head )
+        {
+            r->lprev->lnext = r->lnext;
+            ( r->lnext ? r->lnext->lprev : m_lru_tail ) = r->lprev;
+            r->lprev = NULL;
+            r->lnext = m_lru_head;
+            m_lru_head->lprev = r;
+            m_lru_head = r;
+        }
+        __sync_add_and_fetch( &r->refcnt, 1 );
+        m_hits++;
+        m_lock.unlock();
+        *result = r;
+        return HIT;
+    }
+
+    /* 相同的请求正在执行: 挂在它上面, 执行者结束时唤醒; 先写*result再挂上, 唤醒后的task一定能看到它*/
+    if( r )
+    {
+        __sync_add_and_fetch( &r->refcnt, 1 );
+        *result = r;
+        task->m_park_next = r->parked;
+        r->parked = task;
+        m_lock.unlock();
+        return PARKED;
+    }
+
+    /* 没有命中: 放一个执行中的占位, 由调用者执行*/
+    r = new cgi_result;
+    r->key = ( char* )malloc( key_len );
+    if( ! r->key )
+    {
+        delete r;
+        m_lock.unlock();
+        return BYPASS;
+    }
+    memcpy( r->key, key, key_len );
+    r->key_len = key_len;
+    r->hash = hash;
+    r->data = NULL;
+    r->len = 0;
+    r->expires_ms = 0;
+    r->state = RESULT_RUNNING;
+    r->parked = NULL;
+    r->refcnt = 2;
+    r->lprev = r->lnext = NULL;
+    r->hnext = m_buckets[ hash % BUCKETS ];
+    m_buckets[ hash % BUCKETS ] = r;
+    m_misses++;
+    m_lock.unlock();
+    *result = r;
+    return LEAD;
+}
+
+void cgi_cache::finish( cgi_result *lead, const char *data, int len, int ttl_ms )
+{
+    /* 在锁外拷贝*/
+    char *copy = NULL;
+    if( data && len <= m_max_entry_size && ttl_ms > 0 )
+    {
+        copy = ( char* )malloc( len );
+        if( copy )
+        {
+            memcpy( copy, data, len );
+        }
+    }
+
+    m_lock.lock();
+    if( copy && enabled() )
+    {
+        lead->data = copy;
+        lead->len = len;
+        lead->expires_ms = now_ms() + ttl_ms;
+        lead->state = RESULT_READY;
+        lead->lnext = m_lru_head;
+        ( m_lru_head ? m_lru_head->lprev : m_lru_tail ) = lead;
+        m_lru_head = lead;
+        m_total_bytes += len;
+        m_entries++;
+        evict_locked();
+    }
+    else
+    {
+        free( copy );
+        lead->state = RESULT_FAILED;
+        unlink_locked( lead );
+    }
+    pool_task *parked = lead->parked;
+    lead->parked = NULL;
+    for( pool_task *t = parked; t; t = t->m_park_next )
+    {
+        ( lead->state == RESULT_READY ? m_coalesced : m_bypassed )++;
+    }
+    m_lock.unlock();
+
+    /* resume只是提交到任务所属反应堆的完成队列; 任务随后可能立刻被处理并再次挂起, 先取出下一个*/
+    while( parked )
+    {
+        pool_task *next = parked->m_park_next;
+        parked->resume();
+        parked = next;
+    }
+    release( lead );
+}
+
+/* state在finish中加锁写入, 之后才唤醒任务, 经过完成队列和线程池的同步, 被唤醒的任务能看到它*/
+bool cgi_cache::ready( const cgi_result *r )
+{
+    return r->state == RESULT_READY;
+}
+
+/* 释放一个引用, 最后一个引用释放时回收内存*/
+void cgi_cache::release( cgi_result *r )
+{
+    if( __sync_sub_and_fetch( &r->refcnt, 1 ) == 0 )
+    {
+        free( r->data );
+        free( r->key );
+        delete r;
+    }
+}
+
+int cgi_cache::status( char *buf, int size )
+{
+    if( size <= 0 )
+    {
+        return 0;
+    }
+    m_lock.lock();
+    int len = snprintf( buf, size, "cgi cache: %d entries, %lu bytes, hits %lld, misses %lld, "
+                        "coalesced %lld, bypassed %lld\n", m_entries, ( unsigned long )m_total_bytes,
+                        m_hits, m_misses, m_coalesced, m_bypassed );
+    m_lock.unlock();
+    return len < size ? len : size - 1;
+}
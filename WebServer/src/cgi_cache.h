@@ -0,0 +1,115 @@
+/*************************************************************************
+	> File Name: cgi_cache.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 08时26分13秒
+ ************************************************************************/
+
+#ifndef _CGI_CACHE_H
+#define _CGI_CACHE_H
+
+#include <stddef.h>
+#include "./locker.h"
+#include "./pool_task.h"
+
+/* 一次CGI执行的结果; 执行期间它也是占位, 同时到达的相同请求挂在上面等待, 不再各自fork*/
+struct cgi_result
+{
+    cgi_result *hnext;      /* 哈希桶链表*/
+    cgi_result *lprev;      /* LRU链表, 只有已完成的结果在其中, 表头是最近用过的*/
+    cgi_result *lnext;
+    char *key;              /* 程序、方法、查询串、选定的头部和消息体拼成的键*/
+    int key_len;
+    unsigned int hash;
+    char *data;             /* CGI程序的完整输出(头部、空行、消息体)*/
+    int len;
+    long long expires_ms;   /* 过期时间(单调时钟, 毫秒)*/
+    int state;              /* 执行中、已完成或者失败*/
+    pool_task *parked;      /* 挂起等待执行结果的任务, 以m_park_next链接*/
+    int refcnt;             /* 缓存本身持有一个引用, 执行者和每个使用者各持有一个*/
+};
+
+/* 可缓存的CGI路由(cache_ttl_ms大于0)的输出缓存
+ * 适用于输出只取决于请求消息体(及查询串、选定头部)的CGI程序: 相同的请求在有效期内直接用缓存的输出应答;
+ * 没有命中时第一个请求执行CGI程序, 期间到达的相同请求挂起等待它的结果(singleflight), 一群相同的请求只fork一次;
+ * 挂起的请求不占用工作线程, 执行者结束时把它们交还给各自的反应堆, 再回到线程池使用结果。
+ * 总字节数有上限, 超出时淘汰最久没用过的; 退出码不为0或输出过大的结果不缓存
+ */
+class cgi_cache
+{
+public:
+    /* acquire的查找结果*/
+    enum LOOKUP
+    {
+        HIT = 0,    /* 命中*/
+        LEAD,       /* 没有命中, 由调用者执行*/
+        PARKED,     /* 相同的请求正在执行, 调用者已经挂起*/
+        BYPASS      /* 不使用缓存(没有启用或内存不足), 调用者自己执行但不缓存*/
+    };
+
+public:
+    cgi_cache();
+
+    /* 设置大小限制(启动和重新加载配置时调用), max_total_bytes为0表示不启用
+     * @max_entry_size : 一条结果的最大长度
+     */
+    void configure( size_t max_total_bytes, int max_entry_size );
+    bool enabled() const { return m_max_total_bytes > 0; }
+
+    /* 拼出缓存的键, 返回malloc的内存, 由调用者释放
+     * @protocol : SERVER_PROTOCOL, CGI程序看到的环境不同, 结果也可能不同
+     * @vary : 选定的请求头部, 每个是"名字: 值\r\n", 名字是小写的
+     */
+    static char* make_key( const char *program, const char *protocol, const char *method, const char *query,
+                           const char *vary, int vary_len, const char *body, int body_len, int *key_len );
+    /* 头部名字name是否在路由的cache_vary列表(逗号分隔, 不区分大小写)中*/
+    static bool varies( const char *vary, const char *name, int name_len );
+
+    /* 查找结果, *r带回持有一个引用的结果, 用完后调用release:
+     * HIT : 命中, *r是可用的结果;
+     * LEAD : 没有命中, *r是执行中的占位, 调用者负责执行CGI程序, 然后必须调用finish;
+     * PARKED : 相同的请求正在执行, task已经挂在它上面, *r在锁内设为该结果, 所以r应当是task自己的成员;
+     *          此后调用者不能再访问task, 执行结束时finish调用task->resume(), task回到线程池后用ready(*r)
+     *          判断有没有可用的结果, 没有时自己执行但不缓存;
+     * BYPASS : 没有使用缓存, *r不变
+     */
+    LOOKUP acquire( const char *key, int key_len, pool_task *task, cgi_result **r );
+    /* 执行结束: data为NULL表示结果不可缓存; 唤醒所有挂起的任务并释放执行者的引用
+     * @ttl_ms : 结果的有效期
+     */
+    void finish( cgi_result *lead, const char *data, int len, int ttl_ms );
+    /* 挂起的任务被唤醒后, 等到的结果是否可用*/
+    static bool ready( const cgi_result *r );
+    /* 释放结果的一个引用*/
+    static void release( cgi_result *r );
+
+    /* 输出命中率等统计, 返回写入的长度*/
+    int status( char *buf, int size );
+
+private:
+    static unsigned int hash_key( const char *key, int key_len );
+    cgi_result* find_locked( const char *key, int key_len, unsigned int hash );
+    void unlink_locked( cgi_result *r );
+    void evict_locked();
+
+private:
+    static const int BUCKETS = 1024;
+
+    size_t m_max_total_bytes;
+    int m_max_entry_size;
+    size_t m_total_bytes;
+    int m_entries;
+
+    cgi_result *m_buckets[ BUCKETS ];
+    cgi_result *m_lru_head;
+    cgi_result *m_lru_tail;
+    locker m_lock;
+
+    /* 统计*/
+    long long m_hits;
+    long long m_misses;
+    long long m_coalesced;  /* 等到了相同请求的执行结果*/
+    long long m_bypassed;   /* 相同请求没有可用的结果, 挂起后自己执行*/
+};
+
+#endif
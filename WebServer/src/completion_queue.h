@@ -0,0 +1,112 @@
+/*************************************************************************
+	> File Name: completion_queue.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 19时02分37秒
+ ************************************************************************/
+
+#ifndef _COMPLETION_QUEUE_H
+#define _COMPLETION_QUEUE_H
+
+#include <exception>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* 工作线程到反应堆的完成队列，模板参数T是任务类(见pool_task.h)
+ * 工作线程处理完一个连接后不再自己调用epoll_ctl或关闭连接, 而是把连接连同下一步动作
+ * 提交到接受该连接的反应堆的完成队列中, 由反应堆批量取出并执行, 这样连接的epoll注册、
+ * 关闭都只在它所属的反应堆线程中发生。
+ * 队列是无锁的侵入式栈(多个生产者, 一个消费者): 任务对象自身提供m_cq_next和m_cq_action两个成员,
+ * 提交时不分配内存; 只有队列由空变为非空时才写eventfd唤醒反应堆, 一批完成只需一次唤醒
+ */
+template< typename T >
+class completion_queue
+{
+public:
+    completion_queue();
+    ~completion_queue();
+
+    /* 注册到反应堆epoll事件表中的eventfd*/
+    int fd() const  { return m_eventfd; }
+
+    /* 提交一个完成的连接及其下一步动作(工作线程调用)*/
+    void post( T *conn, int action );
+
+    /* 不提交连接, 只唤醒反应堆*/
+    void wake()
+    {
+        uint64_t one = 1;
+        write( m_eventfd, &one, sizeof( one ) );
+    }
+
+    /* 取出所有已提交的连接(反应堆调用), 返回的链表按提交的先后顺序排列*/
+    T* drain();
+
+    /* 遍历drain返回的链表*/
+    static T* next( T *conn )  { return conn->m_cq_next; }
+    static int action( T *conn )  { return conn->m_cq_action; }
+
+private:
+    T *m_head;          /* 栈顶, 最后提交的连接*/
+    int m_eventfd;
+};
+
+template< typename T >
+completion_queue< T >::completion_queue()
+    :m_head( NULL )
+{
+    m_eventfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( m_eventfd < 0 )
+    {
+        throw std::exception();
+    }
+}
+
+template< typename T >
+completion_queue< T >::~completion_queue()
+{
+    close( m_eventfd );
+}
+
+template< typename T >
+void completion_queue< T >::post( T *conn, int action )
+{
+    conn->m_cq_action = action;
+    T *old = __atomic_load_n( &m_head, __ATOMIC_RELAXED );
+    do
+    {
+        conn->m_cq_next = old;
+    } while( ! __atomic_compare_exchange_n( &m_head, &old, conn, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+
+    /* 队列原来是空的, 反应堆可能正阻塞在epoll_wait中, 唤醒它;
+     * 原来非空则已经有人唤醒过, 反应堆取队列时会把本连接一并取走
+     */
+    if( old == NULL )
+    {
+        wake();
+    }
+}
+
+template< typename T >
+T* completion_queue< T >::drain()
+{
+    /* 先清零eventfd再取走整个栈: 此后提交的连接会看到空栈并重新唤醒反应堆*/
+    uint64_t count;
+    read( m_eventfd, &count, sizeof( count ) );
+    T *list = __atomic_exchange_n( &m_head, ( T* )NULL, __ATOMIC_ACQUIRE );
+
+    /* 栈是后进先出的, 反转成提交顺序*/
+    T *fifo = NULL;
+    while( list )
+    {
+        T *next = list->m_cq_next;
+        list->m_cq_next = fifo;
+        fifo = list;
+        list = next;
+    }
+    return fifo;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*************************************************************************
+	> File Name: conn_pool.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 16时40分09秒
+ ************************************************************************/
+
+#ifndef _CONN_POOL_H
+#define _CONN_POOL_H
+
+#include <new>
+#include <stdlib.h>
+#include "./locker.h"
+#include "./cpu_affinity.h"
+
+/* 每个反应堆私有的连接对象池，模板参数T是连接类
+ * 对象按块(slab)分配在反应堆线程所在的NUMA节点上，连接关闭后对象回到池中，
+ * 下一个连接复用它(连同它已经分配好的读写缓冲区)，所以连接和缓冲区始终留在本节点。
+ * 连接只在所属反应堆线程中关闭和归还, 空闲表的锁几乎不会发生竞争
+ */
+template< typename T >
+class conn_pool
+{
+public:
+    /* 每块包含的对象数*/
+    static const int SLAB_OBJECTS = 256;
+
+    conn_pool();
+    ~conn_pool();
+
+    /* 取一个空闲对象, 池空时分配新的一块*/
+    T* get();
+    /* 归还对象*/
+    void put( T *conn );
+    /* 对池中的每个对象(包括空闲的)调用fn, fn中可以归还对象*/
+    void visit( void ( *fn )( T *conn ) );
+
+private:
+    bool grow();
+
+private:
+    /* 一块连续分配的对象*/
+    struct slab
+    {
+        T *objs;
+        size_t size;
+        slab *next;
+    };
+
+    slab *m_slabs;      /* 已分配的块*/
+    T **m_free;         /* 空闲对象栈*/
+    int m_free_count;   /* 空闲对象数*/
+    int m_capacity;     /* 对象总数*/
+    locker m_lock;      /* 保护空闲对象栈*/
+};
+
+template< typename T >
+conn_pool< T >::conn_pool()
+    :m_slabs( NULL ), m_free( NULL ), m_free_count( 0 ), m_capacity( 0 )
+{
+}
+
+template< typename T >
+conn_pool< T >::~conn_pool()
+{
+    while( m_slabs )
+    {
+        slab *s = m_slabs;
+        m_slabs = s->next;
+        for( int i = 0; i < SLAB_OBJECTS; ++i )
+        {
+            s->objs[ i ].~T();
+        }
+        numa_free( s->objs, s->size );
+        delete s;
+    }
+    free( m_free );
+}
+
+/* 在当前线程所在的NUMA节点上分配一块新对象, 调用时已持有锁*/
+template< typename T >
+bool conn_pool< T >::grow()
+{
+    T **free_stack = ( T** )realloc( m_free, sizeof( T* ) * ( m_capacity + SLAB_OBJECTS ) );
+    if( ! free_stack )
+    {
+        return false;
+    }
+    m_free = free_stack;
+
+    slab *s = new slab;
+    s->size = sizeof( T ) * SLAB_OBJECTS;
+    s->objs = ( T* )numa_alloc_local( s->size );
+    if( ! s->objs )
+    {
+        delete s;
+        return false;
+    }
+    for( int i = 0; i < SLAB_OBJECTS; ++i )
+    {
+        new ( s->objs + i ) T();
+        m_free[ m_free_count++ ] = s->objs + i;
+    }
+    s->next = m_slabs;
+    m_slabs = s;
+    m_capacity += SLAB_OBJECTS;
+    return true;
+}
+
+template< typename T >
+T* conn_pool< T >::get()
+{
+    m_lock.lock();
+    if( m_free_count == 0 && ! grow() )
+    {
+        m_lock.unlock();
+        return NULL;
+    }
+    T *conn = m_free[ --m_free_count ];
+    m_lock.unlock();
+    return conn;
+}
+
+template< typename T >
+void conn_pool< T >::put( T *conn )
+{
+    m_lock.lock();
+    m_free[ m_free_count++ ] = conn;
+    m_lock.unlock();
+}
+
+/* 块只由所属反应堆线程在get中添加, 在同一线程中遍历不需要加锁*/
+template< typename T >
+void conn_pool< T >::visit( void ( *fn )( T *conn ) )
+{
+    for( slab *s = m_slabs; s; s = s->next )
+    {
+        for( int i = 0; i < SLAB_OBJECTS; ++i )
+        {
+            fn( s->objs + i );
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,193 @@
+/*************************************************************************
+	> File Name: cpu_affinity.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 16时15分40秒
+ ************************************************************************/
+#include "./cpu_affinity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* mbind的内存策略, 与<numaif.h>中的定义相同(不依赖libnuma)*/
+#define MPOL_PREFERRED 1
+
+bool pin_self_to_cpus( const int *cpus, int count )
+{
+    if( count <= 0 )
+    {
+        return true;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for( int i = 0; i < count; ++i )
+    {
+        if( cpus[ i ] >= 0 && cpus[ i ] < CPU_SETSIZE )
+        {
+            CPU_SET( cpus[ i ], &set );
+        }
+    }
+    if( pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) != 0 )
+    {
+        printf( "pin thread to cpu %d... failed\n", cpus[ 0 ] );
+        return false;
+    }
+    return true;
+}
+
+int current_numa_node()
+{
+    unsigned int cpu = 0, node = 0;
+    if( syscall( SYS_getcpu, &cpu, &node, NULL ) < 0 )
+    {
+        return -1;
+    }
+    return ( int )node;
+}
+
+void* numa_alloc_local( size_t size )
+{
+    void *addr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( addr == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    /* 单节点机器或内核不支持NUMA时mbind会失败, 此时仍然依靠first-touch*/
+    int node = current_numa_node();
+    if( node >= 0 && node < ( int )( sizeof( unsigned long ) * 8 ) )
+    {
+        unsigned long nodemask = 1UL << node;
+        syscall( SYS_mbind, addr, size, MPOL_PREFERRED, &nodemask,
+                 sizeof( nodemask ) * 8, 0 );
+    }
+
+    /* 由当前线程访问每一页, 使物理页分配在本节点上*/
+    long page = sysconf( _SC_PAGESIZE );
+    for( size_t off = 0; off < size; off += page )
+    {
+        ( ( volatile char* )addr )[ off ] = 0;
+    }
+    return addr;
+}
+
+void numa_free( void *addr, size_t size )
+{
+    if( addr )
+    {
+        munmap( addr, size );
+    }
+}
+
+/* 解析smp_affinity_list格式的CPU列表, 例如 "0-3,8"*/
+static int parse_cpu_list( const char *list, int *cpus, int count, int max )
+{
+    const char *p = list;
+    while( *p && *p != '\n' )
+    {
+        char *end = NULL;
+        long first = strtol( p, &end, 10 );
+        if( end == p )
+        {
+            break;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' )
+        {
+            last = strtol( p + 1, &end, 10 );
+            p = end;
+        }
+        for( long c = first; c <= last; ++c )
+        {
+            bool dup = false;
+            for( int i = 0; i < count; ++i )
+            {
+                if( cpus[ i ] == c )
+                {
+                    dup = true;
+                }
+            }
+            if( ! dup && count < max )
+            {
+                cpus[ count++ ] = ( int )c;
+            }
+        }
+        if( *p == ',' )
+        {
+            p++;
+        }
+    }
+    return count;
+}
+
+/* 中断描述行中是否有名为nic的设备: 设备名要完整匹配, 前面是空白, 后面是行尾、空白或'-'
+ * (eth1不能匹配eth10-TxRx-0或veth1)
+ */
+static bool irq_line_has_nic( const char *line, const char *nic )
+{
+    size_t len = strlen( nic );
+    for( const char *p = strstr( line, nic ); p; p = strstr( p + 1, nic ) )
+    {
+        char before = p == line ? ' ' : p[ -1 ];
+        char after = p[ len ];
+        if( ( before == ' ' || before == '\t' )
+            && ( after == '\0' || after == '\n' || after == ' ' || after == '\t' || after == '-' ) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int nic_irq_cpus( const char *nic, int *cpus, int max )
+{
+    if( ! nic || ! nic[ 0 ] )
+    {
+        return 0;
+    }
+
+    FILE *fp = fopen( "/proc/interrupts", "r" );
+    if( ! fp )
+    {
+        return 0;
+    }
+
+    int count = 0;
+    char line[ 4096 ];
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        /* 中断描述行形如 " 45:  123  0  IR-PCI-MSI  eth0-TxRx-0"*/
+        if( ! irq_line_has_nic( line, nic ) )
+        {
+            continue;
+        }
+        int irq = atoi( line );
+        if( irq <= 0 && line[ strspn( line, " " ) ] != '0' )
+        {
+            continue;
+        }
+
+        char path[ 64 ];
+        snprintf( path, sizeof( path ), "/proc/irq/%d/smp_affinity_list", irq );
+        FILE *aff = fopen( path, "r" );
+        if( ! aff )
+        {
+            continue;
+        }
+        char list[ 256 ];
+        if( fgets( list, sizeof( list ), aff ) )
+        {
+            count = parse_cpu_list( list, cpus, count, max );
+        }
+        fclose( aff );
+    }
+    fclose( fp );
+    return count;
+}
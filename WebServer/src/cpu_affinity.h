@@ -0,0 +1,39 @@
+/*************************************************************************
+	> File Name: cpu_affinity.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 16时02分18秒
+ ************************************************************************/
+
+#ifndef _CPU_AFFINITY_H
+#define _CPU_AFFINITY_H
+
+#include <stddef.h>
+
+/* 将调用线程绑定到一组CPU上
+ * @cpus  : CPU编号数组
+ * @count : 数组长度, 为0时不做任何绑定
+ */
+bool pin_self_to_cpus( const int *cpus, int count );
+
+/* 获取调用线程当前所在的NUMA节点, 失败返回-1*/
+int current_numa_node();
+
+/* 在调用线程所在的NUMA节点上分配内存
+ * 先用mbind把映射区的策略设为优先本节点, 再立即访问所有页面(first-touch),
+ * 因此应当在线程绑定CPU之后调用。内存按页对齐, 内容为0
+ */
+void* numa_alloc_local( size_t size );
+
+/* 释放numa_alloc_local分配的内存*/
+void numa_free( void *addr, size_t size );
+
+/* 从/proc/interrupts和/proc/irq/N/smp_affinity_list中找出网卡nic的各队列中断所绑定的CPU
+ * @nic   : 网卡名, 例如eth0
+ * @cpus  : 用于存放CPU编号(去重)
+ * @max   : cpus数组的长度
+ * 返回值: 找到的CPU个数
+ */
+int nic_irq_cpus( const char *nic, int *cpus, int max );
+
+#endif
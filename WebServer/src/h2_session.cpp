@@ -0,0 +1,1556 @@
+/*************************************************************************
+	> File Name: h2_session.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 22时31分46秒
+ ************************************************************************/
+#include "./h2_session.h"
+#include "./http_conn.h"
+#include "./Singleton.h"
+#include "./prefork.h"
+#include "./cgi_cache.h"
+#include <string.h>
+#include <ctype.h>
+#include <poll.h>
+
+extern int server_status( char *buf, int size );
+extern const char *error_400_form;
+extern const char *error_403_form;
+extern const char *error_404_form;
+extern const char *error_500_form;
+extern const char *error_502_form;
+
+/* 帧标志*/
+#define FLAG_END_STREAM  0x1
+#define FLAG_ACK         0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED      0x8
+#define FLAG_PRIORITY    0x20
+
+/* SETTINGS参数*/
+#define SETTINGS_HEADER_TABLE_SIZE      1
+#define SETTINGS_ENABLE_PUSH            2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define SETTINGS_INITIAL_WINDOW_SIZE    4
+#define SETTINGS_MAX_FRAME_SIZE         5
+
+/* 窗口的最大值2^31-1*/
+#define MAX_WINDOW 0x7fffffffLL
+
+const char h2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* 应答101之后升级请求作为流1继续处理*/
+static const char switching_response[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+
+static unsigned int get_u32( const unsigned char *p )
+{
+    return ( ( unsigned int )p[ 0 ] << 24 ) | ( p[ 1 ] << 16 ) | ( p[ 2 ] << 8 ) | p[ 3 ];
+}
+
+static void put_u32( unsigned char *p, unsigned int v )
+{
+    p[ 0 ] = v >> 24;
+    p[ 1 ] = v >> 16;
+    p[ 2 ] = v >> 8;
+    p[ 3 ] = v;
+}
+
+/* base64url解码(HTTP2-Settings不带填充), 出错返回-1*/
+static int base64url_decode( const char *src, unsigned char *out, int out_size )
+{
+    unsigned int acc = 0;
+    int bits = 0;
+    int n = 0;
+    for( ; *src && *src != '=' && *src != ' ' && *src != '\t'; ++src )
+    {
+        int v;
+        char c = *src;
+        if( c >= 'A' && c <= 'Z' ) v = c - 'A';
+        else if( c >= 'a' && c <= 'z' ) v = c - 'a' + 26;
+        else if( c >= '0' && c <= '9' ) v = c - '0' + 52;
+        else if( c == '-' || c == '+' ) v = 62;
+        else if( c == '_' || c == '/' ) v = 63;
+        else return -1;
+        acc = ( acc << 6 ) | v;
+        bits += 6;
+        if( bits >= 8 )
+        {
+            bits -= 8;
+            if( n >= out_size )
+            {
+                return -1;
+            }
+            out[ n++ ] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+/* 请求方法的名称, 用于访问日志; 只支持GET和POST*/
+static const char *method_name( const char *value, int len )
+{
+    if( len == 3 && memcmp( value, "GET", 3 ) == 0 )
+    {
+        return "GET";
+    }
+    if( len == 4 && memcmp( value, "POST", 4 ) == 0 )
+    {
+        return "POST";
+    }
+    return NULL;
+}
+
+h2_session::h2_session( http_conn *conn, completion_queue< pool_task > *cq, const sockaddr_in &peer, int reactor,
+                        bool tls, int max_streams, int max_body )
+    :m_conn( conn ), m_cq( cq ), m_jobs( 0 ), m_peer( peer ), m_reactor( reactor ), m_tls( tls ), m_max_streams( max_streams ), m_max_body( max_body ),
+     m_active( 0 ), m_last_stream_id( 0 ), m_rr( 0 ),
+     m_hblock_len( 0 ), m_hblock_stream( 0 ), m_hblock_end_stream( false ), m_decoding( NULL ),
+     m_t_read( 0 ), m_need_preface( true ), m_need_settings( true ),
+     m_send_window( DEFAULT_WINDOW ), m_peer_initial_window( DEFAULT_WINDOW ),
+     m_peer_max_frame( MAX_FRAME_SIZE ), m_recv_window( DEFAULT_WINDOW ),
+     m_goaway_sent( false ), m_fatal( false ), m_peer_goaway( false ), m_olen( 0 )
+{
+    m_streams = new h2_stream[ m_max_streams ];
+    memset( m_streams, 0, sizeof( h2_stream ) * m_max_streams );
+    m_hblock = new unsigned char[ MAX_HEADER_BLOCK ];
+    m_ocap = OUTPUT_BATCH + MAX_FRAME_SIZE + 1024;
+    m_obuf = ( char* )malloc( m_ocap );
+}
+
+h2_session::~h2_session()
+{
+    for( int i = 0; i < m_max_streams; ++i )
+    {
+        if( m_streams[ i ].id )
+        {
+            close_stream( &m_streams[ i ] );
+        }
+    }
+    delete [] m_streams;
+    delete [] m_hblock;
+    free( m_obuf );
+}
+
+void h2_session::start()
+{
+    /* 服务器的连接前言: 只通告允许同时进行的流数, 其余参数用默认值*/
+    unsigned char payload[ 6 ];
+    payload[ 0 ] = 0;
+    payload[ 1 ] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32( payload + 2, m_max_streams );
+    append_frame( H2_SETTINGS, 0, 0, payload, sizeof( payload ) );
+}
+
+bool h2_session::upgrade( const char *settings, const char *path, unsigned long long t_begin, unsigned long long t_read )
+{
+    unsigned char payload[ 256 ];
+    int len = base64url_decode( settings, payload, sizeof( payload ) );
+    if( len < 0 || len % 6 != 0 || apply_settings( payload, len ) != H2_NO_ERROR )
+    {
+        return false;
+    }
+    /* 101应答本身就是对HTTP2-Settings的确认, 不需要再发送SETTINGS ACK*/
+    reserve( sizeof( switching_response ) - 1 );
+    memcpy( m_obuf + m_olen, switching_response, sizeof( switching_response ) - 1 );
+    m_olen += sizeof( switching_response ) - 1;
+    start();
+
+    h2_stream *s = new_stream( 1 );
+    m_last_stream_id = 1;
+    s->method = "GET";
+    s->has_method = true;
+    s->has_path = true;
+    /* 升级请求的URL已经按HTTP/1.1规范化过了*/
+    s->bad_path = strlen( path ) >= sizeof( s->path );
+    strncpy( s->path, path, sizeof( s->path ) - 1 );
+    s->headers_done = true;
+    s->state = H2_STREAM_HALF_CLOSED;
+    s->trace.t[ TRACE_BEGIN ] = t_begin;
+    s->trace.t[ TRACE_READ ] = t_read;
+    handle_request( s );
+    return true;
+}
+
+int h2_session::on_input( const char *buf, int len, unsigned long long t_read )
+{
+    const unsigned char *p = ( const unsigned char* )buf;
+    int pos = 0;
+    m_t_read = t_read;
+    if( m_need_preface )
+    {
+        if( len < PREFACE_LEN )
+        {
+            return 0;
+        }
+        if( memcmp( buf, PREFACE, PREFACE_LEN ) != 0 )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return len;
+        }
+        m_need_preface = false;
+        pos = PREFACE_LEN;
+    }
+
+    while( ! m_fatal && len - pos >= FRAME_HEADER_LEN )
+    {
+        int flen = ( p[ pos ] << 16 ) | ( p[ pos + 1 ] << 8 ) | p[ pos + 2 ];
+        if( flen > MAX_FRAME_SIZE )
+        {
+            connection_error( H2_FRAME_SIZE_ERROR );
+            break;
+        }
+        if( len - pos < FRAME_HEADER_LEN + flen )
+        {
+            break;
+        }
+        int type = p[ pos + 3 ];
+        int flags = p[ pos + 4 ];
+        int sid = get_u32( p + pos + 5 ) & 0x7fffffff;
+        pos += FRAME_HEADER_LEN;
+        on_frame( type, flags, sid, p + pos, flen );
+        pos += flen;
+    }
+
+    /* 连接的接收窗口用掉一半就补满, 而不是每个DATA帧都发送WINDOW_UPDATE*/
+    if( ! m_fatal && m_recv_window < DEFAULT_WINDOW / 2 )
+    {
+        append_window_update( 0, DEFAULT_WINDOW - m_recv_window );
+        m_recv_window = DEFAULT_WINDOW;
+    }
+    /* 发生连接错误后剩下的数据不再处理*/
+    return m_fatal ? len : pos;
+}
+
+void h2_session::on_frame( int type, int flags, int sid, const unsigned char *payload, int len )
+{
+    /* 连接前言之后的第一帧必须是SETTINGS*/
+    if( m_need_settings )
+    {
+        if( type != H2_SETTINGS || ( flags & FLAG_ACK ) )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return;
+        }
+        m_need_settings = false;
+    }
+    /* 头部块没有结束时只能收到同一个流的CONTINUATION帧*/
+    if( m_hblock_stream && ( type != H2_CONTINUATION || sid != m_hblock_stream ) )
+    {
+        connection_error( H2_PROTOCOL_ERROR );
+        return;
+    }
+
+    switch( type )
+    {
+        case H2_DATA:
+        {
+            on_data( flags, sid, payload, len );
+            break;
+        }
+        case H2_HEADERS:
+        {
+            on_headers( flags, sid, payload, len );
+            break;
+        }
+        case H2_PRIORITY:
+        {
+            /* 不支持优先级, 所有流轮流发送*/
+            if( sid == 0 )
+            {
+                connection_error( H2_PROTOCOL_ERROR );
+            }
+            else if( len != 5 )
+            {
+                reset_stream( sid, H2_FRAME_SIZE_ERROR );
+            }
+            break;
+        }
+        case H2_RST_STREAM:
+        {
+            if( sid == 0 || sid > m_last_stream_id )
+            {
+                connection_error( H2_PROTOCOL_ERROR );
+                break;
+            }
+            if( len != 4 )
+            {
+                connection_error( H2_FRAME_SIZE_ERROR );
+                break;
+            }
+            h2_stream *s = find_stream( sid );
+            if( s )
+            {
+                close_stream( s );
+            }
+            break;
+        }
+        case H2_SETTINGS:
+        {
+            if( sid != 0 )
+            {
+                connection_error( H2_PROTOCOL_ERROR );
+                break;
+            }
+            on_settings( flags, payload, len );
+            break;
+        }
+        case H2_PING:
+        {
+            if( sid != 0 )
+            {
+                connection_error( H2_PROTOCOL_ERROR );
+            }
+            else if( len != 8 )
+            {
+                connection_error( H2_FRAME_SIZE_ERROR );
+            }
+            else if( ! ( flags & FLAG_ACK ) )
+            {
+                append_frame( H2_PING, FLAG_ACK, 0, payload, len );
+            }
+            break;
+        }
+        case H2_GOAWAY:
+        {
+            if( sid != 0 )
+            {
+                connection_error( H2_PROTOCOL_ERROR );
+                break;
+            }
+            /* 对方不会再发起新的流, 进行中的流应答完就关闭连接*/
+            m_peer_goaway = true;
+            break;
+        }
+        case H2_WINDOW_UPDATE:
+        {
+            on_window_update( sid, payload, len );
+            break;
+        }
+        case H2_CONTINUATION:
+        {
+            on_continuation( flags, sid, payload, len );
+            break;
+        }
+        /* 客户端不能推送*/
+        case H2_PUSH_PROMISE:
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            break;
+        }
+        /* 未知类型的帧必须忽略*/
+        default:
+        {
+            break;
+        }
+    }
+}
+
+void h2_session::on_headers( int flags, int sid, const unsigned char *payload, int len )
+{
+    if( sid == 0 )
+    {
+        connection_error( H2_PROTOCOL_ERROR );
+        return;
+    }
+    /* 去掉填充和优先级信息*/
+    if( flags & FLAG_PADDED )
+    {
+        if( len < 1 || payload[ 0 ] >= len )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return;
+        }
+        len -= 1 + payload[ 0 ];
+        payload++;
+    }
+    if( flags & FLAG_PRIORITY )
+    {
+        if( len < 5 )
+        {
+            connection_error( H2_FRAME_SIZE_ERROR );
+            return;
+        }
+        payload += 5;
+        len -= 5;
+    }
+
+    h2_stream *s = find_stream( sid );
+    if( s )
+    {
+        /* 已有流上的HEADERS帧只能是结束请求的尾部字段*/
+        if( s->state != H2_STREAM_OPEN || ! s->headers_done || ! ( flags & FLAG_END_STREAM ) )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return;
+        }
+    }
+    else
+    {
+        /* 客户端发起的流标识符必须是奇数, 且比之前的都大*/
+        if( ( sid & 1 ) == 0 || sid <= m_last_stream_id )
+        {
+            connection_error( sid <= m_last_stream_id ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR );
+            return;
+        }
+        m_last_stream_id = sid;
+        /* 拒绝的流也要解码头部块, 否则动态表会与对方不一致*/
+        if( ! m_goaway_sent && m_active < m_max_streams )
+        {
+            s = new_stream( sid );
+        }
+        else
+        {
+            reset_stream( sid, H2_REFUSED_STREAM );
+        }
+    }
+
+    if( flags & FLAG_END_HEADERS )
+    {
+        decode_headers( s, payload, len, flags & FLAG_END_STREAM );
+        return;
+    }
+    /* 头部块跨越多帧, 先攒起来*/
+    if( len > MAX_HEADER_BLOCK )
+    {
+        connection_error( H2_ENHANCE_YOUR_CALM );
+        return;
+    }
+    memcpy( m_hblock, payload, len );
+    m_hblock_len = len;
+    m_hblock_stream = sid;
+    m_hblock_end_stream = flags & FLAG_END_STREAM;
+    m_decoding = s;
+}
+
+void h2_session::on_continuation( int flags, int sid, const unsigned char *payload, int len )
+{
+    if( sid == 0 || sid != m_hblock_stream )
+    {
+        connection_error( H2_PROTOCOL_ERROR );
+        return;
+    }
+    if( m_hblock_len + len > MAX_HEADER_BLOCK )
+    {
+        connection_error( H2_ENHANCE_YOUR_CALM );
+        return;
+    }
+    memcpy( m_hblock + m_hblock_len, payload, len );
+    m_hblock_len += len;
+    if( flags & FLAG_END_HEADERS )
+    {
+        m_hblock_stream = 0;
+        /* 流可能在等待CONTINUATION期间被重置, 这里重新查找*/
+        h2_stream *s = m_decoding ? find_stream( sid ) : NULL;
+        decode_headers( s, m_hblock, m_hblock_len, m_hblock_end_stream );
+    }
+}
+
+/* 记下反向代理要转发的一个普通头部, 连接相关的头部不转发; 超过MAX_HEADER_BLOCK的部分丢弃*/
+static void add_header( h2_stream *s, const char *name, int name_len, const char *value, int value_len )
+{
+    static const char *skipped[] =
+    {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "te",
+        "content-length", NULL
+    };
+    for( int i = 0; skipped[ i ]; ++i )
+    {
+        if( ( int )strlen( skipped[ i ] ) == name_len && memcmp( skipped[ i ], name, name_len ) == 0 )
+        {
+            return;
+        }
+    }
+    if( s->authority[ 0 ] && name_len == 4 && memcmp( name, "host", 4 ) == 0 )
+    {
+        return;
+    }
+    int need = s->headers_len + name_len + value_len + 4;
+    if( need > h2_session::MAX_HEADER_BLOCK )
+    {
+        return;
+    }
+    if( need > s->headers_cap )
+    {
+        int cap = s->headers_cap ? s->headers_cap * 2 : 1024;
+        while( cap < need )
+        {
+            cap *= 2;
+        }
+        char *headers = ( char* )realloc( s->headers, cap );
+        if( ! headers )
+        {
+            return;
+        }
+        s->headers = headers;
+        s->headers_cap = cap;
+    }
+    char *p = s->headers + s->headers_len;
+    memcpy( p, name, name_len );
+    p += name_len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy( p, value, value_len );
+    p += value_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    s->headers_len = p - s->headers;
+}
+
+/* 解码出一个请求头部字段: 方法和路径用于查找路由, 普通头部只有反向代理的请求,
+ * 以及可缓存的CGI路由(cache_vary中的头部, 作为缓存键的一部分)才需要
+ */
+void h2_session::on_header( void *arg, const char *name, int name_len, const char *value, int value_len )
+{
+    h2_stream *s = ( h2_stream* )arg;
+    if( ! s || s->headers_done )
+    {
+        return;
+    }
+    if( name_len == 7 && memcmp( name, ":method", 7 ) == 0 )
+    {
+        s->method = method_name( value, value_len );
+        s->has_method = true;
+    }
+    else if( name_len == 5 && memcmp( name, ":path", 5 ) == 0 )
+    {
+        s->has_path = value_len > 0;
+        s->bad_path = value_len >= ( int )sizeof( s->path );
+        if( ! s->bad_path )
+        {
+            /* 与HTTP/1.1相同, 以解码、规范化后的路径查找文件; 查询串不参与*/
+            memcpy( s->path, value, value_len );
+            s->path[ value_len ] = '\0';
+            s->bad_path = ! url_canonicalize( s->path, &s->query );
+        }
+    }
+    else if( name_len == 10 && memcmp( name, ":authority", 10 ) == 0 )
+    {
+        int len = value_len < ( int )sizeof( s->authority ) ? value_len : sizeof( s->authority ) - 1;
+        memcpy( s->authority, value, len );
+        s->authority[ len ] = '\0';
+    }
+    else if( name_len > 0 && name[ 0 ] != ':' )
+    {
+        if( ! s->routed )
+        {
+            s->routed = true;
+            s->matched = s->method && s->has_path && ! s->bad_path
+                       ? current_config()->routes->lookup( s->method, s->path ) : NULL;
+        }
+        if( s->matched && ( s->matched->handler == ROUTE_PROXY
+                            || ( s->matched->cache_ttl_ms > 0
+                                 && cgi_cache::varies( s->matched->cache_vary, name, name_len ) ) ) )
+        {
+            add_header( s, name, name_len, value, value_len );
+        }
+    }
+}
+
+void h2_session::decode_headers( h2_stream *s, const unsigned char *block, int len, bool end_stream )
+{
+    m_decoding = NULL;
+    if( ! m_decoder.decode( block, len, on_header, s ) )
+    {
+        connection_error( H2_COMPRESSION_ERROR );
+        return;
+    }
+    /* 被拒绝的流*/
+    if( ! s )
+    {
+        return;
+    }
+    if( ! s->headers_done )
+    {
+        s->headers_done = true;
+        /* 缺少必需伪头部的请求是畸形的*/
+        if( ! s->has_method || ! s->has_path )
+        {
+            reset_stream( s->id, H2_PROTOCOL_ERROR );
+            return;
+        }
+    }
+    if( end_stream )
+    {
+        s->state = H2_STREAM_HALF_CLOSED;
+        handle_request( s );
+    }
+}
+
+void h2_session::on_data( int flags, int sid, const unsigned char *payload, int len )
+{
+    if( sid == 0 || sid > m_last_stream_id )
+    {
+        connection_error( H2_PROTOCOL_ERROR );
+        return;
+    }
+    /* 整个帧(含填充)都计入流量控制*/
+    m_recv_window -= len;
+    if( m_recv_window < 0 )
+    {
+        connection_error( H2_FLOW_CONTROL_ERROR );
+        return;
+    }
+    if( flags & FLAG_PADDED )
+    {
+        if( len < 1 || payload[ 0 ] >= len )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return;
+        }
+        len -= 1 + payload[ 0 ];
+        payload++;
+    }
+
+    /* 已经关闭的流上还在路上的数据直接丢弃*/
+    h2_stream *s = find_stream( sid );
+    if( ! s )
+    {
+        return;
+    }
+    if( s->state != H2_STREAM_OPEN || ! s->headers_done )
+    {
+        reset_stream( sid, H2_STREAM_CLOSED );
+        return;
+    }
+    s->recv_window -= len;
+    if( s->recv_window < 0 )
+    {
+        reset_stream( sid, H2_FLOW_CONTROL_ERROR );
+        return;
+    }
+    if( s->body_len + len > m_max_body )
+    {
+        log_error( "http2 request body exceeds %d bytes", m_max_body );
+        reset_stream( sid, H2_CANCEL );
+        return;
+    }
+    if( s->body_len + len > s->body_cap )
+    {
+        int cap = s->body_cap ? s->body_cap : 4096;
+        while( cap < s->body_len + len )
+        {
+            cap *= 2;
+        }
+        s->body = ( char* )realloc( s->body, cap );
+        s->body_cap = cap;
+    }
+    memcpy( s->body + s->body_len, payload, len );
+    s->body_len += len;
+
+    if( flags & FLAG_END_STREAM )
+    {
+        s->state = H2_STREAM_HALF_CLOSED;
+        handle_request( s );
+    }
+    else if( s->recv_window < DEFAULT_WINDOW / 2 )
+    {
+        append_window_update( sid, DEFAULT_WINDOW - s->recv_window );
+        s->recv_window = DEFAULT_WINDOW;
+    }
+}
+
+void h2_session::on_settings( int flags, const unsigned char *payload, int len )
+{
+    if( flags & FLAG_ACK )
+    {
+        if( len != 0 )
+        {
+            connection_error( H2_FRAME_SIZE_ERROR );
+        }
+        return;
+    }
+    if( len % 6 != 0 )
+    {
+        connection_error( H2_FRAME_SIZE_ERROR );
+        return;
+    }
+    int error = apply_settings( payload, len );
+    if( error != H2_NO_ERROR )
+    {
+        connection_error( error );
+        return;
+    }
+    append_frame( H2_SETTINGS, FLAG_ACK, 0, NULL, 0 );
+}
+
+int h2_session::apply_settings( const unsigned char *payload, int len )
+{
+    for( int i = 0; i + 6 <= len; i += 6 )
+    {
+        int id = ( payload[ i ] << 8 ) | payload[ i + 1 ];
+        unsigned int value = get_u32( payload + i + 2 );
+        switch( id )
+        {
+            case SETTINGS_ENABLE_PUSH:
+            {
+                if( value > 1 )
+                {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            }
+            /* 初始窗口的变化量作用到所有已有的流上*/
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if( value > MAX_WINDOW )
+                {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                long long delta = ( long long )value - m_peer_initial_window;
+                for( int j = 0; j < m_max_streams; ++j )
+                {
+                    if( m_streams[ j ].id )
+                    {
+                        m_streams[ j ].window += delta;
+                    }
+                }
+                m_peer_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+            {
+                if( value < 16384 || value > 16777215 )
+                {
+                    return H2_PROTOCOL_ERROR;
+                }
+                /* 我们按自己的最大帧发送就够了*/
+                m_peer_max_frame = value < ( unsigned int )MAX_FRAME_SIZE ? value : MAX_FRAME_SIZE;
+                break;
+            }
+            /* 我们不使用动态表编码, 也不推送, 其余参数都不影响发送*/
+            default:
+            {
+                break;
+            }
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+void h2_session::on_window_update( int sid, const unsigned char *payload, int len )
+{
+    if( len != 4 )
+    {
+        connection_error( H2_FRAME_SIZE_ERROR );
+        return;
+    }
+    int increment = get_u32( payload ) & 0x7fffffff;
+    if( sid == 0 )
+    {
+        if( increment == 0 )
+        {
+            connection_error( H2_PROTOCOL_ERROR );
+            return;
+        }
+        m_send_window += increment;
+        if( m_send_window > MAX_WINDOW )
+        {
+            connection_error( H2_FLOW_CONTROL_ERROR );
+        }
+        return;
+    }
+    if( sid > m_last_stream_id )
+    {
+        connection_error( H2_PROTOCOL_ERROR );
+        return;
+    }
+    h2_stream *s = find_stream( sid );
+    if( ! s )
+    {
+        return;
+    }
+    if( increment == 0 )
+    {
+        reset_stream( sid, H2_PROTOCOL_ERROR );
+        return;
+    }
+    s->window += increment;
+    if( s->window > MAX_WINDOW )
+    {
+        reset_stream( sid, H2_FLOW_CONTROL_ERROR );
+    }
+}
+
+/* 请求已经收完, 准备应答; 应答的帧由pull生成*/
+void h2_session::handle_request( h2_stream *s )
+{
+    s->trace.mark( TRACE_DEQUEUE );
+    /* 请求的最后一批数据就是这次读到的*/
+    if( ! s->trace.t[ TRACE_READ ] )
+    {
+        s->trace.t[ TRACE_READ ] = m_t_read;
+    }
+    const route *r = NULL;
+    if( s->bad_path || ! s->method )
+    {
+        respond_error( s, 400 );
+    }
+    else if( ! ( r = s->routed ? s->matched : current_config()->routes->lookup( s->method, s->path ) ) )
+    {
+        respond_error( s, 404 );
+    }
+    else if( r->handler == ROUTE_CGI )
+    {
+        run_cgi( s, r );
+    }
+    else if( r->handler == ROUTE_PROXY )
+    {
+        run_proxy( s, r );
+    }
+    else if( r->handler == ROUTE_STATUS || r->handler == ROUTE_SLOW )
+    {
+        status_page( s, r );
+    }
+    else if( strcmp( s->method, "GET" ) == 0 )
+    {
+        serve_file( s );
+    }
+    else
+    {
+        respond_error( s, 404 );
+    }
+    /* 交给作业的流在结果交回时才准备好应答*/
+    if( ! s->job )
+    {
+        s->trace.mark( TRACE_FILLED );
+    }
+}
+
+/* 与HTTP/1.1的do_request相同: 先查完整响应缓存, 未命中再stat、mmap文件, 小文件顺便放入缓存
+ * 缓存条目里存的是HTTP/1.1的完整响应, 这里只用其中的消息体
+ */
+void h2_session::serve_file( h2_stream *s )
+{
+    char path[ http_conn::FILENAME_LEN ];
+    if( ! http_conn::file_path( s->path, path ) )
+    {
+        respond_error( s, 404 );
+        return;
+    }
+
+    resp_cache *cache = Singleton< resp_cache >::GetInstance();
+    s->entry = cache->lookup( path, true );
+    s->trace.mark( TRACE_STAT );
+    if( s->entry )
+    {
+        respond( s, 200, s->entry->data + s->entry->header_len, s->entry->len - s->entry->header_len );
+        return;
+    }
+    unsigned int gen = cache->generation();
+
+    struct stat st;
+    if( stat( path, &st ) < 0 )
+    {
+        respond_error( s, 404 );
+        return;
+    }
+    s->trace.mark( TRACE_STAT );
+    if( ! ( st.st_mode & S_IROTH ) )
+    {
+        respond_error( s, 403 );
+        return;
+    }
+    if( S_ISDIR( st.st_mode ) )
+    {
+        respond_error( s, 400 );
+        return;
+    }
+    /* 空文件应答一个空网页*/
+    if( st.st_size == 0 )
+    {
+        const char *empty = "<html><body></body></html>";
+        respond( s, 200, empty, strlen( empty ) );
+        return;
+    }
+
+    int fd = open( path, O_RDONLY );
+    /* 较小的文件在工作线程中就读入所有页(MAP_POPULATE), 反应堆生成DATA帧时不会缺页;
+     * 大文件不能整个读入, 生成DATA帧的过程中由produce按窗口提示内核预读
+     */
+    const server_config *cfg = current_config();
+    bool large = st.st_size >= cfg->large_file_threshold;
+    int flags = MAP_PRIVATE | ( large ? 0 : MAP_POPULATE );
+    char *map = fd < 0 ? ( char* )MAP_FAILED : ( char* )mmap( 0, st.st_size, PROT_READ, flags, fd, 0 );
+    if( fd >= 0 )
+    {
+        close( fd );
+    }
+    if( map == MAP_FAILED )
+    {
+        respond_error( s, 500 );
+        return;
+    }
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+    if( large && cfg->readahead_max > 0 )
+    {
+        s->ra_window = cfg->readahead_max;
+        s->ra_end = s->ra_window < st.st_size ? s->ra_window : st.st_size;
+        madvise( map, s->ra_end, MADV_WILLNEED );
+    }
+    s->trace.mark( TRACE_MAPPED );
+    if( ( size_t )st.st_size <= cache->max_file_size() )
+    {
+        s->entry = cache->insert( path, true, map, st.st_size, gen );
+        if( s->entry )
+        {
+            munmap( map, st.st_size );
+            respond( s, 200, s->entry->data + s->entry->header_len, s->entry->len - s->entry->header_len );
+            return;
+        }
+    }
+    s->map = map;
+    s->map_len = st.st_size;
+    respond( s, 200, map, st.st_size );
+}
+
+/* 运行CGI程序: 消息体已经完整地收在内存中, 连同程序和缓存的键交给作业, 由cgi类的线程执行;
+ * 输出也完整地收下来后再编码成应答, 应答因此可以带Content-Length
+ */
+void h2_session::run_cgi( h2_stream *s, const route *r )
+{
+    h2_job *job = new h2_job( this, m_cq, s->id, h2_job::JOB_CGI );
+    if( ! http_conn::cgi_program( r, s->path, job->m_program ) )
+    {
+        delete job;
+        respond_error( s, 404 );
+        return;
+    }
+    job->m_method = s->method;
+    snprintf( job->m_remote, sizeof( job->m_remote ), "%s", inet_ntoa( m_peer.sin_addr ) );
+    job->m_max_header = http_conn::CGI_HEADER_MAX;
+
+    /* 可缓存的路由: 作业先查缓存, 命中时不fork, 相同的请求正在执行时挂起等待它的结果*/
+    if( r->cache_ttl_ms > 0 && Singleton<cgi_cache>::GetInstance()->enabled() )
+    {
+        job->m_key = cgi_cache::make_key( job->m_program, "HTTP/2.0", s->method, s->query, s->headers,
+                                          s->headers_len, s->body, s->body_len, &job->m_key_len );
+        job->m_ttl_ms = r->cache_ttl_ms;
+    }
+    start_job( s, job );
+}
+
+/* 反向代理: 请求的消息体已经收齐, 编码好头部后交给作业转发给上游服务器, 收齐应答后再交回流*/
+void h2_session::run_proxy( h2_stream *s, const route *r )
+{
+    upstream *up = upstream_find( r->upstream );
+    if( ! up )
+    {
+        log_error( "upstream %s not found", r->upstream );
+        respond_error( s, 502 );
+        return;
+    }
+    /* 规范化后的路径是解码过的, 转发前重新编码*/
+    char path[ sizeof( s->path ) * 3 ];
+    int path_len = url_encode_path( s->path, path, sizeof( path ) );
+    int size = path_len + ( s->query ? strlen( s->query ) : 0 ) + s->headers_len + 512;
+    char *head = ( char* )malloc( size );
+    if( path_len < 0 || ! head )
+    {
+        free( head );
+        respond_error( s, 500 );
+        return;
+    }
+    int n = snprintf( head, size, "%s %s%s%s HTTP/1.1\r\n", s->method, path,
+                      s->query ? "?" : "", s->query ? s->query : "" );
+    if( s->authority[ 0 ] )
+    {
+        n += snprintf( head + n, size - n, "host: %s\r\n", s->authority );
+    }
+    memcpy( head + n, s->headers, s->headers_len );
+    n += s->headers_len;
+    if( s->body_len > 0 || strcmp( s->method, "POST" ) == 0 )
+    {
+        n += snprintf( head + n, size - n, "content-length: %d\r\n", s->body_len );
+    }
+    n += snprintf( head + n, size - n,
+                   "x-forwarded-for: %s\r\nx-forwarded-proto: %s\r\nconnection: keep-alive\r\n\r\n",
+                   inet_ntoa( m_peer.sin_addr ), m_tls ? "https" : "http" );
+
+    h2_job *job = new h2_job( this, m_cq, s->id, h2_job::JOB_PROXY );
+    job->m_up = up;
+    job->m_reactor = m_reactor;
+    job->m_head = head;
+    job->m_head_len = n;
+    job->m_max_header = http_conn::PROXY_BUF;
+    start_job( s, job );
+}
+
+/* 消息体移交给作业, 作业经过反应堆进入线程池的cgi类; 作业可能在本函数返回前就执行完毕,
+ * 结果要等处理帧的工作线程把连接交回反应堆后才会设置到流上
+ */
+void h2_session::start_job( h2_stream *s, h2_job *job )
+{
+    job->m_body = s->body;
+    job->m_body_len = s->body_len;
+    s->body = NULL;
+    s->body_len = s->body_cap = 0;
+    s->job = job;
+    m_jobs++;
+    job->resume();
+}
+
+void h2_session::complete( h2_job *job )
+{
+    m_jobs--;
+    h2_stream *s = find_stream( job->m_sid );
+    /* 执行期间流可能已经被重置(槽位也可能给了新的流)*/
+    if( s && s->job == job )
+    {
+        s->job = NULL;
+        if( job->m_forked )
+        {
+            s->trace.t[ TRACE_FORKED ] = job->m_forked;
+        }
+        if( job->m_refused )
+        {
+            reset_stream( s->id, H2_REFUSED_STREAM );
+        }
+        else
+        {
+            if( job->m_status )
+            {
+                respond_error( s, job->m_status );
+            }
+            else
+            {
+                respond_output( s, job->m_out, job->m_out_len, job->m_max_header );
+                job->m_out = NULL;
+            }
+            s->trace.mark( TRACE_FILLED );
+        }
+    }
+    delete job;
+}
+
+void h2_session::detach()
+{
+    m_conn = NULL;
+    if( m_jobs == 0 )
+    {
+        delete this;
+    }
+}
+
+h2_job::h2_job( h2_session *session, completion_queue< pool_task > *cq, int sid, int kind )
+    :m_session( session ), m_cq( cq ), m_sid( sid ), m_kind( kind ), m_next( NULL ), m_method( NULL ),
+     m_key( NULL ), m_key_len( 0 ), m_ttl_ms( 0 ), m_wait( NULL ), m_up( NULL ), m_reactor( 0 ),
+     m_head( NULL ), m_head_len( 0 ), m_body( NULL ), m_body_len( 0 ), m_out( NULL ), m_out_len( 0 ),
+     m_max_header( 0 ), m_status( 0 ), m_refused( false ), m_forked( 0 )
+{
+    m_program[ 0 ] = '\0';
+    m_remote[ 0 ] = '\0';
+}
+
+h2_job::~h2_job()
+{
+    if( m_wait )
+    {
+        cgi_cache::release( m_wait );
+    }
+    free( m_key );
+    free( m_head );
+    free( m_body );
+    free( m_out );
+}
+
+/* 由cgi类的工作线程调用, 执行完毕后交回连接所属的反应堆*/
+void h2_job::process()
+{
+    if( m_kind == JOB_PROXY )
+    {
+        run_proxy();
+    }
+    /* 挂起了, 作业可能已经被唤醒并交给了其他工作线程*/
+    else if( ! run_cgi() )
+    {
+        return;
+    }
+    m_cq->post( this, DONE );
+}
+
+bool h2_job::run_cgi()
+{
+    cgi_cache *cache = Singleton<cgi_cache>::GetInstance();
+    int found = cgi_cache::BYPASS;
+    if( m_wait )
+    {
+        /* 被唤醒: 执行者没有可用的结果时自己执行, 但不缓存*/
+        found = cgi_cache::ready( m_wait ) ? cgi_cache::HIT : cgi_cache::BYPASS;
+    }
+    else if( m_key )
+    {
+        found = cache->acquire( m_key, m_key_len, this, &m_wait );
+        if( found == cgi_cache::PARKED )
+        {
+            return false;
+        }
+    }
+    cgi_result *r = m_wait;
+    m_wait = NULL;
+    if( found == cgi_cache::HIT )
+    {
+        /* respond_output会就地修改并接管输出, 所以给它一份拷贝*/
+        m_out = ( char* )malloc( r->len );
+        if( m_out )
+        {
+            memcpy( m_out, r->data, r->len );
+            m_out_len = r->len;
+        }
+        cgi_cache::release( r );
+        return true;
+    }
+    cgi_result *lead = found == cgi_cache::LEAD ? r : NULL;
+    if( r && ! lead )
+    {
+        cgi_cache::release( r );
+    }
+
+    char env_method[ 32 ];
+    char env_request_method[ 32 ];
+    snprintf( env_method, sizeof( env_method ), "METHOD=%s", m_method );
+    snprintf( env_request_method, sizeof( env_request_method ), "REQUEST_METHOD=%s", m_method );
+    char env_gateway[] = "GATEWAY_INTERFACE=CGI/1.1";
+    char env_protocol[] = "SERVER_PROTOCOL=HTTP/2.0";
+    char env_length[ 64 ];
+    char env_remote[ 64 ];
+    snprintf( env_length, sizeof( env_length ), "CONTENT_LENGTH=%d", m_body_len );
+    snprintf( env_remote, sizeof( env_remote ), "REMOTE_ADDR=%s", m_remote );
+    char *cgi_envp[] = { env_method, env_request_method, env_gateway, env_protocol,
+                         env_remote, env_length, NULL };
+
+    int to_child, from_child;
+    pid_t pid = http_conn::spawn_cgi( m_program, cgi_envp, &to_child, &from_child );
+    if( pid < 0 )
+    {
+        if( lead )
+        {
+            cache->finish( lead, NULL, 0, 0 );
+        }
+        m_status = 500;
+        return true;
+    }
+    m_forked = trace_now();
+
+    bool ok = http_conn::collect_cgi( to_child, from_child, m_body, m_body_len, h2_session::MAX_CGI_OUTPUT,
+                                      &m_out, &m_out_len );
+    bool exited = http_conn::reap_cgi( pid, ! ok );
+    if( lead )
+    {
+        cache->finish( lead, ok && exited ? m_out : NULL, m_out_len, m_ttl_ms );
+    }
+    return true;
+}
+
+void h2_job::run_proxy()
+{
+    if( ! http_conn::proxy_fetch( m_up, m_reactor, m_head, m_head_len, m_body, m_body_len,
+                                  h2_session::MAX_CGI_OUTPUT, &m_out, &m_out_len ) )
+    {
+        m_out = NULL;
+    }
+}
+
+void h2_job::refuse()
+{
+    m_refused = true;
+    if( m_wait )
+    {
+        cgi_cache::release( m_wait );
+        m_wait = NULL;
+    }
+}
+
+/* 线程池因过载放弃执行: 不再执行, 照常交回*/
+void h2_job::reject()
+{
+    refuse();
+    m_cq->post( this, DONE );
+}
+
+/* 反应堆未能把作业交给线程池, 直接交回*/
+void h2_job::reject_inline()
+{
+    refuse();
+    on_completion();
+}
+
+/* 开始执行或挂起后被唤醒: 经过反应堆交给线程池的cgi类*/
+void h2_job::resume()
+{
+    m_cq->post( this, RESUME );
+}
+
+/* 反应堆取出执行完毕的作业: 交给连接, 由它在合适的时候设置到流上; 连接已经关闭时丢弃结果,
+ * 最后一个交回的作业释放会话
+ */
+void h2_job::on_completion()
+{
+    h2_session *h2 = m_session;
+    if( h2->m_conn )
+    {
+        h2->m_conn->h2_job_done( this );
+        return;
+    }
+    delete this;
+    if( --h2->m_jobs == 0 )
+    {
+        delete h2;
+    }
+}
+
+void h2_session::respond_output( h2_stream *s, char *out, int out_len, int max_header )
+{
+    int body_start = out ? http_conn::find_cgi_body( out, out_len ) : -1;
+    if( body_start < 0 || body_start > max_header )
+    {
+        if( out )
+        {
+            log_error( "cgi produced no valid header" );
+        }
+        free( out );
+        respond_error( s, 502 );
+        return;
+    }
+
+    /* 转发的头部行先收集起来, :status伪头部必须排在所有普通头部之前*/
+    struct cgi_lines
+    {
+        char *line[ 64 ];
+        int count;
+        static void add( void *arg, const char *line )
+        {
+            cgi_lines *lines = ( cgi_lines* )arg;
+            if( lines->count < 64 )
+            {
+                lines->line[ lines->count++ ] = ( char* )line;
+            }
+        }
+    } lines;
+    lines.count = 0;
+    const char *reason;
+    int status = http_conn::parse_cgi_head( out, body_start, &reason, cgi_lines::add, &lines );
+    if( status < 0 )
+    {
+        free( out );
+        respond_error( s, 502 );
+        return;
+    }
+    s->own = out;
+    respond( s, status, out + body_start, out_len - body_start, lines.line, lines.count );
+}
+
+void h2_session::respond_error( h2_stream *s, int status )
+{
+    const char *form;
+    switch( status )
+    {
+        case 403: form = error_403_form; break;
+        case 404: form = error_404_form; break;
+        case 500: form = error_500_form; break;
+        case 502: form = error_502_form; break;
+        default: form = error_400_form; break;
+    }
+    respond( s, status, form, strlen( form ) );
+}
+
+/* 内置状态页或慢请求页, 内容放在流自己的缓冲区里, 流结束时释放*/
+void h2_session::status_page( h2_stream *s, const route *r )
+{
+    bool slow = r->handler == ROUTE_SLOW;
+    const int size = slow ? 65536 : 8192;
+    s->own = ( char* )malloc( size );
+    if( ! s->own )
+    {
+        respond_error( s, 500 );
+        return;
+    }
+    int len = slow ? trace_dump( s->own, size ) : server_status( s->own, size );
+    char content_type[] = "content-type: text/plain";
+    char cache_control[] = "cache-control: no-cache";
+    char *extra[] = { content_type, cache_control };
+    respond( s, 200, s->own, len, extra, 2 );
+}
+
+/* 编码应答的头部块
+ * @extra : CGI输出的"名字: 值"形式的头部行; HTTP/2的头部名字必须是小写, 且不能有逐跳头部
+ */
+void h2_session::respond( h2_stream *s, int status, const char *data, long long len,
+                          char **extra, int extra_count )
+{
+    unsigned char block[ http_conn::CGI_HEADER_MAX + 64 ];
+    hpack_encoder enc( block, sizeof( block ) );
+    enc.add_status( status );
+    for( int i = 0; i < extra_count; ++i )
+    {
+        char *line = extra[ i ];
+        char *colon = strchr( line, ':' );
+        if( ! colon || colon == line )
+        {
+            continue;
+        }
+        int name_len = colon - line;
+        for( int j = 0; j < name_len; ++j )
+        {
+            line[ j ] = tolower( line[ j ] );
+        }
+        if( ( name_len == 10 && memcmp( line, "keep-alive", 10 ) == 0 )
+            || ( name_len == 7 && memcmp( line, "upgrade", 7 ) == 0 )
+            || ( name_len == 16 && memcmp( line, "proxy-connection", 16 ) == 0 ) )
+        {
+            continue;
+        }
+        char *value = colon + 1 + strspn( colon + 1, " \t" );
+        enc.add( line, name_len, value, strlen( value ) );
+    }
+    char length[ 32 ];
+    int length_len = snprintf( length, sizeof( length ), "%lld", len );
+    enc.add( "content-length", 14, length, length_len );
+    if( enc.overflow() )
+    {
+        log_error( "http2 response header too large" );
+        status = 502;
+        data = error_502_form;
+        len = strlen( error_502_form );
+        length_len = snprintf( length, sizeof( length ), "%lld", len );
+        enc = hpack_encoder( block, sizeof( block ) );
+        enc.add_status( status );
+        enc.add( "content-length", 14, length, length_len );
+    }
+
+    s->head = ( unsigned char* )malloc( enc.length() );
+    memcpy( s->head, block, enc.length() );
+    s->head_len = enc.length();
+    s->status = status;
+    s->data = data;
+    s->data_len = len;
+}
+
+h2_stream* h2_session::find_stream( int sid )
+{
+    for( int i = 0; i < m_max_streams; ++i )
+    {
+        if( m_streams[ i ].id == sid )
+        {
+            return &m_streams[ i ];
+        }
+    }
+    return NULL;
+}
+
+h2_stream* h2_session::new_stream( int sid )
+{
+    h2_stream *s = find_stream( 0 );
+    memset( s, 0, sizeof( *s ) );
+    s->id = sid;
+    s->state = H2_STREAM_OPEN;
+    s->recv_window = DEFAULT_WINDOW;
+    s->window = m_peer_initial_window;
+    /* 流的第一帧(HEADERS)在这批数据中被读到*/
+    s->trace.t[ TRACE_BEGIN ] = m_t_read;
+    m_active++;
+    return s;
+}
+
+void h2_session::close_stream( h2_stream *s )
+{
+    if( s->entry )
+    {
+        resp_cache::release( s->entry );
+    }
+    if( s->map )
+    {
+        munmap( s->map, s->map_len );
+    }
+    free( s->own );
+    free( s->body );
+    free( s->head );
+    free( s->headers );
+    s->job = NULL;
+    s->id = 0;
+    m_active--;
+}
+
+void h2_session::finish_stream( h2_stream *s )
+{
+    s->trace.mark( TRACE_DONE );
+    trace_finish( &s->trace, m_peer, s->method, s->path, s->query, s->status, s->head_len + s->data_len, true );
+    prefork_count_request();
+
+    log_record *rec = log_reserve();
+    if( rec )
+    {
+        rec->status = s->status;
+        rec->peer = m_peer;
+        rec->method = s->method;
+        rec->bytes = s->head_len + s->data_len;
+        rec->stage_us[ LOG_STAGE_READ ] = trace_us( &s->trace, TRACE_BEGIN, TRACE_READ );
+        rec->stage_us[ LOG_STAGE_QUEUE ] = trace_us( &s->trace, TRACE_READ, TRACE_DEQUEUE );
+        rec->stage_us[ LOG_STAGE_PROCESS ] = trace_us( &s->trace, TRACE_DEQUEUE, TRACE_FILLED );
+        rec->stage_us[ LOG_STAGE_WRITE ] = trace_us( &s->trace, TRACE_FILLED, TRACE_DONE );
+        snprintf( rec->text, LOG_TEXT_LEN, "%.*s", LOG_TEXT_LEN - 1, s->path );
+        log_commit( rec );
+    }
+    close_stream( s );
+}
+
+void h2_session::reset_stream( int sid, int error )
+{
+    unsigned char payload[ 4 ];
+    put_u32( payload, error );
+    append_frame( H2_RST_STREAM, 0, sid, payload, sizeof( payload ) );
+    h2_stream *s = find_stream( sid );
+    if( s )
+    {
+        close_stream( s );
+    }
+}
+
+void h2_session::connection_error( int error )
+{
+    if( ! m_fatal )
+    {
+        go_away( error );
+        m_fatal = true;
+    }
+}
+
+void h2_session::go_away( int error )
+{
+    if( m_goaway_sent && error == H2_NO_ERROR )
+    {
+        return;
+    }
+    unsigned char payload[ 8 ];
+    put_u32( payload, m_last_stream_id );
+    put_u32( payload + 4, error );
+    append_frame( H2_GOAWAY, 0, 0, payload, sizeof( payload ) );
+    m_goaway_sent = true;
+    if( error != H2_NO_ERROR )
+    {
+        m_fatal = true;
+    }
+}
+
+bool h2_session::closing() const
+{
+    return m_fatal || ( ( m_goaway_sent || m_peer_goaway ) && m_active == 0 );
+}
+
+void h2_session::reserve( int len )
+{
+    if( m_olen + len > m_ocap )
+    {
+        while( m_olen + len > m_ocap )
+        {
+            m_ocap *= 2;
+        }
+        m_obuf = ( char* )realloc( m_obuf, m_ocap );
+    }
+}
+
+void h2_session::append_frame( int type, int flags, int sid, const void *payload, int len )
+{
+    reserve( FRAME_HEADER_LEN + len );
+    unsigned char *p = ( unsigned char* )m_obuf + m_olen;
+    p[ 0 ] = len >> 16;
+    p[ 1 ] = len >> 8;
+    p[ 2 ] = len;
+    p[ 3 ] = type;
+    p[ 4 ] = flags;
+    put_u32( p + 5, sid );
+    if( len > 0 )
+    {
+        memcpy( p + FRAME_HEADER_LEN, payload, len );
+    }
+    m_olen += FRAME_HEADER_LEN + len;
+}
+
+void h2_session::append_window_update( int sid, int increment )
+{
+    unsigned char payload[ 4 ];
+    put_u32( payload, increment );
+    append_frame( H2_WINDOW_UPDATE, 0, sid, payload, sizeof( payload ) );
+}
+
+/* 为流生成下一帧: 先是头部块(必要时拆成HEADERS和若干CONTINUATION), 然后是受窗口限制的DATA帧*/
+bool h2_session::produce( h2_stream *s )
+{
+    if( ! s->head_sent )
+    {
+        int flags = s->data_len == 0 ? FLAG_END_STREAM : 0;
+        int type = H2_HEADERS;
+        int off = 0;
+        do
+        {
+            int n = s->head_len - off < m_peer_max_frame ? s->head_len - off : m_peer_max_frame;
+            off += n;
+            append_frame( type, flags | ( off == s->head_len ? FLAG_END_HEADERS : 0 ), s->id,
+                          s->head + off - n, n );
+            type = H2_CONTINUATION;
+            flags = 0;
+        } while( off < s->head_len );
+        s->head_sent = true;
+        if( s->data_len == 0 )
+        {
+            finish_stream( s );
+        }
+        return true;
+    }
+
+    long long n = s->data_len - s->data_sent;
+    n = n < m_peer_max_frame ? n : m_peer_max_frame;
+    n = n < m_send_window ? n : m_send_window;
+    n = n < s->window ? n : s->window;
+    if( n <= 0 )
+    {
+        return false;
+    }
+    /* 大文件: 发送位置离已预读的位置不到半个窗口时, 再提示内核读入一个窗口*/
+    if( s->map && s->ra_window > 0 && s->ra_end < s->data_len && s->ra_end - s->data_sent < s->ra_window / 2 )
+    {
+        long long from = s->ra_end & ~( long long )( sysconf( _SC_PAGESIZE ) - 1 );
+        long long to = s->ra_end + s->ra_window < s->data_len ? s->ra_end + s->ra_window : s->data_len;
+        madvise( s->map + from, to - from, MADV_WILLNEED );
+        s->ra_end = to;
+    }
+    bool last = s->data_sent + n == s->data_len;
+    append_frame( H2_DATA, last ? FLAG_END_STREAM : 0, s->id, s->data + s->data_sent, n );
+    s->data_sent += n;
+    s->window -= n;
+    m_send_window -= n;
+    if( last )
+    {
+        finish_stream( s );
+    }
+    return true;
+}
+
+bool h2_session::pull( const char **data, size_t *len )
+{
+    /* 每轮从上次停下的槽位开始, 给每个有数据可发的流生成一帧*/
+    bool progress = true;
+    while( progress && m_olen < OUTPUT_BATCH && ! m_fatal )
+    {
+        progress = false;
+        for( int i = 0; i < m_max_streams && m_olen < OUTPUT_BATCH; ++i )
+        {
+            h2_stream *s = &m_streams[ ( m_rr + i ) % m_max_streams ];
+            if( s->id && s->status && produce( s ) )
+            {
+                progress = true;
+            }
+        }
+        m_rr = ( m_rr + 1 ) % m_max_streams;
+    }
+    if( m_olen == 0 )
+    {
+        return false;
+    }
+    *data = m_obuf;
+    *len = m_olen;
+    return true;
+}
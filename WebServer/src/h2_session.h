@@ -0,0 +1,326 @@
+/*************************************************************************
+	> File Name: h2_session.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 21时58分17秒
+ ************************************************************************/
+
+#ifndef _H2_SESSION_H
+#define _H2_SESSION_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include "./hpack.h"
+#include "./resp_cache.h"
+#include "./route.h"
+#include "./trace.h"
+#include "./pool_task.h"
+
+class h2_session;
+class h2_job;
+class http_conn;
+class upstream;
+struct cgi_result;
+
+/* 流的状态(只需区分服务器关心的几种)*/
+enum H2_STREAM_STATE
+{
+    H2_STREAM_OPEN = 0,           /* 正在接收请求的头部或消息体*/
+    H2_STREAM_HALF_CLOSED         /* 请求已经收完(对方发送了END_STREAM), 正在应答*/
+};
+
+/* 连接上的一个流, 即一个请求及其应答*/
+struct h2_stream
+{
+    int id;                       /* 流标识符, 0表示槽位空闲*/
+    int state;                    /* H2_STREAM_STATE*/
+    const char *method;           /* 请求方法, 指向静态字符串, 不支持的方法为NULL*/
+    bool has_method;              /* 收到了:method伪头部*/
+    char path[ 200 ];             /* :path伪头部*/
+    bool has_path;
+    bool bad_path;                /* :path过长或者无法规范化*/
+    char *query;                  /* 查询串(未解码), 在path之中, 没有时为NULL*/
+    char authority[ 128 ];        /* :authority伪头部, 转发给上游服务器时作为Host*/
+    bool headers_done;            /* 请求头部已经收完, 此后的HEADERS帧是尾部字段*/
+    bool routed;                  /* 已经查找过路由(收到第一个普通头部时, 伪头部都在它之前)*/
+    const route *matched;         /* 匹配到的路由*/
+    char *headers;                /* 反向代理的请求要转发的普通头部, 每个是"名字: 值\r\n"*/
+    int headers_len;
+    int headers_cap;
+
+    char *body;                   /* 请求的消息体(POST), 收完后交给CGI程序*/
+    int body_len;
+    int body_cap;
+    int recv_window;              /* 接收窗口: 对方还能在本流上发送的字节数*/
+
+    long long window;             /* 发送窗口: 我们还能在本流上发送的字节数*/
+    int status;                   /* 应答状态码, 0表示应答还没准备好*/
+    unsigned char *head;          /* 编码好的应答头部块*/
+    int head_len;
+    bool head_sent;
+    const char *data;             /* 应答的消息体*/
+    long long data_len;
+    long long data_sent;
+
+    /* 消息体所引用的资源, 流结束时释放*/
+    cache_entry *entry;           /* 完整响应缓存条目(消息体在其中)*/
+    char *map;                    /* mmap的文件*/
+    size_t map_len;
+    long long ra_window;          /* 大文件: 每次提示内核预读的长度, 0表示不预读*/
+    long long ra_end;             /* 已经提示预读到的位置*/
+    char *own;                    /* malloc的缓冲区(CGI或上游服务器的输出)*/
+    h2_job *job;                  /* 正在执行的CGI或反向代理作业, 不为NULL时应答还没准备好*/
+
+    /* 经过各阶段的时间点, 用于访问日志和慢请求记录; 开始是收到请求头部的那批数据被读到的时间*/
+    req_trace trace;
+};
+
+/* HTTP/2流上的CGI或反向代理请求
+ * 作为独立的任务交给线程池的cgi类执行, 不占用处理帧的工作线程, 执行期间连接上的其他流照常推进;
+ * 结果经过连接所属反应堆的完成队列交回, 由反应堆设置到流上并发送。执行所需的程序、环境、转发的头部和
+ * 消息体都在创建时复制或移交到作业中, 工作线程不访问会话: 执行期间流可能被重置, 连接也可能关闭
+ */
+class h2_job : public pool_task
+{
+public:
+    enum KIND
+    {
+        JOB_CGI = 0,
+        JOB_PROXY
+    };
+    /* 完成队列中的动作: 执行完毕, 交回会话*/
+    static const int DONE = 0;
+
+public:
+    h2_job( h2_session *session, completion_queue< pool_task > *cq, int sid, int kind );
+    ~h2_job();
+
+    void process();
+    void reject();
+    void on_completion();
+    void reject_inline();
+    void resume();
+
+private:
+    /* 运行CGI程序并收齐输出, 挂起等待相同请求的执行结果时返回false*/
+    bool run_cgi();
+    void run_proxy();
+    /* 不再执行(过载), 流以REFUSED_STREAM重置, 客户端可以安全地重试*/
+    void refuse();
+
+private:
+    friend class h2_session;
+    friend class http_conn;
+
+    h2_session *m_session;
+    completion_queue< pool_task > *m_cq;
+    int m_sid;
+    int m_kind;
+    h2_job *m_next;               /* 连接正在处理帧时, 在连接的待交回链表中的链接*/
+
+    /* CGI: 程序、环境变量和缓存的键(路由不缓存时为NULL)*/
+    char m_program[ 200 ];       /* http_conn::FILENAME_LEN*/
+    const char *m_method;
+    char m_remote[ 32 ];
+    char *m_key;
+    int m_key_len;
+    int m_ttl_ms;
+    cgi_result *m_wait;           /* 挂起时等待的相同请求的执行结果*/
+    /* 反向代理: 上游服务器组和编码好的请求头部*/
+    upstream *m_up;
+    int m_reactor;
+    char *m_head;
+    int m_head_len;
+    char *m_body;                 /* 请求的消息体, 从流移交过来*/
+    int m_body_len;
+
+    /* 结果: 完整的输出(格式与CGI的输出相同), 为NULL且m_status为0时应答502*/
+    char *m_out;
+    int m_out_len;
+    int m_max_header;
+    int m_status;                 /* 不为0时以该状态码应答错误页*/
+    bool m_refused;
+    unsigned long long m_forked;  /* fork CGI程序的时间*/
+};
+
+/* 一个HTTP/2(明文, h2c)连接
+ * 反应堆读到的数据交给工作线程, 由on_input逐帧处理: 请求一收完就在工作线程中准备应答
+ * (静态文件来自完整响应缓存或mmap; CGI和反向代理的请求交给h2_job在cgi类中执行, 结果交回后再应答)。应答的HEADERS和DATA帧由pull按
+ * 流量控制窗口交错生成, 每轮给每个有数据的流一帧, 多个流在同一个连接上轮流推进;
+ * 生成DATA帧只是内存拷贝, 窗口打开后反应堆可以直接继续生成和发送, 不必再经过线程池
+ * 输出缓冲区在交给反应堆发送期间不会被修改: 连接是EPOLLONESHOT的, 发送完毕前不会再读取和处理新的帧
+ */
+class h2_session
+{
+public:
+    /* 帧类型*/
+    enum FRAME_TYPE
+    {
+        H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+        H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+    };
+    /* 错误码*/
+    enum ERROR_CODE
+    {
+        H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+        H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+        H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+    };
+
+    /* 客户端连接前言*/
+    static const char PREFACE[];
+    static const int PREFACE_LEN = 24;
+    static const int FRAME_HEADER_LEN = 9;
+    /* 我们接受的最大帧负载(SETTINGS_MAX_FRAME_SIZE的默认值)*/
+    static const int MAX_FRAME_SIZE = 16384;
+    /* 读缓冲区至少要能放下一个最大的帧*/
+    static const int INPUT_BUFFER_SIZE = 32768;
+    /* pull一次最多生成多少字节*/
+    static const int OUTPUT_BATCH = 65536;
+    /* 流量控制窗口的初始值*/
+    static const int DEFAULT_WINDOW = 65535;
+    /* 跨CONTINUATION帧的头部块的最大长度*/
+    static const int MAX_HEADER_BLOCK = 65536;
+    /* CGI输出的最大长度, 超过时应答502*/
+    static const int MAX_CGI_OUTPUT = 16 << 20;
+
+public:
+    /* @conn : 会话所属的连接, 作业的结果经过它交回会话
+     * @cq : 连接所属反应堆的完成队列, 作业由它交给线程池并交回结果
+     * @peer : 客户端地址, 用于访问日志和CGI的REMOTE_ADDR
+     * @reactor : 连接所属的反应堆, 反向代理时使用该反应堆的上游连接池
+     * @tls : 是否是HTTPS连接, 反向代理时告诉上游服务器原始的协议
+     * @max_streams : 允许同时进行的流数(SETTINGS_MAX_CONCURRENT_STREAMS)
+     * @max_body : 请求消息体的最大长度, 超过时重置该流
+     */
+    h2_session( http_conn *conn, completion_queue< pool_task > *cq, const sockaddr_in &peer, int reactor,
+                bool tls, int max_streams, int max_body );
+    ~h2_session();
+
+    /* 客户端以先验知识直接使用HTTP/2: 发送服务器的连接前言(SETTINGS帧)*/
+    void start();
+    /* HTTP/1.1的Upgrade: h2c请求: 应答101并发送连接前言, 升级请求作为流1处理
+     * HTTP2-Settings无效时返回false, 此时什么都没有发送, 调用者按HTTP/1.1处理该请求
+     * @settings : HTTP2-Settings头部的值(base64url编码的SETTINGS负载)
+     * @path : 升级请求的URL
+     */
+    bool upgrade( const char *settings, const char *path, unsigned long long t_begin, unsigned long long t_read );
+
+    /* 处理buf中的完整帧, 返回消耗的字节数, 剩下的是不完整的帧, 等收到更多数据后再处理
+     * 由工作线程调用, 可能阻塞在文件I/O上; CGI和反向代理的请求交给作业, 不在这里等待
+     * @t_read : 反应堆读到这批数据的时间
+     */
+    int on_input( const char *buf, int len, unsigned long long t_read );
+
+    /* 生成下一批待发送的数据, 没有可发送的数据(或都受流量控制阻塞)时返回false*/
+    bool pull( const char **data, size_t *len );
+    /* pull返回的数据已经发送完毕*/
+    void sent() { m_olen = 0; }
+
+    /* 不再接受新的流: 发送GOAWAY, 错误码不是NO_ERROR时发送完就关闭连接*/
+    void go_away( int error );
+    /* 发送完输出缓冲区后是否应该关闭连接*/
+    bool closing() const;
+    /* 是否没有进行中的流, 也没有待发送的帧*/
+    bool idle() const { return m_active == 0 && m_olen == 0; }
+
+    /* 作业执行完毕, 把结果设置到流上(反应堆线程, 连接不在工作线程中时调用), 然后释放作业*/
+    void complete( h2_job *job );
+    /* 连接关闭(反应堆线程): 没有执行中的作业时释放会话, 否则会话脱离连接, 由最后交回的作业释放*/
+    void detach();
+
+private:
+    /* 处理一帧*/
+    void on_frame( int type, int flags, int sid, const unsigned char *payload, int len );
+    void on_headers( int flags, int sid, const unsigned char *payload, int len );
+    void on_continuation( int flags, int sid, const unsigned char *payload, int len );
+    void on_data( int flags, int sid, const unsigned char *payload, int len );
+    void on_settings( int flags, const unsigned char *payload, int len );
+    void on_window_update( int sid, const unsigned char *payload, int len );
+    /* 应用SETTINGS帧(或HTTP2-Settings头部)中的参数, 出错返回错误码*/
+    int apply_settings( const unsigned char *payload, int len );
+
+    /* 解码一个完整的头部块, 然后根据是否带END_STREAM推进流的状态*/
+    void decode_headers( h2_stream *s, const unsigned char *block, int len, bool end_stream );
+    static void on_header( void *arg, const char *name, int name_len, const char *value, int value_len );
+
+    /* 请求收完后准备应答*/
+    void handle_request( h2_stream *s );
+    void serve_file( h2_stream *s );
+    /* CGI和反向代理: 准备好作业, 交给线程池的cgi类*/
+    void run_cgi( h2_stream *s, const route *r );
+    void run_proxy( h2_stream *s, const route *r );
+    void start_job( h2_stream *s, h2_job *job );
+    /* 按CGI输出格式的应答(头部、空行、消息体)设置应答, out为NULL表示失败, 应答502
+     * @max_header : 头部的最大长度
+     */
+    void respond_output( h2_stream *s, char *out, int out_len, int max_header );
+    void status_page( h2_stream *s, const route *r );
+    void respond_error( h2_stream *s, int status );
+    /* 设置应答: 编码头部块, 消息体是data开始的len个字节*/
+    void respond( h2_stream *s, int status, const char *data, long long len,
+                  char **extra = NULL, int extra_count = 0 );
+
+    /* 流的分配、查找和释放*/
+    h2_stream* find_stream( int sid );
+    h2_stream* new_stream( int sid );
+    void close_stream( h2_stream *s );
+    /* 应答发送完毕, 写访问日志后释放流*/
+    void finish_stream( h2_stream *s );
+
+    /* 错误处理: 流错误发送RST_STREAM并释放流, 连接错误发送GOAWAY后关闭连接*/
+    void reset_stream( int sid, int error );
+    void connection_error( int error );
+
+    /* 往输出缓冲区追加一帧*/
+    void append_frame( int type, int flags, int sid, const void *payload, int len );
+    void append_window_update( int sid, int increment );
+    void reserve( int len );
+    /* 为一个流生成下一帧, 返回是否生成了*/
+    bool produce( h2_stream *s );
+
+private:
+    friend class h2_job;
+
+    http_conn *m_conn;            /* 所属的连接, 连接关闭后为NULL*/
+    completion_queue< pool_task > *m_cq;
+    int m_jobs;                   /* 还没交回的作业数, 只在反应堆线程或处理帧的工作线程中修改, 二者不会同时访问会话*/
+    sockaddr_in m_peer;
+    int m_reactor;
+    bool m_tls;
+    int m_max_streams;
+    int m_max_body;
+
+    h2_stream *m_streams;         /* 流的槽位, 共m_max_streams个*/
+    int m_active;                 /* 进行中的流数*/
+    int m_last_stream_id;         /* 对方发起的最大流标识符*/
+    int m_rr;                     /* 轮流生成帧时下一次开始的槽位*/
+
+    hpack_decoder m_decoder;
+    unsigned char *m_hblock;      /* 跨CONTINUATION帧的头部块*/
+    int m_hblock_len;
+    int m_hblock_stream;          /* 正在等待CONTINUATION帧的流, 0表示没有*/
+    bool m_hblock_end_stream;
+    h2_stream *m_decoding;        /* 正在解码头部的流, 拒绝的流或尾部字段为NULL*/
+
+    unsigned long long m_t_read;  /* 正在处理的这批数据被读到的时间(trace_now)*/
+
+    bool m_need_preface;          /* 还没有收到客户端连接前言*/
+    bool m_need_settings;         /* 连接前言之后的第一帧必须是SETTINGS*/
+
+    /* 对方的参数*/
+    long long m_send_window;      /* 连接的发送窗口*/
+    int m_peer_initial_window;    /* 新流的发送窗口初始值*/
+    int m_peer_max_frame;         /* 对方能接受的最大帧负载*/
+    int m_recv_window;            /* 连接的接收窗口*/
+
+    bool m_goaway_sent;
+    bool m_fatal;                 /* 发生了连接错误, 发送完GOAWAY就关闭*/
+    bool m_peer_goaway;           /* 对方发送了GOAWAY*/
+
+    char *m_obuf;                 /* 输出缓冲区*/
+    int m_olen;
+    int m_ocap;
+};
+
+#endif
@@ -0,0 +1,482 @@
+/*************************************************************************
+	> File Name: hpack.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 21时30分05秒
+ ************************************************************************/
+#include "./hpack.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* 静态表(RFC 7541 附录A), 下标即索引, 0号不用*/
+static const struct
+{
+    const char *name;
+    const char *value;
+} static_table[] =
+{
+    { "", "" },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+static const int STATIC_TABLE_SIZE = 61;
+
+/* Huffman编码(RFC 7541 附录B)中每个符号的码长, 256号是EOS
+ * 这是一个规范Huffman编码: 码字按(码长, 符号)的顺序依次递增分配, 所以只需码长就能还原出码表
+ */
+static const unsigned char huffman_code_len[ 257 ] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+/* 规范Huffman编码的解码表: 对每种码长记录第一个码字、码字个数, 以及这些码字对应的符号*/
+struct huffman_table
+{
+    static const int MAX_LEN = 30;
+    unsigned int first[ MAX_LEN + 1 ];   /* 该码长的第一个码字*/
+    unsigned int count[ MAX_LEN + 1 ];   /* 该码长的码字个数*/
+    int offset[ MAX_LEN + 1 ];           /* 该码长的第一个符号在symbols中的下标*/
+    unsigned short symbols[ 257 ];       /* 按码字顺序排列的符号*/
+
+    huffman_table()
+    {
+        memset( count, 0, sizeof( count ) );
+        for( int i = 0; i < 257; ++i )
+        {
+            count[ huffman_code_len[ i ] ]++;
+        }
+        unsigned int code = 0;
+        int n = 0;
+        for( int len = 1; len <= MAX_LEN; ++len )
+        {
+            first[ len ] = code;
+            offset[ len ] = n;
+            for( int i = 0; i < 257; ++i )
+            {
+                if( huffman_code_len[ i ] == len )
+                {
+                    symbols[ n++ ] = i;
+                }
+            }
+            code = ( code + count[ len ] ) << 1;
+        }
+    }
+};
+static const huffman_table huffman;
+
+/* Huffman解码, 成功返回解码后的长度, 出错(含EOS、填充不合法、超出out的大小)返回-1*/
+static int huffman_decode( const unsigned char *src, int len, char *out, int out_size )
+{
+    unsigned int code = 0;
+    int bits = 0;
+    int n = 0;
+    for( int i = 0; i < len; ++i )
+    {
+        for( int b = 7; b >= 0; --b )
+        {
+            code = ( code << 1 ) | ( ( src[ i ] >> b ) & 1 );
+            if( ++bits > huffman_table::MAX_LEN )
+            {
+                return -1;
+            }
+            /* 规范编码中, 长度为bits且不小于first[bits]的前缀只要落在本码长的范围内就是一个完整码字*/
+            unsigned int k = code - huffman.first[ bits ];
+            if( k >= huffman.count[ bits ] )
+            {
+                continue;
+            }
+            unsigned short sym = huffman.symbols[ huffman.offset[ bits ] + k ];
+            if( sym == 256 || n >= out_size )
+            {
+                return -1;
+            }
+            out[ n++ ] = sym;
+            code = 0;
+            bits = 0;
+        }
+    }
+    /* 末尾的填充必须是EOS码字的前缀(全1), 且不超过7位*/
+    if( bits > 7 || code != ( 1u << bits ) - 1 )
+    {
+        return -1;
+    }
+    return n;
+}
+
+/* 解码一个带前缀的整数, 成功返回消耗的字节数, 出错返回-1*/
+static int decode_int( const unsigned char *src, int len, int prefix_bits, unsigned int *value )
+{
+    if( len < 1 )
+    {
+        return -1;
+    }
+    unsigned int max_prefix = ( 1u << prefix_bits ) - 1;
+    unsigned int v = src[ 0 ] & max_prefix;
+    if( v < max_prefix )
+    {
+        *value = v;
+        return 1;
+    }
+    int shift = 0;
+    for( int i = 1; i < len; ++i )
+    {
+        v += ( unsigned int )( src[ i ] & 0x7f ) << shift;
+        if( ! ( src[ i ] & 0x80 ) )
+        {
+            *value = v;
+            return i + 1;
+        }
+        shift += 7;
+        /* 头部块里没有任何合法的值需要超过28位*/
+        if( shift > 21 )
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/* 解码一个字符串, 成功返回消耗的字节数, 出错返回-1*/
+static int decode_string( const unsigned char *src, int len, char *out, int *out_len )
+{
+    unsigned int n;
+    int used = decode_int( src, len, 7, &n );
+    if( used < 0 || n > ( unsigned int )( len - used ) )
+    {
+        return -1;
+    }
+    if( src[ 0 ] & 0x80 )
+    {
+        *out_len = huffman_decode( src + used, n, out, hpack_decoder::MAX_STRING );
+        if( *out_len < 0 )
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if( n > ( unsigned int )hpack_decoder::MAX_STRING )
+        {
+            return -1;
+        }
+        memcpy( out, src + used, n );
+        *out_len = n;
+    }
+    return used + n;
+}
+
+hpack_decoder::hpack_decoder()
+    :m_head( 0 ), m_count( 0 ), m_size( 0 ), m_max_size( DEFAULT_TABLE_SIZE )
+{
+    /* 每个条目至少占32字节, 表的大小上限决定了最多有多少个条目*/
+    m_capacity = DEFAULT_TABLE_SIZE / 32 + 1;
+    m_entries = new hpack_entry[ m_capacity ];
+    m_name_buf = new char[ MAX_STRING ];
+    m_value_buf = new char[ MAX_STRING ];
+}
+
+hpack_decoder::~hpack_decoder()
+{
+    evict( 0 );
+    delete [] m_entries;
+    delete [] m_name_buf;
+    delete [] m_value_buf;
+}
+
+bool hpack_decoder::lookup( unsigned int index, const char **name, int *name_len,
+                            const char **value, int *value_len )
+{
+    if( index == 0 )
+    {
+        return false;
+    }
+    if( index <= ( unsigned int )STATIC_TABLE_SIZE )
+    {
+        *name = static_table[ index ].name;
+        *name_len = strlen( *name );
+        *value = static_table[ index ].value;
+        *value_len = strlen( *value );
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if( index >= ( unsigned int )m_count )
+    {
+        return false;
+    }
+    /* 动态表中索引越小的条目越新*/
+    hpack_entry *e = &m_entries[ ( m_head - index + m_capacity ) % m_capacity ];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return true;
+}
+
+void hpack_decoder::evict( int limit )
+{
+    while( m_count > 0 && m_size > limit )
+    {
+        hpack_entry *e = &m_entries[ ( m_head - m_count + 1 + m_capacity ) % m_capacity ];
+        m_size -= e->name_len + e->value_len + 32;
+        free( e->name );
+        m_count--;
+    }
+}
+
+void hpack_decoder::insert( const char *name, int name_len, const char *value, int value_len )
+{
+    int size = name_len + value_len + 32;
+    /* 名字可能引用的是即将被淘汰的条目, 先复制再淘汰*/
+    char *mem = NULL;
+    if( size <= m_max_size )
+    {
+        mem = ( char* )malloc( name_len + value_len );
+        memcpy( mem, name, name_len );
+        memcpy( mem + name_len, value, value_len );
+    }
+    /* 比整个表还大的条目会清空动态表, 自己也不插入*/
+    evict( m_max_size - size );
+    if( ! mem )
+    {
+        return;
+    }
+    m_head = ( m_head + 1 ) % m_capacity;
+    hpack_entry *e = &m_entries[ m_head ];
+    e->name = mem;
+    e->name_len = name_len;
+    e->value = mem + name_len;
+    e->value_len = value_len;
+    m_count++;
+    m_size += size;
+}
+
+bool hpack_decoder::decode( const unsigned char *block, int len, hpack_header_fn fn, void *arg )
+{
+    int pos = 0;
+    while( pos < len )
+    {
+        unsigned char first = block[ pos ];
+        unsigned int index;
+        int used;
+
+        /* 1xxxxxxx: 索引的头部字段*/
+        if( first & 0x80 )
+        {
+            used = decode_int( block + pos, len - pos, 7, &index );
+            const char *name, *value;
+            int name_len, value_len;
+            if( used < 0 || ! lookup( index, &name, &name_len, &value, &value_len ) )
+            {
+                return false;
+            }
+            pos += used;
+            fn( arg, name, name_len, value, value_len );
+            continue;
+        }
+
+        /* 001xxxxx: 动态表大小更新, 不能超过我们通告的上限*/
+        if( ( first & 0xe0 ) == 0x20 )
+        {
+            used = decode_int( block + pos, len - pos, 5, &index );
+            if( used < 0 || index > ( unsigned int )DEFAULT_TABLE_SIZE )
+            {
+                return false;
+            }
+            pos += used;
+            m_max_size = index;
+            evict( m_max_size );
+            continue;
+        }
+
+        /* 字面头部字段: 01xxxxxx 加入动态表, 0000xxxx 不加入, 0001xxxx 永不加入*/
+        bool indexing = ( first & 0xc0 ) == 0x40;
+        used = decode_int( block + pos, len - pos, indexing ? 6 : 4, &index );
+        if( used < 0 )
+        {
+            return false;
+        }
+        pos += used;
+
+        const char *name;
+        int name_len;
+        if( index > 0 )
+        {
+            const char *unused;
+            int unused_len;
+            if( ! lookup( index, &name, &name_len, &unused, &unused_len ) )
+            {
+                return false;
+            }
+        }
+        else
+        {
+            used = decode_string( block + pos, len - pos, m_name_buf, &name_len );
+            if( used < 0 )
+            {
+                return false;
+            }
+            pos += used;
+            name = m_name_buf;
+        }
+        int value_len;
+        used = decode_string( block + pos, len - pos, m_value_buf, &value_len );
+        if( used < 0 )
+        {
+            return false;
+        }
+        pos += used;
+
+        fn( arg, name, name_len, m_value_buf, value_len );
+        if( indexing )
+        {
+            insert( name, name_len, m_value_buf, value_len );
+        }
+    }
+    return true;
+}
+
+hpack_encoder::hpack_encoder( unsigned char *buf, int size )
+    :m_buf( buf ), m_size( size ), m_len( 0 ), m_overflow( false )
+{
+}
+
+bool hpack_encoder::put_int( unsigned int value, int prefix_bits, unsigned char first )
+{
+    unsigned int max_prefix = ( 1u << prefix_bits ) - 1;
+    if( m_len + 6 > m_size )
+    {
+        m_overflow = true;
+        return false;
+    }
+    if( value < max_prefix )
+    {
+        m_buf[ m_len++ ] = first | value;
+        return true;
+    }
+    m_buf[ m_len++ ] = first | max_prefix;
+    value -= max_prefix;
+    while( value >= 0x80 )
+    {
+        m_buf[ m_len++ ] = ( value & 0x7f ) | 0x80;
+        value >>= 7;
+    }
+    m_buf[ m_len++ ] = value;
+    return true;
+}
+
+bool hpack_encoder::put_string( const char *str, int len )
+{
+    if( ! put_int( len, 7, 0 ) || m_len + len > m_size )
+    {
+        m_overflow = true;
+        return false;
+    }
+    memcpy( m_buf + m_len, str, len );
+    m_len += len;
+    return true;
+}
+
+bool hpack_encoder::add_status( int status )
+{
+    /* 静态表中有的状态码只需一个字节*/
+    for( int i = 8; i <= 14; ++i )
+    {
+        if( atoi( static_table[ i ].value ) == status )
+        {
+            return put_int( i, 7, 0x80 );
+        }
+    }
+    char value[ 16 ];
+    int len = snprintf( value, sizeof( value ), "%d", status );
+    return add( ":status", 7, value, len );
+}
+
+bool hpack_encoder::add( const char *name, int name_len, const char *value, int value_len )
+{
+    /* 不加入动态表的字面字段, 名字在静态表中时只写索引*/
+    for( int i = 1; i <= STATIC_TABLE_SIZE; ++i )
+    {
+        if( ( int )strlen( static_table[ i ].name ) == name_len
+            && memcmp( static_table[ i ].name, name, name_len ) == 0 )
+        {
+            return put_int( i, 4, 0x00 ) && put_string( value, value_len );
+        }
+    }
+    return put_int( 0, 4, 0x00 ) && put_string( name, name_len ) && put_string( value, value_len );
+}
@@ -0,0 +1,92 @@
+/*************************************************************************
+	> File Name: hpack.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 21时12分40秒
+ ************************************************************************/
+
+#ifndef _HPACK_H
+#define _HPACK_H
+
+/* HPACK头部压缩(RFC 7541)
+ * 解码器维护对端编码器的动态表, 连接上所有头部块必须按收到的顺序解码;
+ * 编码器不使用动态表(也就不需要和对端同步表的状态), 只引用静态表, 字符串不做Huffman编码
+ */
+
+/* 解码出一个头部字段时的回调, name和value不以'\0'结尾, 只在回调期间有效*/
+typedef void (*hpack_header_fn)( void *arg, const char *name, int name_len,
+                                 const char *value, int value_len );
+
+/* 动态表中的一个条目, 名字和值存放在同一块内存中*/
+struct hpack_entry
+{
+    char *name;
+    int name_len;
+    char *value;
+    int value_len;
+};
+
+class hpack_decoder
+{
+public:
+    /* 我们在SETTINGS中通告的SETTINGS_HEADER_TABLE_SIZE(用默认值)*/
+    static const int DEFAULT_TABLE_SIZE = 4096;
+    /* 单个头部名字或值解码后的最大长度*/
+    static const int MAX_STRING = 16384;
+
+public:
+    hpack_decoder();
+    ~hpack_decoder();
+
+    /* 解码一个完整的头部块, 对其中的每个头部字段调用fn
+     * 失败返回false, 此时动态表的状态已经无法与对端保持一致, 调用者应以COMPRESSION_ERROR关闭连接
+     */
+    bool decode( const unsigned char *block, int len, hpack_header_fn fn, void *arg );
+
+private:
+    /* 按索引(静态表1~61, 动态表从62开始)取得头部字段*/
+    bool lookup( unsigned int index, const char **name, int *name_len,
+                 const char **value, int *value_len );
+    /* 在动态表中插入一个条目, 必要时淘汰最旧的条目*/
+    void insert( const char *name, int name_len, const char *value, int value_len );
+    /* 淘汰最旧的条目, 直到表的大小不超过limit*/
+    void evict( int limit );
+
+private:
+    hpack_entry *m_entries;   /* 环形数组, m_head为最新条目的下标*/
+    int m_capacity;           /* 环形数组能容纳的条目数*/
+    int m_head;
+    int m_count;
+    int m_size;               /* 各条目大小之和(名字长度 + 值长度 + 32)*/
+    int m_max_size;           /* 对端通过动态表大小更新指令设定的上限*/
+    char *m_name_buf;         /* 解码字符串用的缓冲区*/
+    char *m_value_buf;
+};
+
+/* 把头部字段依次编码到调用者提供的缓冲区中*/
+class hpack_encoder
+{
+public:
+    hpack_encoder( unsigned char *buf, int size );
+
+    /* 编码:status伪头部*/
+    bool add_status( int status );
+    /* 编码一个头部字段, 名字必须已经是小写的*/
+    bool add( const char *name, int name_len, const char *value, int value_len );
+
+    /* 已编码的长度, 缓冲区不足时整个头部块作废*/
+    int length() const { return m_len; }
+    bool overflow() const { return m_overflow; }
+
+private:
+    bool put_int( unsigned int value, int prefix_bits, unsigned char first );
+    bool put_string( const char *str, int len );
+
+private:
+    unsigned char *m_buf;
+    int m_size;
+    int m_len;
+    bool m_overflow;
+};
+
+#endif
@@ -5,8 +5,18 @@
 	> Created Time: 2018年04月15日 星期日 19时39分30秒
  ************************************************************************/
 #include "./http_conn.h"
+#include "./Singleton.h"
+#include "./h2_session.h"
+#include "./tls.h"
+#include "./prefork.h"
+#include "./cgi_cache.h"
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 
 /* 定义一些HTTP响应的一些状态信息*/
 const char *ok_200_title = "OK";
@@ -18,9 +28,25 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The CGI program did not produce a valid response.\n";
 const char *wwwRoot = "../wwwRoot";
 
+/* 过载时的应答, 预先序列化好, 拒绝请求时不需要解析请求或格式化应答*/
+static const char unavailable_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 66\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The server is too busy to handle the request, please retry later.\n";
+
+#ifndef PATH_MAX
 #define PATH_MAX 1024
+#endif
+
+/* 生成服务器状态页的内容, 返回长度(定义在WebServer.cpp中)*/
+extern int server_status( char *buf, int size );
 
 /* 获取html和cgi所在目录*/
 int get_root_path(char *root_path)
@@ -99,32 +125,208 @@ void modfd(int epollfd, int fd, int ev)
 }
 
 /* 初始化类静态变量，为类内函数提供定义----------------------------------------*/
-/* 初始化用户数量，和epoll监听事件表描述符*/
+/* 初始化用户数量*/
 int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+/* 初始化优雅退出标志*/
+int http_conn::m_draining = 0;
+
+/* 请求方法的名称, 与METHOD枚举一一对应, 用于访问日志*/
+static const char *method_names[] =
+{
+    "GET", "POST", "HEAD", "PUT", "DELETE",
+    "TRACE", "OPTIONS", "CONNECT", "PATCH"
+};
+
+http_conn::http_conn()
+    :m_epollfd( -1 ), m_pool( NULL ), m_cq( NULL ), m_sockfd( -1 ), m_ssl( NULL ), m_read_buf( NULL ),
+     m_read_buf_size( 0 ), m_write_buf( NULL ), m_write_buf_size( 0 ), m_h2( NULL ), m_h2_done( NULL ),
+     m_in_worker( false ), m_cgi_wait( NULL )
+{
+}
+
+http_conn::~http_conn()
+{
+    delete [] m_read_buf;
+    delete [] m_write_buf;
+}
 
-/* 客户方关闭了连接*/
+/* 关闭连接, 只在连接所属的反应堆线程中调用*/
 void http_conn::close_conn( bool read_close )
 {
     if( read_close && ( m_sockfd != -1 ) )
     {
+        m_out.clear();
+        unmap();
+        m_arena.reset();
+        /* HTTP/2流的作业还在执行时, 会话由最后交回的作业释放*/
+        if( m_h2 )
+        {
+            apply_h2_jobs();
+            m_h2->detach();
+            m_h2 = NULL;
+        }
+        if( m_ssl )
+        {
+            SSL_free( m_ssl );
+            m_ssl = NULL;
+        }
         removefd( m_epollfd, m_sockfd );
         m_sockfd = -1;
-        m_user_count--;
+        __sync_sub_and_fetch( &m_user_count, 1 );
+        prefork_count_connection( -1 );
+        /* 对象回到所属反应堆的连接池, 此后不能再访问本对象*/
+        if( m_pool )
+        {
+            m_pool->put( this );
+        }
     }
 }
 
 /* 初始化该HTTP连接*/
-void http_conn::init( int sockfd, const sockaddr_in &addr )
+void http_conn::init( int sockfd, const sockaddr_in &addr, int epollfd, int reactor, conn_pool< http_conn > *pool,
+                      completion_queue< pool_task > *cq, bool tls )
 {
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_reactor = reactor;
+    m_pool = pool;
+    m_cq = cq;
+    m_served = 0;
+    m_in_worker = false;
     /*如下两行是为了避免TIME_WAIT状态，仅用于调试，实际使用时应该去掉*/
     int reuse = 1;
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    /* 限制内核中积压的未发送数据量: 慢速客户端不会在内核里占用数MB缓冲,
+     * EPOLLOUT也只会在积压量低于该值时才触发
+     */
+    const server_config *cfg = current_config();
+    if( cfg->notsent_lowat > 0 )
+    {
+        setsockopt( m_sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                    &cfg->notsent_lowat, sizeof( cfg->notsent_lowat ) );
+    }
+
+    /* 按当前配置准备读写缓冲区, 大小未变时直接复用上一个连接留下的缓冲区*/
+    if( m_read_buf_size != cfg->read_buffer_size )
+    {
+        delete [] m_read_buf;
+        m_read_buf_size = cfg->read_buffer_size;
+        m_read_buf = new char[ m_read_buf_size ];
+    }
+    if( m_write_buf_size != cfg->write_buffer_size )
+    {
+        delete [] m_write_buf;
+        m_write_buf_size = cfg->write_buffer_size;
+        m_write_buf = new char[ m_write_buf_size ];
+    }
+    m_file_address = NULL;
+    m_file_fd = -1;
+    m_cache_entry = NULL;
+    m_handshaking = false;
+    m_ktls_tx = false;
     addfd( m_epollfd, sockfd, true );
-    m_user_count++;
+    __sync_add_and_fetch( &m_user_count, 1 );
+    prefork_count_connection( 1 );
     init();
+
+    /* HTTPS连接先握手, 握手完成前反应堆只调用handshake*/
+    if( tls )
+    {
+        m_ssl = tls_new( sockfd );
+        if( ! m_ssl )
+        {
+            close_conn();
+            return;
+        }
+        m_handshaking = true;
+    }
+}
+
+/* 非阻塞地推进TLS握手, 握手需要的读写事件都由反应堆等待
+ * 握手完成时客户端发来的请求还在套接字中(OpenSSL不会预读握手之后的记录), 重新监听EPOLLIN即可
+ */
+bool http_conn::handshake()
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake( m_ssl );
+    if( ret == 1 )
+    {
+        m_handshaking = false;
+        m_ktls_tx = tls_ktls_send( m_ssl );
+        wait_input();
+        return true;
+    }
+    switch( SSL_get_error( m_ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return true;
+        }
+        case SSL_ERROR_WANT_WRITE:
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            return true;
+        }
+        default:
+        {
+            ERR_clear_error();
+            return false;
+        }
+    }
+}
+
+bool http_conn::input_buffered() const
+{
+    return m_ssl && ! m_handshaking && m_out.empty() && SSL_pending( m_ssl ) > 0;
+}
+
+/* 一条TLS记录解密后可能没有全部放进读缓冲区, 剩下的留在OpenSSL中, 套接字不会再触发EPOLLIN;
+ * 这时同时监听EPOLLOUT, 反应堆被唤醒后发现input_buffered, 按可读处理
+ */
+void http_conn::wait_input()
+{
+    modfd( m_epollfd, m_sockfd, m_ssl && SSL_pending( m_ssl ) > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN );
+}
+
+/* 读取客户数据, TLS连接的错误都映射为errno, 使调用者可以和明文连接一样处理*/
+ssize_t http_conn::recv_some( char *buf, size_t len )
+{
+    if( ! m_ssl )
+    {
+        return recv( m_sockfd, buf, len, 0 );
+    }
+    ERR_clear_error();
+    int ret = SSL_read( m_ssl, buf, len );
+    if( ret > 0 )
+    {
+        return ret;
+    }
+    switch( SSL_get_error( m_ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        case SSL_ERROR_ZERO_RETURN:
+        {
+            return 0;
+        }
+        default:
+        {
+            ERR_clear_error();
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+out_queue::SEND_RESULT http_conn::send_out()
+{
+    SSL *ssl = user_tls();
+    return ssl ? m_out.send_tls( ssl ) : m_out.send( m_sockfd );
 }
 
 /* 初始化调用*/
@@ -134,18 +336,39 @@ void http_conn::init()
     m_linger = false;
     m_method = GET;
     m_url = NULL;
+    m_query = NULL;
+    m_param_count = 0;
+    m_route = NULL;
+    m_page = NULL;
+    m_page_len = 0;
     m_version = 0;
     m_content_length = 0;
+    m_has_content_length = false;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_upgrade_h2c = false;
+    m_h2_settings = NULL;
     m_host = NULL;
     m_start_line = 0;
+    m_header_start = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-    m_bytes_to_send = 0;
-    m_bytes_have_send = 0;
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
-    memset( m_read_file, '\0', FILENAME_LEN );
+    m_inline = false;
+    m_deferred = false;
+    m_cgi_content = NULL;
+    if( m_cgi_wait )
+    {
+        cgi_cache::release( m_cgi_wait );
+        m_cgi_wait = NULL;
+    }
+    m_trace.reset();
+    m_status = 0;
+    m_out.clear();
+    /* 不再清零读写缓冲区和文件名: 解析只访问m_read_idx之前读入的数据, 每一行都由parse_line补上结束符,
+     * 写缓冲区由vsnprintf逐段写入并按m_write_idx发送
+     */
+    m_arena.reset();
 }
 /* 解析行，即判断有没读到一个完整的行(遇到空行\r\n)*/
 http_conn::LINE_STATUS http_conn::parse_line()
@@ -206,15 +429,16 @@ http_conn::LINE_STATUS http_conn::parse_line()
 /* 读取客户数据，直到无数据可读*/
 bool http_conn::read_request()
 {
-    if( m_read_idx >= READ_BUFFER_SIZE )
+    if( m_read_idx >= m_read_buf_size )
     {
         return false;
     }
     int bytes_read = 0;
-    while( true )
+    /* 读缓冲区满时停止读取: 剩下的只可能是消息体, 由处理请求的线程直接从套接字读取*/
+    while( m_read_idx < m_read_buf_size )
     {
         /* 由于m_sockfd是非阻塞的，所以本次调用不会阻塞*/
-        bytes_read = read( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
+        bytes_read = recv_some( m_read_buf + m_read_idx, m_read_buf_size - m_read_idx );
         /* 如果调用返回-1，错误代码为  EAGAIN | EWOULDBLOCK,
          * 并不是因为数据出错,是因为在非阻塞模式下调用了阻塞操作，而操作未完成导致的。
          * 其他的错误代码说明是数据出错
@@ -236,9 +460,77 @@ bool http_conn::read_request()
         /* 更新已读入数据的下一字节m_read_idx位置*/
         m_read_idx += bytes_read;
     }
+    m_trace.mark( TRACE_READ );
+    if( ! m_trace.t[ TRACE_BEGIN ] )
+    {
+        m_trace.t[ TRACE_BEGIN ] = m_trace.t[ TRACE_READ ];
+    }
     return true;
 }
 
+/* 确定请求的调度类: 路由到CGI程序的请求要fork, 反向代理的请求要等待上游服务器, 都归入cgi类,
+ * 其余请求归入static类
+ * 请求行已经被工作线程解析过(请求分多次到达)时直接使用匹配到的路由;
+ * 否则把读缓冲区中的请求行里的URL复制出来规范化后查找路由, 不修改缓冲区, 完整的解析仍由工作线程完成。
+ * 请求行还没收完时只能按请求方法猜测: POST归入cgi类
+ */
+http_conn::SCHED_CLASS http_conn::classify()
+{
+    /* HTTP/2连接的工作线程只处理帧和静态文件, CGI和反向代理的流作为独立的作业进入cgi类, 整个连接归入static类*/
+    if( m_h2 )
+    {
+        return SCHED_STATIC;
+    }
+    if( m_check_state != CHECK_STATE_REQUESTLINE )
+    {
+        return m_route && ( m_route->handler == ROUTE_CGI || m_route->handler == ROUTE_PROXY )
+               ? SCHED_CGI : SCHED_STATIC;
+    }
+    const char *text = m_read_buf + m_start_line;
+    int len = m_read_idx - m_start_line;
+    bool post = len > 4 && strncasecmp( text, "POST", 4 ) == 0 && ( text[ 4 ] == ' ' || text[ 4 ] == '\t' );
+    const char *eol = ( const char* )memchr( text, '\n', len );
+    if( ! eol )
+    {
+        return post ? SCHED_CGI : SCHED_STATIC;
+    }
+
+    /* 取出URL: 方法之后的第一个字段, 绝对形式(http://host/path)只保留路径部分*/
+    const char *url = text;
+    while( url < eol && *url != ' ' && *url != '\t' )
+    {
+        url++;
+    }
+    while( url < eol && ( *url == ' ' || *url == '\t' ) )
+    {
+        url++;
+    }
+    const char *end = url;
+    while( end < eol && *end != ' ' && *end != '\t' )
+    {
+        end++;
+    }
+    if( end - url > 7 && strncasecmp( url, "http://", 7 ) == 0 )
+    {
+        const char *slash = ( const char* )memchr( url + 7, '/', end - url - 7 );
+        url = slash ? slash : end;
+    }
+    char path[ FILENAME_LEN ];
+    char *query;
+    if( end - url >= FILENAME_LEN || end == url )
+    {
+        return SCHED_STATIC;
+    }
+    memcpy( path, url, end - url );
+    path[ end - url ] = '\0';
+    if( ! url_canonicalize( path, &query ) )
+    {
+        return SCHED_STATIC;
+    }
+    const route *r = current_config()->routes->lookup( post ? "POST" : "GET", path );
+    return r && ( r->handler == ROUTE_CGI || r->handler == ROUTE_PROXY ) ? SCHED_CGI : SCHED_STATIC;
+}
+
 /* 解析HTTP请求行，获得请求方法、目标URL，以及HTTP版本号*/
 http_conn::HTTP_CODE http_conn::parse_request_line( char *text )
 {
@@ -304,6 +596,21 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char *text )
     {
         return BAD_REQUEST;
     }
+    /* 解码并规范化路径, 文件查找和缓存都以规范形式为键; 查询参数解码到arena中, 保留原始的查询串*/
+    if( ! url_canonicalize( m_url, &m_query ) )
+    {
+        return BAD_REQUEST;
+    }
+    if( m_query && m_query[ 0 ] )
+    {
+        char *query = m_arena.dup( m_query, strlen( m_query ) );
+        if( query )
+        {
+            m_param_count = url_parse_query( query, m_params, MAX_QUERY_PARAMS );
+        }
+    }
+    m_route = current_config()->routes->lookup( method_names[ m_method ], m_url );
+    m_header_start = m_checked_idx;
     /* 请求行已分析完毕，接下来就要开始分析头部字段，所以状态迁移为CHECK_STATE_HEADER*/
     m_check_state = CHECK_STATE_HEADER;
     /* 返回NO_REQUEST, 表示请求还未分析完，因为头部字段还未分析*/
@@ -316,15 +623,34 @@ http_conn::HTTP_CODE http_conn::parse_headers( char *text )
     /* 遇到空行，表示头部字段解析完毕*/
     if ( text[ 0 ] == '\0')
     {
-        /* 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
-         * 状态转移到CHECK_STATE_CONTENT状态
+        /* 服务器正在退出, 无论客户端是否要求, 应答后都关闭连接*/
+        if( __atomic_load_n( &m_draining, __ATOMIC_RELAXED ) )
+        {
+            m_linger = false;
+        }
+        /* 同时带Content-Length和chunked的请求无法确定消息体在哪里结束, 拒绝以免被用来夹带请求*/
+        if( m_has_content_length && m_chunked )
+        {
+            return BAD_REQUEST;
+        }
+        /* 如果HTTP请求有消息体, 状态转移到CHECK_STATE_CONTENT状态; 消息体不必先读完,
+         * 处理请求时边收边送给CGI程序或上游服务器
          */
-        if ( m_content_length != 0 )
+        if ( m_content_length != 0 || m_chunked )
         {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+            if( m_route && ( m_route->handler == ROUTE_CGI || m_route->handler == ROUTE_PROXY ) )
+            {
+                m_check_state = CHECK_STATE_CONTENT;
+                return NO_REQUEST;
+            }
+            /* 其他处理方式不读取消息体, 连接上剩下的数据无法再解析, 应答后关闭连接*/
+            m_linger = false;
+        }
+        /* 没有消息体的GET请求才能升级到HTTP/2*/
+        else if( wants_h2c() )
+        {
+            return UPGRADE_REQUEST;
         }
-
         /* 头部已解析完毕，没有消息体，整个请求及其头部检验完毕，开始处理请求*/
         return GET_REQUEST;
     }
@@ -342,8 +668,51 @@ http_conn::HTTP_CODE http_conn::parse_headers( char *text )
     else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
     {
         text += 15;
-        text + strspn( text, " \t" );
-        m_content_length = atol( text ); /* 将字符串转为数字*/
+        text += strspn( text, " \t" );
+        /* 必须全部是数字且不超出int的范围, 与前一个Content-Length不同时也不接受*/
+        char *end = NULL;
+        errno = 0;
+        long long len = strtoll( text, &end, 10 );
+        end += strspn( end, " \t" );
+        if( ! isdigit( ( unsigned char )*text ) || *end != '\0' || errno == ERANGE || len > INT_MAX
+            || ( m_has_content_length && m_content_length != len ) )
+        {
+            return BAD_REQUEST;
+        }
+        m_content_length = len;
+        m_has_content_length = true;
+    }
+    /* 处理Transfer-Encoding头部字段, 只支持chunked*/
+    else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "chunked" ) != 0 )
+        {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    /* 处理Expect头部字段: 客户端要先收到100 Continue才发送消息体*/
+    else if ( strncasecmp( text, "Expect:", 7 ) == 0 )
+    {
+        text += 7;
+        text += strspn( text, " \t" );
+        m_expect_continue = strcasecmp( text, "100-continue" ) == 0;
+    }
+    /* 处理Upgrade头部字段, 只关心h2c*/
+    else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 )
+    {
+        text += 8;
+        text += strspn( text, " \t" );
+        m_upgrade_h2c = strcasecmp( text, "h2c" ) == 0;
+    }
+    /* 处理HTTP2-Settings头部字段, 升级时由h2_session解码*/
+    else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 )
+    {
+        text += 15;
+        text += strspn( text, " \t" );
+        m_h2_settings = text;
     }
     /* 处理Host头部字段*/
     else if ( strncasecmp( text, "Host:", 5 ) == 0 )
@@ -362,164 +731,2188 @@ http_conn::HTTP_CODE http_conn::parse_headers( char *text )
 /* 解析消息体，即解析post请求的参数*/
 http_conn::HTTP_CODE http_conn::parse_content( char *text )
 {
-    /* 请求不完整，还有数据未获取完*/
-    if( m_read_idx < ( m_content_length + m_checked_idx ) )
+    /* 要fork CGI程序或等待上游服务器, 不能在反应堆线程中进行; 状态机停在CHECK_STATE_CONTENT, 工作线程会重新进入这里*/
+    if( m_inline )
     {
-        return NO_REQUEST;
+        return DEFERRED_REQUEST;
     }
 
-    int fa_To_ch[2];   /* 父进程往子进程送数据*/
-    int ch_To_fa[2];   /* 子进程往父进程送数据*/
-    if( pipe(fa_To_ch) < 0 )
-    {
-        perror("pipe:");
-    }
-    if( pipe(ch_To_fa) < 0 )
-    {
-        perror("pipe:");
-    }
+    m_trace.mark( TRACE_PARSED );
+    return m_route->handler == ROUTE_PROXY ? run_proxy( text ) : run_cgi( text );
+}
 
-    int pid;
-    if( (pid = fork()) < 0 )
+/* 用SSL_write写一段数据, 返回值与writev相同; 需要等待时errno为EAGAIN, *events为要等待的事件*/
+static ssize_t tls_write( SSL *ssl, const struct iovec *iov, short *events )
+{
+    ERR_clear_error();
+    int ret = SSL_write( ssl, iov->iov_base, iov->iov_len );
+    if( ret > 0 )
     {
-        perror("fork:");
+        return ret;
     }
-
-    if( pid == 0 )
+    int err = SSL_get_error( ssl, ret );
+    if( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ )
     {
-        char METHOD[BUFSIZ];
-        sprintf(METHOD, "METHOD=%s", "POST");
-        char CONTENT_LENGTH[BUFSIZ];
-        sprintf(CONTENT_LENGTH, "CONTENT_LENGTH=%d", m_content_length);
-
-        putenv(METHOD);
-        putenv(CONTENT_LENGTH);
-
-
-        /* 用cgi程序替换当前子进程*/
-        char cgi_path[ PATH_MAX ] = "";
-        get_root_path( cgi_path );
-        strcat(cgi_path, "/cgi-bin/calc_cgi");
-
-        /* 子进程从fa_To_ch[0], 现在已重定向到标准输入读取父进程发送给子进程的数据
-         * 将处理好的数据，发送到ch_To_fa[1], 现在已重定向到标准输出。
-         */
-        close(fa_To_ch[1]);
-        dup2(fa_To_ch[0], STDIN_FILENO);
-        close(ch_To_fa[0]);
-        dup2(ch_To_fa[1], STDOUT_FILENO);
-
-        execl(cgi_path, "calc_cgi", NULL);
-        exit(1);
+        *events = err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+        errno = EAGAIN;
+        return -1;
     }
-    /* 父进程*/
-    else
-    {
-        close(fa_To_ch[0]);
-        close(ch_To_fa[1]);
-        
+    ERR_clear_error();
+    errno = EPIPE;
+    return -1;
+}
 
-        int have_write = 0;
-        int ret;
-        while( (have_write < m_content_length) && (ret = write(fa_To_ch[1], text, m_content_length)) > 0 )
+/* 等待fd可写后继续写, 直到iov中的数据全部写出; 超时或出错返回false
+ * 工作线程在处理CGI请求期间独占连接, 可以在这里阻塞, 不影响反应堆
+ * @ssl : 需要在用户态加密时的SSL对象, 否则为NULL
+ * @trace : 记下等待客户端的次数
+ * @flags : 明文时sendmsg的标志, 如MSG_MORE表示后面紧跟着还有数据, 先不要单独发出一个小包
+ */
+static bool send_iov( int fd, SSL *ssl, struct iovec *iov, int count, req_trace *trace, int flags = 0 )
+{
+    while( count > 0 )
+    {
+        short events = POLLOUT;
+        ssize_t ret;
+        if( ssl )
         {
-            have_write += ret;
+            ret = tls_write( ssl, iov, &events );
         }
-        
-        char buff[ BUFSIZ ] = "";
-        while( (ret = read(ch_To_fa[0], buff, BUFSIZ)) > 0 )
+        else
         {
-            write(m_sockfd, buff, ret);
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ret = sendmsg( fd, &msg, flags );
+        }
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                return false;
+            }
+            trace->stall();
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = events;
+            if( poll( &pfd, 1, http_conn::CGI_SEND_TIMEOUT_MS ) <= 0 )
+            {
+                return false;
+            }
+            continue;
+        }
+        /* 跳过已经写完的片段*/
+        while( count > 0 && ( size_t )ret >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if( count > 0 )
+        {
+            iov->iov_base = ( char* )iov->iov_base + ret;
+            iov->iov_len -= ret;
         }
-       
-        waitpid(pid, NULL, 0);
-        close(ch_To_fa[0]);
-        close(fa_To_ch[1]);
-
-        return GET_REQUEST;
     }
+    return true;
 }
 
-/* 主状态机, 读取完整的行后分析各个部分*/
-http_conn::HTTP_CODE http_conn::process_read()
+/* 请求消息体的chunked解码状态*/
+enum CHUNK_STATE
 {
-    LINE_STATUS line_status = LINE_OK;
-    HTTP_CODE ret = NO_REQUEST;
-    char *text = NULL;
-    
-    /* 拿到一个一行请求内容，可能是请求行，也有可能是头部字段中的一行, 如果当前开始
-     * 消息体时，就不要调用parse_line()了，因为消息体没有\r\n来结尾，所以放在||之前
-     */
-    while( (m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || (line_status = parse_line()) == LINE_OK )
-    {
-        /* text指向当前解析行的第一个字符, text = m_read_buf+m_start_line, m_start_line初值为0*/
-        text = get_line();
+    CHUNK_SIZE = 0,     /* 正在读块大小(十六进制)*/
+    CHUNK_EXT,          /* 跳过块扩展, 直到行尾*/
+    CHUNK_SIZE_LF,      /* 块大小行的\r之后*/
+    CHUNK_DATA,         /* 块数据*/
+    CHUNK_DATA_CR,      /* 块数据之后的\r*/
+    CHUNK_DATA_LF,      /* 块数据之后的\n*/
+    CHUNK_TRAILER,      /* 最后一块之后, 一行的开头*/
+    CHUNK_TRAILER_SKIP, /* 跳过尾部字段, 直到行尾*/
+    CHUNK_TRAILER_LF,   /* 结束消息体的空行的\r之后*/
+    CHUNK_DONE          /* 消息体已经结束*/
+};
 
-        /* m_checked_idx是本行的行末，下一行的行始*/
-        m_start_line = m_checked_idx;
-        switch ( m_check_state )
+struct chunk_decoder
+{
+    int state;
+    long long left;     /* 块大小, 或当前块中还未读取的数据字节数*/
+    int digits;         /* 块大小的十六进制位数*/
+};
+
+/* 在buf中就地解码chunked消息体: 解出的数据移到buf开头, 返回其长度, 格式错误返回-1
+ * 消息体结束(CHUNK_DONE)后的字节不再处理
+ */
+static int decode_chunked( chunk_decoder *d, char *buf, int len )
+{
+    int out = 0;
+    for( int i = 0; i < len && d->state != CHUNK_DONE; )
+    {
+        char c = buf[ i ];
+        switch( d->state )
         {
-            case CHECK_STATE_REQUESTLINE:          /* 第一个状态: 分析请求行*/
+            case CHUNK_SIZE:
             {
-                ret = parse_request_line( text );
-                if ( ret == BAD_REQUEST )
+                int v = isdigit( c ) ? c - '0' : ( isxdigit( c ) ? ( tolower( c ) - 'a' + 10 ) : -1 );
+                if( v >= 0 && d->digits < 15 )
                 {
-                    return BAD_REQUEST;
+                    d->left = d->left * 16 + v;
+                    d->digits++;
+                }
+                else if( d->digits == 0 || v >= 0 )
+                {
+                    return -1;
+                }
+                else if( c == ';' || c == ' ' || c == '\t' )
+                {
+                    d->state = CHUNK_EXT;
+                }
+                else if( c == '\r' )
+                {
+                    d->state = CHUNK_SIZE_LF;
+                }
+                else
+                {
+                    return -1;
                 }
+                ++i;
                 break;
             }
-            case CHECK_STATE_HEADER:              /* 第二个状态: 分析头部字段*/
+            case CHUNK_EXT:
             {
-                ret = parse_headers( text );
-                if ( ret == BAD_REQUEST )
+                if( c == '\r' )
                 {
-                    return BAD_REQUEST;
+                    d->state = CHUNK_SIZE_LF;
                 }
-                else if ( ret == GET_REQUEST && m_method == GET )
+                ++i;
+                break;
+            }
+            case CHUNK_SIZE_LF:
+            {
+                if( c != '\n' )
                 {
-                    return do_request();
+                    return -1;
                 }
+                d->state = d->left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                ++i;
                 break;
             }
-            case CHECK_STATE_CONTENT:            /* 第三个状态: 分析消息体*/
+            case CHUNK_DATA:
             {
-                return parse_content( text );
+                int n = len - i < d->left ? len - i : ( int )d->left;
+                memmove( buf + out, buf + i, n );
+                out += n;
+                i += n;
+                d->left -= n;
+                if( d->left == 0 )
+                {
+                    d->state = CHUNK_DATA_CR;
+                }
+                break;
             }
-            default:
+            case CHUNK_DATA_CR:
+            case CHUNK_DATA_LF:
             {
-                return INTERNAL_ERROR;
+                if( c != ( d->state == CHUNK_DATA_CR ? '\r' : '\n' ) )
+                {
+                    return -1;
+                }
+                if( d->state == CHUNK_DATA_CR )
+                {
+                    d->state = CHUNK_DATA_LF;
+                }
+                else
+                {
+                    d->state = CHUNK_SIZE;
+                    d->digits = 0;
+                }
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER:
+            {
+                d->state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_SKIP;
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER_SKIP:
+            {
+                if( c == '\n' )
+                {
+                    d->state = CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER_LF:
+            {
+                if( c != '\n' )
+                {
+                    return -1;
+                }
+                d->state = CHUNK_DONE;
+                ++i;
+                break;
             }
         }
     }
-    /* 退出while循环，而不是直接返回，说明尚未读取到一个完整的行*/
-    return NO_REQUEST;
+    return out;
 }
 
-/*  当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，如果目标文件存在
- *  对所有用户可读，且不是目录，则使用mmap将其映射到内存地址m_file_address处，并
- *  告诉调用者获取文件成功
+/* 应答已发完但客户端仍在发送消息体时, 直接close会因接收缓冲区中有未读数据而发出RST,
+ * 客户端可能因此丢掉还没读取的应答。先关闭写方向, 再读掉客户端发来的数据, 直到对方关闭或超时;
+ * 客户端一直在发送时也只读到超时为止, 不会无限占用工作线程
  */
-http_conn::HTTP_CODE http_conn::do_request()
+static void drain_before_close( int fd )
 {
-    /* 获取文件在服务器的真实路径( html_path + m_url )*/
-    char html_path[ PATH_MAX ] = {0};
-    get_root_path(html_path);
-    strcpy( m_read_file, html_path );
-    int len = strlen( html_path );
-    if( strcasecmp(m_url, "/") == 0 )
-    {
-        strncpy( m_read_file + len, "/index.html", FILENAME_LEN - len - 1 );
-    }
-    else
+    shutdown( fd, SHUT_WR );
+    char buf[ BUFSIZ ];
+    long long deadline = log_now_ns() + http_conn::LINGER_DRAIN_MS * 1000000LL;
+    while( true )
     {
-        strncpy( m_read_file + len, m_url, FILENAME_LEN - len - 1 );
-    }
-
-    /* 获取文件的属性*/
+        int left_ms = ( deadline - log_now_ns() ) / 1000000;
+        if( left_ms <= 0 )
+        {
+            return;
+        }
+        ssize_t n = recv( fd, buf, sizeof( buf ), 0 );
+        if( n > 0 || ( n < 0 && errno == EINTR ) )
+        {
+            continue;
+        }
+        if( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
+        {
+            return;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if( poll( &pfd, 1, left_ms ) <= 0 )
+        {
+            return;
+        }
+    }
+}
+
+/* 在CGI输出中找到头部与消息体之间的空行, 返回消息体的起始位置, 未找到返回-1
+ * CGI程序的头部可以用\r\n也可以只用\n换行
+ */
+int http_conn::find_cgi_body( const char *buf, int len )
+{
+    for( int i = 0; i < len; ++i )
+    {
+        if( buf[ i ] != '\n' )
+        {
+            continue;
+        }
+        if( i + 1 < len && buf[ i + 1 ] == '\n' )
+        {
+            return i + 2;
+        }
+        if( i + 2 < len && buf[ i + 1 ] == '\r' && buf[ i + 2 ] == '\n' )
+        {
+            return i + 3;
+        }
+    }
+    return -1;
+}
+
+/* 启动CGI程序, 成功返回子进程号, 并由to_child、from_child带回它的标准输入的写端和标准输出的
+ * 读端(都是非阻塞的); 失败返回-1
+ * @program : CGI程序的完整路径
+ * @envp : CGI程序的环境变量, 必须在调用前准备好
+ */
+pid_t http_conn::spawn_cgi( const char *program, char **envp, int *to_child, int *from_child )
+{
+    const char *name = strrchr( program, '/' );
+    char *cgi_argv[] = { ( char* )( name ? name + 1 : program ), NULL };
+
+    /* 管道都带O_CLOEXEC: 同时运行的其他CGI子进程不会继承本请求的管道,
+     * 否则它们持有写端会让本请求读不到EOF
+     */
+    int fa_To_ch[2];   /* 父进程往子进程送数据*/
+    int ch_To_fa[2];   /* 子进程往父进程送数据*/
+    if( pipe2( fa_To_ch, O_CLOEXEC ) < 0 )
+    {
+        log_error( "pipe: %m" );
+        return -1;
+    }
+    if( pipe2( ch_To_fa, O_CLOEXEC ) < 0 )
+    {
+        log_error( "pipe: %m" );
+        close( fa_To_ch[0] );
+        close( fa_To_ch[1] );
+        return -1;
+    }
+    /* 加大管道容量, 减少CGI程序因管道写满而停下来的次数; 超出系统限制(pipe-max-size)时保持默认大小*/
+    fcntl( fa_To_ch[1], F_SETPIPE_SZ, CGI_PIPE_SIZE );
+    fcntl( ch_To_fa[1], F_SETPIPE_SZ, CGI_PIPE_SIZE );
+
+    pid_t pid = fork();
+    if( pid < 0 )
+    {
+        log_error( "fork: %m" );
+        close( fa_To_ch[0] );
+        close( fa_To_ch[1] );
+        close( ch_To_fa[0] );
+        close( ch_To_fa[1] );
+        return -1;
+    }
+    if( pid == 0 )
+    {
+        /* 子进程从标准输入读取请求的消息体, 把应答写到标准输出; dup2出来的描述符不带O_CLOEXEC*/
+        dup2( fa_To_ch[0], STDIN_FILENO );
+        dup2( ch_To_fa[1], STDOUT_FILENO );
+        execve( program, cgi_argv, envp );
+        _exit( 127 );
+    }
+
+    close( fa_To_ch[0] );
+    close( ch_To_fa[1] );
+    setnonblocking( fa_To_ch[1] );
+    setnonblocking( ch_To_fa[0] );
+    *to_child = fa_To_ch[1];
+    *from_child = ch_To_fa[0];
+    return pid;
+}
+
+/* 块大小行带MSG_MORE, 与随后splice的块数据(len个字节, 还在管道中)合在一起发出, 不单独成一个小包
+ * 块数据不带SPLICE_F_MORE: 否则最后不满一个报文段的部分要等更多数据才发出, 实测吞吐反而大降
+ * 管道中的数据只有本线程读取, 至少有len个字节, splice只会因为套接字写满而移动得少一些
+ */
+bool http_conn::splice_chunk( int pipe_fd, int len, long long *sent )
+{
+    char size_line[ 16 ];
+    struct iovec iov;
+    iov.iov_base = size_line;
+    iov.iov_len = sprintf( size_line, "%x\r\n", len );
+    long long total = iov.iov_len + len + 2;
+    if( ! send_iov( m_sockfd, NULL, &iov, 1, &m_trace, MSG_MORE ) )
+    {
+        return false;
+    }
+    while( len > 0 )
+    {
+        ssize_t n = splice( pipe_fd, NULL, m_sockfd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if( n > 0 )
+        {
+            len -= n;
+            continue;
+        }
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n < 0 && errno != EAGAIN )
+        {
+            return false;
+        }
+        m_trace.stall();
+        struct pollfd pfd;
+        pfd.fd = m_sockfd;
+        pfd.events = POLLOUT;
+        if( poll( &pfd, 1, CGI_SEND_TIMEOUT_MS ) <= 0 )
+        {
+            return false;
+        }
+    }
+    iov.iov_base = ( void* )"\r\n";
+    iov.iov_len = 2;
+    if( ! send_iov( m_sockfd, NULL, &iov, 1, &m_trace ) )
+    {
+        return false;
+    }
+    *sent += total;
+    return true;
+}
+
+/* 运行CGI程序并把它的输出流式地转发给客户端
+ * CGI程序按CGI/1.1的约定先输出头部(Status、Content-Type等)和一个空行, 再输出消息体;
+ * 应答的分帧由服务器负责: 状态行和头部由服务器根据CGI头部生成, 消息体一到就以
+ * Transfer-Encoding: chunked分块发送, 客户端不必等CGI程序结束就能收到数据, 连接也可以
+ * 继续用于下一个请求。为兼容旧的CGI程序, 以HTTP/1.x状态行开头的输出按同样的方式处理,
+ * 其中的Content-Length和Connection由服务器重新决定
+ * 返回GET_REQUEST表示应答已经发送完毕, CLOSED_CONNECTION表示发送途中出错,
+ * 其余错误码表示还没有发送任何数据, 由调用者应答相应的错误页面
+ */
+http_conn::HTTP_CODE http_conn::run_cgi( char *body )
+{
+    char program[ FILENAME_LEN ];
+    if( ! cgi_program( m_route, m_url, program ) )
+    {
+        /* 消息体还没有读取, 应答后关闭连接*/
+        if( m_content_length != 0 || m_chunked )
+        {
+            m_linger = false;
+        }
+        return NO_RESOURCE;
+    }
+
+    /* fork之后、exec之前的子进程里只能调用异步信号安全的函数, 所以环境变量都在fork前准备好*/
+    char env_method[ 32 ];
+    char env_request_method[ 32 ];
+    char env_gateway[] = "GATEWAY_INTERFACE=CGI/1.1";
+    char env_protocol[] = "SERVER_PROTOCOL=HTTP/1.1";
+    char env_length[ 64 ];
+    char env_remote[ 64 ];
+    snprintf( env_method, sizeof( env_method ), "METHOD=%s", method_names[ m_method ] );
+    snprintf( env_request_method, sizeof( env_request_method ), "REQUEST_METHOD=%s", method_names[ m_method ] );
+    snprintf( env_length, sizeof( env_length ), "CONTENT_LENGTH=%d", m_content_length );
+    snprintf( env_remote, sizeof( env_remote ), "REMOTE_ADDR=%s", inet_ntoa( m_address.sin_addr ) );
+    /* 原始的(未解码的)查询串, 没有时为空串*/
+    const char *query = m_query ? m_query : "";
+    char *env_query = ( char* )m_arena.alloc( strlen( query ) + sizeof( "QUERY_STRING=" ) );
+    if( ! env_query )
+    {
+        return INTERNAL_ERROR;
+    }
+    sprintf( env_query, "QUERY_STRING=%s", query );
+    /* chunked消息体的长度事先未知, 不设置CONTENT_LENGTH, CGI程序读到EOF为止*/
+    char *cgi_envp[] = { env_method, env_request_method, env_gateway, env_protocol,
+                         env_remote, env_query, m_chunked ? NULL : env_length, NULL };
+
+    /* 可缓存的路由: 消息体不大时收齐后查缓存, 不再边收边送; 挂起后被唤醒的请求已经收齐了消息体*/
+    const server_config *cfg = current_config();
+    if( m_cgi_content || ( m_route->cache_ttl_ms > 0 && ! m_chunked && m_content_length <= cfg->cgi_cache_max_body
+                           && Singleton<cgi_cache>::GetInstance()->enabled() ) )
+    {
+        return run_cgi_cached( program, cgi_envp, body );
+    }
+
+    int to_child, from_child;
+    pid_t pid = spawn_cgi( program, cgi_envp, &to_child, &from_child );
+    if( pid < 0 )
+    {
+        return INTERNAL_ERROR;
+    }
+    m_trace.mark( TRACE_FORKED );
+
+    /* 父进程: 边收消息体边送给CGI程序, 同时转发它的输出; 送完消息体就关闭写端,
+     * 读到EOF为止的CGI程序才能结束
+     */
+    HTTP_CODE ret = pump_cgi( to_child, from_child, body );
+    close( from_child );
+    reap_cgi( pid, ret != GET_REQUEST );
+    return ret;
+}
+
+/* 回收CGI子进程, 应答中途失败时先杀死它, 免得它一直运行下去*/
+bool http_conn::reap_cgi( pid_t pid, bool kill_first )
+{
+    if( kill_first )
+    {
+        kill( pid, SIGKILL );
+    }
+    int status = 0;
+    while( waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+    {
+    }
+    if( WIFEXITED( status ) && WEXITSTATUS( status ) == 127 )
+    {
+        log_error( "exec cgi program failed" );
+    }
+    return WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+/* 同时送消息体和收输出, 只顾一头的话双方可能因管道写满而互相等待*/
+bool http_conn::collect_cgi( int to_child, int from_child, const char *body, int body_len, int max_len,
+                             char **out, int *out_len )
+{
+    int body_sent = 0;
+    bool stdin_open = true;
+    char *buf = NULL;
+    int len = 0;
+    int cap = 0;
+    bool failed = false;
+    int timeout_ms = current_config()->cgi_timeout_ms;
+    while( true )
+    {
+        while( stdin_open && body_sent < body_len )
+        {
+            ssize_t n = write( to_child, body + body_sent, body_len - body_sent );
+            if( n > 0 )
+            {
+                body_sent += n;
+                continue;
+            }
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            /* 管道满时等待; 其他错误(EPIPE)说明CGI程序不再读取*/
+            if( n < 0 && errno != EAGAIN )
+            {
+                body_sent = body_len;
+            }
+            break;
+        }
+        if( stdin_open && body_sent == body_len )
+        {
+            close( to_child );
+            stdin_open = false;
+        }
+
+        struct pollfd fds[ 2 ];
+        fds[ 0 ].fd = from_child;
+        fds[ 0 ].events = POLLIN;
+        fds[ 1 ].fd = to_child;
+        fds[ 1 ].events = POLLOUT;
+        int ready = poll( fds, stdin_open ? 2 : 1, timeout_ms );
+        if( ready < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        /* 超时的CGI程序由调用者杀死并回收*/
+        if( ready <= 0 )
+        {
+            if( ready == 0 )
+            {
+                log_error( "cgi program timed out after %d ms", timeout_ms );
+            }
+            failed = true;
+            break;
+        }
+        if( ! fds[ 0 ].revents )
+        {
+            continue;
+        }
+        if( cap - len < 4096 )
+        {
+            int new_cap = cap ? cap * 2 : 16384;
+            char *p = ( char* )realloc( buf, new_cap );
+            if( ! p )
+            {
+                failed = true;
+                break;
+            }
+            buf = p;
+            cap = new_cap;
+        }
+        ssize_t n = read( from_child, buf + len, cap - len );
+        if( n < 0 && ( errno == EAGAIN || errno == EINTR ) )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            break;
+        }
+        len += n;
+        if( len > max_len )
+        {
+            log_error( "cgi output exceeds %d bytes", max_len );
+            failed = true;
+            break;
+        }
+    }
+    if( stdin_open )
+    {
+        close( to_child );
+    }
+    close( from_child );
+    if( failed )
+    {
+        free( buf );
+        buf = NULL;
+        len = 0;
+    }
+    *out = buf;
+    *out_len = len;
+    return ! failed;
+}
+
+/* 可缓存的CGI路由: 消息体(不超过cgi_cache_max_body)先收齐, 与程序、查询串和选定的头部一起作为键查找缓存;
+ * 没有命中时执行CGI程序并收齐输出, 以Content-Length应答, 输出可以缓存时存入缓存。
+ * 相同的请求正在执行时连接挂在它上面, 返回PARKED_REQUEST, 不占用工作线程; 执行者结束后连接经过反应堆
+ * 回到线程池, 从dispatch再次进入这里, 直接使用它的结果。其余返回值的含义与run_cgi相同
+ */
+http_conn::HTTP_CODE http_conn::run_cgi_cached( const char *program, char **envp, char *body )
+{
+    cgi_cache *cache = Singleton<cgi_cache>::GetInstance();
+    char *content = m_cgi_content;
+    int found;
+    if( m_cgi_wait )
+    {
+        /* 被唤醒: 执行者没有可用的结果时自己执行, 但不缓存*/
+        found = cgi_cache::ready( m_cgi_wait ) ? cgi_cache::HIT : cgi_cache::BYPASS;
+    }
+    else
+    {
+        int buffered = m_read_idx - ( body - m_read_buf );
+        if( buffered > m_content_length )
+        {
+            buffered = m_content_length;
+        }
+        content = body;
+        if( buffered < m_content_length )
+        {
+            if( m_expect_continue )
+            {
+                struct iovec iov;
+                iov.iov_base = ( void* )"HTTP/1.1 100 Continue\r\n\r\n";
+                iov.iov_len = 25;
+                if( ! send_iov( m_sockfd, user_tls(), &iov, 1, &m_trace ) )
+                {
+                    return CLOSED_CONNECTION;
+                }
+            }
+            content = ( char* )m_arena.alloc( m_content_length );
+            if( ! content )
+            {
+                m_linger = false;
+                return INTERNAL_ERROR;
+            }
+            memcpy( content, body, buffered );
+            while( buffered < m_content_length )
+            {
+                ssize_t n = recv_some( content + buffered, m_content_length - buffered );
+                if( n > 0 )
+                {
+                    buffered += n;
+                    continue;
+                }
+                if( n < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+                {
+                    struct pollfd pfd;
+                    pfd.fd = m_sockfd;
+                    pfd.events = POLLIN;
+                    int ready = poll( &pfd, 1, CGI_SEND_TIMEOUT_MS );
+                    if( ready > 0 || ( ready < 0 && errno == EINTR ) )
+                    {
+                        continue;
+                    }
+                }
+                /* 客户端关闭了连接、出错或者迟迟不发送剩下的消息体*/
+                return CLOSED_CONNECTION;
+            }
+        }
+
+        int vary_len = 0;
+        char *vary = cgi_vary( body, &vary_len );
+        int key_len = 0;
+        char *key = vary ? cgi_cache::make_key( program, "HTTP/1.1", method_names[ m_method ], m_query,
+                                                vary, vary_len, content, m_content_length, &key_len ) : NULL;
+        /* 挂起后连接随时可能被其他工作线程接着处理, 所以先记下消息体, 并让process_read从dispatch继续*/
+        m_cgi_content = content;
+        m_deferred = true;
+        found = key ? cache->acquire( key, key_len, this, &m_cgi_wait ) : cgi_cache::BYPASS;
+        free( key );
+        if( found == cgi_cache::PARKED )
+        {
+            return PARKED_REQUEST;
+        }
+        m_deferred = false;
+    }
+
+    cgi_result *r = m_cgi_wait;
+    m_cgi_wait = NULL;
+    if( found == cgi_cache::HIT )
+    {
+        HTTP_CODE ret = send_cgi_output( r->data, r->len );
+        cgi_cache::release( r );
+        return ret;
+    }
+    cgi_result *lead = found == cgi_cache::LEAD ? r : NULL;
+    if( r && ! lead )
+    {
+        cgi_cache::release( r );
+    }
+
+    int to_child, from_child;
+    pid_t pid = spawn_cgi( program, envp, &to_child, &from_child );
+    if( pid < 0 )
+    {
+        if( lead )
+        {
+            cache->finish( lead, NULL, 0, 0 );
+        }
+        return INTERNAL_ERROR;
+    }
+    m_trace.mark( TRACE_FORKED );
+    char *out = NULL;
+    int out_len = 0;
+    bool ok = collect_cgi( to_child, from_child, content, m_content_length, h2_session::MAX_CGI_OUTPUT,
+                           &out, &out_len );
+    bool exited = reap_cgi( pid, ! ok );
+    if( lead )
+    {
+        cache->finish( lead, ok && exited ? out : NULL, out_len, m_route->cache_ttl_ms );
+    }
+    HTTP_CODE ret = ok ? send_cgi_output( out, out_len ) : BAD_GATEWAY;
+    free( out );
+    return ret;
+}
+
+/* 收集路由的cache_vary中列出的请求头部, 名字转成小写, 与HTTP/2的头部格式一致*/
+char* http_conn::cgi_vary( char *body, int *len )
+{
+    char *headers = m_read_buf + m_header_start;
+    char *vary = ( char* )m_arena.alloc( body - headers + 1 );
+    if( ! vary )
+    {
+        return NULL;
+    }
+    int n = 0;
+    /* 头部行已经被parse_line就地截断, 每行以两个'\0'结束, 空行结束头部*/
+    for( char *line = headers; line < body && *line; line += strlen( line ) + 2 )
+    {
+        int name_len = strcspn( line, ":" );
+        if( line[ name_len ] != ':' || ! cgi_cache::varies( m_route->cache_vary, line, name_len ) )
+        {
+            continue;
+        }
+        for( int i = 0; i < name_len; ++i )
+        {
+            vary[ n++ ] = tolower( ( unsigned char )line[ i ] );
+        }
+        const char *value = line + name_len + 1;
+        value += strspn( value, " \t" );
+        n += sprintf( vary + n, ": %s\r\n", value );
+    }
+    vary[ n ] = '\0';
+    *len = n;
+    return vary;
+}
+
+/* 以一份完整的CGI输出应答: 头部在arena中的副本上解析(输出可能来自缓存, 不能就地修改), 消息体带Content-Length*/
+http_conn::HTTP_CODE http_conn::send_cgi_output( const char *out, int out_len )
+{
+    m_trace.mark_once( TRACE_FIRST_BYTE );
+    int limit = out_len < CGI_HEADER_MAX ? out_len : CGI_HEADER_MAX;
+    int body_start = find_cgi_body( out, limit );
+    if( body_start < 0 )
+    {
+        log_error( "cgi produced no valid header" );
+        return BAD_GATEWAY;
+    }
+    char *head = ( char* )m_arena.alloc( body_start );
+    if( ! head )
+    {
+        return INTERNAL_ERROR;
+    }
+    memcpy( head, out, body_start );
+    char framing[ 48 ];
+    snprintf( framing, sizeof( framing ), "Content-Length: %d\r\n", out_len - body_start );
+    long long sent = 0;
+    HTTP_CODE ret = send_cgi_head( head, body_start, framing, &sent );
+    if( ret != GET_REQUEST )
+    {
+        return ret;
+    }
+    if( out_len > body_start && m_method != HEAD )
+    {
+        struct iovec iov;
+        iov.iov_base = ( void* )( out + body_start );
+        iov.iov_len = out_len - body_start;
+        if( ! send_iov( m_sockfd, user_tls(), &iov, 1, &m_trace ) )
+        {
+            return CLOSED_CONNECTION;
+        }
+        sent += out_len - body_start;
+    }
+    m_served++;
+    log_request( m_status, sent );
+    return GET_REQUEST;
+}
+
+/* 逐行解析CGI输出的头部(buf中的前header_len个字节, 会被就地修改)
+ * 返回状态码, 并由reason带回原因短语; 由服务器负责的分帧和连接管理相关的头部(Content-Length、
+ * Connection、Keep-Alive、Transfer-Encoding)被去掉, 其余每行(不含换行符)交给fn转发。状态码无效时返回-1
+ */
+int http_conn::parse_cgi_head( char *buf, int header_len, const char **reason,
+                               cgi_header_fn fn, void *arg )
+{
+    int status = 200;
+    *reason = "OK";
+    bool has_status = false;
+    bool has_location = false;
+    char *line = buf;
+    char *header_end = buf + header_len;
+    while( line < header_end )
+    {
+        char *eol = ( char* )memchr( line, '\n', header_end - line );
+        char *next = eol + 1;
+        if( eol > line && eol[ -1 ] == '\r' )
+        {
+            --eol;
+        }
+        *eol = '\0';
+        if( *line == '\0' )
+        {
+            break;
+        }
+
+        char *code = NULL;
+        if( strncasecmp( line, "Status:", 7 ) == 0 )
+        {
+            code = line + 7;
+        }
+        /* 旧式CGI程序自己输出的状态行*/
+        else if( strncmp( line, "HTTP/1.", 7 ) == 0 )
+        {
+            code = line + strcspn( line, " " );
+        }
+        if( code )
+        {
+            code += strspn( code, " \t" );
+            status = atoi( code );
+            code += strspn( code, "0123456789" );
+            *reason = code + strspn( code, " \t" );
+            has_status = true;
+        }
+        else if( strncasecmp( line, "Content-Length:", 15 ) != 0
+                 && strncasecmp( line, "Connection:", 11 ) != 0
+                 && strncasecmp( line, "Keep-Alive:", 11 ) != 0
+                 && strncasecmp( line, "Transfer-Encoding:", 18 ) != 0 )
+        {
+            has_location = has_location || strncasecmp( line, "Location:", 9 ) == 0;
+            fn( arg, line );
+        }
+        line = next;
+    }
+    if( ! has_status && has_location )
+    {
+        status = 302;
+        *reason = "Found";
+    }
+    if( status < 100 || status > 999 )
+    {
+        log_error( "cgi returned invalid status %d", status );
+        return -1;
+    }
+    return status;
+}
+
+/* 转发的CGI头部逐行追加到HTTP/1.1应答的头部中*/
+struct cgi_extra
+{
+    char *buf;
+    int len;
+    int size;
+};
+
+static void append_cgi_header( void *arg, const char *line )
+{
+    cgi_extra *extra = ( cgi_extra* )arg;
+    int ret = snprintf( extra->buf + extra->len, extra->size - extra->len, "%s\r\n", line );
+    extra->len += ret < extra->size - extra->len ? ret : extra->size - extra->len - 1;
+}
+
+/* 根据CGI输出(或上游应答)的头部(buf中的前header_len个字节)生成并发送应答的状态行和头部
+ * @framing : 消息体的分帧头部, 如"Transfer-Encoding: chunked\r\n", 消息体为空的应答是空串
+ * 返回GET_REQUEST表示已发送, BAD_GATEWAY表示头部无效(什么都没有发送), CLOSED_CONNECTION表示发送失败
+ */
+http_conn::HTTP_CODE http_conn::send_cgi_head( char *buf, int header_len, const char *framing, long long *sent )
+{
+    /* 每行的\n换成\r\n, 最多变成原来的两倍长*/
+    int extra_size = header_len * 2 + 1;
+    char *extra_buf = ( char* )m_arena.alloc( extra_size );
+    if( ! extra_buf )
+    {
+        return CLOSED_CONNECTION;
+    }
+    cgi_extra extra = { extra_buf, 0, extra_size };
+    extra_buf[ 0 ] = '\0';
+    const char *reason;
+    int status = parse_cgi_head( buf, header_len, &reason, append_cgi_header, &extra );
+    if( status < 0 )
+    {
+        return BAD_GATEWAY;
+    }
+
+    int head_size = extra.len + strlen( framing ) + 256;
+    char *head = ( char* )m_arena.alloc( head_size );
+    if( ! head )
+    {
+        return CLOSED_CONNECTION;
+    }
+    int head_len = snprintf( head, head_size,
+                             "HTTP/1.1 %d %.100s\r\n%s%sConnection: %s\r\n\r\n",
+                             status, reason, extra_buf, framing, m_linger ? "keep-alive" : "close" );
+    if( head_len >= head_size )
+    {
+        head_len = head_size - 1;
+    }
+    m_status = status;
+    m_trace.mark( TRACE_FILLED );
+
+    struct iovec iov;
+    iov.iov_base = head;
+    iov.iov_len = head_len;
+    if( ! send_iov( m_sockfd, user_tls(), &iov, 1, &m_trace ) )
+    {
+        return CLOSED_CONNECTION;
+    }
+    *sent += head_len;
+    return GET_REQUEST;
+}
+
+/* 把一段CGI输出作为一块发送给客户端, 长度为0时发送表示结束的最后一块*/
+bool http_conn::send_chunk( const char *data, int len, long long *sent )
+{
+    char size_line[ 16 ];
+    struct iovec iov[ 3 ];
+    int cnt = 0;
+    iov[ cnt ].iov_base = size_line;
+    iov[ cnt++ ].iov_len = sprintf( size_line, len > 0 ? "%x\r\n" : "0\r\n\r\n", len );
+    if( len > 0 )
+    {
+        iov[ cnt ].iov_base = ( void* )data;
+        iov[ cnt++ ].iov_len = len;
+        iov[ cnt ].iov_base = ( void* )"\r\n";
+        iov[ cnt++ ].iov_len = 2;
+    }
+    long long total = 0;
+    for( int i = 0; i < cnt; ++i )
+    {
+        total += iov[ i ].iov_len;
+    }
+    if( ! send_iov( m_sockfd, user_tls(), iov, cnt, &m_trace ) )
+    {
+        return false;
+    }
+    *sent += total;
+    return true;
+}
+
+/* CGI程序运行期间, 同时把请求的消息体送进它的标准输入、把它的标准输出转发给客户端
+ * 两个方向必须在同一个poll循环里交替进行: 只顾送消息体的话, CGI程序可能因标准输出的管道写满
+ * 而不再读标准输入, 双方互相等待。
+ * 消息体不再整个放进读缓冲区: 读缓冲区里已有的部分先送出, 其余的边到达边转发, 内存占用与
+ * 消息体大小无关。Content-Length的消息体用splice从套接字直接移到管道, 不经过用户空间;
+ * chunked的消息体要去掉分块格式, 读到用户空间解码后再写入管道
+ * @in_fd : CGI标准输入管道的写端(非阻塞)
+ * @out_fd : CGI标准输出管道的读端(非阻塞)
+ * @body : 读缓冲区中消息体的起始位置
+ */
+http_conn::HTTP_CODE http_conn::pump_cgi( int in_fd, int out_fd, char *body )
+{
+    /* 读缓冲区中已经收到的那部分消息体*/
+    int buffered = m_read_idx - ( body - m_read_buf );
+    char *pend = body;
+    int pend_len = 0;
+    long long body_left = 0;
+    chunk_decoder decoder = { CHUNK_SIZE, 0, 0 };
+    bool body_done;
+    if( m_chunked )
+    {
+        pend_len = decode_chunked( &decoder, body, buffered );
+        if( pend_len < 0 )
+        {
+            close( in_fd );
+            return BAD_REQUEST;
+        }
+        body_done = decoder.state == CHUNK_DONE;
+    }
+    else
+    {
+        pend_len = buffered < m_content_length ? buffered : m_content_length;
+        body_left = m_content_length - pend_len;
+        body_done = body_left == 0;
+    }
+
+    /* 客户端在等待100 Continue才发送消息体*/
+    if( m_expect_continue && ! body_done )
+    {
+        struct iovec iov;
+        iov.iov_base = ( void* )"HTTP/1.1 100 Continue\r\n\r\n";
+        iov.iov_len = 25;
+        if( ! send_iov( m_sockfd, user_tls(), &iov, 1, &m_trace ) )
+        {
+            close( in_fd );
+            return CLOSED_CONNECTION;
+        }
+    }
+
+    /* chunked消息体的读取和解码缓冲区, 以及CGI的输出(头部在这里攒齐, 之后作为转发缓冲区)
+     * 都取自连接的arena, 不占用工作线程的栈
+     */
+    char *body_buf = ( char* )m_arena.alloc( CGI_BODY_BUF );
+    char *out_buf = ( char* )m_arena.alloc( CGI_HEADER_MAX );
+    if( ! body_buf || ! out_buf )
+    {
+        close( in_fd );
+        return CLOSED_CONNECTION;
+    }
+    int header_len = 0;
+    bool head_sent = false;
+    long long sent = 0;
+    bool stdin_open = true;
+    bool sock_ready = true;           /* 套接字上可能有数据, 读到EAGAIN后变为false*/
+    bool pipe_ready = true;           /* 管道中可能有空间, 写到EAGAIN后变为false*/
+    bool use_splice = ! m_ssl;        /* TLS连接上的消息体要先经过SSL_read解密*/
+    int timeout_ms = current_config()->cgi_timeout_ms;
+    HTTP_CODE ret = GET_REQUEST;
+
+    while( true )
+    {
+        /* 送消息体, 直到送完、管道写满或者套接字上暂时没有数据*/
+        while( stdin_open && pipe_ready )
+        {
+            ssize_t n;
+            if( pend_len > 0 )
+            {
+                n = write( in_fd, pend, pend_len );
+                if( n > 0 )
+                {
+                    pend += n;
+                    pend_len -= n;
+                    continue;
+                }
+            }
+            else if( body_done )
+            {
+                close( in_fd );
+                stdin_open = false;
+                break;
+            }
+            else if( ! sock_ready )
+            {
+                break;
+            }
+            else if( ! m_chunked && use_splice )
+            {
+                n = splice( m_sockfd, NULL, in_fd, NULL, body_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                if( n > 0 )
+                {
+                    body_left -= n;
+                    body_done = body_left == 0;
+                    continue;
+                }
+                /* 不知道是套接字没数据还是管道满了, 两边都等一下*/
+                if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+                {
+                    sock_ready = false;
+                    pipe_ready = false;
+                    break;
+                }
+                if( n < 0 && errno == EINVAL )
+                {
+                    use_splice = false;
+                    continue;
+                }
+            }
+            else
+            {
+                int want = m_chunked || body_left > ( long long )CGI_BODY_BUF ? CGI_BODY_BUF : body_left;
+                n = recv_some( body_buf, want );
+                if( n > 0 )
+                {
+                    pend = body_buf;
+                    if( m_chunked )
+                    {
+                        pend_len = decode_chunked( &decoder, body_buf, n );
+                        if( pend_len < 0 )
+                        {
+                            ret = head_sent ? CLOSED_CONNECTION : BAD_REQUEST;
+                            break;
+                        }
+                        body_done = decoder.state == CHUNK_DONE;
+                    }
+                    else
+                    {
+                        pend_len = n;
+                        body_left -= n;
+                        body_done = body_left == 0;
+                    }
+                    continue;
+                }
+                if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+                {
+                    sock_ready = false;
+                    break;
+                }
+            }
+
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            if( n < 0 && errno == EAGAIN && pend_len > 0 )
+            {
+                pipe_ready = false;
+                break;
+            }
+            /* CGI程序不再读标准输入: 剩下的消息体没法送了, 应答之后关闭连接*/
+            if( n < 0 && errno == EPIPE )
+            {
+                close( in_fd );
+                stdin_open = false;
+                m_linger = false;
+                break;
+            }
+            /* 客户端关闭了连接或者出错*/
+            ret = CLOSED_CONNECTION;
+            break;
+        }
+        if( ret != GET_REQUEST )
+        {
+            break;
+        }
+
+        /* 等待CGI的输出, 以及送消息体所需的套接字数据或管道空间*/
+        struct pollfd fds[ 3 ];
+        int nfds = 0;
+        int pipe_idx = -1;
+        int sock_idx = -1;
+        fds[ nfds ].fd = out_fd;
+        fds[ nfds++ ].events = POLLIN;
+        if( stdin_open && ! pipe_ready )
+        {
+            pipe_idx = nfds;
+            fds[ nfds ].fd = in_fd;
+            fds[ nfds++ ].events = POLLOUT;
+        }
+        if( stdin_open && ! sock_ready && pend_len == 0 )
+        {
+            sock_idx = nfds;
+            fds[ nfds ].fd = m_sockfd;
+            fds[ nfds++ ].events = POLLIN;
+        }
+        int ready = poll( fds, nfds, timeout_ms );
+        if( ready < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( ready < 0 )
+        {
+            ret = CLOSED_CONNECTION;
+            break;
+        }
+        /* 超时: 返回后由run_cgi杀死并回收CGI程序, 还没开始应答时回复502*/
+        if( ready == 0 )
+        {
+            log_error( "cgi program timed out after %d ms", timeout_ms );
+            ret = BAD_GATEWAY;
+            break;
+        }
+        if( pipe_idx >= 0 && fds[ pipe_idx ].revents )
+        {
+            pipe_ready = true;
+        }
+        if( sock_idx >= 0 && fds[ sock_idx ].revents )
+        {
+            sock_ready = true;
+        }
+        if( ! fds[ 0 ].revents )
+        {
+            continue;
+        }
+
+        /* 头部之后的输出不经过用户空间: 管道中现有的数据作为一块用splice直接移到套接字。
+         * 只有要在用户态加密的TLS连接才读出来再发送(内核TLS可以直接splice)
+         */
+        if( head_sent && ! user_tls() )
+        {
+            int avail = 0;
+            if( ioctl( out_fd, FIONREAD, &avail ) < 0 || avail <= 0 )
+            {
+                /* 可读而没有数据: CGI程序关闭了标准输出*/
+                break;
+            }
+            if( ! splice_chunk( out_fd, avail, &sent ) )
+            {
+                ret = CLOSED_CONNECTION;
+                break;
+            }
+            continue;
+        }
+
+        /* 读CGI的输出: 头部攒齐之前追加到out_buf, 之后每次读到的数据作为一块立即转发*/
+        char *dst = head_sent ? out_buf : out_buf + header_len;
+        int room = head_sent ? CGI_HEADER_MAX : CGI_HEADER_MAX - header_len;
+        ssize_t n = read( out_fd, dst, room );
+        if( n < 0 && ( errno == EAGAIN || errno == EINTR ) )
+        {
+            continue;
+        }
+        /* CGI的输出结束*/
+        if( n <= 0 )
+        {
+            break;
+        }
+        if( head_sent )
+        {
+            if( ! send_chunk( out_buf, n, &sent ) )
+            {
+                ret = CLOSED_CONNECTION;
+                break;
+            }
+            continue;
+        }
+        m_trace.mark_once( TRACE_FIRST_BYTE );
+        header_len += n;
+        int body_start = find_cgi_body( out_buf, header_len );
+        if( body_start < 0 )
+        {
+            if( header_len == CGI_HEADER_MAX )
+            {
+                log_error( "cgi header too large" );
+                ret = BAD_GATEWAY;
+                break;
+            }
+            continue;
+        }
+        ret = send_cgi_head( out_buf, body_start, "Transfer-Encoding: chunked\r\n", &sent );
+        if( ret != GET_REQUEST )
+        {
+            break;
+        }
+        head_sent = true;
+        if( header_len > body_start && ! send_chunk( out_buf + body_start, header_len - body_start, &sent ) )
+        {
+            ret = CLOSED_CONNECTION;
+            break;
+        }
+    }
+
+    if( stdin_open )
+    {
+        close( in_fd );
+        /* 消息体还没收完, 连接上剩下的数据不是下一个请求, 应答之后关闭连接*/
+        m_linger = false;
+    }
+    if( ret == GET_REQUEST && ! head_sent )
+    {
+        log_error( "cgi produced no valid header" );
+        ret = BAD_GATEWAY;
+    }
+    if( ret != GET_REQUEST )
+    {
+        /* 已经开始发送应答就不能再换成错误页面了*/
+        return head_sent ? CLOSED_CONNECTION : ret;
+    }
+    if( ! send_chunk( NULL, 0, &sent ) )
+    {
+        return CLOSED_CONNECTION;
+    }
+    m_served++;
+    log_request( m_status, sent );
+    if( ! body_done )
+    {
+        drain_before_close( m_sockfd );
+    }
+    return GET_REQUEST;
+}
+
+/* 上游应答的接收状态*/
+struct proxy_response
+{
+    char *buf;              /* 接收缓冲区(PROXY_BUF字节), 先攒齐头部, 之后作为消息体的转发缓冲区*/
+    int len;                /* buf中的字节数*/
+    int header_len;         /* 头部(含结尾的空行)的长度*/
+    int status;
+    long long left;         /* Content-Length消息体还没收到的字节数, -1表示没有Content-Length*/
+    bool chunked;           /* 消息体是chunked编码*/
+    bool close;             /* 上游要求关闭连接, 或者消息体以关闭连接结束*/
+    bool no_body;           /* 应答没有消息体(204、304)*/
+    chunk_decoder decoder;
+};
+
+/* 把iov中的数据全部写给上游服务器, 每次最多等待timeout_ms
+ * 返回1表示写完, 0表示上游在收完请求之前就开始应答了(连接可读), -1表示出错或超时
+ */
+static int send_upstream( int fd, struct iovec *iov, int count, int timeout_ms )
+{
+    while( count > 0 )
+    {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t ret = sendmsg( fd, &msg, MSG_NOSIGNAL );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                return -1;
+            }
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT | POLLIN;
+            if( poll( &pfd, 1, timeout_ms ) <= 0 )
+            {
+                return -1;
+            }
+            if( pfd.revents & POLLIN )
+            {
+                return 0;
+            }
+            continue;
+        }
+        while( count > 0 && ( size_t )ret >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if( count > 0 )
+        {
+            iov->iov_base = ( char* )iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 1;
+}
+
+/* 头部行line(不含换行符, 长度len)是否是名为name的头部, 是则返回值的起始位置*/
+static const char* header_value( const char *line, int len, const char *name )
+{
+    int name_len = strlen( name );
+    if( len < name_len || strncasecmp( line, name, name_len ) != 0 )
+    {
+        return NULL;
+    }
+    line += name_len;
+    while( *line == ' ' || *line == '\t' )
+    {
+        line++;
+    }
+    return line;
+}
+
+/* 值中是否含有token(不区分大小写), 值以换行符结束*/
+static bool value_has( const char *value, const char *token )
+{
+    int len = strlen( token );
+    for( ; *value && *value != '\r' && *value != '\n'; ++value )
+    {
+        if( strncasecmp( value, token, len ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 读取上游应答的头部, 跳过1xx的中间应答, 并从中取出消息体的分帧方式
+ * 返回1表示成功, 0表示上游还没有发送任何数据就关闭了连接(复用的空闲连接可以重试), -1表示出错或超时
+ */
+static int read_upstream_head( int fd, int timeout_ms, proxy_response *r )
+{
+    r->len = 0;
+    while( true )
+    {
+        if( r->len == http_conn::PROXY_BUF )
+        {
+            log_error( "upstream response header too large" );
+            return -1;
+        }
+        if( ! upstream_wait( fd, POLLIN, timeout_ms ) )
+        {
+            log_error( "upstream response timed out" );
+            return -1;
+        }
+        ssize_t n = recv( fd, r->buf + r->len, http_conn::PROXY_BUF - r->len, 0 );
+        if( n < 0 && ( errno == EINTR || errno == EAGAIN ) )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return r->len == 0 && ( n == 0 || errno == ECONNRESET ) ? 0 : -1;
+        }
+        r->len += n;
+        int body = http_conn::find_cgi_body( r->buf, r->len );
+        if( body < 0 )
+        {
+            continue;
+        }
+        if( r->len < 12 || strncmp( r->buf, "HTTP/1.", 7 ) != 0 )
+        {
+            log_error( "upstream sent an invalid status line" );
+            return -1;
+        }
+        r->status = atoi( r->buf + 9 );
+        if( r->status >= 100 && r->status < 200 )
+        {
+            memmove( r->buf, r->buf + body, r->len - body );
+            r->len -= body;
+            continue;
+        }
+
+        r->header_len = body;
+        r->left = -1;
+        r->chunked = false;
+        r->close = false;
+        r->no_body = r->status == 204 || r->status == 304;
+        memset( &r->decoder, 0, sizeof( r->decoder ) );
+        for( const char *line = r->buf; line < r->buf + body; )
+        {
+            const char *eol = ( const char* )memchr( line, '\n', r->buf + body - line );
+            int len = eol - line;
+            const char *value;
+            if( ( value = header_value( line, len, "Content-Length:" ) ) != NULL )
+            {
+                r->left = atoll( value );
+            }
+            else if( ( value = header_value( line, len, "Transfer-Encoding:" ) ) != NULL )
+            {
+                r->chunked = value_has( value, "chunked" );
+            }
+            else if( ( value = header_value( line, len, "Connection:" ) ) != NULL )
+            {
+                r->close = value_has( value, "close" );
+            }
+            line = eol + 1;
+        }
+        /* 既没有Content-Length也不是chunked的消息体以上游关闭连接结束*/
+        if( ! r->no_body && ! r->chunked && r->left < 0 )
+        {
+            r->close = true;
+        }
+        if( r->chunked )
+        {
+            r->left = -1;
+        }
+        return 1;
+    }
+}
+
+/* 接收上游应答的消息体, 每收到一段就交给sink(chunked已经解码), 直到消息体结束
+ * 消息体完整时返回true; 上游出错时返回false, sink失败时返回false并置sink_failed
+ */
+typedef bool (*proxy_sink_fn)( void *arg, const char *data, int len );
+static bool relay_upstream_body( int fd, int timeout_ms, proxy_response *r,
+                                 proxy_sink_fn sink, void *arg, bool *sink_failed )
+{
+    *sink_failed = false;
+    char *data = r->buf + r->header_len;
+    int n = r->len - r->header_len;
+    if( r->no_body )
+    {
+        /* 多出来的数据说明上游的应答有问题, 连接不能再用*/
+        r->close = r->close || n > 0;
+        return true;
+    }
+    while( true )
+    {
+        if( n > 0 )
+        {
+            if( r->chunked )
+            {
+                n = decode_chunked( &r->decoder, data, n );
+                if( n < 0 )
+                {
+                    log_error( "upstream sent an invalid chunked body" );
+                    return false;
+                }
+            }
+            else if( r->left >= 0 && n > r->left )
+            {
+                n = r->left;
+                r->close = true;
+            }
+            if( n > 0 && ! sink( arg, data, n ) )
+            {
+                *sink_failed = true;
+                return false;
+            }
+            if( r->left >= 0 )
+            {
+                r->left -= n;
+            }
+        }
+        if( ( r->chunked && r->decoder.state == CHUNK_DONE ) || r->left == 0 )
+        {
+            return true;
+        }
+        if( ! upstream_wait( fd, POLLIN, timeout_ms ) )
+        {
+            log_error( "upstream response timed out" );
+            return false;
+        }
+        data = r->buf;
+        n = recv( fd, data, http_conn::PROXY_BUF, 0 );
+        if( n < 0 && ( errno == EINTR || errno == EAGAIN ) )
+        {
+            n = 0;
+            continue;
+        }
+        if( n == 0 && ! r->chunked && r->left < 0 )
+        {
+            return true;
+        }
+        if( n <= 0 )
+        {
+            log_error( "upstream closed the connection in the middle of a response" );
+            return false;
+        }
+    }
+}
+
+/* 转发给客户端的应答消息体: 上游给出了Content-Length时原样转发, 否则分块转发*/
+struct proxy_client
+{
+    http_conn *conn;
+    bool chunked;
+    long long sent;
+};
+
+bool http_conn::send_to_client( void *arg, const char *data, int len )
+{
+    proxy_client *client = ( proxy_client* )arg;
+    http_conn *conn = client->conn;
+    if( client->chunked )
+    {
+        return conn->send_chunk( data, len, &client->sent );
+    }
+    struct iovec iov;
+    iov.iov_base = ( void* )data;
+    iov.iov_len = len;
+    if( ! send_iov( conn->m_sockfd, conn->user_tls(), &iov, 1, &conn->m_trace ) )
+    {
+        return false;
+    }
+    client->sent += len;
+    return true;
+}
+
+/* 生成转发给上游服务器的请求头部(在m_arena中), 失败返回NULL
+ * 客户端的头部原样转发, 只去掉逐跳(hop-by-hop)的头部: 与上游的连接管理和消息体的分帧由代理重新决定。
+ * 路径是规范化之后的, 重新编码后放进请求行; 查询串保持原样
+ * @body : 读缓冲区中头部结束(消息体开始)的位置
+ */
+char* http_conn::proxy_head( char *body, int *len )
+{
+    static const char *hop_by_hop[] =
+    {
+        "Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Trailer:", "Upgrade:",
+        "HTTP2-Settings:", "Expect:", "Transfer-Encoding:", "Content-Length:", NULL
+    };
+    char *headers = m_read_buf + m_header_start;
+    int url_size = strlen( m_url ) * 3 + 1;
+    int size = ( body - headers ) + url_size + ( m_query ? strlen( m_query ) : 0 ) + 512;
+    char *head = ( char* )m_arena.alloc( size );
+    char *path = ( char* )m_arena.alloc( url_size );
+    if( ! head || ! path || url_encode_path( m_url, path, url_size ) < 0 )
+    {
+        return NULL;
+    }
+    int n = snprintf( head, size, "%s %s%s%s HTTP/1.1\r\n", method_names[ m_method ], path,
+                      m_query ? "?" : "", m_query ? m_query : "" );
+
+    /* 头部行已经被parse_line就地截断, 每行以两个'\0'结束, 空行结束头部*/
+    const char *forwarded = NULL;
+    for( char *line = headers; line < body && *line; line += strlen( line ) + 2 )
+    {
+        int i = 0;
+        while( hop_by_hop[ i ] && strncasecmp( line, hop_by_hop[ i ], strlen( hop_by_hop[ i ] ) ) != 0 )
+        {
+            i++;
+        }
+        if( hop_by_hop[ i ] )
+        {
+            continue;
+        }
+        /* 已有的X-Forwarded-For与客户端地址合并成一行*/
+        if( strncasecmp( line, "X-Forwarded-For:", 16 ) == 0 )
+        {
+            forwarded = line + 16 + strspn( line + 16, " \t" );
+            continue;
+        }
+        n += snprintf( head + n, size - n, "%s\r\n", line );
+        if( n >= size )
+        {
+            return NULL;
+        }
+    }
+    if( m_chunked )
+    {
+        n += snprintf( head + n, size - n, "Transfer-Encoding: chunked\r\n" );
+    }
+    else if( m_content_length > 0 || m_method == POST )
+    {
+        n += snprintf( head + n, size - n, "Content-Length: %d\r\n", m_content_length );
+    }
+    if( n < size )
+    {
+        n += snprintf( head + n, size - n,
+                       "X-Forwarded-For: %s%s%s\r\nX-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                       forwarded ? forwarded : "", forwarded ? ", " : "", inet_ntoa( m_address.sin_addr ),
+                       m_ssl ? "https" : "http" );
+    }
+    if( n >= size )
+    {
+        return NULL;
+    }
+    *len = n;
+    return head;
+}
+
+/* 反向代理: 把请求转发给路由指定的上游服务器组, 并把应答转发给客户端
+ * 请求头部和读缓冲区中已有的消息体先发出, 其余的消息体边收边转发(chunked的消息体解码后重新分块),
+ * 应答的消息体也是收到一段就转发一段, 两个方向的内存占用都与消息体大小无关。
+ * 到上游的连接来自本反应堆的空闲长连接池, 应答完整且上游允许时放回池中给后续请求复用;
+ * 复用的连接可能恰好已被上游关闭, 还没有收到应答的任何数据、请求也还没有从套接字上读取过
+ * 消息体时, 换一条连接重新发送。
+ * 返回值的含义与run_cgi相同
+ */
+http_conn::HTTP_CODE http_conn::run_proxy( char *body )
+{
+    upstream *up = upstream_find( m_route->upstream );
+    int head_len = 0;
+    char *head = up ? proxy_head( body, &head_len ) : NULL;
+    char *body_buf = ( char* )m_arena.alloc( CGI_BODY_BUF + 32 );
+    proxy_response resp;
+    resp.buf = ( char* )m_arena.alloc( PROXY_BUF );
+    if( ! head || ! body_buf || ! resp.buf )
+    {
+        if( ! up )
+        {
+            log_error( "upstream %s not found", m_route->upstream );
+        }
+        if( m_content_length != 0 || m_chunked )
+        {
+            m_linger = false;
+        }
+        return up ? INTERNAL_ERROR : BAD_GATEWAY;
+    }
+    int timeout = up->config().timeout_ms;
+
+    /* 读缓冲区中已经收到的那部分消息体, chunked的先解码*/
+    int buffered = m_read_idx - ( body - m_read_buf );
+    int pend_len = 0;
+    long long body_left = 0;
+    chunk_decoder decoder = { CHUNK_SIZE, 0, 0 };
+    bool body_done;
+    if( m_chunked )
+    {
+        pend_len = decode_chunked( &decoder, body, buffered );
+        if( pend_len < 0 )
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        body_done = decoder.state == CHUNK_DONE;
+    }
+    else
+    {
+        pend_len = buffered < m_content_length ? buffered : m_content_length;
+        body_left = m_content_length - pend_len;
+        body_done = body_left == 0;
+    }
+    if( m_expect_continue && ! body_done )
+    {
+        struct iovec iov;
+        iov.iov_base = ( void* )"HTTP/1.1 100 Continue\r\n\r\n";
+        iov.iov_len = 25;
+        if( ! send_iov( m_sockfd, user_tls(), &iov, 1, &m_trace ) )
+        {
+            return CLOSED_CONNECTION;
+        }
+    }
+
+    int fd = -1;
+    int server = -1;
+    bool reused = false;
+    bool streamed = false;            /* 已经从套接字上读取过消息体, 不能再重新发送了*/
+    while( true )
+    {
+        fd = up->acquire( m_reactor, 0, &server, &reused );
+        if( fd < 0 )
+        {
+            log_error( "upstream %s: no server available", up->config().name );
+            if( ! body_done )
+            {
+                m_linger = false;
+            }
+            return BAD_GATEWAY;
+        }
+        m_trace.mark( TRACE_UPSTREAM );
+
+        /* 头部和读缓冲区中的消息体一起发出*/
+        char size_line[ 16 ];
+        struct iovec iov[ 5 ];
+        int cnt = 0;
+        iov[ cnt ].iov_base = head;
+        iov[ cnt++ ].iov_len = head_len;
+        if( m_chunked && pend_len > 0 )
+        {
+            iov[ cnt ].iov_base = size_line;
+            iov[ cnt++ ].iov_len = sprintf( size_line, "%x\r\n", pend_len );
+        }
+        if( pend_len > 0 )
+        {
+            iov[ cnt ].iov_base = body;
+            iov[ cnt++ ].iov_len = pend_len;
+        }
+        if( m_chunked && pend_len > 0 )
+        {
+            iov[ cnt ].iov_base = ( void* )"\r\n";
+            iov[ cnt++ ].iov_len = 2;
+        }
+        if( m_chunked && body_done )
+        {
+            iov[ cnt ].iov_base = ( void* )"0\r\n\r\n";
+            iov[ cnt++ ].iov_len = 5;
+        }
+        int sent = send_upstream( fd, iov, cnt, timeout );
+
+        /* 其余的消息体边收边转发, 上游提前应答(比如拒绝了请求)时停止转发*/
+        while( sent > 0 && ! body_done )
+        {
+            int want = m_chunked || body_left > ( long long )CGI_BODY_BUF ? CGI_BODY_BUF : body_left;
+            ssize_t n = recv_some( body_buf + 16, want );
+            if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            {
+                struct pollfd fds[ 2 ];
+                fds[ 0 ].fd = m_sockfd;
+                fds[ 0 ].events = POLLIN;
+                fds[ 1 ].fd = fd;
+                fds[ 1 ].events = POLLIN;
+                int ready = poll( fds, 2, CGI_SEND_TIMEOUT_MS );
+                if( ready < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if( ready > 0 && fds[ 1 ].revents )
+                {
+                    break;
+                }
+                if( ready > 0 )
+                {
+                    continue;
+                }
+                /* 客户端迟迟不发送剩下的消息体*/
+                up->release( m_reactor, server, fd, UPSTREAM_CLOSE );
+                return CLOSED_CONNECTION;
+            }
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            /* 客户端关闭了连接或者出错*/
+            if( n <= 0 )
+            {
+                up->release( m_reactor, server, fd, UPSTREAM_CLOSE );
+                return CLOSED_CONNECTION;
+            }
+            streamed = true;
+            char *data = body_buf + 16;
+            if( m_chunked )
+            {
+                n = decode_chunked( &decoder, data, n );
+                if( n < 0 )
+                {
+                    up->release( m_reactor, server, fd, UPSTREAM_CLOSE );
+                    m_linger = false;
+                    return BAD_REQUEST;
+                }
+                body_done = decoder.state == CHUNK_DONE;
+            }
+            else
+            {
+                body_left -= n;
+                body_done = body_left == 0;
+            }
+            /* 块大小行放在数据前面预留的位置上, 块结束的\r\n(以及最后一块)放在数据后面*/
+            int len = n;
+            if( m_chunked )
+            {
+                int prefix = n > 0 ? sprintf( size_line, "%x\r\n", ( int )n ) : 0;
+                memcpy( data - prefix, size_line, prefix );
+                data -= prefix;
+                len += prefix;
+                if( n > 0 )
+                {
+                    memcpy( data + len, "\r\n", 2 );
+                    len += 2;
+                }
+                if( body_done )
+                {
+                    memcpy( data + len, "0\r\n\r\n", 5 );
+                    len += 5;
+                }
+            }
+            if( len > 0 )
+            {
+                struct iovec part;
+                part.iov_base = data;
+                part.iov_len = len;
+                sent = send_upstream( fd, &part, 1, timeout );
+            }
+        }
+
+        int got = read_upstream_head( fd, timeout, &resp );
+        if( got > 0 )
+        {
+            m_trace.mark( TRACE_FIRST_BYTE );
+            break;
+        }
+        if( got == 0 && reused && ! streamed )
+        {
+            up->release( m_reactor, server, fd, UPSTREAM_CLOSE );
+            continue;
+        }
+        if( got == 0 )
+        {
+            log_error( "upstream %s: %s closed the connection without a response",
+                       up->config().name, up->server_name( server ) );
+        }
+        up->release( m_reactor, server, fd, UPSTREAM_FAILED );
+        if( ! body_done )
+        {
+            m_linger = false;
+        }
+        return BAD_GATEWAY;
+    }
+
+    /* 消息体还没转发完上游就应答了, 客户端连接上剩下的数据不是下一个请求, 应答之后关闭连接*/
+    if( ! body_done )
+    {
+        m_linger = false;
+    }
+    char framing[ 64 ];
+    proxy_client client = { this, false, 0 };
+    if( resp.no_body )
+    {
+        framing[ 0 ] = '\0';
+    }
+    else if( resp.left >= 0 )
+    {
+        snprintf( framing, sizeof( framing ), "Content-Length: %lld\r\n", resp.left );
+    }
+    else
+    {
+        strcpy( framing, "Transfer-Encoding: chunked\r\n" );
+        client.chunked = true;
+    }
+    /* 转发头部会就地修改缓冲区, 之后的消息体从header_len处开始, 不受影响*/
+    HTTP_CODE ret = send_cgi_head( resp.buf, resp.header_len, framing, &client.sent );
+    if( ret != GET_REQUEST )
+    {
+        up->release( m_reactor, server, fd, ret == BAD_GATEWAY ? UPSTREAM_FAILED : UPSTREAM_CLOSE );
+        return ret;
+    }
+
+    bool sink_failed;
+    if( ! relay_upstream_body( fd, timeout, &resp, send_to_client, &client, &sink_failed ) )
+    {
+        up->release( m_reactor, server, fd, sink_failed ? UPSTREAM_CLOSE : UPSTREAM_FAILED );
+        return CLOSED_CONNECTION;
+    }
+    up->release( m_reactor, server, fd, resp.close || ! body_done ? UPSTREAM_CLOSE : UPSTREAM_KEEP );
+    if( client.chunked && ! send_chunk( NULL, 0, &client.sent ) )
+    {
+        return CLOSED_CONNECTION;
+    }
+    m_served++;
+    log_request( m_status, client.sent );
+    if( ! body_done )
+    {
+        drain_before_close( m_sockfd );
+    }
+    return GET_REQUEST;
+}
+
+/* HTTP/2的流收集上游应答: 头部和解码后的消息体依次追加到一个缓冲区里*/
+struct proxy_collect
+{
+    char *out;
+    int len;
+    int cap;
+    int max;
+};
+
+static bool collect_response( void *arg, const char *data, int len )
+{
+    proxy_collect *c = ( proxy_collect* )arg;
+    if( c->len + len > c->max )
+    {
+        log_error( "upstream response exceeds %d bytes", c->max );
+        return false;
+    }
+    if( c->len + len > c->cap )
+    {
+        int cap = c->cap ? c->cap : 16384;
+        while( cap < c->len + len )
+        {
+            cap *= 2;
+        }
+        char *out = ( char* )realloc( c->out, cap );
+        if( ! out )
+        {
+            return false;
+        }
+        c->out = out;
+        c->cap = cap;
+    }
+    memcpy( c->out + c->len, data, len );
+    c->len += len;
+    return true;
+}
+
+bool http_conn::proxy_fetch( upstream *up, int reactor, const char *head, int head_len,
+                             const char *body, int body_len, int max_len, char **out, int *out_len )
+{
+    int timeout = up->config().timeout_ms;
+    proxy_response resp;
+    resp.buf = ( char* )malloc( PROXY_BUF );
+    if( ! resp.buf )
+    {
+        return false;
+    }
+    int fd = -1;
+    int server = -1;
+    bool reused = false;
+    while( true )
+    {
+        fd = up->acquire( reactor, 0, &server, &reused );
+        if( fd < 0 )
+        {
+            log_error( "upstream %s: no server available", up->config().name );
+            free( resp.buf );
+            return false;
+        }
+        struct iovec iov[ 2 ];
+        iov[ 0 ].iov_base = ( void* )head;
+        iov[ 0 ].iov_len = head_len;
+        iov[ 1 ].iov_base = ( void* )body;
+        iov[ 1 ].iov_len = body_len;
+        send_upstream( fd, iov, body_len > 0 ? 2 : 1, timeout );
+        int got = read_upstream_head( fd, timeout, &resp );
+        if( got > 0 )
+        {
+            break;
+        }
+        up->release( reactor, server, fd, got == 0 && reused ? UPSTREAM_CLOSE : UPSTREAM_FAILED );
+        if( got == 0 && reused )
+        {
+            continue;
+        }
+        free( resp.buf );
+        return false;
+    }
+
+    proxy_collect collect = { NULL, 0, 0, max_len };
+    bool sink_failed = true;
+    bool ok = collect_response( &collect, resp.buf, resp.header_len )
+              && relay_upstream_body( fd, timeout, &resp, collect_response, &collect, &sink_failed );
+    up->release( reactor, server, fd, ! ok ? ( sink_failed ? UPSTREAM_CLOSE : UPSTREAM_FAILED )
+                                           : ( resp.close ? UPSTREAM_CLOSE : UPSTREAM_KEEP ) );
+    free( resp.buf );
+    if( ! ok )
+    {
+        free( collect.out );
+        return false;
+    }
+    *out = collect.out;
+    *out_len = collect.len;
+    return true;
+}
+
+/* 主状态机, 读取完整的行后分析各个部分*/
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    LINE_STATUS line_status = LINE_OK;
+    HTTP_CODE ret = NO_REQUEST;
+    char *text = NULL;
+
+    /* 反应堆已经解析完整个请求, 只把目标文件的处理推迟到了这里*/
+    if( m_deferred )
+    {
+        m_deferred = false;
+        return wants_h2c() ? UPGRADE_REQUEST : dispatch();
+    }
+
+    /* 连接上的第一个请求以HTTP/2连接前言开头: 客户端以先验知识直接使用HTTP/2*/
+    if( m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_served == 0
+        && current_config()->http2_enable )
+    {
+        int n = m_read_idx < h2_session::PREFACE_LEN ? m_read_idx : h2_session::PREFACE_LEN;
+        if( n > 0 && memcmp( m_read_buf, h2_session::PREFACE, n ) == 0 )
+        {
+            if( n < h2_session::PREFACE_LEN )
+            {
+                return NO_REQUEST;
+            }
+            /* 切换协议要分配会话, 交给工作线程*/
+            return m_inline ? DEFERRED_REQUEST : UPGRADE_REQUEST;
+        }
+    }
+    
+    /* 拿到一个一行请求内容，可能是请求行，也有可能是头部字段中的一行, 如果当前开始
+     * 消息体时，就不要调用parse_line()了，因为消息体没有\r\n来结尾，所以放在||之前
+     */
+    while( (m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || (line_status = parse_line()) == LINE_OK )
+    {
+        /* text指向当前解析行的第一个字符, text = m_read_buf+m_start_line, m_start_line初值为0*/
+        text = get_line();
+
+        /* m_checked_idx是本行的行末，下一行的行始*/
+        m_start_line = m_checked_idx;
+        switch ( m_check_state )
+        {
+            case CHECK_STATE_REQUESTLINE:          /* 第一个状态: 分析请求行*/
+            {
+                ret = parse_request_line( text );
+                if ( ret == BAD_REQUEST )
+                {
+                    return BAD_REQUEST;
+                }
+                break;
+            }
+            case CHECK_STATE_HEADER:              /* 第二个状态: 分析头部字段*/
+            {
+                ret = parse_headers( text );
+                if ( ret == BAD_REQUEST )
+                {
+                    return BAD_REQUEST;
+                }
+                else if ( ret == GET_REQUEST )
+                {
+                    return dispatch();
+                }
+                else if ( ret == UPGRADE_REQUEST )
+                {
+                    if( m_inline )
+                    {
+                        m_deferred = true;
+                        return DEFERRED_REQUEST;
+                    }
+                    return UPGRADE_REQUEST;
+                }
+                break;
+            }
+            case CHECK_STATE_CONTENT:            /* 第三个状态: 分析消息体*/
+            {
+                return parse_content( text );
+            }
+            default:
+            {
+                return INTERNAL_ERROR;
+            }
+        }
+    }
+    /* 退出while循环，而不是直接返回，说明尚未读取到一个完整的行*/
+    return NO_REQUEST;
+}
+
+const char* http_conn::query_param( const char *name ) const
+{
+    return url_find_param( m_params, m_param_count, name );
+}
+
+bool http_conn::file_path( const char *url, char *path )
+{
+    char root[ PATH_MAX ] = {0};
+    get_root_path( root );
+    int len = strlen( url );
+    int n = snprintf( path, FILENAME_LEN, "%s%s%s", root, url, url[ len - 1 ] == '/' ? "index.html" : "" );
+    return n < FILENAME_LEN;
+}
+
+bool http_conn::cgi_program( const route *r, const char *url, char *path )
+{
+    return file_path( r->program[ 0 ] ? r->program : url, path ) && access( path, X_OK ) == 0;
+}
+
+/* 按请求匹配到的路由分派: 静态文件只接受GET; CGI程序要fork, 反向代理要等待上游服务器, 反应堆内联处理时交给工作线程*/
+http_conn::HTTP_CODE http_conn::dispatch()
+{
+    m_trace.mark( TRACE_PARSED );
+    if( ! m_route )
+    {
+        return NO_RESOURCE;
+    }
+    switch( m_route->handler )
+    {
+        case ROUTE_STATIC:
+        {
+            return m_method == GET ? do_request() : NO_RESOURCE;
+        }
+        case ROUTE_CGI:
+        {
+            if( m_inline )
+            {
+                m_deferred = true;
+                return DEFERRED_REQUEST;
+            }
+            return run_cgi( m_read_buf + m_checked_idx );
+        }
+        case ROUTE_STATUS:
+        case ROUTE_SLOW:
+        {
+            return status_page();
+        }
+        case ROUTE_PROXY:
+        {
+            if( m_inline )
+            {
+                m_deferred = true;
+                return DEFERRED_REQUEST;
+            }
+            return run_proxy( m_read_buf + m_checked_idx );
+        }
+        default:
+        {
+            return NO_RESOURCE;
+        }
+    }
+}
+
+/* 内置状态页: 内容由server_status(慢请求页由trace_dump)生成到本请求的arena中*/
+http_conn::HTTP_CODE http_conn::status_page()
+{
+    bool slow = m_route->handler == ROUTE_SLOW;
+    const int size = slow ? 65536 : 8192;
+    m_page = ( char* )m_arena.alloc( size );
+    if( ! m_page )
+    {
+        return INTERNAL_ERROR;
+    }
+    m_page_len = slow ? trace_dump( m_page, size ) : server_status( m_page, size );
+    return STATUS_REQUEST;
+}
+
+/*  当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，如果目标文件存在
+ *  对所有用户可读，且不是目录，则使用mmap将其映射到内存地址m_file_address处，并
+ *  告诉调用者获取文件成功
+ */
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    /* 获取文件在服务器的真实路径( html_path + m_url ), 过长的路径不会对应任何文件*/
+    if( ! file_path( m_url, m_read_file ) )
+    {
+        return NO_RESOURCE;
+    }
+
+    /* 先查完整响应缓存, 命中则无需stat、mmap和格式化响应头*/
+    resp_cache *cache = Singleton< resp_cache >::GetInstance();
+    m_cache_entry = cache->lookup( m_read_file, m_linger );
+    if( m_cache_entry )
+    {
+        m_trace.mark( TRACE_STAT );
+        return FILE_REQUEST;
+    }
+    /* 未命中缓存就需要stat、mmap文件, 交给工作线程去做*/
+    if( m_inline )
+    {
+        m_deferred = true;
+        return DEFERRED_REQUEST;
+    }
+    /* 记录读取文件前的失效代数, 读取期间文件若被修改则不会插入缓存*/
+    unsigned int gen = cache->generation();
+
+    /* 获取文件的属性*/
     if ( stat( m_read_file, &m_file_stat ) < 0 )
     {
         return NO_RESOURCE;    /* 文件不存在*/
     }
+    m_trace.mark( TRACE_STAT );
 
     /* 查看权限是否满足( 其他人(others)是否有读权限 )*/
     if ( ! ( m_file_stat.st_mode & S_IROTH ) )
@@ -535,19 +2928,54 @@ http_conn::HTTP_CODE http_conn::do_request()
 
     /* 以只读打开文件，并映射到内存*/
     int fd = open( m_read_file, O_RDONLY );
+    if( fd < 0 )
+    {
+        return INTERNAL_ERROR;
+    }
+
+    /* 大文件整个mmap的话, 反应堆发送时会在缺页上一页页地阻塞, 同一反应堆的其他连接都要等它;
+     * 改为sendfile, 并告诉内核这是顺序读取, 发送过程中由输出队列按发送速度预读
+     */
+    const server_config *cfg = current_config();
+    if( m_file_stat.st_size >= cfg->large_file_threshold && m_file_stat.st_size > 0 )
+    {
+        posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+        m_file_fd = fd;
+        m_trace.mark( TRACE_MAPPED );
+        return FILE_REQUEST;
+    }
 
     /* 参数1: 0，表示使用系统自动分配的地址 
      * 参数2: 映射内存的大小
      * 参数3: PROT_READ，映射内存的权限为只读
-     * 参数4: MAP_PRIVATE，内存段为调用进程所私有。对该内存段的修改不会反映到被映射的文件中
+     * 参数4: MAP_PRIVATE，内存段为调用进程所私有。对该内存段的修改不会反映到被映射的文件中;
+     *        MAP_POPULATE, 在工作线程中就把所有页读入并建立映射, 反应堆发送时不会再缺页
      * 参数5: 被映射文件打开的文件描述符
      * 参数6: 映射文件的内部偏移值，0表示从文件起始处开始
      */
     m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ,
-                                  MAP_PRIVATE, fd, 0);
+                                  MAP_PRIVATE | MAP_POPULATE, fd, 0);
 
     /* 映射完毕后，关闭文件描述符*/
     close( fd );
+    if( m_file_address == MAP_FAILED )
+    {
+        m_file_address = NULL;
+        return INTERNAL_ERROR;
+    }
+    madvise( m_file_address, m_file_stat.st_size, MADV_SEQUENTIAL );
+    m_trace.mark( TRACE_MAPPED );
+
+    /* 小文件渲染成完整响应放入缓存, 之后直接从缓存发送*/
+    if( ( size_t )m_file_stat.st_size <= cache->max_file_size() )
+    {
+        m_cache_entry = cache->insert( m_read_file, m_linger, m_file_address,
+                                       m_file_stat.st_size, gen );
+        if( m_cache_entry )
+        {
+            unmap();
+        }
+    }
 
     return FILE_REQUEST;
 }
@@ -560,92 +2988,71 @@ void http_conn::unmap()
         munmap( m_file_address, m_file_stat.st_size );
         m_file_address = NULL;
     }
+    if( m_file_fd >= 0 )
+    {
+        close( m_file_fd );
+        m_file_fd = -1;
+    }
 }
 
-/* 写HTTP响应*/
+/* 写HTTP响应
+ * 从输出队列记录的断点处继续发送。写缓冲满时不再忙等，而是重新监听EPOLLOUT后让出反应堆
+ */
 bool http_conn::write_response()
 {
-    int temp = 0;
+    if( m_h2 )
+    {
+        return write_h2();
+    }
 
     /* 如果没有要发送的数据了，那么可以再去获取客户端请求了*/
-    if ( m_bytes_to_send == 0 )
+    if ( m_out.empty() )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
         init();
+        wait_input();
         return true;
     }
 
-    /* 一定保证将响应头在这成功发送*/
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    while( bytes_have_send < bytes_to_send )
+    switch( send_out() )
     {
-        temp = write(m_sockfd, m_write_buf, m_write_idx);
-        if( temp == -1 )
+        /* TCP写缓冲没有空间(或未发送数据已达到TCP_NOTSENT_LOWAT)，等待下一轮EPOLLOUT事件*/
+        case out_queue::SEND_AGAIN:
         {
-            if ( errno == EAGAIN || errno == EWOULDBLOCK )
-            {
-                continue;
-            }
+            m_trace.stall();
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            return true;
         }
-        bytes_have_send += temp;
-    }
-    m_write_idx = 0;
-
-
-    /* 发送响应文件体, 可能本次发送不完，需要等待EPOLLOUT事件*/
-    while( 1 )
-    {
-        temp = write(m_sockfd, m_file_address + m_bytes_have_send, m_file_stat.st_size);
-        if ( temp <= -1 )
+        case out_queue::SEND_ERROR:
         {
-            /* 如果TCP写缓冲没有空间，则等待下一轮 EPOLLOUT 事件。
-             * 虽然在此期间，服务器无法立即接收到同一客户的下一个
-             * 请求,但这可以保证连接的完整性
-             */
-            if ( errno == EAGAIN )
-            {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
-            }
+            m_out.clear();
             unmap();
             return false;
         }
-
-        /* 更新 m_bytes_to_send 和 m_bytes_have_send 的值*/
-        m_bytes_to_send -= temp;
-        m_bytes_have_send += temp;
-
-        /* 如果写完了, 就去监听EPOLLIN，不再监听EPOLLOUT事件了*/
-        if ( m_bytes_to_send <= m_bytes_have_send )
+        default:
         {
-            /* 将记录置空*/
-            m_bytes_have_send = 0;
-            m_bytes_to_send = 0;
-
-            /* 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否
-             * 立即关闭连接
-             */
-            unmap();
-            if( m_linger )
-            {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            }
-            else
-            {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            }
+            break;
         }
     }
+
+    /* 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否
+     * 立即关闭连接
+     */
+    unmap();
+    m_served++;
+    log_request( m_status, m_out.bytes_sent() );
+    if( m_linger )
+    {
+        init();
+        wait_input();
+        return true;
+    }
+    return false;
 }
 
 /* 往写缓冲中写入待发送的数据*/
 bool http_conn::add_response( const char *format, ... )
 {
-    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    if( m_write_idx >= m_write_buf_size )
     {
         return false;
     }
@@ -657,9 +3064,9 @@ bool http_conn::add_response( const char *format, ... )
      *               const char *format,
      *               va_list ap);
      */
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx,
+    int len = vsnprintf( m_write_buf + m_write_idx, m_write_buf_size - 1 - m_write_idx,
                          format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+    if( len >= ( m_write_buf_size - 1 - m_write_idx ) )
     {
         return false;
     }
@@ -676,14 +3083,13 @@ bool http_conn::add_content( const char *content )
 /* 将对HTTP请求的响应状态写入写缓冲: 例如: HTTP/1.1 200 OK*/
 bool http_conn::add_status_line( int status, const char *title )
 {
+    m_status = status;
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 /* 将HTTP响应的头部字段写入写缓冲*/
 bool http_conn::add_headers( int content_len )
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 /* 向写缓冲中写入消息体长度*/
 bool http_conn::add_content_length( int content_len )
@@ -700,6 +3106,12 @@ bool http_conn::add_blank_line()
 {
     return add_response( "%s", "\r\n" );
 }
+/* 大文件片段发送完毕后关闭其描述符*/
+static void close_file( void *arg )
+{
+    close( ( int )( long )arg );
+}
+
 /* 根据服务器处理HTTP请求的结果，决定返回给客户端的内容并写入写缓冲*/
 bool http_conn::process_write( HTTP_CODE ret )
 {
@@ -716,6 +3128,17 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
             break;
         }
+        /* CGI程序没有输出有效的应答*/
+        case BAD_GATEWAY:
+        {
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if ( ! add_content( error_502_form ) )
+            {
+                return false;
+            }
+            break;
+        }
         /* 错误的请求语法*/
         case BAD_REQUEST:
         {
@@ -749,16 +3172,52 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
             break;
         }
+        /* 内置状态页*/
+        case STATUS_REQUEST:
+        {
+            add_status_line( 200, ok_200_title );
+            add_response( "%s", "Content-Type: text/plain\r\nCache-Control: no-cache\r\n" );
+            add_headers( m_page_len );
+            return m_out.push_memory( m_write_buf, m_write_idx )
+                && m_out.push_memory( m_page, m_page_len );
+        }
         /* 正确的文件请求*/
         case FILE_REQUEST:
         {
+            /* 缓存命中: 整个响应就是一块连续的只读内存, 引用在发送完毕后释放*/
+            if( m_cache_entry )
+            {
+                cache_entry *entry = m_cache_entry;
+                m_cache_entry = NULL;
+                m_status = 200;
+                if( ! m_out.push_memory( entry->data, entry->len, resp_cache::release, entry ) )
+                {
+                    resp_cache::release( entry );
+                    return false;
+                }
+                return true;
+            }
             add_status_line( 200, ok_200_title );
             if ( m_file_stat.st_size != 0 )
             {
                 add_headers( m_file_stat.st_size );
-                m_bytes_to_send = m_file_stat.st_size;
-               
-                return true;
+                /* 大文件: 描述符交给输出队列, 发送完毕(或连接关闭)时由它关闭*/
+                if( m_file_fd >= 0 )
+                {
+                    int fd = m_file_fd;
+                    m_file_fd = -1;
+                    if( m_out.push_memory( m_write_buf, m_write_idx )
+                        && m_out.push_file( fd, 0, m_file_stat.st_size, current_config()->readahead_max,
+                                            close_file, ( void* )( long )fd ) )
+                    {
+                        return true;
+                    }
+                    close( fd );
+                    return false;
+                }
+                /* 响应头和映射的文件内容作为两个片段进入输出队列*/
+                return m_out.push_memory( m_write_buf, m_write_idx )
+                    && m_out.push_memory( m_file_address, m_file_stat.st_size );
             }
             /* 如果文件为空文件的话，则构造一个空html网页*/
             else
@@ -770,40 +3229,392 @@ bool http_conn::process_write( HTTP_CODE ret )
                     return false;
                 }
             }
+            break;
         }
         default:
         {
             return false;       
         }
     }
+    return m_out.push_memory( m_write_buf, m_write_idx );
+}
+
+/* 在反应堆线程中直接处理请求(内联快速路径)
+ * 完整的、命中完整响应缓存的GET请求以及不需要访问文件的错误请求, 在这里解析后立即发送应答,
+ * 省去交给线程池的信号量交接和等待EPOLLOUT的一次往返; 需要stat、mmap文件或fork CGI的请求
+ * 在解析到那一步时被推迟, 返回false, 由调用者把连接交给线程池, 工作线程从推迟处继续处理
+ */
+bool http_conn::process_inline()
+{
+    /* HTTP/2连接的帧都交给工作线程处理*/
+    if( m_h2 )
+    {
+        return false;
+    }
+    m_trace.start();
+    m_inline = true;
+    HTTP_CODE read_ret = process_read();
+    m_inline = false;
+
+    if( read_ret == DEFERRED_REQUEST )
+    {
+        return false;
+    }
+
+    /* 请求不完整, 继续读取*/
+    if( read_ret == NO_REQUEST )
+    {
+        wait_input();
+        return true;
+    }
+
+    /* 填充应答后直接尝试发送, 发不完时write_response会注册EPOLLOUT*/
+    if( ! process_write( read_ret ) )
+    {
+        close_conn();
+        return true;
+    }
+    m_trace.mark( TRACE_FILLED );
+    if( ! write_response() )
+    {
+        close_conn();
+    }
     return true;
 }
 
-/* 由线程池中的工作线程调用，这是处理HTTP请求的入口函数*/
+/* 写一条访问日志: 各阶段耗时由请求处理过程中记下的时间点算出, 日志只是填进本线程的环形缓冲区*/
+void http_conn::log_request( int status, long long bytes )
+{
+    m_trace.mark( TRACE_DONE );
+    const char *method = m_url ? method_names[ m_method ] : NULL;
+    trace_finish( &m_trace, m_address, method, m_url, m_query, status, bytes, false );
+    prefork_count_request();
+
+    log_record *rec = log_reserve();
+    if( ! rec )
+    {
+        return;
+    }
+    rec->status = status;
+    rec->peer = m_address;
+    rec->method = method;
+    rec->bytes = bytes;
+    rec->stage_us[ LOG_STAGE_READ ] = trace_us( &m_trace, TRACE_BEGIN, TRACE_READ );
+    rec->stage_us[ LOG_STAGE_QUEUE ] = trace_us( &m_trace, TRACE_READ, TRACE_DEQUEUE );
+    rec->stage_us[ LOG_STAGE_PROCESS ] = trace_us( &m_trace, TRACE_DEQUEUE, TRACE_FILLED );
+    rec->stage_us[ LOG_STAGE_WRITE ] = trace_us( &m_trace, TRACE_FILLED, TRACE_DONE );
+    snprintf( rec->text, LOG_TEXT_LEN, "%s%s%s", m_url ? m_url : "-", m_query ? "?" : "",
+              m_query ? m_query : "" );
+    log_commit( rec );
+}
+
+/* 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+ * 工作线程不直接操作epoll事件表或关闭连接, 而是把下一步动作提交给连接所属的反应堆
+ */
 void http_conn::process()
 {
+    if( m_h2 )
+    {
+        process_h2();
+        return;
+    }
+    m_trace.start();
     /* 进入主状态机，处理客户请求*/
     HTTP_CODE read_ret = process_read();
 
-    /* 如果请求不完整，则将该客户端连接再次放入事件监听表，读取其后续数据*/
+    /* 切换到HTTP/2, 之后本连接上的数据都按帧处理; HTTP2-Settings无效时按HTTP/1.1应答升级请求*/
+    if( read_ret == UPGRADE_REQUEST )
+    {
+        if( start_h2() )
+        {
+            process_h2();
+            return;
+        }
+        read_ret = dispatch();
+    }
+
+    /* 连接挂在相同CGI请求的执行结果上, 可能已经被唤醒并交给了其他工作线程*/
+    if( read_ret == PARKED_REQUEST )
+    {
+        return;
+    }
+
+    /* 如果请求不完整，则让反应堆将该客户端连接再次放入事件监听表，读取其后续数据*/
     if ( read_ret == NO_REQUEST )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        m_cq->post( this, WANT_READ );
         return;
     }
 
-    /* 因为POST请求已经在子进程中处理了，这一块则直接返回，继续监听下一个请求*/
-    if( m_method == POST )
+    /* CGI请求的应答已经流式发送完毕, 保持连接时等待下一个请求*/
+    if( read_ret == GET_REQUEST )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        if( m_linger )
+        {
+            init();
+            m_cq->post( this, WANT_READ );
+        }
+        else
+        {
+            m_cq->post( this, WANT_CLOSE );
+        }
         return;
     }
     /* 根据服务器对客户端请求的结果，向写缓冲写入对客户端回复响应*/
     bool write_ret = process_write( read_ret );
     if ( ! write_ret )
+    {
+        m_cq->post( this, WANT_CLOSE );
+        return;
+    }
+    m_trace.mark( TRACE_FILLED );
+    /* 由反应堆将写缓冲中的响应发送给客户端*/
+    m_cq->post( this, WANT_WRITE );
+}
+
+/* 填充过载应答, 请求不再处理, 应答发送后关闭连接*/
+bool http_conn::fill_unavailable()
+{
+    /* 被唤醒后没能回到线程池的请求不再使用等到的结果*/
+    if( m_cgi_wait )
+    {
+        cgi_cache::release( m_cgi_wait );
+        m_cgi_wait = NULL;
+    }
+    m_linger = false;
+    m_status = 503;
+    m_trace.start();
+    m_trace.mark( TRACE_FILLED );
+    return m_out.push_memory( unavailable_response, sizeof( unavailable_response ) - 1 );
+}
+
+/* 线程池因过载放弃执行请求时, 由工作线程代替process调用*/
+void http_conn::reject()
+{
+    /* HTTP/2连接不能插入HTTP/1.1的应答, 以GOAWAY告知客户端不再接受新的流*/
+    if( m_h2 )
+    {
+        m_h2->go_away( h2_session::H2_ENHANCE_YOUR_CALM );
+        m_cq->post( this, WANT_WRITE );
+        return;
+    }
+    m_cq->post( this, fill_unavailable() ? WANT_WRITE : WANT_CLOSE );
+}
+
+/* 请求未能进入线程池(队列已满或过载), 反应堆直接发送过载应答*/
+void http_conn::reject_inline()
+{
+    m_in_worker = false;
+    if( m_h2 )
+    {
+        m_h2->go_away( h2_session::H2_ENHANCE_YOUR_CALM );
+        if( ! write_response() )
+        {
+            close_conn();
+        }
+        return;
+    }
+    if( ! fill_unavailable() || ! write_response() )
+    {
+        close_conn();
+    }
+}
+
+/* 连接数超过上限时, 不为新连接分配连接对象, 尽力发送过载应答后立即关闭*/
+void http_conn::refuse( int connfd, bool tls )
+{
+    if( tls )
+    {
+        close( connfd );
+        return;
+    }
+    send( connfd, unavailable_response, sizeof( unavailable_response ) - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+    close( connfd );
+}
+
+/* 已经应答过请求, 而读缓冲区中还没有新数据, 说明长连接正在等待下一个请求;
+ * 交给工作线程的连接读缓冲区中一定有数据, 所以这里不会关闭正在处理中的连接。
+ * 刚建立、还没发来第一个请求的连接不算空闲, 客户端不会重试在新连接上失败的请求
+ */
+void http_conn::close_if_idle()
+{
+    if( m_sockfd == -1 || m_in_worker || m_read_idx != 0 || ! m_out.empty() )
+    {
+        return;
+    }
+    /* HTTP/2连接没有进行中的流时就是空闲的*/
+    if( m_h2 ? m_h2->idle() : m_served > 0 )
+    {
+        close_conn();
+    }
+}
+
+/* 反应堆从完成队列中取出本连接后调用*/
+void http_conn::on_completion()
+{
+    m_in_worker = false;
+    apply_h2_jobs();
+    switch( m_cq_action )
+    {
+        case WANT_READ:
+        {
+            wait_input();
+            break;
+        }
+        /* 直接尝试发送, 而不是先注册EPOLLOUT再等一轮epoll_wait; 发不完时write_response会注册EPOLLOUT*/
+        case WANT_WRITE:
+        {
+            if( ! write_response() )
+            {
+                close_conn();
+            }
+            break;
+        }
+        default:
+        {
+            close_conn();
+            break;
+        }
+    }
+}
+
+void http_conn::h2_job_done( h2_job *job )
+{
+    if( m_in_worker )
+    {
+        job->m_next = m_h2_done;
+        m_h2_done = job;
+        return;
+    }
+    m_h2->complete( job );
+    /* 连接可能正在等待EPOLLIN或EPOLLOUT, 直接尝试发送, write_h2会重新注册需要的事件*/
+    if( ! write_response() )
     {
         close_conn();
     }
-    /* 监听可写事件，监听到可写时，将写缓冲中的响应发送给客户端*/
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+}
+
+/* 把连接在工作线程中时交回的作业设置到流上*/
+void http_conn::apply_h2_jobs()
+{
+    while( m_h2_done )
+    {
+        h2_job *job = m_h2_done;
+        m_h2_done = job->m_next;
+        m_h2->complete( job );
+    }
+}
+
+/* 由CGI输出缓存的执行者调用, 连接此时不在任何线程中处理, 交给所属的反应堆*/
+void http_conn::resume()
+{
+    m_cq->post( this, RESUME );
+}
+
+/* 是否是可以升级到HTTP/2的请求: 带Upgrade: h2c和HTTP2-Settings、没有消息体的GET请求*/
+bool http_conn::wants_h2c() const
+{
+    return m_upgrade_h2c && m_h2_settings && m_method == GET && m_content_length == 0
+           && ! m_chunked && current_config()->http2_enable;
+}
+
+/* 切换到HTTP/2
+ * 升级请求应答101后作为流1处理, 读缓冲区中升级请求之后的数据(客户端的连接前言)留给帧处理;
+ * 先验知识的连接前言还在读缓冲区开头, 由h2_session校验。读缓冲区扩大到能放下一个最大的帧
+ */
+bool http_conn::start_h2()
+{
+    const server_config *cfg = current_config();
+    m_h2 = new h2_session( this, m_cq, m_address, m_reactor, m_ssl != NULL, cfg->http2_max_streams,
+                           cfg->http2_max_body );
+    int keep = 0;
+    if( m_upgrade_h2c )
+    {
+        if( ! m_h2->upgrade( m_h2_settings, m_url, m_trace.t[ TRACE_BEGIN ], m_trace.t[ TRACE_READ ] ) )
+        {
+            delete m_h2;
+            m_h2 = NULL;
+            return false;
+        }
+        keep = m_checked_idx;
+    }
+    else
+    {
+        m_h2->start();
+    }
+
+    int len = m_read_idx - keep;
+    if( m_read_buf_size < h2_session::INPUT_BUFFER_SIZE )
+    {
+        char *buf = new char[ h2_session::INPUT_BUFFER_SIZE ];
+        memcpy( buf, m_read_buf + keep, len );
+        delete [] m_read_buf;
+        m_read_buf = buf;
+        m_read_buf_size = h2_session::INPUT_BUFFER_SIZE;
+    }
+    else
+    {
+        memmove( m_read_buf, m_read_buf + keep, len );
+    }
+    m_read_idx = len;
+    m_checked_idx = m_start_line = 0;
+    return true;
+}
+
+/* 处理读缓冲区中的完整帧, 不完整的帧移到缓冲区开头等待后续数据*/
+void http_conn::process_h2()
+{
+    int used = m_h2->on_input( m_read_buf, m_read_idx, m_trace.t[ TRACE_READ ] );
+    memmove( m_read_buf, m_read_buf + used, m_read_idx - used );
+    m_read_idx -= used;
+    if( __atomic_load_n( &m_draining, __ATOMIC_RELAXED ) )
+    {
+        m_h2->go_away( h2_session::H2_NO_ERROR );
+    }
+    m_cq->post( this, WANT_WRITE );
+}
+
+/* 发送HTTP/2帧: 每次取出会话生成的一批帧发送, 直到没有可发送的数据(或都受流量控制阻塞)
+ * 发送不完时注册EPOLLOUT, 这期间不读取新的帧; 发完后继续监听EPOLLIN, 等待请求和WINDOW_UPDATE
+ */
+bool http_conn::write_h2()
+{
+    const char *data;
+    size_t len;
+    for( ;; )
+    {
+        if( m_out.empty() )
+        {
+            if( ! m_h2->pull( &data, &len ) )
+            {
+                break;
+            }
+            m_out.push_memory( data, len );
+        }
+        switch( send_out() )
+        {
+            case out_queue::SEND_AGAIN:
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            case out_queue::SEND_ERROR:
+            {
+                m_out.clear();
+                return false;
+            }
+            default:
+            {
+                m_h2->sent();
+                m_out.clear();
+                break;
+            }
+        }
+    }
+    if( m_h2->closing() )
+    {
+        return false;
+    }
+    wait_input();
+    return true;
 }
@@ -23,18 +23,48 @@
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <netinet/tcp.h>
 #include "./locker.h"
+#include "./out_queue.h"
+#include "./resp_cache.h"
+#include "./server_config.h"
+#include "./conn_pool.h"
+#include "./completion_queue.h"
+#include "./pool_task.h"
+#include "./async_log.h"
+#include "./arena.h"
+#include "./url.h"
+#include "./route.h"
+#include "./upstream.h"
+#include "./trace.h"
+
+class h2_session;
+class h2_job;
+struct cgi_result;
+
+/* 解析CGI输出的头部时, 对每个需要转发的头部行调用的回调*/
+typedef void (*cgi_header_fn)( void *arg, const char *line );
 
 /* 处理http连接类*/
-class http_conn
+class http_conn : public pool_task
 {
 public:
     /* 文件名的最大长度*/
     static const int FILENAME_LEN = 200;
-    /* 读缓冲区的大小*/
-    static const int READ_BUFFER_SIZE = 2048;
-    /* 写缓冲区的大小*/
-    static const int WRITE_BUFFER_SIZE = 1024;
+    /* CGI输出的头部的最大长度*/
+    static const int CGI_HEADER_MAX = 4096;
+    /* 转发请求消息体给CGI程序时的读取缓冲区大小*/
+    static const int CGI_BODY_BUF = 8192;
+    /* 接收上游服务器应答的缓冲区大小, 也是应答头部的最大长度*/
+    static const int PROXY_BUF = 16384;
+    /* 最多解析的查询参数个数*/
+    static const int MAX_QUERY_PARAMS = 16;
+    /* CGI标准输入、输出管道的容量(F_SETPIPE_SZ), 大一些每次splice能移动更多数据*/
+    static const int CGI_PIPE_SIZE = 262144;
+    /* 转发CGI输出时, 客户端迟迟不接收数据的最长等待时间*/
+    static const int CGI_SEND_TIMEOUT_MS = 30000;
+    /* 消息体没收完就应答时, 关闭连接前最多花多长时间读掉客户端还在发送的数据*/
+    static const int LINGER_DRAIN_MS = 2000;
     /* http请求方法，但我们仅支持GET*/
     enum METHOD 
     {
@@ -59,6 +89,11 @@ public:
         FILE_REQUEST,          /* 请求一个文件*/
         INTERNAL_ERROR,        /* 服务器内部错误*/
         CLOSED_CONNECTION,     /* 客户端已经关闭连接了*/
+        DEFERRED_REQUEST,      /* 反应堆内联处理时遇到需要阻塞的操作, 交给工作线程继续处理*/
+        BAD_GATEWAY,           /* CGI程序或上游服务器没有给出有效的应答*/
+        UPGRADE_REQUEST,       /* 客户端要切换到HTTP/2(连接前言或Upgrade: h2c)*/
+        STATUS_REQUEST,        /* 请求内置的服务器状态页或慢请求页*/
+        PARKED_REQUEST,        /* 可缓存的CGI请求挂在相同请求的执行结果上, 连接已经交出, 工作线程不能再访问它*/
     };
     /* 行的读取状态*/
     enum LINE_STATUS
@@ -67,29 +102,110 @@ public:
         LINE_BAD,       /* 行出错*/
         LINE_OPEN       /* 行数据尚且不完整*/
     };
+    /* 工作线程处理完请求后, 交给反应堆执行的下一步动作*/
+    enum NEXT_ACTION
+    {
+        WANT_READ = 0,  /* 继续读取客户数据*/
+        WANT_WRITE,     /* 发送已填充好的应答*/
+        WANT_CLOSE      /* 关闭连接*/
+    };
+    /* 请求的调度类, 即线程池中请求队列的编号*/
+    enum SCHED_CLASS
+    {
+        SCHED_STATIC = 0,   /* 静态文件请求*/
+        SCHED_CGI,          /* 需要fork CGI程序或者转发给上游服务器的请求*/
+        SCHED_CLASS_NUMBER
+    };
 
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn();
+    ~http_conn();
 
 
 public:
-    /* 初始化新接受的连接*/
-    void init( int sockfd, const sockaddr_in& addr );
+    /* 初始化新接受的连接
+     * @epollfd : 接受该连接的反应堆的epoll描述符
+     * @reactor : 接受该连接的反应堆的编号, 反向代理时使用该反应堆的上游连接池
+     * @pool : 该连接对象所属的连接池, 关闭连接时归还
+     * @cq : 接受该连接的反应堆的完成队列, 工作线程处理完请求后提交到这里
+     * @tls : 是否是HTTPS连接, 是则先进行TLS握手
+     */
+    void init( int sockfd, const sockaddr_in& addr, int epollfd, int reactor, conn_pool< http_conn > *pool,
+               completion_queue< pool_task > *cq, bool tls );
     /* 关闭连接*/
     void close_conn( bool real_close = true );
     /* 处理客户请求*/
     void process();
+    /* TLS连接是否还在握手*/
+    bool handshaking() const { return m_handshaking; }
+    /* 推进TLS握手, 出错返回false; 由反应堆在握手完成前代替read_request/write_response调用*/
+    bool handshake();
+    /* TLS连接的OpenSSL缓冲中是否还有解密好、没读走的数据(套接字本身不会再变为可读)*/
+    bool input_buffered() const;
     /* 非阻塞读操作*/
     bool read_request();
     /* 非阻塞写操作*/
     bool write_response();
+    /* 根据请求行确定请求的调度类, 在把请求交给线程池之前调用*/
+    SCHED_CLASS classify();
+    /* 在反应堆线程中直接处理请求, 返回false表示需要交给线程池*/
+    bool process_inline();
+    /* 反应堆把连接交给线程池之前调用, 直到工作线程提交的动作执行时(on_completion)为止, 连接都算在工作线程中*/
+    void enter_worker() { m_in_worker = true; }
+    /* 在反应堆线程中执行工作线程提交的下一步动作*/
+    void on_completion();
+    /* HTTP/2流的作业执行完毕(反应堆线程): 连接正在工作线程中处理帧时先记下, 交回反应堆后再设置到流上*/
+    void h2_job_done( h2_job *job );
+    /* 等到了相同CGI请求的执行结果, 重新交给线程池继续处理*/
+    void resume();
+    /* 连接空闲(正在等待下一个请求)时关闭它, 优雅退出时由反应堆调用*/
+    void close_if_idle();
+    /* 过载时拒绝请求, 应答503: reject由线程池的工作线程调用, reject_inline由反应堆调用*/
+    void reject();
+    void reject_inline();
+    /* 连接数超过上限时拒绝新连接, HTTPS连接还没握手, 只能直接关闭*/
+    static void refuse( int connfd, bool tls );
+    /* 本次请求的查询参数(已解码), 没有该参数时返回NULL*/
+    const char* query_param( const char *name ) const;
+    /* 由规范化的URL得到目标文件的完整路径, 以'/'结尾的目录对应其中的index.html
+     * 路径超过FILENAME_LEN时返回false
+     */
+    static bool file_path( const char *url, char *path );
+
+    /* CGI相关的公共部分, HTTP/2的流也通过它们运行CGI程序*/
+    /* 得到路由r对应的CGI程序的完整路径, 路由没有指定程序时是url本身对应的文件; 程序不存在或不可执行时返回false*/
+    static bool cgi_program( const route *r, const char *url, char *path );
+    static pid_t spawn_cgi( const char *program, char **envp, int *to_child, int *from_child );
+    /* 回收CGI子进程, 返回它是否正常退出(退出码为0)*/
+    static bool reap_cgi( pid_t pid, bool kill_first );
+    /* 把内存中完整的消息体送进CGI程序, 同时收下它的全部输出(malloc的缓冲区, 由调用者释放)
+     * 出错或输出超过max_len时返回false, 此时*out已经释放; 两个管道都由本函数关闭
+     */
+    static bool collect_cgi( int to_child, int from_child, const char *body, int body_len, int max_len,
+                             char **out, int *out_len );
+    static int find_cgi_body( const char *buf, int len );
+    static int parse_cgi_head( char *buf, int header_len, const char **reason,
+                               cgi_header_fn fn, void *arg );
+    /* 反向代理的公共部分: 把完整的请求(头部和消息体)转发给上游服务器组并收齐应答, HTTP/2的流使用
+     * 成功时out带回应答的头部和解码后的消息体(malloc的缓冲区, 格式与CGI的输出相同), 失败返回false
+     * @max_len : 应答的最大长度, 超过时失败
+     */
+    static bool proxy_fetch( upstream *up, int reactor, const char *head, int head_len,
+                             const char *body, int body_len, int max_len, char **out, int *out_len );
 
 /* 以下是类内部调用的函数-------------------------------*/
 private:
     /* 初始化连接*/
     void init();
+    /* 继续监听EPOLLIN, 等待客户端的下一批数据*/
+    void wait_input();
+    /* 从连接上读取数据(TLS连接经过SSL_read), 返回值与read相同*/
+    ssize_t recv_some( char *buf, size_t len );
+    /* 发送输出队列(需要时经过SSL_write)*/
+    out_queue::SEND_RESULT send_out();
+    /* 需要在用户态加密时返回SSL对象, 明文连接或内核已经接管加密时返回NULL*/
+    SSL* user_tls() const { return m_ktls_tx ? NULL : m_ssl; }
     /* 解析HTTP请求*/
     HTTP_CODE process_read();
     /* 填充HTTP应答*/
@@ -99,11 +215,40 @@ private:
     HTTP_CODE parse_request_line( char *text );
     HTTP_CODE parse_headers( char *text );
     HTTP_CODE parse_content( char *text );
+    /* 请求解析完毕后按路由分派*/
+    HTTP_CODE dispatch();
     HTTP_CODE do_request();
+    HTTP_CODE status_page();
+    /* 运行CGI程序, 并把它的输出分块转发给客户端*/
+    HTTP_CODE run_cgi( char *body );
+    HTTP_CODE pump_cgi( int in_fd, int out_fd, char *body );
+    HTTP_CODE send_cgi_head( char *buf, int header_len, const char *framing, long long *sent );
+    /* 可缓存的CGI路由: 收齐消息体后查找输出缓存, 没有命中时执行CGI程序并收齐输出*/
+    HTTP_CODE run_cgi_cached( const char *program, char **envp, char *body );
+    /* 选定的请求头部(路由的cache_vary), 每个是"名字: 值\r\n", 在m_arena中*/
+    char* cgi_vary( char *body, int *len );
+    /* 以完整的CGI输出应答, 带Content-Length*/
+    HTTP_CODE send_cgi_output( const char *out, int out_len );
+    bool send_chunk( const char *data, int len, long long *sent );
+    /* 把管道中的len个字节作为一块用splice直接移到套接字, 不经过用户空间*/
+    bool splice_chunk( int pipe_fd, int len, long long *sent );
+    /* 反向代理: 把请求转发给上游服务器, 两个方向的消息体都边收边转发*/
+    HTTP_CODE run_proxy( char *body );
+    char* proxy_head( char *body, int *len );
+    static bool send_to_client( void *arg, const char *data, int len );
     char* get_line()  { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
+    /* 是否是可以接受的Upgrade: h2c请求*/
+    bool wants_h2c() const;
+
+    /* HTTP/2连接: 切换协议, 处理帧, 发送帧*/
+    bool start_h2();
+    void process_h2();
+    bool write_h2();
+    void apply_h2_jobs();
 
     /* 下面这一组函数被process_write调用以填充HTTP应答*/
+    /* 解除文件映射, 关闭还没有交给输出队列的大文件描述符*/
     void unmap();
     bool add_response( const char *format, ... );
     bool add_content( const char *content );
@@ -112,39 +257,61 @@ private:
     bool add_content_length(int content_length);
     bool add_linger();
     bool add_blank_line();
+    /* 填充预先序列化好的503应答*/
+    bool fill_unavailable();
+    /* 应答发送完毕后写一条访问日志, 慢请求另外记入慢请求环形缓冲区*/
+    void log_request( int status, long long bytes );
 
 
 public:
-    /*所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符
-     *设置为静态的
-     */
-    static int m_epollfd;
-    /* 统计用户数量*/
+    /* 统计用户数量(各反应堆都会修改, 需原子操作)*/
     static int m_user_count;
+    /* 服务器正在优雅退出, 此后的应答都带Connection: close*/
+    static int m_draining;
 
 private:
+    /* 每个反应堆有自己的epoll内核事件表, 连接的事件注册在接受它的反应堆上*/
+    int m_epollfd;
+    int m_reactor;
+    /* 连接对象所属的连接池*/
+    conn_pool< http_conn > *m_pool;
+    /* 所属反应堆的完成队列*/
+    completion_queue< pool_task > *m_cq;
+
     /* 该HTTP连接的socket和对方的socket地址*/
     int m_sockfd;
     sockaddr_in m_address;
 
-    /* 读缓冲区*/
-    char m_read_buf[ READ_BUFFER_SIZE ];
+    /* HTTPS连接的SSL对象, 明文连接为NULL*/
+    SSL *m_ssl;
+    /* 还在TLS握手*/
+    bool m_handshaking;
+    /* 握手后发送方向由内核加密(kTLS), 可以直接往套接字上写明文*/
+    bool m_ktls_tx;
+
+    /* 读缓冲区, 大小由配置决定(http_conn.read_buffer_size)*/
+    char *m_read_buf;
+    int m_read_buf_size;
     /* 标识读缓冲区中已经读入的客户数据的最后一个字节的下一个位置*/
     int m_read_idx;
     /* 当前正在分析的字符在读缓冲区中的位置*/
     int m_checked_idx;
     /* 当前正在解析的行的起始位置*/
     int m_start_line;
+    /* 请求头部(请求行之后)在读缓冲区中的起始位置, 反向代理转发头部时使用*/
+    int m_header_start;
 
-    /* 写缓冲区*/
-    char m_write_buf[ WRITE_BUFFER_SIZE ];
+    /* 写缓冲区, 大小由配置决定(http_conn.write_buffer_size)*/
+    char *m_write_buf;
+    int m_write_buf_size;
     /* 写缓冲区中待发送的字节数*/
     int m_write_idx;
 
-    /* 本次响应已经发送的字节数*/
-    int m_bytes_have_send;
-    /* 本次响应将要发送的字节数*/
-    int m_bytes_to_send;
+    /* 本次请求的临时内存, 每个请求开始时整体归还*/
+    arena m_arena;
+
+    /* 本次响应的输出队列(响应头、文件内容等片段), 记录了每个片段已经发送的字节数*/
+    out_queue m_out;
 
     /* 主状态机当前所处的状态*/ 
     CHECK_STATE m_check_state;
@@ -153,21 +320,64 @@ private:
 
     /* 客户请求的目标文件的完整路径，其内容等于doc_root + m_url, (doc_root是网站根目录)*/
     char m_read_file[ FILENAME_LEN ];
-    /* 客户请求的目标文件的文件名*/
+    /* 请求匹配到的路由, 指向配置快照中的路由表; 没有匹配的路由时为NULL*/
+    const route *m_route;
+    /* 内置状态页的内容, 在m_arena中*/
+    char *m_page;
+    int m_page_len;
+    /* 客户请求的目标文件的文件名, 已经解码并规范化, 不含查询串*/
     char *m_url;
+    /* 查询串(未解码), 没有时为NULL; 以及解析出的查询参数, 解码后的内容在m_arena中*/
+    char *m_query;
+    url_param m_params[ MAX_QUERY_PARAMS ];
+    int m_param_count;
     /* HTTP协议版本号，我们仅支持HTTP/1.1*/
     char *m_version;
     /* 主机名*/
     char *m_host;
     /* HTTP请求的消息体长度*/
     int m_content_length;
+    /* 是否带了Content-Length头部(值可以为0)*/
+    bool m_has_content_length;
+    /* HTTP请求的消息体是否为chunked编码*/
+    bool m_chunked;
+    /* 客户端是否要先收到100 Continue才发送消息体*/
+    bool m_expect_continue;
     /* HTTP请求是否要求保持连接*/
     bool m_linger;
+    /* 请求带有Upgrade: h2c, 以及HTTP2-Settings头部的值*/
+    bool m_upgrade_h2c;
+    char *m_h2_settings;
+    /* 切换到HTTP/2后的连接状态, 为NULL表示仍是HTTP/1.1*/
+    h2_session *m_h2;
+    /* 连接在工作线程中时交回的HTTP/2作业, 以h2_job::m_next链接; 它和m_in_worker只由反应堆线程访问*/
+    h2_job *m_h2_done;
+    bool m_in_worker;
 
     /* 客户请求的目标文件mmap到内存中的起始位置*/
     char *m_file_address;
+    /* 大文件不mmap, 打开的描述符交给输出队列用sendfile发送, 交出之前为-1以外的值*/
+    int m_file_fd;
     /* 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息*/
     struct stat m_file_stat;
+    /* 命中(或刚插入)的完整响应缓存条目, 持有一个引用直到交给输出队列*/
+    cache_entry *m_cache_entry;
+
+    /* 是否正在反应堆线程中内联处理请求*/
+    bool m_inline;
+    /* 请求已经解析完毕, 但目标文件的处理被推迟给了工作线程*/
+    bool m_deferred;
+    /* 可缓存的CGI请求已经收齐的消息体(在m_arena中), 挂起后被唤醒时不再读取*/
+    char *m_cgi_content;
+    /* 挂起时等待的相同请求的执行结果, 持有一个引用*/
+    cgi_result *m_cgi_wait;
+    /* 本连接上已经应答的请求数*/
+    int m_served;
+
+    /* 本次请求经过各阶段的时间点, 用于访问日志中的各阶段耗时和慢请求记录*/
+    req_trace m_trace;
+    /* 本次应答的状态码*/
+    int m_status;
 };
 
 #endif
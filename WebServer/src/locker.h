@@ -11,6 +11,8 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
 
 /*封装(线程间)信号量的类-------------------------------------------------*/
 class sem 
@@ -46,6 +48,28 @@ public:
         return sem_wait(&m_sem) == 0;
     }
 
+    /*等待信号量, 最多等待ms毫秒, 超时返回false*/
+    bool timedwait( int ms )
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += ( long )( ms % 1000 ) * 1000000;
+        if( ts.tv_nsec >= 1000000000 )
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while( sem_timedwait( &m_sem, &ts ) != 0 )
+        {
+            if( errno != EINTR )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
     /*增加信号量*/
     bool post()
     {
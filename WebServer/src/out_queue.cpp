@@ -0,0 +1,313 @@
+/*************************************************************************
+	> File Name: out_queue.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 13时20分45秒
+ ************************************************************************/
+#include "./out_queue.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+
+out_queue::out_queue()
+    :m_head( 0 ), m_count( 0 ), m_pending( 0 ), m_total_sent( 0 ), m_tls_retry( 0 )
+{
+}
+
+out_queue::~out_queue()
+{
+    clear();
+}
+
+/* 在队尾占用一个片段位置*/
+out_segment* out_queue::push_segment()
+{
+    if( m_count >= MAX_SEGMENTS )
+    {
+        return NULL;
+    }
+    out_segment *seg = &m_segs[ ( m_head + m_count ) % MAX_SEGMENTS ];
+    memset( seg, 0, sizeof( *seg ) );
+    seg->fd = -1;
+    m_count++;
+    return seg;
+}
+
+/* 追加一个内存片段, 长度为0的片段直接忽略*/
+bool out_queue::push_memory( const char *data, size_t len,
+                             segment_release_fn release, void *arg )
+{
+    if( len == 0 )
+    {
+        if( release )
+        {
+            release( arg );
+        }
+        return true;
+    }
+    out_segment *seg = push_segment();
+    if( ! seg )
+    {
+        return false;
+    }
+    seg->type = SEG_MEMORY;
+    seg->data = data;
+    seg->len = len;
+    seg->release = release;
+    seg->arg = arg;
+    m_pending += len;
+    return true;
+}
+
+/* 追加一个文件区间片段, 需要预读时先提示读入第一个窗口, 磁盘读取与响应头的发送同时进行*/
+bool out_queue::push_file( int fd, off_t offset, size_t len, size_t readahead,
+                           segment_release_fn release, void *arg )
+{
+    if( len == 0 )
+    {
+        if( release )
+        {
+            release( arg );
+        }
+        return true;
+    }
+    out_segment *seg = push_segment();
+    if( ! seg )
+    {
+        return false;
+    }
+    seg->type = SEG_FILE;
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->len = len;
+    seg->release = release;
+    seg->arg = arg;
+    seg->readahead = readahead;
+    seg->ra_end = offset;
+    if( readahead > 0 )
+    {
+        size_t window = READAHEAD_MIN < readahead ? READAHEAD_MIN : readahead;
+        window = window < len ? window : len;
+        posix_fadvise( fd, offset, window, POSIX_FADV_WILLNEED );
+        seg->ra_end = offset + window;
+    }
+    m_pending += len;
+    return true;
+}
+
+/* 弹出队首片段, 并释放其引用的资源*/
+void out_queue::pop_segment()
+{
+    out_segment *seg = &m_segs[ m_head ];
+    if( seg->release )
+    {
+        seg->release( seg->arg );
+    }
+    m_head = ( m_head + 1 ) % MAX_SEGMENTS;
+    m_count--;
+}
+
+/* 丢弃所有片段*/
+void out_queue::clear()
+{
+    while( m_count > 0 )
+    {
+        pop_segment();
+    }
+    m_head = 0;
+    m_pending = 0;
+    m_total_sent = 0;
+    m_tls_retry = 0;
+}
+
+/* 将n个已发送字节依次记到队首的片段上, 发送完的片段出队*/
+void out_queue::consume( size_t n )
+{
+    m_pending -= n;
+    m_total_sent += n;
+    while( n > 0 && m_count > 0 )
+    {
+        out_segment *seg = &m_segs[ m_head ];
+        size_t left = seg->len - seg->sent;
+        if( n < left )
+        {
+            seg->sent += n;
+            return;
+        }
+        n -= left;
+        seg->sent = seg->len;
+        pop_segment();
+    }
+}
+
+/* 发送位置离已预读的位置不到半个窗口时, 提示内核把预读推进到发送位置之后一个窗口处
+ * 窗口取本轮发出字节数的两倍: 客户端收得快, 每轮发得多, 预读也跟着变大; 收得慢就只预读一小段,
+ * 不会为一个慢连接把整个大文件读进页缓存。WILLNEED只是异步的提示, 每次sendfile之前都推进窗口,
+ * 让磁盘读取尽量走在发送前面; 读入还没完成的页sendfile仍然要等待磁盘, 预读只是减少这种等待
+ */
+void out_queue::readahead( size_t round )
+{
+    if( m_count == 0 )
+    {
+        return;
+    }
+    out_segment *seg = &m_segs[ m_head ];
+    if( seg->type != SEG_FILE || seg->readahead == 0 )
+    {
+        return;
+    }
+    off_t pos = seg->offset + seg->sent;
+    off_t end = seg->offset + seg->len;
+    size_t window = round * 2;
+    window = window > READAHEAD_MIN ? window : READAHEAD_MIN;
+    window = window < seg->readahead ? window : seg->readahead;
+    if( seg->ra_end >= end || seg->ra_end - pos >= ( off_t )( window / 2 ) )
+    {
+        return;
+    }
+    off_t from = seg->ra_end > pos ? seg->ra_end : pos;
+    off_t to = pos + ( off_t )window < end ? pos + ( off_t )window : end;
+    posix_fadvise( seg->fd, from, to - from, POSIX_FADV_WILLNEED );
+    seg->ra_end = to;
+}
+
+/* 把队首开始的连续内存片段聚合成一次sendmsg发送。
+ * 如果后面紧跟着文件片段，则带上MSG_MORE，让响应头和文件内容尽量合并到同一个TCP报文中
+ */
+ssize_t out_queue::send_memory( int sockfd )
+{
+    struct iovec iov[ MAX_IOV ];
+    int iovcnt = 0;
+    bool more = false;
+
+    for( int i = 0; i < m_count && iovcnt < MAX_IOV; ++i )
+    {
+        const out_segment *seg = &m_segs[ ( m_head + i ) % MAX_SEGMENTS ];
+        if( seg->type != SEG_MEMORY )
+        {
+            more = true;
+            break;
+        }
+        iov[ iovcnt ].iov_base = ( void* )( seg->data + seg->sent );
+        iov[ iovcnt ].iov_len = seg->len - seg->sent;
+        iovcnt++;
+    }
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg( sockfd, &msg, MSG_NOSIGNAL | ( more ? MSG_MORE : 0 ) );
+}
+
+/* 用sendfile发送队首文件片段的剩余部分, 每次都只请求剩余长度*/
+ssize_t out_queue::send_file( int sockfd )
+{
+    out_segment *seg = &m_segs[ m_head ];
+    off_t offset = seg->offset + seg->sent;
+    ssize_t ret = sendfile( sockfd, seg->fd, &offset, seg->len - seg->sent );
+    if( ret == 0 )
+    {
+        /* 文件在发送过程中被截断了, 无法再按照已声明的长度发送*/
+        errno = EIO;
+        return -1;
+    }
+    return ret;
+}
+
+/* 发送队列中的数据, 直到全部发送完毕、写缓冲满或出错*/
+out_queue::SEND_RESULT out_queue::send( int sockfd )
+{
+    size_t round = 0;
+    while( m_count > 0 )
+    {
+        ssize_t ret;
+        if( m_segs[ m_head ].type == SEG_MEMORY )
+        {
+            ret = send_memory( sockfd );
+        }
+        else
+        {
+            readahead( round );
+            ret = send_file( sockfd );
+        }
+
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            /* 写缓冲已满, 交还给epoll, 下次从当前位置继续*/
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                readahead( round );
+                return SEND_AGAIN;
+            }
+            return SEND_ERROR;
+        }
+        consume( ret );
+        round += ret;
+    }
+    return SEND_DONE;
+}
+
+/* 从队首开始复制数据(不出队), 文件片段用pread读取*/
+ssize_t out_queue::gather( char *buf, size_t len )
+{
+    size_t copied = 0;
+    for( int i = 0; i < m_count && copied < len; ++i )
+    {
+        const out_segment *seg = &m_segs[ ( m_head + i ) % MAX_SEGMENTS ];
+        size_t n = seg->len - seg->sent;
+        n = n < len - copied ? n : len - copied;
+        if( seg->type == SEG_MEMORY )
+        {
+            memcpy( buf + copied, seg->data + seg->sent, n );
+        }
+        else if( pread( seg->fd, buf + copied, n, seg->offset + seg->sent ) != ( ssize_t )n )
+        {
+            return -1;
+        }
+        copied += n;
+    }
+    return copied;
+}
+
+/* 用户态加密时, 把队首的数据聚合成一个个完整的TLS记录交给SSL_write, 响应头和小文件合在同一个记录里
+ * SSL_write返回WANT_WRITE时这条记录已经在OpenSSL内部, 下次必须用同样的数据重试
+ */
+out_queue::SEND_RESULT out_queue::send_tls( SSL *ssl )
+{
+    char buf[ TLS_RECORD ];
+    size_t round = 0;
+    while( m_count > 0 )
+    {
+        readahead( round );
+        ssize_t len = gather( buf, m_tls_retry > 0 ? m_tls_retry : sizeof( buf ) );
+        if( len <= 0 )
+        {
+            return SEND_ERROR;
+        }
+        int ret = SSL_write( ssl, buf, len );
+        if( ret <= 0 )
+        {
+            if( SSL_get_error( ssl, ret ) == SSL_ERROR_WANT_WRITE )
+            {
+                m_tls_retry = len;
+                readahead( round );
+                return SEND_AGAIN;
+            }
+            return SEND_ERROR;
+        }
+        m_tls_retry = 0;
+        consume( ret );
+        round += ret;
+    }
+    return SEND_DONE;
+}
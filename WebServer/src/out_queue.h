@@ -0,0 +1,120 @@
+/*************************************************************************
+	> File Name: out_queue.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 13时02分11秒
+ ************************************************************************/
+
+#ifndef _OUT_QUEUE_H
+#define _OUT_QUEUE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+typedef struct ssl_st SSL;
+
+/* 片段发送完毕(或被丢弃)时的回调, 用于释放片段所引用的资源*/
+typedef void (*segment_release_fn)( void *arg );
+
+/* 输出队列中的一个待发送片段*/
+struct out_segment
+{
+    int type;                     /* 片段类型: 内存片段或文件片段*/
+    const char *data;             /* 内存片段的起始地址*/
+    int fd;                       /* 文件片段对应的文件描述符*/
+    off_t offset;                 /* 文件片段在文件中的起始偏移*/
+    size_t len;                   /* 片段总长度*/
+    size_t sent;                  /* 片段中已经发送的字节数*/
+    size_t readahead;             /* 文件片段预读窗口的上限, 0表示不主动预读*/
+    off_t ra_end;                 /* 已经提示内核预读到的文件位置*/
+    segment_release_fn release;   /* 释放回调, 可以为NULL*/
+    void *arg;                    /* 释放回调的参数*/
+};
+
+/* 每个连接的输出队列
+ * 响应由若干片段(内存块、文件区间)组成, 队列精确记录每个片段已经发送了多少字节。
+ * 套接字写满(EAGAIN)时立即返回, 由调用者重新监听EPOLLOUT, 下次从断点处继续发送,
+ * 而不是在反应堆线程上忙等
+ */
+class out_queue
+{
+public:
+    /* 队列中最多容纳的片段数*/
+    static const int MAX_SEGMENTS = 16;
+    /* 一次writev最多聚合的内存片段数*/
+    static const int MAX_IOV = 8;
+    /* 用户态TLS加密时, 一次SSL_write最多聚合的字节数(一个TLS记录的最大明文长度)*/
+    static const int TLS_RECORD = 16384;
+    /* 文件片段预读窗口的下限*/
+    static const size_t READAHEAD_MIN = 131072;
+
+    /* 片段类型*/
+    enum SEGMENT_TYPE
+    {
+        SEG_MEMORY = 0,   /* 内存片段, 使用writev发送*/
+        SEG_FILE          /* 文件区间, 使用sendfile发送*/
+    };
+
+    /* 一次发送的结果*/
+    enum SEND_RESULT
+    {
+        SEND_DONE = 0,    /* 队列已全部发送完毕*/
+        SEND_AGAIN,       /* 套接字写缓冲已满, 需要等待下一次EPOLLOUT*/
+        SEND_ERROR        /* 发送出错, 应关闭连接*/
+    };
+
+public:
+    out_queue();
+    ~out_queue();
+
+    /* 追加一个内存片段*/
+    bool push_memory( const char *data, size_t len,
+                      segment_release_fn release = NULL, void *arg = NULL );
+    /* 追加一个文件区间片段
+     * @readahead : 大于0时在发送过程中用posix_fadvise(WILLNEED)提前让内核读入后面的数据,
+     *              窗口按每轮(每次EPOLLOUT)实际发出的字节数调整, 不超过该值
+     */
+    bool push_file( int fd, off_t offset, size_t len, size_t readahead = 0,
+                    segment_release_fn release = NULL, void *arg = NULL );
+
+    /* 尽可能多地发送队列中的数据, 直到发送完毕、写缓冲满或出错*/
+    SEND_RESULT send( int sockfd );
+    /* 同上, 但用SSL_write加密后发送(内核没有接管TLS加密时使用)*/
+    SEND_RESULT send_tls( SSL *ssl );
+
+    /* 丢弃队列中所有未发送的片段(会调用各片段的释放回调)*/
+    void clear();
+
+    /* 队列是否为空*/
+    bool empty() const { return m_count == 0; }
+    /* 队列中尚未发送的字节数*/
+    size_t bytes_pending() const { return m_pending; }
+    /* 自上次clear以来已经发送的字节数*/
+    size_t bytes_sent() const { return m_total_sent; }
+
+private:
+    /* 追加片段的公共部分*/
+    out_segment* push_segment();
+    /* 弹出队首片段(已发送完毕)*/
+    void pop_segment();
+    /* 发送队首开始的连续内存片段*/
+    ssize_t send_memory( int sockfd );
+    /* 发送队首的文件片段*/
+    ssize_t send_file( int sockfd );
+    /* 把队首开始的最多len个字节复制到buf中, 返回复制的字节数, 读文件出错返回-1*/
+    ssize_t gather( char *buf, size_t len );
+    /* 将n个已发送字节记到队首的各片段上*/
+    void consume( size_t n );
+    /* 队首是文件片段时, 按本轮发出的字节数round让预读保持在发送位置之前, 每次发送文件数据之前调用*/
+    void readahead( size_t round );
+
+private:
+    out_segment m_segs[ MAX_SEGMENTS ];  /* 环形数组保存片段*/
+    int m_head;                          /* 队首片段的下标*/
+    int m_count;                         /* 队列中的片段数*/
+    size_t m_pending;                    /* 尚未发送的字节数*/
+    size_t m_total_sent;                 /* 已经发送的字节数*/
+    int m_tls_retry;                     /* SSL_write要求重试时上次写的长度, 重试必须写同样的数据*/
+};
+
+#endif
@@ -0,0 +1,63 @@
+/*************************************************************************
+	> File Name: pool_task.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 16时05分41秒
+ ************************************************************************/
+
+#ifndef _POOL_TASK_H
+#define _POOL_TASK_H
+
+#include <stddef.h>
+
+template< typename T > class threadpool;
+template< typename T > class completion_queue;
+class cgi_cache;
+
+/* 线程池和反应堆完成队列中的任务
+ * 线程池的请求队列、完成队列和CGI输出缓存的等待链表都是侵入式的, 链接放在任务对象自身中;
+ * 连接(http_conn)和HTTP/2流的CGI/反向代理作业(h2_job)都从它派生, 共用调度类的线程和反应堆的完成队列。
+ * 任务的完整生命周期: 反应堆交给线程池 -> 工作线程process -> 提交到所属反应堆的完成队列 -> 反应堆on_completion;
+ * 工作线程中途要等待其他任务的结果时把自己挂起(见cgi_cache::acquire), 等到后由resume提交RESUME,
+ * 反应堆再把它交给线程池的SCHED_CGI类, 期间不占用任何线程
+ */
+class pool_task
+{
+public:
+    /* 完成队列中的动作: 把任务重新交给线程池; 其余的动作由派生类自己解释*/
+    static const int RESUME = -1;
+
+public:
+    pool_task()
+        :m_cq_next( NULL ), m_cq_action( 0 ), m_tp_next( NULL ), m_tp_enqueue_ns( 0 ), m_park_next( NULL )
+    {
+    }
+    virtual ~pool_task() {}
+
+    /* 在工作线程中执行任务*/
+    virtual void process() = 0;
+    /* 线程池因过载放弃执行任务时, 由工作线程代替process调用*/
+    virtual void reject() = 0;
+    /* 反应堆从完成队列中取出任务后调用*/
+    virtual void on_completion() = 0;
+    /* 反应堆未能把任务交给线程池(队列已满或过载)时调用*/
+    virtual void reject_inline() = 0;
+    /* 挂起的任务等到了结果(任意线程调用): 以RESUME提交到所属反应堆的完成队列*/
+    virtual void resume() = 0;
+
+protected:
+    friend class threadpool< pool_task >;
+    friend class completion_queue< pool_task >;
+    friend class cgi_cache;
+
+    /* 在完成队列中的链接和下一步动作*/
+    pool_task *m_cq_next;
+    int m_cq_action;
+    /* 在线程池请求队列中的链接和入队时间*/
+    pool_task *m_tp_next;
+    long long m_tp_enqueue_ns;
+    /* 挂起时在等待链表中的链接*/
+    pool_task *m_park_next;
+};
+
+#endif
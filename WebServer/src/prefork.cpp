@@ -0,0 +1,88 @@
+/*************************************************************************
+	> File Name: prefork.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 07时14分20秒
+ ************************************************************************/
+
+#include "./prefork.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+worker_slot *g_worker_slot = NULL;
+
+/* 所有工作进程的槽位: 匿名共享映射, fork出的工作进程(包括重新拉起的)都映射着同一份*/
+static worker_slot *g_slots = NULL;
+static int g_workers = 0;
+
+bool prefork_init( int workers )
+{
+    void *p = mmap( NULL, sizeof( worker_slot ) * workers, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED )
+    {
+        return false;
+    }
+    memset( p, 0, sizeof( worker_slot ) * workers );
+    g_slots = ( worker_slot* )p;
+    g_workers = workers;
+    return true;
+}
+
+worker_slot* prefork_slot( int index )
+{
+    return &g_slots[ index ];
+}
+
+void prefork_attach( int index )
+{
+    g_worker_slot = &g_slots[ index ];
+    /* 上一个工作进程异常退出时没来得及减去的连接数清零*/
+    __atomic_store_n( &g_worker_slot->connections, 0, __ATOMIC_RELAXED );
+}
+
+void prefork_ready()
+{
+    if( g_worker_slot )
+    {
+        __atomic_store_n( &g_worker_slot->ready, 1, __ATOMIC_RELEASE );
+    }
+}
+
+int prefork_status( char *buf, int size )
+{
+    if( ! g_slots || size <= 0 )
+    {
+        return 0;
+    }
+    int len = 0;
+#define PREFORK_APPEND( ... ) \
+    do { \
+        int n = snprintf( buf + len, size - len, __VA_ARGS__ ); \
+        len += n < size - len ? n : size - len - 1; \
+    } while( 0 )
+
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    int total_connections = 0;
+    long long total_requests = 0;
+    PREFORK_APPEND( "%-6s %8s %6s %10s %12s %14s %8s\n", "worker", "pid", "ready", "uptime_s",
+                    "connections", "requests", "restarts" );
+    for( int i = 0; i < g_workers; ++i )
+    {
+        worker_slot *w = &g_slots[ i ];
+        pid_t pid = __atomic_load_n( &w->pid, __ATOMIC_RELAXED );
+        int connections = __atomic_load_n( &w->connections, __ATOMIC_RELAXED );
+        long long requests = __atomic_load_n( &w->requests, __ATOMIC_RELAXED );
+        total_connections += connections;
+        total_requests += requests;
+        PREFORK_APPEND( "%-6d %8d %6s %10lld %12d %14lld %8d\n", i, pid,
+                        __atomic_load_n( &w->ready, __ATOMIC_ACQUIRE ) ? "yes" : "no",
+                        pid ? now.tv_sec - w->started : 0, connections, requests, w->restarts );
+    }
+    PREFORK_APPEND( "%-6s %8s %6s %10s %12d %14lld\n", "total", "", "", "", total_connections, total_requests );
+#undef PREFORK_APPEND
+    return len;
+}
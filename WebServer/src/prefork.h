@@ -0,0 +1,64 @@
+/*************************************************************************
+	> File Name: prefork.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 07时02分45秒
+ ************************************************************************/
+
+#ifndef _PREFORK_H
+#define _PREFORK_H
+
+#include <sys/types.h>
+
+/* prefork模式下最多的工作进程数*/
+#define MAX_WORKER_PROCESSES 128
+/* master进程最多持有的监听套接字数(工作进程数 * 反应堆数), HTTPS的另算*/
+#define MAX_LISTEN_FDS 1024
+
+/* 一个工作进程的统计, 放在master创建的共享内存中
+ * 启动信息由master写入, 计数由工作进程自己原子地更新; 各槽位独占缓存行, 互不干扰
+ */
+struct worker_slot
+{
+    pid_t pid;                 /* 0表示该工作进程没有在运行*/
+    int ready;                 /* 工作进程已经开始accept*/
+    int restarts;              /* 被master重新拉起的次数*/
+    int connections;           /* 当前的连接数*/
+    long long started;         /* 最近一次启动的时间(秒, CLOCK_REALTIME)*/
+    long long requests;        /* 累计应答的请求数, 重新拉起后继续累计*/
+} __attribute__(( aligned( 64 ) ));
+
+/* 本进程的统计槽位, 单进程模式和master进程中为NULL*/
+extern worker_slot *g_worker_slot;
+
+/* master进程在fork工作进程之前创建共享内存, 失败返回false
+ * @workers : 工作进程数
+ */
+bool prefork_init( int workers );
+/* 第index个工作进程的槽位*/
+worker_slot* prefork_slot( int index );
+/* 工作进程启动后调用, 此后的计数记在第index个槽位上*/
+void prefork_attach( int index );
+/* 工作进程的各反应堆都已开始监听*/
+void prefork_ready();
+
+/* 计数, 只在prefork模式的工作进程中生效*/
+static inline void prefork_count_request()
+{
+    if( g_worker_slot )
+    {
+        __atomic_add_fetch( &g_worker_slot->requests, 1, __ATOMIC_RELAXED );
+    }
+}
+static inline void prefork_count_connection( int delta )
+{
+    if( g_worker_slot )
+    {
+        __atomic_add_fetch( &g_worker_slot->connections, delta, __ATOMIC_RELAXED );
+    }
+}
+
+/* 输出各工作进程的统计及其合计, 不是prefork模式时什么都不输出, 返回写入的长度*/
+int prefork_status( char *buf, int size );
+
+#endif
@@ -0,0 +1,466 @@
+/*************************************************************************
+	> File Name: reactor.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 17时21分04秒
+ ************************************************************************/
+#include "./reactor.h"
+#include "./cpu_affinity.h"
+#include "./async_log.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+extern void addfd( int epollfd, int fd, bool one_shot );
+extern void removefd( int epollfd, int fd );
+
+reactor::reactor( int id, threadpool< pool_task > *pool, http_conn **users, int max_fd )
+    :m_id( id ), m_cpu( -1 ), m_epollfd( -1 ), m_listenfd( -1 ), m_tls_listenfd( -1 ), m_backlog( 0 ),
+     m_events( NULL ), m_max_events( 0 ), m_sig_fd( -1 ), m_on_signal( NULL ),
+     m_watch_fd( -1 ), m_on_watch( NULL ), m_drain_deadline( 0 ), m_accept_stopped( false ),
+     m_pool( pool ), m_users( users ), m_max_fd( max_fd ),
+     m_loops( 0 ), m_loop_events( 0 ), m_busy_ns( 0 ), m_busy_max_ns( 0 ), m_accepted( 0 ), m_refused( 0 )
+{
+    m_max_events = current_config()->max_event_number;
+    m_events = new epoll_event[ m_max_events ];
+    /* 本进程的描述符都设置close-on-exec, 热升级exec新程序或fork CGI程序时不会泄漏给它们*/
+    m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    if( m_epollfd < 0 )
+    {
+        throw std::exception();
+    }
+    /* 完成队列的eventfd, 工作线程提交连接时唤醒本反应堆*/
+    addfd( m_epollfd, m_done.fd(), false );
+}
+
+reactor::~reactor()
+{
+    if( m_listenfd >= 0 )
+    {
+        close( m_listenfd );
+    }
+    if( m_tls_listenfd >= 0 )
+    {
+        close( m_tls_listenfd );
+    }
+    close( m_epollfd );
+    delete [] m_events;
+}
+
+long long reactor::now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void reactor::count_loop( int events, long long busy_ns )
+{
+    __atomic_store_n( &m_loops, m_loops + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &m_loop_events, m_loop_events + events, __ATOMIC_RELAXED );
+    __atomic_store_n( &m_busy_ns, m_busy_ns + busy_ns, __ATOMIC_RELAXED );
+    /* 查看时会把它清零, 所以要用原子操作比较后写入*/
+    long long max = __atomic_load_n( &m_busy_max_ns, __ATOMIC_RELAXED );
+    while( busy_ns > max && ! __atomic_compare_exchange_n( &m_busy_max_ns, &max, busy_ns, true,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+    }
+}
+
+int reactor::status_header( char *buf, int size )
+{
+    int n = snprintf( buf, size, "%-8s %12s %12s %14s %10s %10s %10s %10s\n", "reactor", "loops", "events",
+                      "busy_us", "avg_us", "max_us", "accepted", "refused" );
+    return n < size ? n : size - 1;
+}
+
+int reactor::status( char *buf, int size )
+{
+    unsigned long long loops = __atomic_load_n( &m_loops, __ATOMIC_RELAXED );
+    unsigned long long busy_ns = __atomic_load_n( &m_busy_ns, __ATOMIC_RELAXED );
+    long long max_ns = __atomic_exchange_n( &m_busy_max_ns, 0, __ATOMIC_RELAXED );
+    int n = snprintf( buf, size, "%-8d %12llu %12llu %14llu %10llu %10lld %10llu %10llu\n", m_id, loops,
+                      __atomic_load_n( &m_loop_events, __ATOMIC_RELAXED ), busy_ns / 1000,
+                      loops ? busy_ns / loops / 1000 : 0, max_ns / 1000,
+                      __atomic_load_n( &m_accepted, __ATOMIC_RELAXED ),
+                      __atomic_load_n( &m_refused, __ATOMIC_RELAXED ) );
+    return n < size ? n : size - 1;
+}
+
+/* 创建监听套接字, 绑定并监听, 然后加入本反应堆的epoll事件表*/
+bool reactor::listen_on( const server_config *cfg, int cpu, bool reuseport, int inherited_fd )
+{
+    m_cpu = cpu;
+    m_backlog = cfg->listen_backlog;
+    m_listenfd = open_listener( cfg, cfg->port, reuseport, inherited_fd );
+    return m_listenfd >= 0;
+}
+
+bool reactor::listen_tls_on( const server_config *cfg, bool reuseport, int inherited_fd )
+{
+    m_tls_listenfd = open_listener( cfg, cfg->tls_port, reuseport, inherited_fd );
+    return m_tls_listenfd >= 0;
+}
+
+int reactor::open_listener( const server_config *cfg, int port, bool reuseport, int inherited_fd )
+{
+    int cpu = m_cpu;
+
+    /* 继承来的套接字已经绑定并处于监听状态, 已排队的连接也都在它上面, 不能重建*/
+    if( inherited_fd >= 0 )
+    {
+        fcntl( inherited_fd, F_SETFD, FD_CLOEXEC );
+        if( cfg->incoming_cpu && cpu >= 0 )
+        {
+            setsockopt( inherited_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof( cpu ) );
+        }
+        listen( inherited_fd, m_backlog );
+        addfd( m_epollfd, inherited_fd, false );
+        return inherited_fd;
+    }
+
+    int listenfd = create_listener( cfg, port, reuseport, cpu, m_backlog );
+    if( listenfd >= 0 )
+    {
+        addfd( m_epollfd, listenfd, false );
+    }
+    return listenfd;
+}
+
+int reactor::create_listener( const server_config *cfg, int port, bool reuseport, int cpu, int backlog )
+{
+    int listenfd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( listenfd < 0 )
+    {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    bzero( &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, cfg->ip, &address.sin_addr );
+    address.sin_port = htons( port );
+
+    int op = 1;
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof( op ) );
+    if( reuseport )
+    {
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &op, sizeof( op ) );
+    }
+    /* 多个反应堆共享端口时, 内核优先把新连接交给SO_INCOMING_CPU与收包CPU一致的监听套接字,
+     * 这样连接从软中断到accept再到处理都留在同一个CPU上
+     */
+    if( cfg->incoming_cpu && cpu >= 0 )
+    {
+        setsockopt( listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof( cpu ) );
+    }
+
+    /* 绑定监听套接字到指定地址和端口*/
+    if( bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0
+        || listen( listenfd, backlog ) < 0 )
+    {
+        perror( "bind:" );
+        close( listenfd );
+        return -1;
+    }
+    return listenfd;
+}
+
+void reactor::set_signal_pipe( int fd, void ( *on_signal )( int sig ) )
+{
+    m_sig_fd = fd;
+    m_on_signal = on_signal;
+    addfd( m_epollfd, fd, false );
+}
+
+void reactor::set_watch_fd( int fd, bool ( *on_ready )( int fd ) )
+{
+    m_watch_fd = fd;
+    m_on_watch = on_ready;
+    addfd( m_epollfd, fd, false );
+}
+
+void* reactor::thread_entry( void *arg )
+{
+    reactor *r = ( reactor* )arg;
+    r->run();
+    return r;
+}
+
+bool reactor::start()
+{
+    return pthread_create( &m_thread, NULL, thread_entry, this ) == 0;
+}
+
+void reactor::join()
+{
+    pthread_join( m_thread, NULL );
+}
+
+/* 监听套接字是边沿触发的, 必须一直accept到EAGAIN, 否则同时到达的连接会被遗漏*/
+void reactor::handle_accept( int listenfd )
+{
+    bool tls = listenfd == m_tls_listenfd;
+    while( true )
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept4( listenfd, ( struct sockaddr* )&client_address,
+                              &client_addrlength, SOCK_CLOEXEC );
+        if ( connfd < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            {
+                log_error( "reactor %d accept: %m", m_id );
+            }
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+        if( http_conn::m_user_count >= m_max_fd || connfd >= m_max_fd )
+        {
+            http_conn::refuse( connfd, tls );
+            __atomic_store_n( &m_refused, m_refused + 1, __ATOMIC_RELAXED );
+            continue;
+        }
+
+        /* 从本反应堆的连接池中取一个连接对象, 初始化客户连接*/
+        http_conn *conn = m_conns.get();
+        if( ! conn )
+        {
+            http_conn::refuse( connfd, tls );
+            __atomic_store_n( &m_refused, m_refused + 1, __ATOMIC_RELAXED );
+            continue;
+        }
+        __atomic_store_n( &m_accepted, m_accepted + 1, __ATOMIC_RELAXED );
+        m_users[ connfd ] = conn;
+        conn->init( connfd, client_address, m_epollfd, m_id, &m_conns, &m_done, tls );
+    }
+}
+
+/* 读出信号管道中所有的信号并逐个处理*/
+void reactor::handle_signal()
+{
+    char signals[ 1024 ];
+    int ret = recv( m_sig_fd, signals, sizeof( signals ), 0 );
+    for( int i = 0; i < ret; ++i )
+    {
+        m_on_signal( signals[ i ] );
+    }
+}
+
+/* 批量执行工作线程提交的动作, 一次eventfd唤醒可以取走多个任务*/
+void reactor::handle_completions()
+{
+    pool_task *task = m_done.drain();
+    while( task )
+    {
+        /* 执行动作可能关闭连接并把对象归还连接池, 先取出下一个*/
+        pool_task *next = completion_queue< pool_task >::next( task );
+        /* 挂起的任务等到了结果, 与新请求一样交给线程池, 进不去时同样直接拒绝*/
+        if( completion_queue< pool_task >::action( task ) == pool_task::RESUME )
+        {
+            if( ! m_pool->append( task, http_conn::SCHED_CGI ) )
+            {
+                task->reject_inline();
+            }
+        }
+        else
+        {
+            task->on_completion();
+        }
+        task = next;
+    }
+}
+
+void reactor::begin_drain( long long deadline_ms )
+{
+    __atomic_store_n( &m_drain_deadline, deadline_ms, __ATOMIC_RELEASE );
+    /* 本反应堆可能正阻塞在epoll_wait中, 借完成队列的eventfd唤醒它*/
+    m_done.wake();
+}
+
+/* 关闭空闲连接时对连接池中每个对象调用*/
+static void close_idle( http_conn *conn )
+{
+    conn->close_if_idle();
+}
+
+/* 优雅退出
+ * 第一次调用时关闭监听套接字(新进程持有同一个套接字, 继续accept), 并关闭等待下一个请求的
+ * 长连接; 其余连接的应答带Connection: close, 发送完后自行关闭
+ */
+bool reactor::drain()
+{
+    if( ! m_accept_stopped )
+    {
+        m_accept_stopped = true;
+        if( m_listenfd >= 0 )
+        {
+            removefd( m_epollfd, m_listenfd );
+            m_listenfd = -1;
+        }
+        if( m_tls_listenfd >= 0 )
+        {
+            removefd( m_epollfd, m_tls_listenfd );
+            m_tls_listenfd = -1;
+        }
+        m_conns.visit( close_idle );
+    }
+    return http_conn::m_user_count == 0 || now_ms() >= m_drain_deadline;
+}
+
+/* 重新加载配置后, 调整本反应堆的listen队列长度和事件数组大小*/
+void reactor::apply_config( const server_config *cfg )
+{
+    if( cfg->listen_backlog != m_backlog && m_listenfd >= 0 )
+    {
+        /* 对已经处于监听状态的套接字再次调用listen可以修改其队列长度*/
+        m_backlog = cfg->listen_backlog;
+        listen( m_listenfd, m_backlog );
+        if( m_tls_listenfd >= 0 )
+        {
+            listen( m_tls_listenfd, m_backlog );
+        }
+    }
+    if( cfg->max_event_number != m_max_events )
+    {
+        delete [] m_events;
+        m_max_events = cfg->max_event_number;
+        m_events = new epoll_event[ m_max_events ];
+    }
+}
+
+/* 事件循环*/
+void reactor::run()
+{
+    /* 先绑定CPU, 之后连接池的内存才会分配在本地NUMA节点上*/
+    if( m_cpu >= 0 )
+    {
+        pin_self_to_cpus( &m_cpu, 1 );
+    }
+
+    while( true )
+    {
+        /* 优雅退出期间定期醒来检查连接是否都已关闭*/
+        long long deadline = __atomic_load_n( &m_drain_deadline, __ATOMIC_ACQUIRE );
+        if( deadline && drain() )
+        {
+            break;
+        }
+        int number = epoll_wait( m_epollfd, m_events, m_max_events, deadline ? 100 : -1 );
+        if ( ( number < 0 ) && ( errno != EINTR ))
+        {
+            log_error( "reactor %d epoll_wait: %m", m_id );
+            break;
+        }
+        long long t_begin = now_ns();
+
+        /* 内联快速路径只对命中完整响应缓存的请求有意义*/
+        const server_config *cfg = current_config();
+        bool inline_enabled = cfg->inline_fast_path && cfg->cache_enable;
+
+        for( int i = 0; i < number; i++ )
+        {
+            int sockfd = m_events[i].data.fd;
+
+            /* 有新连接到来*/
+            if( sockfd == m_listenfd || sockfd == m_tls_listenfd )
+            {
+                handle_accept( sockfd );
+            }
+
+            /* 有信号到来*/
+            else if( ( sockfd == m_sig_fd ) && ( m_events[i].events & EPOLLIN ) )
+            {
+                handle_signal();
+            }
+
+            /* 工作线程处理完了一批连接*/
+            else if( sockfd == m_done.fd() )
+            {
+                handle_completions();
+            }
+
+            /* 额外监视的描述符可读*/
+            else if( sockfd == m_watch_fd )
+            {
+                if( ! m_on_watch( sockfd ) )
+                {
+                    removefd( m_epollfd, sockfd );
+                    m_watch_fd = -1;
+                }
+            }
+
+            /* TLS握手完成之前, 读写事件都用来推进握手*/
+            else if( m_users[ sockfd ]->handshaking() )
+            {
+                if( ! m_users[ sockfd ]->handshake() )
+                {
+                    m_users[ sockfd ]->close_conn();
+                }
+            }
+
+            /* 客户端有数据到来(TLS连接也可能是OpenSSL中还有没读走的数据)*/
+            else if( ( m_events[i].events & EPOLLIN ) || m_users[ sockfd ]->input_buffered() )
+            {
+                /* 根据读的结果，决定是将任务按其调度类添加到线程池，还是关闭连接*/
+                http_conn *conn = m_users[ sockfd ];
+                if( conn->read_request() )
+                {
+                    http_conn::SCHED_CLASS cls = conn->classify();
+                    /* 静态请求先尝试在本线程中直接应答, 不能内联完成的再交给线程池*/
+                    if( cls == http_conn::SCHED_STATIC && inline_enabled && conn->process_inline() )
+                    {
+                        continue;
+                    }
+                    /* 队列已满或过载时不能把连接晾在那里(EPOLLONESHOT已经失效), 直接应答503*/
+                    conn->enter_worker();
+                    if( ! m_pool->append( conn, cls ) )
+                    {
+                        conn->reject_inline();
+                    }
+                }
+                else
+                {
+                    conn->close_conn();
+                }
+            }
+
+            /* 可写*/
+            else if( m_events[ i ].events & EPOLLOUT )
+            {
+                /* 客户端连接已经可写，这时，将对客户端的响应写到客户端连接中*/
+                if( !m_users[ sockfd ]->write_response() )
+                {
+                    /* 根据写的结果，决定是否关闭连接*/
+                    m_users[ sockfd ]->close_conn();
+                }
+            }
+
+            /* 如果有异常发生, 直接关闭连接*/
+            else
+            {
+                m_users[ sockfd ]->close_conn();
+            }
+        }
+
+        apply_config( current_config() );
+        count_loop( number > 0 ? number : 0, now_ns() - t_begin );
+    }
+}
@@ -0,0 +1,130 @@
+/*************************************************************************
+	> File Name: reactor.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 16时58分31秒
+ ************************************************************************/
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "./threadpool.h"
+#include "./http_conn.h"
+#include "./conn_pool.h"
+#include "./completion_queue.h"
+#include "./server_config.h"
+
+/* 反应堆: 一个事件循环线程
+ * 每个反应堆有自己的epoll内核事件表和监听套接字(多个反应堆时使用SO_REUSEPORT),
+ * 可以绑定到一个CPU上, 并在该CPU上设置SO_INCOMING_CPU, 使内核把在该CPU上收到的
+ * 新连接交给这个反应堆; 它接受的连接对象来自它私有的、分配在本地NUMA节点上的连接池。
+ * 连接的epoll注册和关闭只由接受它的反应堆执行, 工作线程通过完成队列把连接交还回来
+ */
+class reactor
+{
+public:
+    /* @id : 反应堆编号, 0号反应堆运行在主线程中并负责处理信号
+     * @pool : 工作线程池
+     * @users : 以描述符为下标的连接表, 所有反应堆共享(描述符在进程内唯一)
+     * @max_fd : 连接表的大小
+     */
+    reactor( int id, threadpool< pool_task > *pool, http_conn **users, int max_fd );
+    ~reactor();
+
+    /* 创建并监听本反应堆的监听套接字
+     * @cpu : 本反应堆绑定的CPU, -1表示不绑定
+     * @reuseport : 是否与其他反应堆共享端口(SO_REUSEPORT)
+     * @inherited_fd : 热升级时从旧进程继承的监听套接字, -1表示新建
+     */
+    bool listen_on( const server_config *cfg, int cpu, bool reuseport, int inherited_fd = -1 );
+    /* 再监听HTTPS端口(tls.port), 在listen_on之后调用, 参数含义相同*/
+    bool listen_tls_on( const server_config *cfg, bool reuseport, int inherited_fd = -1 );
+    /* 本反应堆的监听套接字, 热升级时传给新进程*/
+    int listen_fd() const  { return m_listenfd; }
+    int tls_listen_fd() const  { return m_tls_listenfd; }
+
+    /* 设置信号管道, 管道中每读到一个信号值就调用一次on_signal*/
+    void set_signal_pipe( int fd, void ( *on_signal )( int sig ) );
+    /* 监视一个描述符, 可读时调用on_ready; on_ready返回false时停止监视并关闭该描述符*/
+    void set_watch_fd( int fd, bool ( *on_ready )( int fd ) );
+
+    /* 开始优雅退出(可以在任意线程中调用): 停止accept, 关闭空闲的长连接, 正在处理的请求
+     * 应答完后关闭连接; 所有连接都关闭或到达deadline_ms(单调时钟, 毫秒)时事件循环返回
+     */
+    void begin_drain( long long deadline_ms );
+
+    /* 在新线程中运行事件循环*/
+    bool start();
+    /* 在当前线程中运行事件循环*/
+    void run();
+    /* 等待start启动的事件循环线程结束*/
+    void join();
+
+    /* 输出本反应堆的事件循环统计(一行, 各列见status_header), 返回写入的长度
+     * 单轮处理的最长时间在每次查看后清零, 所以它是上次查看以来的最大值
+     */
+    int status( char *buf, int size );
+    static int status_header( char *buf, int size );
+
+    /* 单调时钟, 毫秒*/
+    static long long now_ms();
+    /* 创建绑定并监听好的套接字, 不加入任何事件表, 失败返回-1
+     * prefork模式下由master进程创建, 工作进程以继承的方式接管
+     * @cpu : 设置SO_INCOMING_CPU的CPU, -1表示不设置
+     */
+    static int create_listener( const server_config *cfg, int port, bool reuseport, int cpu, int backlog );
+
+private:
+    static void* thread_entry( void *arg );
+    /* 创建监听套接字并加入事件表, 或者接管继承来的监听套接字, 失败返回-1*/
+    int open_listener( const server_config *cfg, int port, bool reuseport, int inherited_fd );
+    /* 接受监听套接字上所有已完成握手的连接*/
+    void handle_accept( int listenfd );
+    /* 处理信号管道中的信号*/
+    void handle_signal();
+    /* 执行工作线程提交到完成队列中的动作*/
+    void handle_completions();
+    /* 把重新加载后的配置应用到本反应堆(listen队列长度、事件数组大小)*/
+    void apply_config( const server_config *cfg );
+    /* 优雅退出时关闭监听套接字和空闲连接, 返回事件循环是否应该结束*/
+    bool drain();
+    /* 记下一轮事件循环: 处理了events个事件, 用了busy_ns纳秒*/
+    void count_loop( int events, long long busy_ns );
+
+private:
+    int m_id;                        /* 反应堆编号*/
+    int m_cpu;                       /* 绑定的CPU, -1表示不绑定*/
+    int m_epollfd;                   /* 本反应堆的epoll内核事件表*/
+    int m_listenfd;                  /* 本反应堆的监听套接字*/
+    int m_tls_listenfd;              /* HTTPS监听套接字, -1表示没有*/
+    int m_backlog;                   /* 当前的listen队列长度*/
+    epoll_event *m_events;           /* epoll_wait返回的事件*/
+    int m_max_events;                /* 事件数组的大小*/
+
+    int m_sig_fd;                    /* 信号管道的读端, -1表示不处理信号*/
+    void ( *m_on_signal )( int sig );
+    int m_watch_fd;                  /* 额外监视的描述符, -1表示没有*/
+    bool ( *m_on_watch )( int fd );
+
+    long long m_drain_deadline;      /* 优雅退出的截止时间, 0表示没有在退出*/
+    bool m_accept_stopped;           /* 是否已经停止accept*/
+
+    threadpool< pool_task > *m_pool;
+    http_conn **m_users;
+    int m_max_fd;
+    conn_pool< http_conn > m_conns;  /* 本反应堆私有的连接对象池*/
+    completion_queue< pool_task > m_done;  /* 工作线程处理完的任务*/
+    pthread_t m_thread;
+
+    /* 事件循环的统计, 只由本反应堆线程更新, 状态页在其他线程中读取*/
+    unsigned long long m_loops;      /* epoll_wait返回的次数*/
+    unsigned long long m_loop_events;
+    unsigned long long m_busy_ns;    /* 处理事件的累计时间(不含阻塞在epoll_wait中的时间)*/
+    long long m_busy_max_ns;         /* 上次查看以来单轮处理的最长时间*/
+    unsigned long long m_accepted;
+    unsigned long long m_refused;    /* 连接数达到max_fd或连接池耗尽时拒绝的连接*/
+};
+
+#endif
@@ -0,0 +1,486 @@
+/*************************************************************************
+	> File Name: resp_cache.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 14时31分02秒
+ ************************************************************************/
+#include "./resp_cache.h"
+#include "./async_log.h"
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* 缓存响应的头部格式, 与http_conn::process_write生成的200响应一致*/
+static const char *cache_header_format = "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n";
+
+resp_cache::resp_cache()
+    :m_enabled( false ), m_max_file_size( 0 ), m_max_total_bytes( 0 ), m_total_bytes( 0 ),
+     m_hand( NULL ), m_generation( 0 ), m_inotify_fd( -1 )
+{
+    memset( m_buckets, 0, sizeof( m_buckets ) );
+}
+
+resp_cache::~resp_cache()
+{
+    if( m_inotify_fd >= 0 )
+    {
+        close( m_inotify_fd );
+    }
+}
+
+/* 初始化缓存, 开始监听根目录, 并根据需要预热*/
+bool resp_cache::init( const char *root, size_t max_file_size, size_t max_total_bytes, bool warm_up )
+{
+    if( ! root || max_file_size == 0 || max_total_bytes == 0 )
+    {
+        return false;
+    }
+    m_root = root;
+    m_max_file_size = max_file_size;
+    m_max_total_bytes = max_total_bytes;
+
+    /* 没有inotify就无法保证缓存的一致性, 此时不启用缓存*/
+    m_inotify_fd = inotify_init1( IN_CLOEXEC );
+    if( m_inotify_fd < 0 )
+    {
+        perror( "inotify_init1:" );
+        return false;
+    }
+    add_watch_recursive( m_root.c_str() );
+
+    pthread_t tid;
+    if( pthread_create( &tid, NULL, watcher, this ) != 0 )
+    {
+        return false;
+    }
+    pthread_detach( tid );
+    m_enabled = true;
+
+    if( warm_up )
+    {
+        warm_dir( m_root.c_str() );
+    }
+    printf( "response cache: %lu bytes cached at startup\n", ( unsigned long )m_total_bytes );
+    return true;
+}
+
+/* 调整大小限制*/
+void resp_cache::configure( size_t max_file_size, size_t max_total_bytes )
+{
+    if( max_file_size == 0 || max_total_bytes == 0 )
+    {
+        return;
+    }
+    m_lock.lock();
+    m_max_file_size = max_file_size;
+    m_max_total_bytes = max_total_bytes;
+    evict_locked( 0 );
+    m_lock.unlock();
+}
+
+/* FNV-1a哈希, 连接方式也参与计算*/
+unsigned int resp_cache::hash_key( const char *path, bool linger )
+{
+    unsigned int h = 2166136261u;
+    for( const char *p = path; *p; ++p )
+    {
+        h ^= ( unsigned char )*p;
+        h *= 16777619u;
+    }
+    h ^= linger ? 1 : 0;
+    h *= 16777619u;
+    return h;
+}
+
+cache_entry* resp_cache::find_locked( const char *path, bool linger, unsigned int hash )
+{
+    for( cache_entry *e = m_buckets[ hash % BUCKETS ]; e; e = e->hnext )
+    {
+        if( e->hash == hash && e->linger == linger && strcmp( e->key, path ) == 0 )
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* 查找缓存, 命中时设置CLOCK访问位并增加引用计数*/
+cache_entry* resp_cache::lookup( const char *path, bool linger )
+{
+    if( ! m_enabled )
+    {
+        return NULL;
+    }
+    unsigned int hash = hash_key( path, linger );
+    m_lock.lock();
+    cache_entry *e = find_locked( path, linger, hash );
+    if( e )
+    {
+        e->referenced = true;
+        __sync_add_and_fetch( &e->refcnt, 1 );
+    }
+    m_lock.unlock();
+    return e;
+}
+
+/* 释放一个引用, 最后一个引用释放时回收内存*/
+void resp_cache::put( cache_entry *e )
+{
+    if( __sync_sub_and_fetch( &e->refcnt, 1 ) == 0 )
+    {
+        munmap( e->data, e->map_len );
+        free( e->key );
+        delete e;
+    }
+}
+
+void resp_cache::release( void *arg )
+{
+    put( ( cache_entry* )arg );
+}
+
+/* 将条目从哈希表和CLOCK链表中摘除, 并释放缓存本身持有的引用*/
+void resp_cache::unlink_locked( cache_entry *e )
+{
+    cache_entry **pp = &m_buckets[ e->hash % BUCKETS ];
+    while( *pp && *pp != e )
+    {
+        pp = &( *pp )->hnext;
+    }
+    if( *pp )
+    {
+        *pp = e->hnext;
+    }
+
+    if( e->cnext == e )
+    {
+        m_hand = NULL;
+    }
+    else
+    {
+        e->cprev->cnext = e->cnext;
+        e->cnext->cprev = e->cprev;
+        if( m_hand == e )
+        {
+            m_hand = e->cnext;
+        }
+    }
+    m_total_bytes -= e->len;
+    put( e );
+}
+
+/* CLOCK淘汰: 访问位为真的条目获得第二次机会, 直到腾出need字节*/
+void resp_cache::evict_locked( size_t need )
+{
+    while( m_hand && m_total_bytes + need > m_max_total_bytes )
+    {
+        cache_entry *e = m_hand;
+        if( e->referenced )
+        {
+            e->referenced = false;
+            m_hand = e->cnext;
+        }
+        else
+        {
+            unlink_locked( e );
+        }
+    }
+}
+
+/* 渲染并插入一条完整响应*/
+cache_entry* resp_cache::insert( const char *path, bool linger, const char *body, size_t body_len,
+                                 unsigned int gen )
+{
+    if( ! m_enabled || body_len == 0 || body_len > m_max_file_size )
+    {
+        return NULL;
+    }
+
+    char header[ 128 ];
+    int header_len = snprintf( header, sizeof( header ), cache_header_format,
+                               ( unsigned long )body_len, linger ? "keep-alive" : "close" );
+    size_t len = header_len + body_len;
+    if( len > m_max_total_bytes )
+    {
+        return NULL;
+    }
+
+    /* 在锁外完成渲染, 渲染完后将映射区设为只读*/
+    long page = sysconf( _SC_PAGESIZE );
+    size_t map_len = ( len + page - 1 ) / page * page;
+    char *data = ( char* )mmap( NULL, map_len, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( data == MAP_FAILED )
+    {
+        return NULL;
+    }
+    memcpy( data, header, header_len );
+    memcpy( data + header_len, body, body_len );
+    mprotect( data, map_len, PROT_READ );
+
+    cache_entry *e = new cache_entry;
+    e->key = strdup( path );
+    e->hash = hash_key( path, linger );
+    e->linger = linger;
+    e->data = data;
+    e->len = len;
+    e->header_len = header_len;
+    e->map_len = map_len;
+    e->refcnt = 2;          /* 缓存一个, 调用者一个*/
+    e->referenced = true;
+
+    m_lock.lock();
+    /* 读取文件期间发生过失效事件, 内容可能已经过期*/
+    cache_entry *old = find_locked( path, linger, e->hash );
+    if( gen != m_generation || old )
+    {
+        if( old )
+        {
+            old->referenced = true;
+            __sync_add_and_fetch( &old->refcnt, 1 );
+        }
+        m_lock.unlock();
+        e->refcnt = 1;
+        put( e );
+        return old;
+    }
+
+    evict_locked( len );
+    e->hnext = m_buckets[ e->hash % BUCKETS ];
+    m_buckets[ e->hash % BUCKETS ] = e;
+    if( m_hand )
+    {
+        /* 插入到CLOCK指针之前, 即最后才会被扫描到*/
+        e->cnext = m_hand;
+        e->cprev = m_hand->cprev;
+        m_hand->cprev->cnext = e;
+        m_hand->cprev = e;
+    }
+    else
+    {
+        e->cnext = e->cprev = e;
+        m_hand = e;
+    }
+    m_total_bytes += len;
+    m_lock.unlock();
+    return e;
+}
+
+/* 让文件对应的两种连接方式的缓存都失效*/
+void resp_cache::invalidate( const char *path )
+{
+    m_lock.lock();
+    __sync_add_and_fetch( &m_generation, 1 );
+    for( int linger = 0; linger < 2; ++linger )
+    {
+        cache_entry *e = find_locked( path, linger, hash_key( path, linger ) );
+        if( e )
+        {
+            unlink_locked( e );
+        }
+    }
+    m_lock.unlock();
+}
+
+/* 让所有条目失效*/
+void resp_cache::flush()
+{
+    m_lock.lock();
+    __sync_add_and_fetch( &m_generation, 1 );
+    while( m_hand )
+    {
+        unlink_locked( m_hand );
+    }
+    m_lock.unlock();
+}
+
+/* 读取一个文件并插入缓存*/
+void resp_cache::load_file( const char *path )
+{
+    struct stat st;
+    if( stat( path, &st ) < 0 || ! S_ISREG( st.st_mode ) || ! ( st.st_mode & S_IROTH )
+        || st.st_size == 0 || ( size_t )st.st_size > m_max_file_size )
+    {
+        return;
+    }
+
+    unsigned int gen = m_generation;
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return;
+    }
+    char *body = ( char* )malloc( st.st_size );
+    ssize_t have_read = 0, ret = 0;
+    while( body && have_read < st.st_size
+           && ( ret = read( fd, body + have_read, st.st_size - have_read ) ) > 0 )
+    {
+        have_read += ret;
+    }
+    close( fd );
+
+    if( body && have_read == st.st_size )
+    {
+        for( int linger = 0; linger < 2; ++linger )
+        {
+            cache_entry *e = insert( path, linger, body, have_read, gen );
+            if( e )
+            {
+                put( e );
+            }
+        }
+    }
+    free( body );
+}
+
+/* 递归预热目录*/
+void resp_cache::warm_dir( const char *dir )
+{
+    DIR *dp = opendir( dir );
+    if( ! dp )
+    {
+        return;
+    }
+    struct dirent *ent;
+    while( ( ent = readdir( dp ) ) != NULL && m_total_bytes < m_max_total_bytes )
+    {
+        if( ent->d_name[ 0 ] == '.' )
+        {
+            continue;
+        }
+        std::string path = std::string( dir ) + "/" + ent->d_name;
+        struct stat st;
+        if( stat( path.c_str(), &st ) < 0 )
+        {
+            continue;
+        }
+        if( S_ISDIR( st.st_mode ) )
+        {
+            warm_dir( path.c_str() );
+        }
+        else
+        {
+            load_file( path.c_str() );
+        }
+    }
+    closedir( dp );
+}
+
+/* 递归为目录及其子目录添加inotify监视*/
+void resp_cache::add_watch_recursive( const char *dir )
+{
+    int wd = inotify_add_watch( m_inotify_fd, dir,
+                                IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF );
+    if( wd < 0 )
+    {
+        return;
+    }
+    m_lock.lock();
+    m_watches[ wd ] = dir;
+    m_lock.unlock();
+
+    DIR *dp = opendir( dir );
+    if( ! dp )
+    {
+        return;
+    }
+    struct dirent *ent;
+    while( ( ent = readdir( dp ) ) != NULL )
+    {
+        if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+        {
+            continue;
+        }
+        std::string path = std::string( dir ) + "/" + ent->d_name;
+        struct stat st;
+        if( stat( path.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ) )
+        {
+            add_watch_recursive( path.c_str() );
+        }
+    }
+    closedir( dp );
+}
+
+void* resp_cache::watcher( void *arg )
+{
+    resp_cache *cache = ( resp_cache* )arg;
+    cache->watch_loop();
+    return cache;
+}
+
+/* inotify事件循环: 文件变化时让缓存失效, 新建的子目录加入监视*/
+void resp_cache::watch_loop()
+{
+    char buf[ 16384 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+    while( true )
+    {
+        ssize_t len = read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            log_error( "inotify read: %m" );
+            break;
+        }
+
+        for( char *p = buf; p < buf + len; )
+        {
+            struct inotify_event *ev = ( struct inotify_event* )p;
+            p += sizeof( struct inotify_event ) + ev->len;
+
+            /* 事件队列溢出, 丢失了事件, 只能让所有条目失效*/
+            if( ev->mask & IN_Q_OVERFLOW )
+            {
+                flush();
+                continue;
+            }
+
+            m_lock.lock();
+            std::map< int, std::string >::iterator it = m_watches.find( ev->wd );
+            if( it == m_watches.end() )
+            {
+                m_lock.unlock();
+                continue;
+            }
+            std::string path = it->second;
+            if( ev->mask & IN_IGNORED )
+            {
+                m_watches.erase( it );
+            }
+            m_lock.unlock();
+
+            if( ev->len == 0 )
+            {
+                continue;
+            }
+            path += "/";
+            path += ev->name;
+
+            if( ( ev->mask & IN_ISDIR ) && ( ev->mask & ( IN_CREATE | IN_MOVED_TO ) ) )
+            {
+                add_watch_recursive( path.c_str() );
+            }
+            /* 整个子目录被删除或移走, 其下的条目逐个失效代价太大, 直接清空缓存*/
+            else if( ev->mask & IN_ISDIR )
+            {
+                flush();
+            }
+            else
+            {
+                invalidate( path.c_str() );
+            }
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/*************************************************************************
+	> File Name: resp_cache.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 14时05分37秒
+ ************************************************************************/
+
+#ifndef _RESP_CACHE_H
+#define _RESP_CACHE_H
+
+#include <map>
+#include <string>
+#include <stddef.h>
+#include "./locker.h"
+
+/* 一条缓存的完整响应: 状态行、头部和消息体连续存放在同一块只读内存中*/
+struct cache_entry
+{
+    cache_entry *hnext;     /* 哈希桶链表*/
+    cache_entry *cprev;     /* CLOCK环形链表*/
+    cache_entry *cnext;
+    char *key;              /* 文件的完整路径*/
+    unsigned int hash;      /* key和连接方式的哈希值*/
+    bool linger;            /* 响应头中的Connection是否为keep-alive*/
+    char *data;             /* 序列化好的完整响应(只读映射)*/
+    size_t len;             /* 完整响应的长度*/
+    size_t header_len;      /* 状态行和头部的长度, 消息体紧随其后*/
+    size_t map_len;         /* 映射区的长度(按页对齐)*/
+    int refcnt;             /* 引用计数: 缓存本身持有一个引用, 每个正在发送它的连接各持有一个*/
+    bool referenced;        /* CLOCK算法的访问位*/
+};
+
+/* 热点小文件的完整响应缓存
+ * 命中时只需把缓存条目作为一个内存片段交给输出队列, 一次send即可完成整个响应;
+ * 总字节数有上限, 用CLOCK算法淘汰; 通过inotify监听网站根目录, 文件被修改、删除
+ * 或移动时立即让对应条目失效
+ */
+class resp_cache
+{
+public:
+    resp_cache();
+    ~resp_cache();
+
+    /* 初始化缓存
+     * @root : 网站根目录
+     * @max_file_size : 允许缓存的最大文件大小
+     * @max_total_bytes : 缓存占用的总字节数上限
+     * @warm_up : 是否在启动时预先加载根目录下的小文件
+     */
+    bool init( const char *root, size_t max_file_size, size_t max_total_bytes, bool warm_up );
+
+    /* 调整缓存的大小限制(重新加载配置时调用), 超出新上限的部分立即淘汰*/
+    void configure( size_t max_file_size, size_t max_total_bytes );
+
+    /* 缓存是否已启用*/
+    bool enabled() const { return m_enabled; }
+    /* 允许缓存的最大文件大小*/
+    size_t max_file_size() const { return m_max_file_size; }
+
+    /* 查找缓存, 命中时返回的条目已增加引用计数, 用完后须调用release*/
+    cache_entry* lookup( const char *path, bool linger );
+
+    /* 取得当前的失效代数, 在读取文件之前记录, 插入时用来判断文件是否已经变化*/
+    unsigned int generation() const { return m_generation; }
+
+    /* 将文件内容渲染成完整响应并插入缓存。
+     * 如果在gen之后发生过失效事件，说明读到的内容可能已过期，则放弃插入。
+     * 成功时返回已增加引用计数的条目
+     */
+    cache_entry* insert( const char *path, bool linger, const char *body, size_t body_len,
+                         unsigned int gen );
+
+    /* 让某个文件对应的缓存失效*/
+    void invalidate( const char *path );
+    /* 让所有条目失效*/
+    void flush();
+
+    /* 释放条目的一个引用(可以直接作为输出队列片段的释放回调)*/
+    static void release( void *arg );
+
+private:
+    static unsigned int hash_key( const char *path, bool linger );
+    cache_entry* find_locked( const char *path, bool linger, unsigned int hash );
+    void unlink_locked( cache_entry *e );
+    void evict_locked( size_t need );
+    static void put( cache_entry *e );
+
+    /* 预热: 递归加载目录下的小文件*/
+    void warm_dir( const char *dir );
+    void load_file( const char *path );
+
+    /* inotify相关*/
+    void add_watch_recursive( const char *dir );
+    static void* watcher( void *arg );
+    void watch_loop();
+
+private:
+    static const int BUCKETS = 4096;
+
+    bool m_enabled;
+    std::string m_root;
+    size_t m_max_file_size;
+    size_t m_max_total_bytes;
+    size_t m_total_bytes;
+
+    cache_entry *m_buckets[ BUCKETS ];  /* 哈希表*/
+    cache_entry *m_hand;                /* CLOCK指针*/
+    locker m_lock;                      /* 保护哈希表和CLOCK链表*/
+    volatile unsigned int m_generation; /* 每次失效事件加一*/
+
+    int m_inotify_fd;
+    std::map< int, std::string > m_watches;  /* inotify监视描述符 -> 目录路径*/
+};
+
+#endif
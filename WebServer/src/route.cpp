@@ -0,0 +1,301 @@
+/*************************************************************************
+	> File Name: route.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 01时52分19秒
+ ************************************************************************/
+#include "./route.h"
+#include <string.h>
+#include <algorithm>
+
+/* 查找时记录的前缀候选的最大个数(路径上有前缀路由的结点数), 超过时只保留最长的几个*/
+#define MAX_PREFIX_DEPTH 32
+
+route_table::route_table()
+    :m_ext_mask( 0 )
+{
+}
+
+bool route_table::add( int match, const char *key, const route &r )
+{
+    if( match == ROUTE_EXT )
+    {
+        /* 扩展名可以写成".cgi"或"cgi"*/
+        if( key[ 0 ] == '.' )
+        {
+            key++;
+        }
+        if( key[ 0 ] == '\0' || strchr( key, '/' ) )
+        {
+            return false;
+        }
+    }
+    else if( key[ 0 ] != '/' )
+    {
+        return false;
+    }
+    if( strlen( key ) >= sizeof( m_pending[ 0 ].key ) )
+    {
+        return false;
+    }
+
+    int index = m_routes.size();
+    m_routes.push_back( r );
+    m_routes[ index ].next = -1;
+    for( size_t i = 0; i < m_pending.size(); ++i )
+    {
+        if( m_pending[ i ].match == match && strcmp( m_pending[ i ].key, key ) == 0 )
+        {
+            m_routes[ m_pending[ i ].last ].next = index;
+            m_pending[ i ].last = index;
+            return true;
+        }
+    }
+    pending p;
+    p.match = match;
+    strcpy( p.key, key );
+    p.first = p.last = index;
+    m_pending.push_back( p );
+    return true;
+}
+
+bool route_table::key_less( const pending *a, const pending *b )
+{
+    return strcmp( a->key, b->key ) < 0;
+}
+
+void route_table::compile()
+{
+    /* 精确路径和前缀按键排序后合并成前缀树的键*/
+    std::vector< const pending* > sorted;
+    int ext_count = 0;
+    for( size_t i = 0; i < m_pending.size(); ++i )
+    {
+        if( m_pending[ i ].match == ROUTE_EXT )
+        {
+            ext_count++;
+        }
+        else
+        {
+            sorted.push_back( &m_pending[ i ] );
+        }
+    }
+    std::sort( sorted.begin(), sorted.end(), key_less );
+    std::vector< trie_key > keys;
+    for( size_t i = 0; i < sorted.size(); ++i )
+    {
+        if( keys.empty() || strcmp( keys.back().key, sorted[ i ]->key ) != 0 )
+        {
+            trie_key k = { sorted[ i ]->key, ( int )strlen( sorted[ i ]->key ), -1, -1 };
+            keys.push_back( k );
+        }
+        ( sorted[ i ]->match == ROUTE_EXACT ? keys.back().exact : keys.back().prefix ) = sorted[ i ]->first;
+    }
+    if( ! keys.empty() )
+    {
+        m_nodes.resize( 1 );
+        build( 0, 0, keys.size(), 0, keys );
+    }
+
+    /* 扩展名哈希表的大小取不小于两倍条数的2的幂, 冲突链很短*/
+    if( ext_count > 0 )
+    {
+        unsigned int size = 4;
+        while( size < ( unsigned int )ext_count * 2 )
+        {
+            size <<= 1;
+        }
+        ext_slot empty = { 0, -1, 0, -1 };
+        m_ext.assign( size, empty );
+        m_ext_mask = size - 1;
+        for( size_t i = 0; i < m_pending.size(); ++i )
+        {
+            const pending &p = m_pending[ i ];
+            if( p.match != ROUTE_EXT )
+            {
+                continue;
+            }
+            int len = strlen( p.key );
+            unsigned int h = hash( p.key, len );
+            unsigned int slot = h & m_ext_mask;
+            while( m_ext[ slot ].key >= 0 )
+            {
+                slot = ( slot + 1 ) & m_ext_mask;
+            }
+            m_ext[ slot ].hash = h;
+            m_ext[ slot ].key = m_labels.size();
+            m_ext[ slot ].key_len = len;
+            m_ext[ slot ].routes = p.first;
+            m_labels.insert( m_labels.end(), p.key, p.key + len );
+        }
+    }
+
+    /* 编译完成后不再需要原始的键*/
+    std::vector< pending >().swap( m_pending );
+}
+
+/* 为已排序的键keys[lo, hi)建立子树, 它们的前depth个字节相同, 子树的根是m_nodes[node]
+ * 本结点的边标签是这些键的最长公共前缀中depth之后的部分; 恰好在这里结束的键(至多一个,
+ * 排序后在最前面)挂在本结点上, 其余的键按下一个字节分组, 每组成为一个子结点
+ */
+void route_table::build( int node, int lo, int hi, int depth, const std::vector< trie_key > &keys )
+{
+    const trie_key &a = keys[ lo ];
+    const trie_key &b = keys[ hi - 1 ];
+    int lcp = depth;
+    while( lcp < a.len && lcp < b.len && a.key[ lcp ] == b.key[ lcp ] )
+    {
+        lcp++;
+    }
+
+    m_nodes[ node ].label = m_labels.size();
+    m_nodes[ node ].label_len = lcp - depth;
+    m_nodes[ node ].first = lcp > depth ? a.key[ depth ] : 0;
+    m_nodes[ node ].exact = m_nodes[ node ].prefix = -1;
+    m_labels.insert( m_labels.end(), a.key + depth, a.key + lcp );
+    int i = lo;
+    if( a.len == lcp )
+    {
+        m_nodes[ node ].exact = a.exact;
+        m_nodes[ node ].prefix = a.prefix;
+        i++;
+    }
+
+    int groups = 0;
+    for( int j = i; j < hi; ++j )
+    {
+        if( j == i || keys[ j ].key[ lcp ] != keys[ j - 1 ].key[ lcp ] )
+        {
+            groups++;
+        }
+    }
+    int first_child = m_nodes.size();
+    m_nodes[ node ].first_child = first_child;
+    m_nodes[ node ].child_count = groups;
+    m_nodes.resize( first_child + groups );
+
+    int child = first_child;
+    while( i < hi )
+    {
+        int j = i + 1;
+        while( j < hi && keys[ j ].key[ lcp ] == keys[ i ].key[ lcp ] )
+        {
+            j++;
+        }
+        build( child++, i, j, lcp, keys );
+        i = j;
+    }
+}
+
+unsigned int route_table::hash( const char *s, int len )
+{
+    /* FNV-1a*/
+    unsigned int h = 2166136261u;
+    for( int i = 0; i < len; ++i )
+    {
+        h = ( h ^ ( unsigned char )s[ i ] ) * 16777619u;
+    }
+    return h;
+}
+
+/* 在一条路由链中取第一条方法相符的路由*/
+const route* route_table::pick( int chain, const char *method ) const
+{
+    for( int i = chain; i >= 0; i = m_routes[ i ].next )
+    {
+        const route &r = m_routes[ i ];
+        if( r.method[ 0 ] == '\0' || strcmp( r.method, method ) == 0 )
+        {
+            return &r;
+        }
+    }
+    return NULL;
+}
+
+const route* route_table::lookup( const char *method, const char *path ) const
+{
+    int len = strlen( path );
+    int prefixes[ MAX_PREFIX_DEPTH ];
+    int prefix_count = 0;
+    int exact = -1;
+
+    /* 沿路径走前缀树, 记下途经的前缀路由, 走到路径末尾时的结点上是精确匹配的路由*/
+    if( ! m_nodes.empty() )
+    {
+        const trie_node *n = &m_nodes[ 0 ];
+        int pos = 0;
+        while( true )
+        {
+            if( n->label_len > len - pos || memcmp( path + pos, m_labels.data() + n->label, n->label_len ) != 0 )
+            {
+                break;
+            }
+            pos += n->label_len;
+            if( n->prefix >= 0 )
+            {
+                prefixes[ prefix_count < MAX_PREFIX_DEPTH ? prefix_count++ : MAX_PREFIX_DEPTH - 1 ] = n->prefix;
+            }
+            if( pos == len )
+            {
+                exact = n->exact;
+                break;
+            }
+            const trie_node *child = NULL;
+            unsigned char c = path[ pos ];
+            for( int k = 0; k < n->child_count; ++k )
+            {
+                const trie_node *m = &m_nodes[ n->first_child + k ];
+                if( m->first >= c )
+                {
+                    child = m->first == c ? m : NULL;
+                    break;
+                }
+            }
+            if( ! child )
+            {
+                break;
+            }
+            n = child;
+        }
+    }
+
+    const route *r;
+    if( exact >= 0 && ( r = pick( exact, method ) ) )
+    {
+        return r;
+    }
+
+    /* 扩展名: 最后一段中最后一个'.'之后的部分*/
+    if( ! m_ext.empty() )
+    {
+        const char *slash = strrchr( path, '/' );
+        const char *dot = strrchr( slash ? slash : path, '.' );
+        if( dot && dot[ 1 ] )
+        {
+            int ext_len = path + len - dot - 1;
+            unsigned int h = hash( dot + 1, ext_len );
+            for( unsigned int slot = h & m_ext_mask; m_ext[ slot ].key >= 0; slot = ( slot + 1 ) & m_ext_mask )
+            {
+                const ext_slot &e = m_ext[ slot ];
+                if( e.hash == h && e.key_len == ext_len && memcmp( m_labels.data() + e.key, dot + 1, ext_len ) == 0 )
+                {
+                    if( ( r = pick( e.routes, method ) ) )
+                    {
+                        return r;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    /* 最长的前缀优先*/
+    while( prefix_count > 0 )
+    {
+        if( ( r = pick( prefixes[ --prefix_count ], method ) ) )
+        {
+            return r;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,116 @@
+/*************************************************************************
+	> File Name: route.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 01时37分52秒
+ ************************************************************************/
+
+#ifndef _ROUTE_H
+#define _ROUTE_H
+
+#include <vector>
+
+/* 路由的处理方式*/
+enum ROUTE_HANDLER
+{
+    ROUTE_STATIC = 0,     /* 网站根目录下的文件*/
+    ROUTE_CGI,            /* 运行CGI程序*/
+    ROUTE_STATUS,         /* 内置的服务器状态页*/
+    ROUTE_PROXY,          /* 转发给上游服务器(反向代理)*/
+    ROUTE_SLOW            /* 内置的慢请求页*/
+};
+
+/* 路由的匹配方式*/
+enum ROUTE_MATCH
+{
+    ROUTE_EXACT = 0,      /* 路径完全相同*/
+    ROUTE_PREFIX,         /* 路径以它开头*/
+    ROUTE_EXT             /* 路径最后一段的扩展名*/
+};
+
+/* 一条路由*/
+struct route
+{
+    int handler;          /* ROUTE_HANDLER*/
+    char method[ 8 ];     /* 只匹配该请求方法, 为空匹配任何方法*/
+    char program[ 200 ];  /* CGI程序(网站根目录下的路径), 为空时运行请求的路径本身对应的文件*/
+    char upstream[ 32 ];  /* 反向代理转发到的上游服务器组的名字*/
+    int cache_ttl_ms;     /* CGI的输出缓存多久, 0表示不缓存(见cgi_cache)*/
+    char cache_vary[ 96 ];/* 参与缓存键的请求头部名字, 逗号分隔*/
+    int next;             /* 同一个键上的下一条路由(按配置顺序), -1表示没有*/
+};
+
+/* 路由表: 把(请求方法, 规范化的路径)映射到路由
+ * 匹配顺序是精确路径、扩展名、最长前缀; 同一个键上有多条路由时取第一条方法相符的。
+ * 配置加载时把所有路由编译成只读的紧凑结构: 精确路径和前缀共用一棵压缩前缀树(radix trie),
+ * 结点连续存放, 兄弟结点相邻并按边标签的首字节排序; 扩展名放在开放寻址的哈希表里。
+ * 查找只需沿着路径走一遍树, 访问的结点数不超过路径中分叉的次数, 路由再多也只涉及几个缓存行。
+ * 编译好的路由表随配置快照发布, 之后不再修改, 各线程无锁并发查找
+ */
+class route_table
+{
+public:
+    route_table();
+
+    /* 添加一条路由(编译之前), key的格式错误时返回false*/
+    bool add( int match, const char *key, const route &r );
+    /* 编译成查找结构, 之后不能再添加*/
+    void compile();
+    /* 查找路由, 没有匹配的返回NULL*/
+    const route* lookup( const char *method, const char *path ) const;
+    /* 路由条数*/
+    int size() const { return m_routes.size(); }
+
+private:
+    /* 前缀树的结点, 从父结点到本结点的边标签是m_labels中label开始的label_len个字节*/
+    struct trie_node
+    {
+        int label;
+        unsigned short label_len;
+        unsigned short child_count;
+        unsigned char first;         /* 标签的首字节, 在兄弟结点中查找时使用*/
+        int first_child;             /* 子结点在m_nodes中连续存放*/
+        int exact;                   /* 精确匹配到本结点的路由链, -1表示没有*/
+        int prefix;                  /* 以本结点为前缀的路由链, -1表示没有*/
+    };
+    /* 扩展名哈希表的槽位*/
+    struct ext_slot
+    {
+        unsigned int hash;
+        int key;                     /* 扩展名在m_labels中的偏移, -1表示空槽*/
+        int key_len;
+        int routes;
+    };
+    /* 编译前收集的键, (匹配方式, 键)相同的路由串成一条链*/
+    struct pending
+    {
+        int match;
+        char key[ 200 ];
+        int first;                   /* 链的首条和末条路由*/
+        int last;
+    };
+    /* 前缀树的一个键, 精确匹配和前缀匹配的同一个路径合并为一个键*/
+    struct trie_key
+    {
+        const char *key;
+        int len;
+        int exact;
+        int prefix;
+    };
+
+    void build( int node, int lo, int hi, int depth, const std::vector< trie_key > &keys );
+    const route* pick( int chain, const char *method ) const;
+    static bool key_less( const pending *a, const pending *b );
+    static unsigned int hash( const char *s, int len );
+
+private:
+    std::vector< route > m_routes;
+    std::vector< pending > m_pending;
+
+    std::vector< trie_node > m_nodes;
+    std::vector< char > m_labels;
+    std::vector< ext_slot > m_ext;
+    unsigned int m_ext_mask;
+};
+
+#endif
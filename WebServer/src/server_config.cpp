@@ -0,0 +1,378 @@
+/*************************************************************************
+	> File Name: server_config.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 15时24分50秒
+ ************************************************************************/
+#include "./server_config.h"
+#include "./route.h"
+#include "./upstream.h"
+#include "./prefork.h"
+#include "../static/parse_cfg/parse_configure_file.h"
+#include <stdio.h>
+#include <string.h>
+
+/* 当前生效的配置快照*/
+static server_config *g_config = NULL;
+
+/* 读取可选的整型配置项, 不存在时使用默认值*/
+static int get_int_or( const char *path, int *val, int def )
+{
+    if( ! exist_val( path ) )
+    {
+        *val = def;
+        return 0;
+    }
+    return get_val_single( path, val, TYPE_INT );
+}
+
+/* 读取可选的字符串配置项, 不存在时使用默认值, 超长部分被截断*/
+static int get_string_or( const char *path, char *val, int size, const char *def )
+{
+    char str[ 1024 ] = {0};
+    if( exist_val( path ) )
+    {
+        if( get_val_single( path, str, TYPE_STRING ) < 0 )
+        {
+            return -1;
+        }
+        def = str;
+    }
+    strncpy( val, def, size - 1 );
+    val[ size - 1 ] = '\0';
+    return 0;
+}
+
+/* 读取可选的CPU编号数组, 不存在时个数为0*/
+static int get_cpus_or_empty( const char *path, int *cpus, int *count )
+{
+    *count = 0;
+    if( ! exist_val( path ) )
+    {
+        return 0;
+    }
+    int num = get_val_count( path );
+    if( num < 0 || num > MAX_CONFIG_CPUS )
+    {
+        printf( "config %s must be an array of at most %d cpus\n", path, MAX_CONFIG_CPUS );
+        return -1;
+    }
+    if( num > 0 && get_val_array( path, ( void** )&cpus, num, TYPE_INT ) < 0 )
+    {
+        return -1;
+    }
+    *count = num;
+    return 0;
+}
+
+/* 读取上游服务器组列表upstreams, 没有时个数为0; 出错返回NULL*/
+static upstream_config* load_upstreams( int *count )
+{
+    *count = 0;
+    if( ! exist_val( "upstreams" ) )
+    {
+        return new upstream_config[ 1 ];
+    }
+    int num = get_val_count( "upstreams" );
+    if( num < 0 )
+    {
+        printf( "config upstreams must be a list\n" );
+        return NULL;
+    }
+    upstream_config *ups = new upstream_config[ num > 0 ? num : 1 ];
+    memset( ups, 0, sizeof( upstream_config ) * ( num > 0 ? num : 1 ) );
+    for( int i = 0; i < num; ++i )
+    {
+        upstream_config *u = &ups[ i ];
+        char name[ 64 ];
+        int ret = 0;
+        snprintf( name, sizeof( name ), "upstreams.[%d].name", i );
+        ret |= get_string_or( name, u->name, sizeof( u->name ), "" );
+        snprintf( name, sizeof( name ), "upstreams.[%d].max_idle", i );
+        ret |= get_int_or( name, &u->max_idle, 32 );
+        snprintf( name, sizeof( name ), "upstreams.[%d].connect_timeout_ms", i );
+        ret |= get_int_or( name, &u->connect_timeout_ms, 1000 );
+        snprintf( name, sizeof( name ), "upstreams.[%d].timeout_ms", i );
+        ret |= get_int_or( name, &u->timeout_ms, 30000 );
+        snprintf( name, sizeof( name ), "upstreams.[%d].health_check", i );
+        ret |= get_string_or( name, u->health_check, sizeof( u->health_check ), "" );
+        snprintf( name, sizeof( name ), "upstreams.[%d].health_interval_ms", i );
+        ret |= get_int_or( name, &u->health_interval_ms, 2000 );
+        snprintf( name, sizeof( name ), "upstreams.[%d].max_fails", i );
+        ret |= get_int_or( name, &u->max_fails, 2 );
+
+        snprintf( name, sizeof( name ), "upstreams.[%d].servers", i );
+        u->server_count = get_val_count( name );
+        for( int s = 0; s < u->server_count && s < MAX_UPSTREAM_SERVERS; ++s )
+        {
+            snprintf( name, sizeof( name ), "upstreams.[%d].servers.[%d]", i, s );
+            ret |= get_string_or( name, u->servers[ s ], sizeof( u->servers[ s ] ), "" );
+        }
+
+        bool dup = false;
+        for( int k = 0; k < i; ++k )
+        {
+            dup = dup || strcmp( ups[ k ].name, u->name ) == 0;
+        }
+        if( ret < 0 || u->name[ 0 ] == '\0' || dup
+            || u->server_count < 1 || u->server_count > MAX_UPSTREAM_SERVERS
+            || u->max_idle < 0 || u->max_idle > 4096
+            || u->connect_timeout_ms < 1 || u->timeout_ms < 1
+            || u->health_interval_ms < 0 || u->max_fails < 0
+            || ( u->health_check[ 0 ] && u->health_check[ 0 ] != '/' ) )
+        {
+            printf( "config upstreams[%d] is invalid\n", i );
+            delete [] ups;
+            return NULL;
+        }
+    }
+    *count = num;
+    return ups;
+}
+
+/* 读取并编译路由表; 反向代理的路由必须引用ups中的上游服务器组
+ * 没有配置routes时使用与之前写死的行为相同的路由: POST请求都交给cgi-bin/calc_cgi, GET请求是静态文件
+ */
+static route_table* load_routes( const upstream_config *ups, int ups_count )
+{
+    route_table *table = new route_table;
+    route r;
+    memset( &r, 0, sizeof( r ) );
+    if( ! exist_val( "routes" ) )
+    {
+        r.handler = ROUTE_CGI;
+        strcpy( r.method, "POST" );
+        strcpy( r.program, "/cgi-bin/calc_cgi" );
+        table->add( ROUTE_PREFIX, "/", r );
+        r.handler = ROUTE_STATIC;
+        strcpy( r.method, "GET" );
+        r.program[ 0 ] = '\0';
+        table->add( ROUTE_PREFIX, "/", r );
+        table->compile();
+        return table;
+    }
+
+    static const char *match_names[] = { "exact", "prefix", "ext" };
+    static const char *handler_names[] = { "static", "cgi", "status", "proxy", "slow" };
+    int count = get_val_count( "routes" );
+    if( count < 0 )
+    {
+        printf( "config routes must be a list\n" );
+        delete table;
+        return NULL;
+    }
+    for( int i = 0; i < count; ++i )
+    {
+        char name[ 64 ];
+        char match[ 16 ], path[ 256 ], handler[ 16 ], program[ 256 ];
+        int ret = 0;
+        snprintf( name, sizeof( name ), "routes.[%d].match", i );
+        ret |= get_string_or( name, match, sizeof( match ), "prefix" );
+        snprintf( name, sizeof( name ), "routes.[%d].path", i );
+        ret |= get_string_or( name, path, sizeof( path ), "" );
+        snprintf( name, sizeof( name ), "routes.[%d].handler", i );
+        ret |= get_string_or( name, handler, sizeof( handler ), "static" );
+        snprintf( name, sizeof( name ), "routes.[%d].method", i );
+        ret |= get_string_or( name, r.method, sizeof( r.method ), "" );
+        snprintf( name, sizeof( name ), "routes.[%d].program", i );
+        ret |= get_string_or( name, program, sizeof( program ), "" );
+        snprintf( name, sizeof( name ), "routes.[%d].upstream", i );
+        ret |= get_string_or( name, r.upstream, sizeof( r.upstream ), "" );
+        snprintf( name, sizeof( name ), "routes.[%d].cache_ttl_ms", i );
+        ret |= get_int_or( name, &r.cache_ttl_ms, 0 );
+        snprintf( name, sizeof( name ), "routes.[%d].cache_vary", i );
+        ret |= get_string_or( name, r.cache_vary, sizeof( r.cache_vary ), "" );
+
+        int m = 0, h = 0;
+        while( m < 3 && strcmp( match, match_names[ m ] ) != 0 )
+        {
+            m++;
+        }
+        while( h < 5 && strcmp( handler, handler_names[ h ] ) != 0 )
+        {
+            h++;
+        }
+        bool has_upstream = false;
+        for( int k = 0; k < ups_count; ++k )
+        {
+            has_upstream = has_upstream || strcmp( ups[ k ].name, r.upstream ) == 0;
+        }
+        /* CGI程序的路径相对于网站根目录*/
+        int n = snprintf( r.program, sizeof( r.program ), "%s%s",
+                          program[ 0 ] && program[ 0 ] != '/' ? "/" : "", program );
+        r.handler = h;
+        if( ret < 0 || m == 3 || h == 5 || n >= ( int )sizeof( r.program )
+            || ( h == ROUTE_PROXY && ! has_upstream ) || r.cache_ttl_ms < 0
+            || ( r.cache_ttl_ms > 0 && h != ROUTE_CGI ) || ! table->add( m, path, r ) )
+        {
+            printf( "config routes[%d] is invalid\n", i );
+            delete table;
+            return NULL;
+        }
+    }
+    table->compile();
+    return table;
+}
+
+/* 检查配置项的取值范围*/
+static bool check_range( const char *name, int val, int min, int max )
+{
+    if( val < min || val > max )
+    {
+        printf( "config %s=%d out of range [%d, %d]\n", name, val, min, max );
+        return false;
+    }
+    return true;
+}
+
+server_config* load_server_config( const char *conf_path )
+{
+    if( conf_path == NULL )
+    {
+        printf("load_server_config arguments error!\n");
+        return NULL;
+    }
+
+    /* 打开配置文件*/
+    if( open_conf( conf_path ) < 0 )
+    {
+        return NULL;
+    }
+
+    server_config *cfg = new server_config;
+    memset( cfg, 0, sizeof( *cfg ) );
+
+    /* ip和端口是必需的, 其余配置项缺省时与之前写死在代码中的值保持一致*/
+    int ret = 0;
+    ret |= get_val_single( "web_server_info.ip", cfg->ip, TYPE_STRING );
+    ret |= get_val_single( "web_server_info.port", &cfg->port, TYPE_INT );
+    ret |= get_int_or( "web_server_info.listen_backlog", &cfg->listen_backlog, 5 );
+    ret |= get_int_or( "web_server_info.max_fd", &cfg->max_fd, 65536 );
+    ret |= get_int_or( "web_server_info.max_event_number", &cfg->max_event_number, 10000 );
+    ret |= get_int_or( "web_server_info.reactor_number", &cfg->reactor_number, 1 );
+    ret |= get_int_or( "web_server_info.worker_processes", &cfg->worker_processes, 0 );
+    ret |= get_int_or( "web_server_info.drain_timeout_ms", &cfg->drain_timeout_ms, 30000 );
+
+    ret |= get_cpus_or_empty( "cpu_affinity.reactor_cpus", cfg->reactor_cpus, &cfg->reactor_cpu_count );
+    ret |= get_cpus_or_empty( "cpu_affinity.worker_cpus", cfg->worker_cpus, &cfg->worker_cpu_count );
+    ret |= get_int_or( "cpu_affinity.incoming_cpu", &cfg->incoming_cpu, 0 );
+    if( exist_val( "cpu_affinity.nic" ) )
+    {
+        char nic[ 256 ] = {0};
+        ret |= get_val_single( "cpu_affinity.nic", nic, TYPE_STRING );
+        strncpy( cfg->nic, nic, sizeof( cfg->nic ) - 1 );
+    }
+
+    ret |= get_int_or( "thread_pool.thread_number", &cfg->thread_number, 8 );
+    ret |= get_int_or( "thread_pool.max_thread_number", &cfg->max_thread_number, cfg->thread_number );
+    ret |= get_int_or( "thread_pool.max_requests", &cfg->max_requests, 10000 );
+    ret |= get_int_or( "thread_pool.nice", &cfg->nice, 0 );
+    ret |= get_int_or( "thread_pool.cgi_thread_number", &cfg->cgi_thread_number, 2 );
+    ret |= get_int_or( "thread_pool.cgi_max_thread_number", &cfg->cgi_max_thread_number,
+                       cfg->cgi_thread_number > 16 ? cfg->cgi_thread_number : 16 );
+    ret |= get_int_or( "thread_pool.cgi_max_requests", &cfg->cgi_max_requests, 1000 );
+    ret |= get_int_or( "thread_pool.cgi_nice", &cfg->cgi_nice, 5 );
+    ret |= get_int_or( "thread_pool.queue_delay_target_us", &cfg->queue_delay_target_us, 5000 );
+    ret |= get_int_or( "thread_pool.idle_timeout_ms", &cfg->idle_timeout_ms, 10000 );
+    ret |= get_int_or( "thread_pool.shed_target_us", &cfg->shed_target_us, 50000 );
+    ret |= get_int_or( "thread_pool.shed_interval_ms", &cfg->shed_interval_ms, 100 );
+
+    ret |= get_int_or( "http_conn.read_buffer_size", &cfg->read_buffer_size, 2048 );
+    ret |= get_int_or( "http_conn.write_buffer_size", &cfg->write_buffer_size, 1024 );
+    ret |= get_int_or( "http_conn.notsent_lowat", &cfg->notsent_lowat, 16384 );
+    ret |= get_int_or( "http_conn.inline_fast_path", &cfg->inline_fast_path, 0 );
+    ret |= get_int_or( "http_conn.cgi_timeout_ms", &cfg->cgi_timeout_ms, 30000 );
+
+    ret |= get_int_or( "response_cache.enable", &cfg->cache_enable, 0 );
+    ret |= get_int_or( "response_cache.max_file_size", &cfg->cache_max_file_size, 65536 );
+    ret |= get_int_or( "response_cache.max_total_bytes", &cfg->cache_max_total_bytes, 64 << 20 );
+    ret |= get_int_or( "response_cache.warm_up", &cfg->cache_warm_up, 0 );
+    ret |= get_int_or( "large_file.threshold", &cfg->large_file_threshold, 1 << 20 );
+    ret |= get_int_or( "large_file.readahead_max", &cfg->readahead_max, 4 << 20 );
+    ret |= get_int_or( "cgi_cache.max_total_bytes", &cfg->cgi_cache_max_bytes, 16 << 20 );
+    ret |= get_int_or( "cgi_cache.max_entry_size", &cfg->cgi_cache_max_entry, 1 << 20 );
+    ret |= get_int_or( "cgi_cache.max_body_size", &cfg->cgi_cache_max_body, 65536 );
+
+    ret |= get_string_or( "log.access_log", cfg->access_log, sizeof( cfg->access_log ), "" );
+    ret |= get_string_or( "log.error_log", cfg->error_log, sizeof( cfg->error_log ), "" );
+    ret |= get_int_or( "log.ring_size", &cfg->log_ring_size, 1024 );
+    ret |= get_int_or( "log.flush_interval_ms", &cfg->log_flush_interval_ms, 100 );
+    ret |= get_int_or( "log.rotate_size", &cfg->log_rotate_size, 100 << 20 );
+    ret |= get_int_or( "log.rotate_keep", &cfg->log_rotate_keep, 5 );
+    ret |= get_int_or( "log.slow_request_ms", &cfg->slow_request_ms, 1000 );
+    ret |= get_int_or( "log.slow_ring_size", &cfg->slow_ring_size, 64 );
+
+    ret |= get_int_or( "http2.enable", &cfg->http2_enable, 1 );
+    ret |= get_int_or( "http2.max_concurrent_streams", &cfg->http2_max_streams, 100 );
+    ret |= get_int_or( "http2.max_body_size", &cfg->http2_max_body, 8 << 20 );
+
+    ret |= get_int_or( "tls.enable", &cfg->tls_enable, 0 );
+    ret |= get_int_or( "tls.port", &cfg->tls_port, 8443 );
+    ret |= get_string_or( "tls.cert_file", cfg->tls_cert_file, sizeof( cfg->tls_cert_file ), "../etc/server.crt" );
+    ret |= get_string_or( "tls.key_file", cfg->tls_key_file, sizeof( cfg->tls_key_file ), "../etc/server.key" );
+    ret |= get_int_or( "tls.ktls", &cfg->tls_ktls, 1 );
+
+    cfg->upstreams = load_upstreams( &cfg->upstream_count );
+    cfg->routes = cfg->upstreams ? load_routes( cfg->upstreams, cfg->upstream_count ) : NULL;
+
+    /* 关闭配置文件并释放资源*/
+    close_conf();
+
+    if( ret < 0 || ! cfg->routes
+        || ! check_range( "port", cfg->port, 1, 65535 )
+        || ! check_range( "listen_backlog", cfg->listen_backlog, 1, 65535 )
+        || ! check_range( "max_fd", cfg->max_fd, 64, 1 << 24 )
+        || ! check_range( "max_event_number", cfg->max_event_number, 1, 1 << 20 )
+        || ! check_range( "reactor_number", cfg->reactor_number, 1, 256 )
+        || ! check_range( "worker_processes", cfg->worker_processes, 0, MAX_WORKER_PROCESSES )
+        || ! check_range( "worker_processes * reactor_number", cfg->worker_processes * cfg->reactor_number,
+                          0, MAX_LISTEN_FDS )
+        || ! check_range( "drain_timeout_ms", cfg->drain_timeout_ms, 0, 86400000 )
+        || ! check_range( "thread_number", cfg->thread_number, 1, 1024 )
+        || ! check_range( "max_thread_number", cfg->max_thread_number, cfg->thread_number, 4096 )
+        || ! check_range( "max_requests", cfg->max_requests, 1, 1 << 24 )
+        || ! check_range( "nice", cfg->nice, -20, 19 )
+        || ! check_range( "cgi_thread_number", cfg->cgi_thread_number, 1, 1024 )
+        || ! check_range( "cgi_max_thread_number", cfg->cgi_max_thread_number, cfg->cgi_thread_number, 4096 )
+        || ! check_range( "cgi_max_requests", cfg->cgi_max_requests, 1, 1 << 24 )
+        || ! check_range( "cgi_nice", cfg->cgi_nice, -20, 19 )
+        || ! check_range( "queue_delay_target_us", cfg->queue_delay_target_us, 1, 10000000 )
+        || ! check_range( "idle_timeout_ms", cfg->idle_timeout_ms, 1, 86400000 )
+        || ! check_range( "shed_target_us", cfg->shed_target_us, 0, 60000000 )
+        || ! check_range( "shed_interval_ms", cfg->shed_interval_ms, 1, 60000 )
+        || ! check_range( "read_buffer_size", cfg->read_buffer_size, 512, 1 << 20 )
+        || ! check_range( "write_buffer_size", cfg->write_buffer_size, 256, 1 << 20 )
+        || ! check_range( "notsent_lowat", cfg->notsent_lowat, 0, 1 << 30 )
+        || ! check_range( "cgi_timeout_ms", cfg->cgi_timeout_ms, 1, 86400000 )
+        || ! check_range( "ring_size", cfg->log_ring_size, 16, 1 << 20 )
+        || ! check_range( "flush_interval_ms", cfg->log_flush_interval_ms, 1, 60000 )
+        || ! check_range( "rotate_size", cfg->log_rotate_size, 0, 0x7fffffff )
+        || ! check_range( "rotate_keep", cfg->log_rotate_keep, 0, 100 )
+        || ! check_range( "large_file.threshold", cfg->large_file_threshold, 0, 0x7fffffff )
+        || ! check_range( "readahead_max", cfg->readahead_max, 0, 1 << 30 )
+        || ! check_range( "cgi_cache.max_total_bytes", cfg->cgi_cache_max_bytes, 0, 0x7fffffff )
+        || ! check_range( "cgi_cache.max_entry_size", cfg->cgi_cache_max_entry, 0, 1 << 30 )
+        || ! check_range( "cgi_cache.max_body_size", cfg->cgi_cache_max_body, 0, 1 << 24 )
+        || ! check_range( "slow_request_ms", cfg->slow_request_ms, 0, 3600000 )
+        || ! check_range( "slow_ring_size", cfg->slow_ring_size, 1, 65536 )
+        || ! check_range( "max_concurrent_streams", cfg->http2_max_streams, 1, 1024 )
+        || ! check_range( "max_body_size", cfg->http2_max_body, 0, 1 << 30 )
+        || ! check_range( "tls.port", cfg->tls_port, 1, 65535 ) )
+    {
+        delete cfg->routes;
+        delete [] cfg->upstreams;
+        delete cfg;
+        return NULL;
+    }
+    return cfg;
+}
+
+const server_config* current_config()
+{
+    return __atomic_load_n( &g_config, __ATOMIC_ACQUIRE );
+}
+
+void publish_config( server_config *cfg )
+{
+    __atomic_store_n( &g_config, cfg, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,120 @@
+/*************************************************************************
+	> File Name: server_config.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 15时10分26秒
+ ************************************************************************/
+
+#ifndef _SERVER_CONFIG_H
+#define _SERVER_CONFIG_H
+
+/* 配置中允许指定的最多CPU个数*/
+#define MAX_CONFIG_CPUS 256
+
+class route_table;
+struct upstream_config;
+
+/* 服务器运行参数的一份快照
+ * 快照一旦发布就不再修改; 重新加载配置时生成一份新快照, 再原子地替换当前快照,
+ * 所以任何线程拿到的快照指针在其整个生命周期内都是一致、可用的
+ */
+struct server_config
+{
+    /* web_server_info: 监听相关*/
+    char ip[ 33 ];             /* 监听地址*/
+    int port;                  /* 监听端口*/
+    int listen_backlog;        /* listen的全连接队列长度*/
+    int max_fd;                /* 最大连接描述符数(仅在启动时生效)*/
+    int max_event_number;      /* 每次epoll_wait最多返回的事件数*/
+    int reactor_number;        /* 反应堆(事件循环)线程数(仅在启动时生效)*/
+    int worker_processes;      /* prefork模式的工作进程数, 0表示单进程模式(仅在启动时生效)*/
+    int drain_timeout_ms;      /* 优雅退出(热升级)时等待已有连接处理完的最长时间*/
+
+    /* thread_pool: 线程池, 静态请求和CGI请求分别排队, 各有自己的线程*/
+    int thread_number;         /* 静态请求的常驻工作线程数*/
+    int max_thread_number;     /* 静态请求排队时间超标时允许扩容到的最大线程数*/
+    int max_requests;          /* 静态请求队列中允许的最大请求数*/
+    int nice;                  /* 静态请求工作线程的nice值*/
+    int cgi_thread_number;     /* CGI请求的常驻工作线程数*/
+    int cgi_max_thread_number; /* CGI请求的最大工作线程数*/
+    int cgi_max_requests;      /* CGI请求队列中允许的最大请求数*/
+    int cgi_nice;              /* CGI请求工作线程(及其fork的CGI进程)的nice值*/
+    int queue_delay_target_us; /* 排队时间目标值(微秒), 超过则扩容*/
+    int idle_timeout_ms;       /* 超出常驻数的线程空闲多久后退出(毫秒)*/
+    int shed_target_us;        /* 过载判定的排队时间目标值(微秒), 0表示不削减负载*/
+    int shed_interval_ms;      /* 过载判定的观察周期(毫秒)*/
+
+    /* cpu_affinity: 线程绑定(仅在启动时生效)*/
+    int reactor_cpus[ MAX_CONFIG_CPUS ];   /* 反应堆i绑定到reactor_cpus[i % n]*/
+    int reactor_cpu_count;
+    int worker_cpus[ MAX_CONFIG_CPUS ];    /* 工作线程绑定到这组CPU上*/
+    int worker_cpu_count;
+    char nic[ 32 ];            /* 未指定reactor_cpus时, 按该网卡的中断所在CPU放置反应堆*/
+    int incoming_cpu;          /* 是否在监听套接字上设置SO_INCOMING_CPU*/
+
+    /* http_conn: 连接缓冲区*/
+    int read_buffer_size;      /* 读缓冲区大小(对新连接生效)*/
+    int write_buffer_size;     /* 写缓冲区大小(对新连接生效)*/
+    int notsent_lowat;         /* TCP_NOTSENT_LOWAT(对新连接生效)*/
+    int inline_fast_path;      /* 命中缓存的静态请求是否直接在反应堆线程中应答*/
+    int cgi_timeout_ms;        /* CGI程序既不读消息体也不输出超过该时间(毫秒)后被杀死*/
+
+    /* response_cache: 完整响应缓存*/
+    int cache_enable;          /* 是否启用(仅在启动时生效)*/
+    int cache_max_file_size;   /* 允许缓存的最大文件大小*/
+    int cache_max_total_bytes; /* 缓存总字节数上限*/
+    int cache_warm_up;         /* 启动时是否预热*/
+
+    /* large_file: 大文件的发送方式*/
+    int large_file_threshold;  /* 不小于该大小的文件用sendfile发送并按发送速度预读, 不再mmap*/
+    int readahead_max;         /* 预读窗口的上限*/
+
+    /* cgi_cache: 可缓存的CGI路由(cache_ttl_ms大于0)的输出缓存*/
+    int cgi_cache_max_bytes;   /* 缓存占用的总字节数上限, 0表示不启用*/
+    int cgi_cache_max_entry;   /* 一条CGI输出的最大长度, 超过时不缓存*/
+    int cgi_cache_max_body;    /* 消息体不超过该长度的请求才查找缓存, 更大的照常流式转发*/
+
+    /* log: 访问日志与错误日志(仅在启动时生效)*/
+    char access_log[ 256 ];    /* 访问日志文件, 为空则不记录*/
+    char error_log[ 256 ];     /* 错误日志文件, 为空则写到标准错误*/
+    int log_ring_size;         /* 每个线程的日志环形缓冲区容纳的记录数*/
+    int log_flush_interval_ms; /* 后台线程写日志的间隔*/
+    int log_rotate_size;       /* 日志文件超过该字节数后轮转, 0表示不轮转*/
+    int log_rotate_keep;       /* 轮转时保留的旧文件个数*/
+    int slow_request_ms;       /* 总耗时超过它的请求连同各阶段耗时记入慢请求环形缓冲区, 0表示不记录(可重新加载)*/
+    int slow_ring_size;        /* 保留的慢请求数*/
+
+    /* http2: 明文HTTP/2(h2c)*/
+    int http2_enable;          /* 是否接受HTTP/2连接(先验知识或Upgrade: h2c)*/
+    int http2_max_streams;     /* 每个连接允许同时进行的流数*/
+    int http2_max_body;        /* 单个流的请求消息体的最大长度*/
+
+    /* tls: HTTPS监听(仅在启动时生效)*/
+    int tls_enable;            /* 是否开启HTTPS监听*/
+    int tls_port;              /* HTTPS监听端口, 地址与ip相同*/
+    char tls_cert_file[ 256 ]; /* 证书链文件(PEM)*/
+    char tls_key_file[ 256 ];  /* 私钥文件(PEM)*/
+    int tls_ktls;              /* 握手后是否把记录加密交给内核(kTLS), 内核不支持时自动退回用户态加密*/
+
+    /* upstreams: 反向代理的上游服务器组(仅在启动时生效)*/
+    const upstream_config *upstreams;
+    int upstream_count;
+
+    /* routes: 编译好的路由表, 随快照一起发布*/
+    const route_table *routes;
+};
+
+/* 从配置文件加载一份新的配置快照, 缺省的可选项使用默认值
+ * 成功返回新快照(由调用者发布), 失败返回NULL
+ */
+server_config* load_server_config( const char *conf_path );
+
+/* 获取当前生效的配置快照*/
+const server_config* current_config();
+
+/* 原子地发布新的配置快照
+ * 旧快照可能仍被其他线程引用, 因此不会被释放(配置只在启动和SIGHUP时加载, 数量很少)
+ */
+void publish_config( server_config *cfg );
+
+#endif
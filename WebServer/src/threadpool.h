@@ -10,40 +10,182 @@
 
 #include <list>
 #include <cstdio>
+#include <cstring>
+#include <climits>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include "./locker.h"
+#include "./cpu_affinity.h"
+#include "./async_log.h"
 
 
-/*线程池类，将它定义为模板是为了代码复用，模板参数T是任务类*/
+/*线程池中一个调度类的运行统计*/
+struct threadpool_stats
+{
+    int live_threads;            /*当前线程数*/
+    int busy_threads;            /*正在执行任务的线程数*/
+    int queued;                  /*队列中等待的任务数*/
+    long long oldest_wait_us;    /*队首任务已经等待的时间(微秒)*/
+    long long avg_wait_us;       /*最近一个统计周期内任务的平均排队时间(微秒)*/
+    long long max_wait_us;       /*最近一个统计周期内任务的最长排队时间(微秒)*/
+    long long avg_service_us;    /*最近一个统计周期内任务的平均执行时间(微秒)*/
+    double utilization;          /*最近一个统计周期内工作线程的利用率(0~1)*/
+    long long completed;         /*累计完成的任务数*/
+    long long rejected;          /*累计因队列已满被拒绝的任务数*/
+    long long shed;              /*累计因过载被丢弃(入队时拒绝或出队时放弃)的任务数*/
+    bool overloaded;             /*当前是否处于过载状态*/
+};
+
+/*线程池类，将它定义为模板是为了代码复用，模板参数T是任务类
+ *任务按调度类分别排队, 每个调度类有自己的请求队列、线程数范围和优先级(nice值),
+ *各类的线程只处理本类的任务, 因此某一类任务执行得再慢也只会占满本类的线程。
+ *每个类的线程数在[最小线程数, 最大线程数]之间自适应: 任务入队时本类线程都在忙、或者有任务因过载
+ *被丢弃时, 管理线程被唤醒并测量任务的排队时间, 超过目标值时增加线程; 空闲超过一定时间的线程
+ *自行退出, 直到剩下最小线程数。
+ *线程数已经扩到上限仍然消化不了时按CoDel的思路削减负载(见shed_locked), 被丢弃的任务
+ *交给T::reject()快速应答, 而不是让所有任务都排很久的队。
+ *请求队列是侵入式的FIFO链表: 任务对象自身提供m_tp_next(队列中的下一个)和m_tp_enqueue_ns
+ *(入队时间)两个成员, 入队出队都不分配内存。同一个任务对象同时最多在队列中出现一次
+ *(连接是EPOLLONESHOT的, 处理完之前不会再次入队)。
+ *所有线程都是可join的, 析构时等待它们全部退出
+ */
 template< typename T >
 class threadpool
 {
+public:
+    /*最多的调度类个数*/
+    static const int MAX_CLASSES = 8;
+
 private:
-    /*工作线程线程函数，它不断从工作队列中取出任务并执行之*/
+    /*调度类*/
+    struct sched_class
+    {
+        char name[ 16 ];
+        T *head;                     /*本类的请求队列(侵入式链表), 从head出队*/
+        T *tail;                     /*从tail入队*/
+        int queued;                  /*队列中的任务数*/
+        sem queuestat;               /*本类是否有任务需要处理*/
+        int min_threads;             /*最小线程数(常驻)*/
+        int max_threads;             /*最大线程数*/
+        int max_requests;            /*请求队列中允许的最大请求数*/
+        int nice;                    /*本类线程的nice值*/
+        int nice_gen;                /*nice值每修改一次加一, 工作线程据此重新设置*/
+        int live;                    /*当前线程数*/
+        int busy;                    /*正在执行任务的线程数*/
+        int retire;                  /*等待退出的线程数(调低最大线程数时使用)*/
+
+        /*统计: 当前统计周期内的累计值, 由管理线程定期结转*/
+        long long wait_ns_sum;       /*任务排队时间之和*/
+        long long wait_ns_max;       /*任务排队时间最大值*/
+        long long dequeued;          /*出队的任务数*/
+        long long busy_ns_sum;       /*工作线程执行任务的时间之和*/
+        long long period_done;       /*本周期完成的任务数*/
+        long long completed;         /*累计完成的任务数*/
+        long long rejected;          /*累计被拒绝的任务数*/
+        threadpool_stats last;       /*上一个统计周期的结果*/
+
+        /*过载检测: 一个观察周期内出队任务的最小排队时间仍超过目标值, 说明积压不是短暂的突发*/
+        long long codel_min_wait;    /*本观察周期内出队任务的最小排队时间*/
+        long long codel_period_end;  /*本观察周期的结束时间*/
+        bool overloaded;             /*上一个观察周期是否过载*/
+        long long shed;              /*累计因过载被丢弃的任务数*/
+    };
+
+    /*工作线程的描述*/
+    struct worker_info
+    {
+        pthread_t tid;
+        threadpool *pool;
+        int cls;                     /*所属的调度类*/
+    };
+
+    /*工作线程线程函数，它不断从本类的工作队列中取出任务并执行之*/
     static void* worker( void *arg );
+    /*管理线程线程函数，负责扩容和回收已退出的线程*/
+    static void* manager( void *arg );
 
     /*被worker调用*/
-    void run(); 
+    void run( int cls );
+    /*被manager调用*/
+    void manage();
+
+    /*创建一个调度类, 调用时已持有m_queuelocker*/
+    void create_class_locked( const char *name, int min_threads, int max_threads,
+                              int max_requests, int nice );
+    /*为调度类cls创建一个工作线程, 调用时不能持有m_queuelocker*/
+    bool spawn( int cls );
+    /*join已经退出的工作线程*/
+    void reap();
+    /*唤醒所有类的所有线程*/
+    void wake_all();
+    /*如果CPU集合有变化, 则重新绑定当前线程, gen是当前线程上次绑定时的代数*/
+    void update_affinity( int &gen );
+    /*如果调度类的nice值有变化, 则重新设置当前线程的nice值*/
+    void update_priority( sched_class *c, int &gen );
+    /*根据刚出队任务的排队时间更新过载状态, 返回该任务是否应被丢弃, 调用时已持有m_queuelocker*/
+    bool shed_locked( sched_class *c, long long wait, long long now );
+
+public:
+    /*单调时钟, 纳秒*/
+    static long long now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( long long )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
 
 private:
-    int m_thread_number;         /*线程池中的线程数*/
-    int m_max_requests;          /*请求队列中允许的最大请求数*/
-    pthread_t *m_threads;        /*描述线程池的数组，其大小为m_thread_number*/
-    std::list< T* > m_workqueue; /*使用STL中的链表来做请求队列*/ 
+    sched_class *m_classes[ MAX_CLASSES ];  /*调度类, 下标即类的编号*/
+    int m_class_count;
+    std::list< worker_info* > m_workers;    /*所有未被join的工作线程*/
+    std::list< worker_info* > m_exited;     /*已经退出、等待join的工作线程*/
 
-    locker m_queuelocker;        /*保护请求队列的互斥锁*/
-    sem    m_queuestat;          /*是否有任务需要处理*/
+    locker m_queuelocker;        /*保护请求队列和以上所有成员的互斥锁*/
+    sem    m_manager_wake;       /*唤醒管理线程: 需要扩容、有任务被丢弃或有线程退出时post*/
     bool   m_stop;               /*是否结束线程*/
+    pthread_t m_manager;         /*管理线程*/
+
+    long long m_target_delay_ns; /*排队时间的目标值, 超过则扩容*/
+    int    m_idle_timeout_ms;    /*线程空闲多久后退出*/
+    long long m_period_start;    /*统计周期的开始时间*/
+    long long m_shed_target_ns;  /*过载判定的排队时间目标值, 0表示不削减负载*/
+    long long m_shed_interval_ns;/*过载判定的观察周期*/
+
+    int   *m_cpus;               /*工作线程绑定的CPU集合, 为NULL时不绑定*/
+    int    m_cpu_count;
+    int    m_affinity_gen;       /*CPU集合每修改一次加一, 工作线程据此重新绑定*/
 
 public:
-    /*参数thread_number是线程池中线程的数量，max_requests是
-     *请求队列中最多允许的、等待处理的请求的数量*/
+    /*创建线程池及其0号调度类"default", 参数thread_number是0号类中常驻线程的数量,
+     *max_requests是0号类的请求队列中最多允许的、等待处理的请求的数量*/
     threadpool( int thread_number = 8, int max_requests = 10000 );
     ~threadpool();
 
-    /*往请求队列中添加任务*/
-    bool append( T *request );
+    /*往调度类cls的请求队列中添加任务*/
+    bool append( T *request, int cls = 0 );
+
+    /*设置调度类cls的名字、线程数范围、队列长度上限和nice值
+     *cls等于当前类的个数时创建一个新类; 线程数少于最小值时立即补足,
+     *多于最大值的线程在取完手上的任务后退出
+     */
+    bool set_class( int cls, const char *name, int min_threads, int max_threads,
+                    int max_requests, int nice );
+    /*设置扩容的排队时间目标值和空闲线程的退出时间(对所有调度类生效)*/
+    void set_adaptive( int target_delay_us, int idle_timeout_ms );
+    /*设置过载时削减负载的排队时间目标值和观察周期, target_us为0时不削减(对所有调度类生效)*/
+    void set_shedding( int target_us, int interval_ms );
+    /*把所有工作线程(包括以后创建的)绑定到一组CPU上*/
+    void set_cpu_affinity( const int *cpus, int count );
+
+    /*调度类的个数和名字*/
+    int class_count();
+    const char* class_name( int cls );
+    /*获取调度类cls的运行统计*/
+    bool get_stats( int cls, threadpool_stats *stats );
 };
 
 
@@ -52,116 +194,643 @@ public:
 /* 线程池构造函数*/
 template< typename T >
 threadpool< T >::threadpool(int thread_number, int max_requests)
-               :m_thread_number( thread_number ), m_max_requests( max_requests ),
-                m_stop( false ), m_threads(NULL)
+               :m_class_count( 0 ), m_stop( false ),
+                m_target_delay_ns( 5000000LL ), m_idle_timeout_ms( 10000 ),
+                m_period_start( now_ns() ), m_shed_target_ns( 0 ), m_shed_interval_ns( 100000000LL ),
+                m_cpus( NULL ), m_cpu_count( 0 ), m_affinity_gen( 0 )
 {
-    if(( thread_number <= 0 ) || (max_requests <= 0))   
-    {
-        throw std::exception();
-    }
-
-    /* 创建m_thread_number个线程描述符标识线程*/
-    m_threads = new pthread_t[ m_thread_number ];
-    if( !m_threads )
+    if(( thread_number <= 0 ) || (max_requests <= 0))
     {
         throw std::exception();
     }
 
-    /*创建thread_number个线程， 并将它们都设置为脱离线程*/
+    /*创建0号调度类及其thread_number个常驻工作线程*/
+    m_queuelocker.lock();
+    create_class_locked( "default", thread_number, thread_number, max_requests, 0 );
+    m_queuelocker.unlock();
     for( int i = 0; i < thread_number; ++i )
     {
         printf("create the %dth thread\n", i);
-
-        /* 在C++程序中使用pthread_create函数时，该函数的第3个参数必须
-         * 指向一个静态函数(worker), 而要在一个静态函数中使用类的动态
-         * 成员(包括成员变量和成员函数), 可以使用一种方法: 将类的对象
-         * 作为参数传递给该静态函数，然后再静态函数中引用这个对象，并
-         * 调用其静态方法
-         */
-        if( pthread_create( m_threads + i, NULL, worker, this) != 0)
+        if( ! spawn( 0 ) )
         {
             throw std::exception();
         }
+    }
 
-        if( pthread_detach( m_threads[i] ) )
-        {
-            delete [] m_threads;
-            throw std::exception();
-        }
+    /*创建管理线程*/
+    if( pthread_create( &m_manager, NULL, manager, this ) != 0 )
+    {
+        throw std::exception();
     }
 }
 
-/* 线程池析构函数*/
+/* 线程池析构函数
+ * 先设置结束标志并唤醒所有线程, 再逐个join, 保证析构返回时没有线程还在访问线程池
+ */
 template< typename T >
 threadpool< T >::~threadpool()
 {
-    delete [] m_threads;
+    m_queuelocker.lock();
     m_stop = true;
+    m_queuelocker.unlock();
+
+    wake_all();
+    m_manager_wake.post();
+    pthread_join( m_manager, NULL );
+
+    /*管理线程已退出, 此后只有本线程访问m_workers*/
+    while( ! m_workers.empty() )
+    {
+        worker_info *info = m_workers.front();
+        m_workers.pop_front();
+        pthread_join( info->tid, NULL );
+        delete info;
+    }
+    m_exited.clear();
+    for( int c = 0; c < m_class_count; ++c )
+    {
+        delete m_classes[ c ];
+    }
+    delete [] m_cpus;
+}
+
+/* 创建一个调度类*/
+template< typename T >
+void threadpool< T >::create_class_locked( const char *name, int min_threads, int max_threads,
+                                           int max_requests, int nice )
+{
+    sched_class *c = new sched_class;
+    strncpy( c->name, name, sizeof( c->name ) - 1 );
+    c->name[ sizeof( c->name ) - 1 ] = '\0';
+    c->min_threads = min_threads;
+    c->max_threads = max_threads;
+    c->max_requests = max_requests;
+    c->nice = nice;
+    c->nice_gen = 0;
+    c->head = c->tail = NULL;
+    c->queued = 0;
+    c->live = c->busy = c->retire = 0;
+    c->wait_ns_sum = c->wait_ns_max = c->dequeued = c->busy_ns_sum = 0;
+    c->period_done = c->completed = c->rejected = 0;
+    c->last = threadpool_stats();
+    c->codel_min_wait = LLONG_MAX;
+    c->codel_period_end = 0;
+    c->overloaded = false;
+    c->shed = 0;
+    m_classes[ m_class_count++ ] = c;
+}
+
+/* 创建一个工作线程
+ * pthread_create要分配栈, 比较慢, 不在锁内调用, 免得入队出队都等着它。先在锁内登记线程并计入
+ * 线程数, 新线程马上退出时也能在m_workers中找到自己; 只有构造函数和管理线程会创建线程,
+ * 而join(reap)也只在管理线程中进行, 所以创建完成之前info不会被join和释放
+ */
+template< typename T >
+bool threadpool< T >::spawn( int cls )
+{
+    worker_info *info = new worker_info;
+    info->pool = this;
+    info->cls = cls;
+    m_queuelocker.lock();
+    m_workers.push_back( info );
+    m_classes[ cls ]->live++;
+    m_queuelocker.unlock();
+
+    /* 在C++程序中使用pthread_create函数时，该函数的第3个参数必须
+     * 指向一个静态函数(worker), 而要在一个静态函数中使用类的动态
+     * 成员(包括成员变量和成员函数), 可以使用一种方法: 将类的对象
+     * 作为参数传递给该静态函数，然后再静态函数中引用这个对象，并
+     * 调用其静态方法
+     */
+    if( pthread_create( &info->tid, NULL, worker, info ) != 0 )
+    {
+        m_queuelocker.lock();
+        m_workers.remove( info );
+        m_classes[ cls ]->live--;
+        m_queuelocker.unlock();
+        delete info;
+        return false;
+    }
+    return true;
+}
+
+/* join已经退出的工作线程*/
+template< typename T >
+void threadpool< T >::reap()
+{
+    m_queuelocker.lock();
+    std::list< worker_info* > exited;
+    exited.swap( m_exited );
+    for( typename std::list< worker_info* >::iterator it = exited.begin(); it != exited.end(); ++it )
+    {
+        m_workers.remove( *it );
+    }
+    m_queuelocker.unlock();
+
+    for( typename std::list< worker_info* >::iterator it = exited.begin(); it != exited.end(); ++it )
+    {
+        pthread_join( ( *it )->tid, NULL );
+        delete *it;
+    }
 }
 
-/* 向任务队列中添加任务*/
+/* 向调度类cls的任务队列中添加任务*/
 template< typename T >
-bool threadpool< T >::append( T *request )
+bool threadpool< T >::append( T *request, int cls )
 {
     /*操作工作队列时一定要加锁，因为它是所有线程共享的*/
     m_queuelocker.lock();
+    if( cls < 0 || cls >= m_class_count )
+    {
+        cls = 0;
+    }
+    sched_class *c = m_classes[ cls ];
 
     /*超过任务数量上限，则不添加该任务*/
-    if( m_workqueue.size() > m_max_requests )
+    if( c->queued >= c->max_requests )
     {
+        c->rejected++;
         m_queuelocker.unlock();
         return false;
     }
 
-    m_workqueue.push_back( request );
+    /*过载时队首任务已经等待超过目标值, 新任务只会等得更久, 在入队前就拒绝它*/
+    long long now = now_ns();
+    if( c->overloaded && c->head && now - c->head->m_tp_enqueue_ns > m_shed_target_ns )
+    {
+        c->shed++;
+        m_queuelocker.unlock();
+        m_manager_wake.post();
+        return false;
+    }
+
+    request->m_tp_next = NULL;
+    request->m_tp_enqueue_ns = now;
+    if( c->tail )
+    {
+        c->tail->m_tp_next = request;
+    }
+    else
+    {
+        c->head = request;
+    }
+    c->tail = request;
+    c->queued++;
+    /*排队的任务比空闲线程多, 让管理线程尽快检查是否需要扩容; 一批任务同时入队(如挂起的CGI请求
+     *一起被唤醒)时空闲线程还没来得及取走任务, 只看忙碌线程数会漏掉这次唤醒*/
+    bool saturated = ( c->queued > c->live - c->busy ) && ( c->live < c->max_threads );
     m_queuelocker.unlock();
 
-    /*唤醒当前正在等待任务的一个线程*/
-    m_queuestat.post();
+    /*唤醒本类当前正在等待任务的一个线程*/
+    c->queuestat.post();
+    if( saturated )
+    {
+        m_manager_wake.post();
+    }
+    return true;
+}
+
+/* 设置调度类的参数
+ * 最小值提高时由管理线程补足; 当前线程数超过新的最大值时, 记下需要退出的线程数,
+ * 并唤醒相应数量的线程, 被唤醒的线程发现有退出名额就结束, 不会中断正在处理的任务
+ */
+template< typename T >
+bool threadpool< T >::set_class( int cls, const char *name, int min_threads, int max_threads,
+                                 int max_requests, int nice )
+{
+    if( min_threads <= 0 || max_threads < min_threads || max_requests <= 0 )
+    {
+        return false;
+    }
+
+    m_queuelocker.lock();
+    if( cls < 0 || cls > m_class_count || cls >= MAX_CLASSES )
+    {
+        m_queuelocker.unlock();
+        return false;
+    }
+    if( cls == m_class_count )
+    {
+        create_class_locked( name, min_threads, max_threads, max_requests, nice );
+    }
+
+    sched_class *c = m_classes[ cls ];
+    strncpy( c->name, name, sizeof( c->name ) - 1 );
+    c->min_threads = min_threads;
+    c->max_threads = max_threads;
+    c->max_requests = max_requests;
+    int wake = 0;
+    if( c->nice != nice )
+    {
+        c->nice = nice;
+        c->nice_gen++;
+        wake = c->live;
+    }
+    int excess = c->live - c->retire - max_threads;
+    if( excess > 0 )
+    {
+        c->retire += excess;
+        wake = wake > excess ? wake : excess;
+    }
+    m_queuelocker.unlock();
+
+    /*唤醒线程, 让它们退出或者设置新的nice值(空唤醒会因队列为空而继续等待)*/
+    for( int i = 0; i < wake; ++i )
+    {
+        c->queuestat.post();
+    }
+    m_manager_wake.post();
+    return true;
+}
+
+/* 设置扩容的排队时间目标值和空闲线程的退出时间*/
+template< typename T >
+void threadpool< T >::set_adaptive( int target_delay_us, int idle_timeout_ms )
+{
+    m_queuelocker.lock();
+    if( target_delay_us > 0 )
+    {
+        m_target_delay_ns = ( long long )target_delay_us * 1000;
+    }
+    if( idle_timeout_ms > 0 )
+    {
+        m_idle_timeout_ms = idle_timeout_ms;
+    }
+    m_queuelocker.unlock();
+}
+
+/* 设置削减负载的排队时间目标值和观察周期*/
+template< typename T >
+void threadpool< T >::set_shedding( int target_us, int interval_ms )
+{
+    m_queuelocker.lock();
+    m_shed_target_ns = ( long long )target_us * 1000;
+    if( interval_ms > 0 )
+    {
+        m_shed_interval_ns = ( long long )interval_ms * 1000000;
+    }
+    if( m_shed_target_ns == 0 )
+    {
+        for( int i = 0; i < m_class_count; ++i )
+        {
+            m_classes[ i ]->overloaded = false;
+        }
+    }
+    m_queuelocker.unlock();
+}
+
+/* 设置工作线程绑定的CPU集合, 各线程在下一次取任务前完成绑定*/
+template< typename T >
+void threadpool< T >::set_cpu_affinity( const int *cpus, int count )
+{
+    if( count <= 0 )
+    {
+        return;
+    }
+    m_queuelocker.lock();
+    delete [] m_cpus;
+    m_cpus = new int[ count ];
+    for( int i = 0; i < count; ++i )
+    {
+        m_cpus[ i ] = cpus[ i ];
+    }
+    m_cpu_count = count;
+    m_affinity_gen++;
+    m_queuelocker.unlock();
+
+    /*唤醒所有等待任务的线程, 让它们立即完成绑定(空唤醒会因队列为空而继续等待)*/
+    wake_all();
+}
+
+/* 唤醒所有类的所有线程
+ * 先在锁内记下各类的线程数: 被唤醒的线程可能马上退出并减少线程数, 不能边唤醒边读取
+ */
+template< typename T >
+void threadpool< T >::wake_all()
+{
+    int live[ MAX_CLASSES ];
+    m_queuelocker.lock();
+    int count = m_class_count;
+    for( int c = 0; c < count; ++c )
+    {
+        live[ c ] = m_classes[ c ]->live;
+    }
+    m_queuelocker.unlock();
+
+    for( int c = 0; c < count; ++c )
+    {
+        for( int i = 0; i < live[ c ]; ++i )
+        {
+            m_classes[ c ]->queuestat.post();
+        }
+    }
+}
+
+/* 调用时已持有m_queuelocker*/
+template< typename T >
+void threadpool< T >::update_affinity( int &gen )
+{
+    if( gen != m_affinity_gen )
+    {
+        gen = m_affinity_gen;
+        pin_self_to_cpus( m_cpus, m_cpu_count );
+    }
+}
+
+/* 调用时已持有m_queuelocker
+ * Linux上nice值是线程属性, 用线程id调用setpriority只影响当前线程;
+ * 工作线程fork出的子进程(CGI)也会继承这个nice值
+ */
+template< typename T >
+void threadpool< T >::update_priority( sched_class *c, int &gen )
+{
+    if( gen != c->nice_gen )
+    {
+        gen = c->nice_gen;
+        if( setpriority( PRIO_PROCESS, syscall( SYS_gettid ), c->nice ) < 0 )
+        {
+            log_error( "setpriority: %m" );
+        }
+    }
+}
+
+template< typename T >
+int threadpool< T >::class_count()
+{
+    m_queuelocker.lock();
+    int count = m_class_count;
+    m_queuelocker.unlock();
+    return count;
+}
+
+template< typename T >
+const char* threadpool< T >::class_name( int cls )
+{
+    if( cls < 0 || cls >= class_count() )
+    {
+        return NULL;
+    }
+    return m_classes[ cls ]->name;
+}
+
+/* 获取运行统计: 周期性的数据来自上一个统计周期, 其余为当前值*/
+template< typename T >
+bool threadpool< T >::get_stats( int cls, threadpool_stats *stats )
+{
+    m_queuelocker.lock();
+    if( cls < 0 || cls >= m_class_count )
+    {
+        m_queuelocker.unlock();
+        return false;
+    }
+    sched_class *c = m_classes[ cls ];
+    *stats = c->last;
+    stats->live_threads = c->live;
+    stats->busy_threads = c->busy;
+    stats->queued = c->queued;
+    stats->oldest_wait_us = c->head == NULL ? 0
+                          : ( now_ns() - c->head->m_tp_enqueue_ns ) / 1000;
+    stats->completed = c->completed;
+    stats->rejected = c->rejected;
+    stats->shed = c->shed;
+    stats->overloaded = c->overloaded;
+    m_queuelocker.unlock();
     return true;
 }
 
 /* 线程函数入口
- * 接受的参数是线程池对象, 因为worker函数是静态的不能调用非静态成员函数，
- * 所以从参数获取对象，通过对象来调用非静态成员函数
+ * 接受的参数是线程描述, 因为worker函数是静态的不能调用非静态成员函数，
+ * 所以从参数获取线程池对象，通过对象来调用非静态成员函数
  */
 template< typename T >
 void* threadpool< T >::worker( void *arg )
 {
-    threadpool *pool = (threadpool *)arg;
-    pool->run();
+    worker_info *info = ( worker_info* )arg;
+    threadpool *pool = info->pool;
+    pool->run( info->cls );
 
+    /*登记到已退出列表, 由管理线程(或析构函数)join*/
+    pool->m_queuelocker.lock();
+    pool->m_exited.push_back( info );
+    pool->m_queuelocker.unlock();
+    pool->m_manager_wake.post();
     return pool;
 }
 
 /* 线程函数核心*/
 template< typename T >
-void threadpool< T >::run()
+void threadpool< T >::run( int cls )
 {
-    while( ! m_stop )
+    sched_class *c = m_classes[ cls ];
+    int affinity_gen = 0;
+    int nice_gen = -1;
+    while( true )
     {
-        /*等待任务*/
-        m_queuestat.wait();
+        /*等待任务, 超时说明本线程空闲了一段时间*/
+        bool got = c->queuestat.timedwait( m_idle_timeout_ms );
 
         /*等到了任务，现在要在任务队列中取任务，对任务队列操作必须加锁*/
         m_queuelocker.lock();
-        if ( m_workqueue.empty() )
-        {/*其他线程抢先一步取走了任务*/
+        if ( m_stop )
+        {
+            c->live--;
+            m_queuelocker.unlock();
+            break;
+        }
+        /*线程数超过了最大值, 本线程退出; 唤醒本线程的可能是入队的任务, 把这次唤醒转给其他线程*/
+        if ( c->retire > 0 )
+        {
+            c->retire--;
+            c->live--;
+            m_queuelocker.unlock();
+            if( got )
+            {
+                c->queuestat.post();
+            }
+            break;
+        }
+        update_affinity( affinity_gen );
+        update_priority( c, nice_gen );
+        if ( c->head == NULL )
+        {
+            /*空闲超时, 且线程数多于常驻线程数, 本线程退出*/
+            if( ! got && c->live > c->min_threads )
+            {
+                c->live--;
+                m_queuelocker.unlock();
+                break;
+            }
+            /*其他线程抢先一步取走了任务*/
             m_queuelocker.unlock();
             continue;
         }
 
-        /*取任务*/
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
+        /*取任务, 并记录它的排队时间*/
+        T *request = c->head;
+        c->head = request->m_tp_next;
+        if( c->head == NULL )
+        {
+            c->tail = NULL;
+        }
+        c->queued--;
+        request->m_tp_next = NULL;
+        long long start = now_ns();
+        long long wait = start - request->m_tp_enqueue_ns;
+        c->wait_ns_sum += wait;
+        if( wait > c->wait_ns_max )
+        {
+            c->wait_ns_max = wait;
+        }
+        c->dequeued++;
+        c->busy++;
+        bool drop = shed_locked( c, wait, start );
         m_queuelocker.unlock();
-        if( ! request )
+
+        /*执行任务, 已经排队太久的任务只做快速拒绝, 并让管理线程检查是否还能扩容*/
+        if( drop )
         {
-            continue;
+            m_manager_wake.post();
+            request->reject();
+        }
+        else
+        {
+            request->process();
+        }
+
+        m_queuelocker.lock();
+        c->busy--;
+        c->completed++;
+        c->period_done++;
+        c->busy_ns_sum += now_ns() - start;
+        m_queuelocker.unlock();
+    }
+}
+
+/* CoDel式的过载判定与削减
+ * 排队时间的短暂尖峰(突发)会很快被消化, 不应该拒绝任何请求; 只有在整个观察周期内连排队
+ * 最短的任务都超过了目标值, 才说明队列里有一段持续的积压(线程数已扩到上限仍处理不过来),
+ * 此时进入过载状态: 入队时队首已等待超过目标值的新任务直接拒绝, 出队时排队超过两倍目标值
+ * 的任务放弃执行、快速应答, 于是被接受的请求的排队时间被限制在目标值附近。
+ * 不过载时不放弃任何任务; 队列被取空说明积压已经消除, 立即退出过载状态
+ */
+template< typename T >
+bool threadpool< T >::shed_locked( sched_class *c, long long wait, long long now )
+{
+    if( m_shed_target_ns <= 0 )
+    {
+        return false;
+    }
+    if( wait < c->codel_min_wait )
+    {
+        c->codel_min_wait = wait;
+    }
+    if( c->head == NULL )
+    {
+        c->overloaded = false;
+        c->codel_min_wait = LLONG_MAX;
+        c->codel_period_end = now + m_shed_interval_ns;
+    }
+    else if( now >= c->codel_period_end )
+    {
+        c->overloaded = c->codel_min_wait > m_shed_target_ns;
+        c->codel_min_wait = LLONG_MAX;
+        c->codel_period_end = now + m_shed_interval_ns;
+    }
+
+    bool drop = c->overloaded && wait > 2 * m_shed_target_ns;
+    if( drop )
+    {
+        c->shed++;
+    }
+    return drop;
+}
+
+template< typename T >
+void* threadpool< T >::manager( void *arg )
+{
+    threadpool *pool = ( threadpool* )arg;
+    pool->manage();
+    return pool;
+}
+
+/* 管理线程核心
+ * 平时睡眠, 被append(本类线程都在忙)、任务被丢弃、线程退出或set_class唤醒时逐个检查各调度类
+ * 队首任务的排队时间, 超过目标值就按积压量扩容, 并join已经退出的线程; 没有事件时也在每个
+ * 统计周期结束时醒来结转统计数据。新线程在锁外创建
+ */
+template< typename T >
+void threadpool< T >::manage()
+{
+    /*统计周期*/
+    const long long period_ns = 1000000000LL;
+
+    while( true )
+    {
+        long long left_ms = ( m_period_start + period_ns - now_ns() ) / 1000000 + 1;
+        m_manager_wake.timedwait( left_ms > 0 ? left_ms : 1 );
+        reap();
+
+        m_queuelocker.lock();
+        if( m_stop )
+        {
+            m_queuelocker.unlock();
+            break;
+        }
+
+        long long now = now_ns();
+        bool rollup = ( now - m_period_start >= period_ns );
+        long long elapsed = now - m_period_start;
+        int spawn_count[ MAX_CLASSES ];
+        int class_count = m_class_count;
+        for( int cls = 0; cls < m_class_count; ++cls )
+        {
+            sched_class *c = m_classes[ cls ];
+            long long oldest = c->head == NULL ? 0 : now - c->head->m_tp_enqueue_ns;
+            int idle = c->live - c->busy;
+            int want = c->live - c->retire;
+
+            /*队首任务等待太久, 或者排队的任务比空闲线程多: 按积压量扩容*/
+            if( oldest >= m_target_delay_ns || c->queued > idle )
+            {
+                int backlog = c->queued - ( idle > 0 ? idle : 0 );
+                want += backlog > 1 ? backlog : 1;
+            }
+            if( want < c->min_threads )
+            {
+                want = c->min_threads;
+            }
+            if( want > c->max_threads )
+            {
+                want = c->max_threads;
+            }
+            spawn_count[ cls ] = want - ( c->live - c->retire );
+
+            /*结转统计周期*/
+            if( rollup )
+            {
+                c->last.avg_wait_us = c->dequeued ? c->wait_ns_sum / c->dequeued / 1000 : 0;
+                c->last.max_wait_us = c->wait_ns_max / 1000;
+                c->last.avg_service_us = c->period_done ? c->busy_ns_sum / c->period_done / 1000 : 0;
+                c->last.utilization = c->live ? ( double )c->busy_ns_sum / ( ( double )elapsed * c->live ) : 0;
+                if( c->last.utilization > 1.0 )
+                {
+                    c->last.utilization = 1.0;
+                }
+                c->wait_ns_sum = c->wait_ns_max = c->dequeued = c->busy_ns_sum = c->period_done = 0;
+            }
+        }
+        if( rollup )
+        {
+            m_period_start = now;
         }
+        m_queuelocker.unlock();
 
-        /*执行任务*/
-        request->process();
+        for( int cls = 0; cls < class_count; ++cls )
+        {
+            for( int i = 0; i < spawn_count[ cls ] && spawn( cls ); ++i )
+            {
+            }
+        }
     }
 }
 #endif
@@ -0,0 +1,94 @@
+/*************************************************************************
+	> File Name: tls.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 23时24分51秒
+ ************************************************************************/
+#include "./tls.h"
+#include "./async_log.h"
+#include <string.h>
+
+/* 所有HTTPS连接共用的SSL_CTX, 启动后只读*/
+static SSL_CTX *g_ctx = NULL;
+
+/* ALPN协议列表(长度前缀格式)*/
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+static const unsigned char alpn_http11[] = "\x08http/1.1";
+
+/* ALPN选择回调: 按服务器的偏好顺序选择客户端也支持的协议, 都不支持时不协商*/
+static int select_alpn( SSL *, const unsigned char **out, unsigned char *outlen,
+                        const unsigned char *in, unsigned int inlen, void *arg )
+{
+    const unsigned char *prefs = ( const unsigned char* )arg;
+    unsigned int prefs_len = prefs == alpn_h2 ? sizeof( alpn_h2 ) - 1 : sizeof( alpn_http11 ) - 1;
+    unsigned char *selected;
+    if( SSL_select_next_proto( &selected, outlen, prefs, prefs_len, in, inlen ) != OPENSSL_NPN_NEGOTIATED )
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_init( const char *cert_file, const char *key_file, bool ktls, bool h2 )
+{
+    g_ctx = SSL_CTX_new( TLS_server_method() );
+    if( ! g_ctx )
+    {
+        tls_log_errors( "SSL_CTX_new" );
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( g_ctx, TLS1_2_VERSION );
+    /* 不支持重新协商: 工作线程阻塞发送应答时不必处理握手消息
+     * 写缓冲满时SSL_write返回已写出的部分, 重试时缓冲区地址可以变化(输出队列每次从断点处重新取数据)
+     */
+    SSL_CTX_set_options( g_ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE );
+    SSL_CTX_set_mode( g_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                             | SSL_MODE_RELEASE_BUFFERS );
+    if( ktls )
+    {
+        /* 会话密钥生效时, OpenSSL用setsockopt(TCP_ULP, "tls")把加密交给内核*/
+        SSL_CTX_set_options( g_ctx, SSL_OP_ENABLE_KTLS );
+    }
+    SSL_CTX_set_alpn_select_cb( g_ctx, select_alpn, ( void* )( h2 ? alpn_h2 : alpn_http11 ) );
+
+    if( SSL_CTX_use_certificate_chain_file( g_ctx, cert_file ) != 1
+        || SSL_CTX_use_PrivateKey_file( g_ctx, key_file, SSL_FILETYPE_PEM ) != 1
+        || SSL_CTX_check_private_key( g_ctx ) != 1 )
+    {
+        tls_log_errors( cert_file );
+        SSL_CTX_free( g_ctx );
+        g_ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+SSL* tls_new( int fd )
+{
+    SSL *ssl = SSL_new( g_ctx );
+    if( ! ssl )
+    {
+        tls_log_errors( "SSL_new" );
+        return NULL;
+    }
+    SSL_set_fd( ssl, fd );
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+bool tls_ktls_send( SSL *ssl )
+{
+    return BIO_get_ktls_send( SSL_get_wbio( ssl ) ) > 0;
+}
+
+void tls_log_errors( const char *what )
+{
+    unsigned long err;
+    while( ( err = ERR_get_error() ) != 0 )
+    {
+        char buf[ 128 ];
+        ERR_error_string_n( err, buf, sizeof( buf ) );
+        log_error( "%s: %s", what, buf );
+    }
+}
@@ -0,0 +1,35 @@
+/*************************************************************************
+	> File Name: tls.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月19日 星期一 23时16分08秒
+ ************************************************************************/
+
+#ifndef _TLS_H
+#define _TLS_H
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* HTTPS: 握手由OpenSSL完成, 之后尽量把记录的加密交给内核(kTLS)
+ * 内核接管发送方向后, 应答仍然可以直接writev/sendfile到套接字上, 由内核加密, 不必经过
+ * 用户态的加密缓冲; 内核不支持时退回到SSL_write。接收方向总是通过SSL_read, 启用了kTLS
+ * 接收时OpenSSL会直接从内核读取解密后的数据
+ */
+
+/* 加载证书和私钥, 创建全局的SSL_CTX(仅在启动时调用一次)
+ * @ktls : 是否尝试启用kTLS
+ * @h2 : ALPN协商时是否提供h2
+ */
+bool tls_init( const char *cert_file, const char *key_file, bool ktls, bool h2 );
+
+/* 为新接受的连接创建SSL对象, 处于等待握手的服务器状态, 失败返回NULL*/
+SSL* tls_new( int fd );
+
+/* 握手完成后, 发送方向是否已经由内核加密*/
+bool tls_ktls_send( SSL *ssl );
+
+/* 把OpenSSL错误队列中的错误写到错误日志, 并清空错误队列*/
+void tls_log_errors( const char *what );
+
+#endif
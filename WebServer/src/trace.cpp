@@ -0,0 +1,207 @@
+/*************************************************************************
+	> File Name: trace.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 04时31分08秒
+ ************************************************************************/
+
+#include "./trace.h"
+#include "./async_log.h"
+#include "./locker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <cpuid.h>
+#endif
+
+/* 一条慢请求记录*/
+struct slow_request
+{
+    struct timespec time;              /* 请求结束的时间*/
+    struct sockaddr_in peer;
+    const char *method;                /* 指向静态字符串*/
+    int status;
+    long long bytes;
+    bool h2;
+    int stalls;
+    int total_us;
+    int stage_us[ TRACE_STAGE_NUMBER ];  /* 到达该阶段时距请求开始的微秒数, -1表示没有经过*/
+    char url[ LOG_TEXT_LEN ];
+};
+
+bool g_trace_tsc = false;
+/* 每微秒的时钟周期数, 不用TSC时时间点就是纳秒*/
+static double g_ticks_per_us = 1000.0;
+/* 慢请求阈值(时钟周期数, 原子操作), 0表示不记录*/
+static unsigned long long g_threshold = 0;
+static int g_threshold_ms = 0;
+
+/* 慢请求环形缓冲区: 只有慢请求才会加锁写入, 正常请求只比较一次阈值*/
+static slow_request *g_slow = NULL;
+static int g_slow_size = 0;
+static long long g_slow_count = 0;    /* 累计记录的慢请求数*/
+static locker g_slow_lock;
+
+static const char *stage_names[ TRACE_STAGE_NUMBER ] =
+{
+    "begin", "read", "queue", "parse", "stat", "mmap", "fork", "upstream",
+    "first_byte", "fill", "write_wait", "done"
+};
+
+/* CPU是否有不变的TSC: CPUID 0x80000007的EDX第8位*/
+static bool invariant_tsc()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    unsigned int eax, ebx, ecx, edx;
+    if( __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) )
+    {
+        return edx & ( 1u << 8 );
+    }
+#endif
+    return false;
+}
+
+/* 用单调时钟测出TSC的频率*/
+static bool calibrate()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    struct timespec begin, end;
+    clock_gettime( CLOCK_MONOTONIC, &begin );
+    unsigned long long t0 = __rdtsc();
+    struct timespec wait = { 0, 20000000 };
+    while( nanosleep( &wait, &wait ) < 0 )
+    {
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    unsigned long long t1 = __rdtsc();
+    long long ns = ( end.tv_sec - begin.tv_sec ) * 1000000000LL + end.tv_nsec - begin.tv_nsec;
+    if( ns <= 0 || t1 <= t0 )
+    {
+        return false;
+    }
+    g_ticks_per_us = ( double )( t1 - t0 ) * 1000.0 / ns;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool trace_init( int ring_size )
+{
+    g_trace_tsc = invariant_tsc() && calibrate();
+    if( ! g_trace_tsc )
+    {
+        g_ticks_per_us = 1000.0;
+    }
+    g_slow = new slow_request[ ring_size ];
+    if( ! g_slow )
+    {
+        return false;
+    }
+    memset( g_slow, 0, sizeof( slow_request ) * ring_size );
+    g_slow_size = ring_size;
+    return true;
+}
+
+void trace_set_threshold( int threshold_ms )
+{
+    g_threshold_ms = threshold_ms;
+    __atomic_store_n( &g_threshold, ( unsigned long long )( threshold_ms * 1000.0 * g_ticks_per_us ),
+                      __ATOMIC_RELAXED );
+}
+
+int trace_us( const req_trace *t, int from, int to )
+{
+    if( ! t->t[ from ] || ! t->t[ to ] || t->t[ to ] < t->t[ from ] )
+    {
+        return 0;
+    }
+    return ( t->t[ to ] - t->t[ from ] ) / g_ticks_per_us;
+}
+
+void trace_finish( const req_trace *t, const sockaddr_in &peer, const char *method,
+                   const char *url, const char *query, int status, long long bytes, bool h2 )
+{
+    unsigned long long threshold = __atomic_load_n( &g_threshold, __ATOMIC_RELAXED );
+    if( threshold == 0 || ! g_slow || ! t->t[ TRACE_BEGIN ] || t->t[ TRACE_DONE ] < t->t[ TRACE_BEGIN ]
+        || t->t[ TRACE_DONE ] - t->t[ TRACE_BEGIN ] < threshold )
+    {
+        return;
+    }
+
+    g_slow_lock.lock();
+    slow_request *r = &g_slow[ g_slow_count++ % g_slow_size ];
+    clock_gettime( CLOCK_REALTIME, &r->time );
+    r->peer = peer;
+    r->method = method;
+    r->status = status;
+    r->bytes = bytes;
+    r->h2 = h2;
+    r->stalls = t->stalls;
+    r->total_us = trace_us( t, TRACE_BEGIN, TRACE_DONE );
+    for( int i = 0; i < TRACE_STAGE_NUMBER; ++i )
+    {
+        r->stage_us[ i ] = t->t[ i ] ? trace_us( t, TRACE_BEGIN, i ) : -1;
+    }
+    snprintf( r->url, sizeof( r->url ), "%s%s%s", url ? url : "-", query ? "?" : "", query ? query : "" );
+    g_slow_lock.unlock();
+}
+
+/* 输出一条慢请求: 各阶段按到达的先后排列, 每个阶段给出距上一阶段的微秒数*/
+static int dump_one( const slow_request *r, char *buf, int size )
+{
+    int order[ TRACE_STAGE_NUMBER ];
+    int count = 0;
+    for( int i = 0; i < TRACE_STAGE_NUMBER; ++i )
+    {
+        if( r->stage_us[ i ] < 0 )
+        {
+            continue;
+        }
+        int j = count++;
+        while( j > 0 && r->stage_us[ order[ j - 1 ] ] > r->stage_us[ i ] )
+        {
+            order[ j ] = order[ j - 1 ];
+            --j;
+        }
+        order[ j ] = i;
+    }
+
+    struct tm tm;
+    localtime_r( &r->time.tv_sec, &tm );
+    int len = snprintf( buf, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03ld %s %s %s %s %d %lld bytes, %d us:",
+                        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                        r->time.tv_nsec / 1000000, inet_ntoa( r->peer.sin_addr ), r->h2 ? "h2" : "http/1.1",
+                        r->method ? r->method : "-", r->url, r->status, r->bytes, r->total_us );
+    for( int k = 1; k < count && len < size; ++k )
+    {
+        len += snprintf( buf + len, size - len, " %s +%d", stage_names[ order[ k ] ],
+                         r->stage_us[ order[ k ] ] - r->stage_us[ order[ k - 1 ] ] );
+    }
+    if( len < size )
+    {
+        len += snprintf( buf + len, size - len, ", write stalls %d\n", r->stalls );
+    }
+    return len < size ? len : size;
+}
+
+int trace_dump( char *buf, int size )
+{
+    if( size <= 0 )
+    {
+        return 0;
+    }
+    g_slow_lock.lock();
+    long long count = g_slow_count;
+    int shown = count < g_slow_size ? count : g_slow_size;
+    int len = snprintf( buf, size, "slow requests: %lld (threshold %d ms, clock %s), latest %d:\n",
+                        count, g_threshold_ms, g_trace_tsc ? "tsc" : "monotonic", shown );
+    len = len < size ? len : size - 1;
+    for( int i = 0; i < shown && len < size - 1; ++i )
+    {
+        len += dump_one( &g_slow[ ( count - 1 - i ) % g_slow_size ], buf + len, size - len );
+    }
+    g_slow_lock.unlock();
+    return len < size ? len : size - 1;
+}
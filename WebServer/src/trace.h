@@ -0,0 +1,106 @@
+/*************************************************************************
+	> File Name: trace.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 04时12分36秒
+ ************************************************************************/
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+/* 请求处理的阶段, 每个阶段记下到达它的时间点; 同一请求不一定经过所有阶段*/
+enum TRACE_STAGE
+{
+    TRACE_BEGIN = 0,        /* 读到请求的第一批数据*/
+    TRACE_READ,             /* 最近一次读完数据, 随后交给线程池或内联处理*/
+    TRACE_DEQUEUE,          /* 开始处理(与上一阶段之差是在线程池中排队的时间)*/
+    TRACE_PARSED,           /* 请求行和头部解析完, 找到了路由*/
+    TRACE_STAT,             /* 查完响应缓存或stat完文件*/
+    TRACE_MAPPED,           /* 文件打开并mmap完*/
+    TRACE_FORKED,           /* CGI子进程已经启动*/
+    TRACE_UPSTREAM,         /* 取得了到上游服务器的连接*/
+    TRACE_FIRST_BYTE,       /* 收到CGI程序或上游服务器的第一批输出*/
+    TRACE_FILLED,           /* 应答填充完毕(流式应答是发出头部时)*/
+    TRACE_WRITE_WAIT,       /* 第一次因为客户端收得慢而等待套接字可写*/
+    TRACE_DONE,             /* 应答发送完毕*/
+    TRACE_STAGE_NUMBER
+};
+
+/* 当前时间点(时钟周期数)
+ * CPU有不变的TSC(频率恒定、各核同步)时直接读TSC, 只要几纳秒, 不进内核也不查vDSO;
+ * 否则退回单调时钟的纳秒数。换算成微秒只在请求结束时做一次
+ */
+extern bool g_trace_tsc;
+static inline unsigned long long trace_now()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    if( g_trace_tsc )
+    {
+        return __rdtsc();
+    }
+#endif
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned long long )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 一个请求经过各阶段的时间点, 由连接(或HTTP/2的流)携带, 请求结束时算出各阶段耗时*/
+struct req_trace
+{
+    unsigned long long t[ TRACE_STAGE_NUMBER ];  /* 0表示没有经过该阶段*/
+    int stalls;                                  /* 等待套接字可写的次数*/
+
+    void reset() { memset( this, 0, sizeof( *this ) ); }
+    void mark( int stage ) { t[ stage ] = trace_now(); }
+    void mark_once( int stage )
+    {
+        if( ! t[ stage ] )
+        {
+            t[ stage ] = trace_now();
+        }
+    }
+    /* 开始处理请求; 流水线中的后续请求没有经过读取, 从这里算起*/
+    void start()
+    {
+        t[ TRACE_DEQUEUE ] = trace_now();
+        if( ! t[ TRACE_BEGIN ] )
+        {
+            t[ TRACE_BEGIN ] = t[ TRACE_READ ] = t[ TRACE_DEQUEUE ];
+        }
+    }
+    /* 客户端收得慢, 发送要等待套接字可写*/
+    void stall()
+    {
+        mark_once( TRACE_WRITE_WAIT );
+        ++stalls;
+    }
+};
+
+/* 校准时钟并分配慢请求环形缓冲区(启动时调用一次)
+ * @ring_size : 最多保留的慢请求数, 写满后覆盖最早的
+ */
+bool trace_init( int ring_size );
+
+/* 设置慢请求的阈值(毫秒), 0表示不记录; 重新加载配置时可以修改*/
+void trace_set_threshold( int threshold_ms );
+
+/* 两个阶段之间的微秒数, 任一阶段没有经过时为0*/
+int trace_us( const req_trace *t, int from, int to );
+
+/* 请求结束: 总耗时超过阈值时把各阶段的时间点记入慢请求环形缓冲区
+ * @url, @query : 请求的路径和查询串(可为NULL)
+ */
+void trace_finish( const req_trace *t, const sockaddr_in &peer, const char *method,
+                   const char *url, const char *query, int status, long long bytes, bool h2 );
+
+/* 输出慢请求环形缓冲区的内容, 最近的在前, 返回写入的长度*/
+int trace_dump( char *buf, int size );
+
+#endif
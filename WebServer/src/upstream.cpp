@@ -0,0 +1,490 @@
+/*************************************************************************
+	> File Name: upstream.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 03时05分38秒
+ ************************************************************************/
+#include "./upstream.h"
+#include "./async_log.h"
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* 所有上游服务器组, 启动后只读*/
+static upstream **g_upstreams = NULL;
+static int g_upstream_count = 0;
+
+/* 健康检查线程没有任务时的检查周期, 也是清理空闲池的周期*/
+static const int HEALTH_TICK_MS = 1000;
+
+upstream::upstream( const upstream_config &cfg, int reactor_count )
+    :m_cfg( cfg ), m_reactor_count( reactor_count ), m_rr( 0 )
+{
+    m_servers = new server[ m_cfg.server_count ];
+    memset( m_servers, 0, sizeof( server ) * m_cfg.server_count );
+    m_pools = new idle_pool[ reactor_count ];
+    for( int i = 0; i < reactor_count; ++i )
+    {
+        m_pools[ i ].fds = new int[ m_cfg.server_count * ( m_cfg.max_idle > 0 ? m_cfg.max_idle : 1 ) ];
+        m_pools[ i ].count = new int[ m_cfg.server_count ];
+        memset( m_pools[ i ].count, 0, sizeof( int ) * m_cfg.server_count );
+    }
+}
+
+upstream::~upstream()
+{
+    for( int i = 0; i < m_reactor_count; ++i )
+    {
+        for( int s = 0; s < m_cfg.server_count; ++s )
+        {
+            for( int k = 0; k < m_pools[ i ].count[ s ]; ++k )
+            {
+                close( m_pools[ i ].fds[ s * m_cfg.max_idle + k ] );
+            }
+        }
+        delete [] m_pools[ i ].fds;
+        delete [] m_pools[ i ].count;
+    }
+    delete [] m_pools;
+    delete [] m_servers;
+}
+
+bool upstream::init()
+{
+    for( int s = 0; s < m_cfg.server_count; ++s )
+    {
+        const char *text = m_cfg.servers[ s ];
+        server *srv = &m_servers[ s ];
+        if( strncmp( text, "unix:", 5 ) == 0 )
+        {
+            sockaddr_un *un = ( sockaddr_un* )&srv->addr;
+            if( strlen( text + 5 ) >= sizeof( un->sun_path ) || text[ 5 ] == '\0' )
+            {
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            strcpy( un->sun_path, text + 5 );
+            srv->addr_len = sizeof( sockaddr_un );
+            continue;
+        }
+
+        /* IPv4的"IP:端口", 或者IPv6的"[IP]:端口"*/
+        const char *colon = strrchr( text, ':' );
+        if( ! colon )
+        {
+            return false;
+        }
+        int port = atoi( colon + 1 );
+        char host[ 64 ];
+        int host_len = colon - text;
+        if( host_len > 1 && text[ 0 ] == '[' && text[ host_len - 1 ] == ']' )
+        {
+            text++;
+            host_len -= 2;
+        }
+        if( port <= 0 || port > 65535 || host_len <= 0 || host_len >= ( int )sizeof( host ) )
+        {
+            return false;
+        }
+        memcpy( host, text, host_len );
+        host[ host_len ] = '\0';
+        sockaddr_in *in4 = ( sockaddr_in* )&srv->addr;
+        sockaddr_in6 *in6 = ( sockaddr_in6* )&srv->addr;
+        if( inet_pton( AF_INET, host, &in4->sin_addr ) == 1 )
+        {
+            in4->sin_family = AF_INET;
+            in4->sin_port = htons( port );
+            srv->addr_len = sizeof( sockaddr_in );
+        }
+        else if( inet_pton( AF_INET6, host, &in6->sin6_addr ) == 1 )
+        {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons( port );
+            srv->addr_len = sizeof( sockaddr_in6 );
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* 在没试过的服务器中选进行中请求最少的, 优先选没被摘除的; 从轮转位置开始比较, 负载相同时轮流选择*/
+int upstream::pick( unsigned int tried )
+{
+    int n = m_cfg.server_count;
+    unsigned int start = __atomic_fetch_add( &m_rr, 1, __ATOMIC_RELAXED );
+    int best = -1;
+    int best_load = 0;
+    int best_down = 1;
+    for( int k = 0; k < n; ++k )
+    {
+        int s = ( start + k ) % n;
+        if( tried & ( 1u << s ) )
+        {
+            continue;
+        }
+        int down = __atomic_load_n( &m_servers[ s ].down, __ATOMIC_RELAXED );
+        int load = __atomic_load_n( &m_servers[ s ].outstanding, __ATOMIC_RELAXED );
+        if( best < 0 || down < best_down || ( down == best_down && load < best_load ) )
+        {
+            best = s;
+            best_load = load;
+            best_down = down;
+        }
+    }
+    return best;
+}
+
+bool upstream_wait( int fd, short events, int timeout_ms )
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    while( true )
+    {
+        int ret = poll( &pfd, 1, timeout_ms );
+        if( ret < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        return ret > 0;
+    }
+}
+
+/* 非阻塞地建立连接, 最多等待connect_timeout_ms*/
+int upstream::connect_to( int s )
+{
+    server *srv = &m_servers[ s ];
+    int fd = socket( srv->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        log_error( "upstream %s: socket: %m", m_cfg.name );
+        return -1;
+    }
+    if( connect( fd, ( sockaddr* )&srv->addr, srv->addr_len ) < 0 )
+    {
+        int err = errno;
+        if( err == EINPROGRESS )
+        {
+            socklen_t len = sizeof( err );
+            err = ETIMEDOUT;
+            if( upstream_wait( fd, POLLOUT, m_cfg.connect_timeout_ms ) )
+            {
+                getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len );
+            }
+        }
+        if( err != 0 )
+        {
+            log_error( "upstream %s: connect %s: %s", m_cfg.name, m_cfg.servers[ s ], strerror( err ) );
+            close( fd );
+            return -1;
+        }
+    }
+    if( srv->addr.ss_family != AF_UNIX )
+    {
+        int on = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    }
+    return fd;
+}
+
+bool upstream::stale( int fd )
+{
+    char c;
+    ssize_t n = recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    return ! ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) );
+}
+
+int upstream::pop_idle( int reactor, int s )
+{
+    if( m_cfg.max_idle <= 0 )
+    {
+        return -1;
+    }
+    idle_pool *pool = &m_pools[ reactor ];
+    while( true )
+    {
+        int fd = -1;
+        pool->lock.lock();
+        if( pool->count[ s ] > 0 )
+        {
+            fd = pool->fds[ s * m_cfg.max_idle + --pool->count[ s ] ];
+        }
+        pool->lock.unlock();
+        if( fd < 0 || ! stale( fd ) )
+        {
+            return fd;
+        }
+        close( fd );
+    }
+}
+
+int upstream::acquire( int reactor, unsigned int tried, int *server, bool *reused )
+{
+    int s;
+    while( ( s = pick( tried ) ) >= 0 )
+    {
+        tried |= 1u << s;
+        __atomic_add_fetch( &m_servers[ s ].outstanding, 1, __ATOMIC_RELAXED );
+        __atomic_add_fetch( &m_servers[ s ].requests, 1, __ATOMIC_RELAXED );
+        *server = s;
+        int fd = pop_idle( reactor, s );
+        if( fd >= 0 )
+        {
+            *reused = true;
+            return fd;
+        }
+        fd = connect_to( s );
+        if( fd >= 0 )
+        {
+            *reused = false;
+            return fd;
+        }
+        release( reactor, s, -1, UPSTREAM_FAILED );
+    }
+    return -1;
+}
+
+void upstream::release( int reactor, int s, int fd, int result )
+{
+    server *srv = &m_servers[ s ];
+    __atomic_sub_fetch( &srv->outstanding, 1, __ATOMIC_RELAXED );
+    if( result == UPSTREAM_FAILED )
+    {
+        /* 没有健康检查时不摘除, 否则被摘除的服务器再也回不来*/
+        int fails = __atomic_add_fetch( &srv->fails, 1, __ATOMIC_RELAXED );
+        if( m_cfg.health_interval_ms > 0 && m_cfg.max_fails > 0 && fails >= m_cfg.max_fails )
+        {
+            mark( s, true );
+        }
+    }
+    else
+    {
+        __atomic_store_n( &srv->fails, 0, __ATOMIC_RELAXED );
+    }
+    if( fd < 0 )
+    {
+        return;
+    }
+    if( result == UPSTREAM_KEEP && m_cfg.max_idle > 0 )
+    {
+        idle_pool *pool = &m_pools[ reactor ];
+        bool kept = false;
+        pool->lock.lock();
+        if( pool->count[ s ] < m_cfg.max_idle )
+        {
+            pool->fds[ s * m_cfg.max_idle + pool->count[ s ]++ ] = fd;
+            kept = true;
+        }
+        pool->lock.unlock();
+        if( kept )
+        {
+            return;
+        }
+    }
+    close( fd );
+}
+
+void upstream::mark( int s, bool down )
+{
+    if( __atomic_exchange_n( &m_servers[ s ].down, down ? 1 : 0, __ATOMIC_RELAXED ) != ( down ? 1 : 0 ) )
+    {
+        log_error( "upstream %s: server %s is %s", m_cfg.name, m_cfg.servers[ s ], down ? "down" : "up" );
+    }
+    if( ! down )
+    {
+        __atomic_store_n( &m_servers[ s ].fails, 0, __ATOMIC_RELAXED );
+    }
+}
+
+/* 健康检查: 能建立连接即可; 配置了检查路径时还要发送GET请求, 应答2xx或3xx才算健康*/
+bool upstream::probe( int s )
+{
+    int fd = connect_to( s );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    if( m_cfg.health_check[ 0 ] == '\0' )
+    {
+        close( fd );
+        return true;
+    }
+    char buf[ 512 ];
+    int len = snprintf( buf, sizeof( buf ), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                        m_cfg.health_check,
+                        m_servers[ s ].addr.ss_family == AF_UNIX ? "localhost" : m_cfg.servers[ s ] );
+    bool ok = false;
+    if( send( fd, buf, len, MSG_NOSIGNAL ) == len )
+    {
+        /* 只需要状态行: "HTTP/1.1 200"*/
+        int got = 0;
+        while( got < 12 && upstream_wait( fd, POLLIN, m_cfg.timeout_ms ) )
+        {
+            ssize_t n = recv( fd, buf + got, sizeof( buf ) - 1 - got, 0 );
+            if( n <= 0 )
+            {
+                break;
+            }
+            got += n;
+        }
+        buf[ got ] = '\0';
+        int status = got >= 12 && strncmp( buf, "HTTP/1.", 7 ) == 0 ? atoi( buf + 9 ) : 0;
+        ok = status >= 200 && status < 400;
+    }
+    close( fd );
+    return ok;
+}
+
+void upstream::check_health()
+{
+    for( int s = 0; s < m_cfg.server_count; ++s )
+    {
+        mark( s, ! probe( s ) );
+    }
+}
+
+void upstream::sweep_idle()
+{
+    if( m_cfg.max_idle <= 0 )
+    {
+        return;
+    }
+    for( int r = 0; r < m_reactor_count; ++r )
+    {
+        idle_pool *pool = &m_pools[ r ];
+        pool->lock.lock();
+        for( int s = 0; s < m_cfg.server_count; ++s )
+        {
+            int *fds = pool->fds + s * m_cfg.max_idle;
+            int kept = 0;
+            for( int k = 0; k < pool->count[ s ]; ++k )
+            {
+                if( stale( fds[ k ] ) )
+                {
+                    close( fds[ k ] );
+                }
+                else
+                {
+                    fds[ kept++ ] = fds[ k ];
+                }
+            }
+            pool->count[ s ] = kept;
+        }
+        pool->lock.unlock();
+    }
+}
+
+int upstream::status( char *buf, int size )
+{
+    int len = 0;
+    for( int s = 0; s < m_cfg.server_count && len < size; ++s )
+    {
+        int idle = 0;
+        for( int i = 0; i < m_reactor_count; ++i )
+        {
+            idle += __atomic_load_n( &m_pools[ i ].count[ s ], __ATOMIC_RELAXED );
+        }
+        server *srv = &m_servers[ s ];
+        int n = snprintf( buf + len, size - len,
+                          "upstream %s %s: %s, outstanding %d, idle %d, requests %lld\n",
+                          m_cfg.name, m_cfg.servers[ s ],
+                          __atomic_load_n( &srv->down, __ATOMIC_RELAXED ) ? "down" : "up",
+                          __atomic_load_n( &srv->outstanding, __ATOMIC_RELAXED ), idle,
+                          __atomic_load_n( &srv->requests, __ATOMIC_RELAXED ) );
+        len += n < size - len ? n : size - len - 1;
+    }
+    return len;
+}
+
+/* 健康检查线程: 各组按自己的间隔检查, 每个周期清理一次空闲池*/
+static void* health_checker( void * )
+{
+    long long *due = new long long[ g_upstream_count ];
+    memset( due, 0, sizeof( long long ) * g_upstream_count );
+    while( true )
+    {
+        long long now = log_now_ns() / 1000000;
+        for( int i = 0; i < g_upstream_count; ++i )
+        {
+            upstream *u = g_upstreams[ i ];
+            int interval = u->config().health_interval_ms;
+            if( interval > 0 && now >= due[ i ] )
+            {
+                u->check_health();
+                due[ i ] = now + interval;
+            }
+            u->sweep_idle();
+        }
+        int sleep_ms = HEALTH_TICK_MS;
+        now = log_now_ns() / 1000000;
+        for( int i = 0; i < g_upstream_count; ++i )
+        {
+            if( g_upstreams[ i ]->config().health_interval_ms > 0 && due[ i ] - now < sleep_ms )
+            {
+                sleep_ms = due[ i ] - now > 0 ? due[ i ] - now : 0;
+            }
+        }
+        usleep( sleep_ms * 1000 );
+    }
+    return NULL;
+}
+
+bool upstream_init( const upstream_config *cfgs, int count, int reactor_count )
+{
+    if( count == 0 )
+    {
+        return true;
+    }
+    g_upstreams = new upstream*[ count ];
+    for( int i = 0; i < count; ++i )
+    {
+        g_upstreams[ i ] = new upstream( cfgs[ i ], reactor_count );
+        if( ! g_upstreams[ i ]->init() )
+        {
+            printf( "upstream %s has an invalid server address\n", cfgs[ i ].name );
+            return false;
+        }
+    }
+    g_upstream_count = count;
+
+    pthread_t tid;
+    if( pthread_create( &tid, NULL, health_checker, NULL ) != 0 )
+    {
+        return false;
+    }
+    pthread_detach( tid );
+    return true;
+}
+
+upstream* upstream_find( const char *name )
+{
+    for( int i = 0; i < g_upstream_count; ++i )
+    {
+        if( strcmp( g_upstreams[ i ]->config().name, name ) == 0 )
+        {
+            return g_upstreams[ i ];
+        }
+    }
+    return NULL;
+}
+
+int upstream_status( char *buf, int size )
+{
+    int len = 0;
+    for( int i = 0; i < g_upstream_count && len < size - 1; ++i )
+    {
+        len += g_upstreams[ i ]->status( buf + len, size - len );
+    }
+    return len;
+}
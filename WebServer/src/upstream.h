@@ -0,0 +1,122 @@
+/*************************************************************************
+	> File Name: upstream.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 02时47分15秒
+ ************************************************************************/
+
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include <sys/socket.h>
+#include "./locker.h"
+
+/* 一组上游服务器中最多的服务器数*/
+#define MAX_UPSTREAM_SERVERS 32
+
+/* 上游服务器组的配置(仅在启动时生效)*/
+struct upstream_config
+{
+    char name[ 32 ];                /* 组名, 路由中以upstream引用*/
+    char servers[ MAX_UPSTREAM_SERVERS ][ 112 ];  /* "IP:端口"或者"unix:套接字路径"*/
+    int server_count;
+    int max_idle;                   /* 每个反应堆为每台服务器保留的空闲长连接数*/
+    int connect_timeout_ms;         /* 建立连接的最长时间*/
+    int timeout_ms;                 /* 等待上游读写的最长时间*/
+    char health_check[ 128 ];       /* 健康检查请求的路径, 为空时只检查能否建立连接*/
+    int health_interval_ms;         /* 健康检查的间隔, 0表示不检查(也不会摘除服务器)*/
+    int max_fails;                  /* 连续失败多少次后摘除该服务器, 直到健康检查通过*/
+};
+
+/* 一次转发结束时上游连接的去向*/
+enum UPSTREAM_RESULT
+{
+    UPSTREAM_KEEP = 0,    /* 应答完整, 连接放回空闲池*/
+    UPSTREAM_CLOSE,       /* 应答完整(或是客户端出了问题), 但连接不能复用*/
+    UPSTREAM_FAILED       /* 上游出错, 关闭连接并记一次失败*/
+};
+
+/* 一组上游服务器(反向代理的目标)
+ * 选择服务器时取进行中请求最少的健康服务器(least outstanding requests), 计数由所有反应堆共享;
+ * 全部被摘除时退而在所有服务器中选择, 总比直接失败好。
+ * 到每台服务器的空闲长连接按反应堆分池存放: 工作线程使用连接所属反应堆的池, 不同反应堆的
+ * 请求互不争用同一把锁。放在池里的连接可能已被上游关闭, 取出时用MSG_PEEK确认;
+ * 健康检查线程也会定期清理已经失效的空闲连接
+ */
+class upstream
+{
+public:
+    upstream( const upstream_config &cfg, int reactor_count );
+    ~upstream();
+
+    /* 解析服务器地址, 地址无效时返回false*/
+    bool init();
+
+    /* 选一台服务器并取得到它的连接(非阻塞套接字), 优先复用本反应堆池中的空闲连接
+     * 返回连接, 并由server带回服务器编号、reused带回是否复用的连接; 所有服务器都连不上时返回-1
+     * @tried : 本次请求已经试过的服务器(位图), 不再选择它们
+     */
+    int acquire( int reactor, unsigned int tried, int *server, bool *reused );
+    /* 一次转发结束, 按result归还或关闭连接*/
+    void release( int reactor, int server, int fd, int result );
+
+    /* 检查所有服务器的健康状况, 由健康检查线程按health_interval_ms调用*/
+    void check_health();
+    /* 关闭空闲池中已被上游关闭的连接, 免得它们一直停在CLOSE_WAIT状态, 由健康检查线程定期调用*/
+    void sweep_idle();
+
+    const upstream_config& config() const { return m_cfg; }
+    const char* server_name( int server ) const { return m_cfg.servers[ server ]; }
+    /* 输出各服务器的状态(进行中的请求、空闲连接、健康状况), 返回写入的长度*/
+    int status( char *buf, int size );
+
+private:
+    /* 一台服务器*/
+    struct server
+    {
+        sockaddr_storage addr;
+        socklen_t addr_len;
+        int outstanding;          /* 进行中的请求数(原子操作)*/
+        int fails;                /* 连续失败的次数(原子操作)*/
+        int down;                 /* 是否已被摘除(原子操作)*/
+        long long requests;       /* 累计转发的请求数(原子操作)*/
+    };
+    /* 一个反应堆的空闲连接池, 每台服务器一个栈, 各max_idle个槽位*/
+    struct idle_pool
+    {
+        locker lock;
+        int *fds;
+        int *count;
+    };
+
+    int pick( unsigned int tried );
+    int connect_to( int server );
+    /* 从池中取出一条空闲连接, 没有时返回-1*/
+    int pop_idle( int reactor, int server );
+    /* 连接上是否有未读的数据或对方已经关闭(空闲连接不应该收到任何数据)*/
+    static bool stale( int fd );
+    /* 向一台服务器发送健康检查, 返回是否健康*/
+    bool probe( int server );
+    void mark( int server, bool down );
+
+private:
+    upstream_config m_cfg;
+    server *m_servers;
+    int m_reactor_count;
+    idle_pool *m_pools;
+    unsigned int m_rr;            /* 进行中的请求数相同时轮流选择(原子操作)*/
+};
+
+/* 按配置创建所有上游服务器组, 需要时启动健康检查线程(仅在启动时调用一次)*/
+bool upstream_init( const upstream_config *cfgs, int count, int reactor_count );
+
+/* 按名字查找上游服务器组, 没有时返回NULL*/
+upstream* upstream_find( const char *name );
+
+/* 输出所有上游服务器组的状态, 供服务器状态页使用*/
+int upstream_status( char *buf, int size );
+
+/* 以指定的超时时间等待fd上的事件, 超时或出错返回false*/
+bool upstream_wait( int fd, short events, int timeout_ms );
+
+#endif
@@ -0,0 +1,297 @@
+/*************************************************************************
+	> File Name: url.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 00时44分03秒
+ ************************************************************************/
+#include "./url.h"
+#include <string.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 返回p开始的len个字节中第一个a、b或c的位置, 都没有时返回len*/
+static int find_any( const char *p, int len, char a, char b, char c )
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    const __m128i vc = _mm_set1_epi8( c );
+    for( ; i + 16 <= len; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )( p + i ) );
+        __m128i m = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, va ), _mm_cmpeq_epi8( v, vb ) ),
+                                  _mm_cmpeq_epi8( v, vc ) );
+        int bits = _mm_movemask_epi8( m );
+        if( bits )
+        {
+            return i + __builtin_ctz( bits );
+        }
+    }
+#endif
+    for( ; i < len; ++i )
+    {
+        if( p[ i ] == a || p[ i ] == b || p[ i ] == c )
+        {
+            return i;
+        }
+    }
+    return len;
+}
+
+/* 路径中是否有"//"或"/."(可能是"."或".."段), 没有时路径已经是规范的
+ * 每16个字节算出'/'和'.'的位掩码, 某个'/'的下一个字节是'/'或'.'即为命中; 跨块的一对用上一块的最高位衔接
+ */
+static bool need_normalize( const char *p, int len )
+{
+    int i = 0;
+    bool last_slash = false;
+#ifdef __SSE2__
+    const __m128i slash = _mm_set1_epi8( '/' );
+    const __m128i dot = _mm_set1_epi8( '.' );
+    for( ; i + 16 <= len; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )( p + i ) );
+        unsigned int s = _mm_movemask_epi8( _mm_cmpeq_epi8( v, slash ) );
+        unsigned int d = _mm_movemask_epi8( _mm_cmpeq_epi8( v, dot ) );
+        if( ( s & ( ( s | d ) >> 1 ) ) || ( last_slash && ( ( s | d ) & 1 ) ) )
+        {
+            return true;
+        }
+        last_slash = s & 0x8000;
+    }
+#endif
+    for( ; i < len; ++i )
+    {
+        if( last_slash && ( p[ i ] == '/' || p[ i ] == '.' ) )
+        {
+            return true;
+        }
+        last_slash = p[ i ] == '/';
+    }
+    return false;
+}
+
+static int hex_value( char c )
+{
+    if( c >= '0' && c <= '9' )
+    {
+        return c - '0';
+    }
+    if( c >= 'a' && c <= 'f' )
+    {
+        return c - 'a' + 10;
+    }
+    if( c >= 'A' && c <= 'F' )
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* 逐段重写路径, 段之间只留一个'/', 去掉"."段, ".."段回退到上一个'/'
+ * 写入位置始终不超过读取位置(每个输出段之前至少有一个输入的'/'), 可以原地进行
+ */
+static bool normalize( char *p, int len, int *out_len )
+{
+    int w = 0;
+    int r = 0;
+    bool dir = false;     /* 最后一段是否指向目录*/
+    while( r < len )
+    {
+        while( r < len && p[ r ] == '/' )
+        {
+            r++;
+        }
+        int s = r;
+        while( r < len && p[ r ] != '/' )
+        {
+            r++;
+        }
+        int n = r - s;
+        if( n == 0 || ( n == 1 && p[ s ] == '.' ) )
+        {
+            dir = true;
+            continue;
+        }
+        if( n == 2 && p[ s ] == '.' && p[ s + 1 ] == '.' )
+        {
+            if( w == 0 )
+            {
+                return false;
+            }
+            while( p[ --w ] != '/' )
+            {
+            }
+            dir = true;
+            continue;
+        }
+        p[ w++ ] = '/';
+        memmove( p + w, p + s, n );
+        w += n;
+        dir = false;
+    }
+    if( w == 0 || dir )
+    {
+        p[ w++ ] = '/';
+    }
+    p[ w ] = '\0';
+    *out_len = w;
+    return true;
+}
+
+bool url_canonicalize( char *url, char **query )
+{
+    *query = NULL;
+    int len = strlen( url );
+    int r = 0;
+    int w = 0;
+    while( r < len )
+    {
+        /* 整段复制到下一个需要处理的字符, 没有转义时写入位置和读取位置相同, 不需要移动*/
+        int n = find_any( url + r, len - r, '%', '?', '#' );
+        if( w != r )
+        {
+            memmove( url + w, url + r, n );
+        }
+        w += n;
+        r += n;
+        if( r >= len )
+        {
+            break;
+        }
+        if( url[ r ] == '?' )
+        {
+            char *q = url + r + 1;
+            q[ find_any( q, len - r - 1, '#', '#', '#' ) ] = '\0';
+            *query = q;
+            break;
+        }
+        if( url[ r ] == '#' )
+        {
+            break;
+        }
+        int hi = hex_value( url[ r + 1 ] );
+        int lo = hi < 0 ? -1 : hex_value( url[ r + 2 ] );
+        if( lo < 0 || ( hi | lo ) == 0 )
+        {
+            return false;
+        }
+        url[ w++ ] = ( char )( hi << 4 | lo );
+        r += 3;
+    }
+    url[ w ] = '\0';
+    if( w == 0 || url[ 0 ] != '/' )
+    {
+        return false;
+    }
+    return ! need_normalize( url, w ) || normalize( url, w, &w );
+}
+
+/* 原地解码查询串中的一个名字或值*/
+static void decode_component( char *p )
+{
+    int len = strlen( p );
+    int r = 0;
+    int w = 0;
+    while( r < len )
+    {
+        int n = find_any( p + r, len - r, '%', '+', '%' );
+        if( w != r )
+        {
+            memmove( p + w, p + r, n );
+        }
+        w += n;
+        r += n;
+        if( r >= len )
+        {
+            break;
+        }
+        if( p[ r ] == '+' )
+        {
+            p[ w++ ] = ' ';
+            r++;
+            continue;
+        }
+        int hi = hex_value( p[ r + 1 ] );
+        int lo = hi < 0 ? -1 : hex_value( p[ r + 2 ] );
+        if( lo < 0 || ( hi | lo ) == 0 )
+        {
+            p[ w++ ] = p[ r++ ];
+            continue;
+        }
+        p[ w++ ] = ( char )( hi << 4 | lo );
+        r += 3;
+    }
+    p[ w ] = '\0';
+}
+
+int url_parse_query( char *query, url_param *params, int max )
+{
+    int count = 0;
+    char *p = query;
+    while( p && *p && count < max )
+    {
+        char *next = strchr( p, '&' );
+        if( next )
+        {
+            *next++ = '\0';
+        }
+        if( *p )
+        {
+            char *value = strchr( p, '=' );
+            if( value )
+            {
+                *value++ = '\0';
+                decode_component( value );
+            }
+            decode_component( p );
+            params[ count ].name = p;
+            params[ count ].value = value ? value : "";
+            count++;
+        }
+        p = next;
+    }
+    return count;
+}
+
+const char* url_find_param( const url_param *params, int count, const char *name )
+{
+    for( int i = 0; i < count; ++i )
+    {
+        if( strcmp( params[ i ].name, name ) == 0 )
+        {
+            return params[ i ].value;
+        }
+    }
+    return NULL;
+}
+
+int url_encode_path( const char *path, char *out, int size )
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int n = 0;
+    for( const unsigned char *p = ( const unsigned char* )path; *p; ++p )
+    {
+        /* RFC 3986中pchar和'/'之外的字节都要转义*/
+        bool plain = isalnum( *p ) || strchr( "/-._~!$&'()*+,;=:@", *p );
+        if( n + ( plain ? 1 : 3 ) >= size )
+        {
+            return -1;
+        }
+        if( plain )
+        {
+            out[ n++ ] = *p;
+        }
+        else
+        {
+            out[ n++ ] = '%';
+            out[ n++ ] = hex[ *p >> 4 ];
+            out[ n++ ] = hex[ *p & 15 ];
+        }
+    }
+    out[ n ] = '\0';
+    return n;
+}
@@ -0,0 +1,48 @@
+/*************************************************************************
+	> File Name: url.h
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 00时31分26秒
+ ************************************************************************/
+
+#ifndef _URL_H
+#define _URL_H
+
+/* 请求目标(URL)的解码与规范化
+ * 同一个文件可以有多种写法(/a/./b、/a//b、/a/c/../b、/%61/b), 文件查找和完整响应缓存
+ * 都必须以唯一的规范形式为键, 否则编码过的路径找不到文件, 同一文件在缓存中也会有多份。
+ * 扫描要特殊处理的字符时一次比较16个字节(SSE2), 绝大多数URL没有转义和./..,
+ * 只需一遍向量扫描就能确认, 不必逐字节处理
+ */
+
+/* 一个查询参数, 名字和值都已解码*/
+struct url_param
+{
+    const char *name;
+    const char *value;
+};
+
+/* 原地解码并规范化请求目标的路径部分
+ * 百分号转义被解码; 连续的'/'合并成一个; "."段被去掉, ".."段与前一段抵消;
+ * 路径以目录结尾("/a/"、"/a/.")时保留结尾的'/'。查询串从路径中分离出来, 本身不解码
+ * @url : 以'/'开头、以'\0'结尾, 规范化后的路径写回url开头(只会变短)
+ * @query : 返回查询串('?'之后、'#'之前)的起始位置, 没有查询串时为NULL
+ * 转义无效、解码出'\0'或者".."越过了根目录时返回false, 应答400
+ */
+bool url_canonicalize( char *url, char **query );
+
+/* 把查询串解析成参数: 以'&'分隔, 名字和值以'='分隔, 都按表单编码解码('+'是空格)
+ * 原地修改query, 最多解析max个参数, 返回参数个数。无效的转义原样保留
+ */
+int url_parse_query( char *query, url_param *params, int max );
+
+/* 在参数中查找名字为name的参数的值, 没有时返回NULL*/
+const char* url_find_param( const url_param *params, int count, const char *name );
+
+/* 把解码后的路径重新编码成可以放进请求行的形式(转发给上游服务器时使用)
+ * 路径中允许出现的字符原样保留, 其余字节写成百分号转义
+ * 返回写入out的长度(不含结尾的'\0'), size不够时返回-1
+ */
+int url_encode_path( const char *path, char *out, int size );
+
+#endif
@@ -166,6 +166,38 @@ int get_val_array( const char *path, void **val, int count, int value_type )
     return 0;
 }
 
+/* 判断配置文件中是否存在某个变量
+ * @path : 变量在配置文件中位置
+ */
+int exist_val( const char *path )
+{
+    if( !p_conf || !path )
+    {
+        return 0;
+    }
+
+    return config_lookup( p_conf, path ) != NULL ? 1 : 0;
+}
+
+/* 获取数组或列表变量的元素个数
+ * @path : 变量在配置文件中位置
+ */
+int get_val_count( const char *path )
+{
+    if( !p_conf || !path )
+    {
+        return -1;
+    }
+
+    config_setting_t *p_set = config_lookup( p_conf, path );
+    if( p_set == NULL || ( ! config_setting_is_array( p_set ) && ! config_setting_is_list( p_set ) ) )
+    {
+        return -1;
+    }
+
+    return config_setting_length( p_set );
+}
+
 /* 初始化并打开配置文件
  * @filename: 配置文件绝对路径名
  */
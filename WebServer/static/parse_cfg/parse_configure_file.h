@@ -33,6 +33,18 @@ int get_val_single( const char *path, void *val, int value_type );
  */
 int get_val_array( const char *path, void **val, int count, int value_type );
 
+/* 判断配置文件中是否存在某个变量, 用于读取有默认值的可选配置项
+ * @path : 变量在配置文件中位置
+ * 返回值: 存在返回1, 不存在返回0
+ */
+int exist_val( const char *path );
+
+/* 获取配置文件中数组或列表变量的元素个数
+ * @path : 变量在配置文件中位置
+ * 返回值: 元素个数, 变量不存在或不是数组/列表时返回-1
+ */
+int get_val_count( const char *path );
+
 /* 初始化并打开配置文件
  * @filename: 配置文件绝对路径名
  */
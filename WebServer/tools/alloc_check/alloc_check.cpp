@@ -0,0 +1,245 @@
+/*************************************************************************
+	> File Name: alloc_check.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 16时31分52秒
+ ************************************************************************/
+
+/* 检查长连接上处理请求是否还会向堆申请内存: 服务器要用make ALLOC_COUNT=1编译, 状态页中才有
+ * 整个进程的"heap allocations"计数。在同一个长连接上先发-w个请求预热(连接池、arena的固定块、
+ * 各种缓存都在这时建立), 再连续取两次状态页, 两次之差是取状态页本身的分配次数; 然后发-n个请求,
+ * 再取一次状态页, 计数的增长超出取状态页本身的部分就是这些请求造成的, 不为0时返回1
+ *
+ * 工作线程在处理第一个请求时才建立自己的一些状态, 预热的请求数要足够让每个工作线程都处理过请求
+ *
+ * 用法: ./alloc_check -p 8000 -u /index.html -n 1000
+ * 测试期间不要有其他客户端访问服务器, 否则计数会包含它们的请求
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* 应答头部的最大长度*/
+static const int HEADER_MAX = 16384;
+
+static int g_fd = -1;
+static char g_buf[ HEADER_MAX ];
+static int g_len = 0;
+
+/* 在长连接上发一个GET请求并收完应答, 消息体存入body(最多body_size - 1个字节), 返回状态码, 出错返回-1*/
+static int request( const char *path, char *body, int body_size )
+{
+    char req[ 1024 ];
+    int req_len = snprintf( req, sizeof( req ),
+                            "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", path );
+    if( req_len >= ( int )sizeof( req ) )
+    {
+        return -1;
+    }
+    for( int sent = 0; sent < req_len; )
+    {
+        ssize_t n = send( g_fd, req + sent, req_len - sent, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        sent += n;
+    }
+
+    /* 收齐头部*/
+    char *end;
+    while( ( end = ( char* )memmem( g_buf, g_len, "\r\n\r\n", 4 ) ) == NULL )
+    {
+        if( g_len == HEADER_MAX )
+        {
+            return -1;
+        }
+        ssize_t n = recv( g_fd, g_buf + g_len, HEADER_MAX - g_len, 0 );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        g_len += n;
+    }
+    int head_len = end + 4 - g_buf;
+    end[ 2 ] = '\0';
+    int status = 0;
+    sscanf( g_buf, "HTTP/%*d.%*d %d", &status );
+    const char *cl = strcasestr( g_buf, "\r\nContent-Length:" );
+    bool closing = strcasestr( g_buf, "\r\nConnection: close" ) != NULL;
+    if( ! cl || closing )
+    {
+        fprintf( stderr, "%s: response is not keep-alive with Content-Length\n", path );
+        return -1;
+    }
+    long long left = atoll( cl + 17 );
+
+    /* 收消息体, 读缓冲区里多出来的部分留给下一个应答*/
+    int body_used = 0;
+    memmove( g_buf, g_buf + head_len, g_len - head_len );
+    g_len -= head_len;
+    while( left > 0 )
+    {
+        if( g_len == 0 )
+        {
+            ssize_t n = recv( g_fd, g_buf, HEADER_MAX, 0 );
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            if( n <= 0 )
+            {
+                return -1;
+            }
+            g_len = n;
+        }
+        int take = left < g_len ? left : g_len;
+        int copy = take < body_size - 1 - body_used ? take : body_size - 1 - body_used;
+        if( body && copy > 0 )
+        {
+            memcpy( body + body_used, g_buf, copy );
+            body_used += copy;
+        }
+        memmove( g_buf, g_buf + take, g_len - take );
+        g_len -= take;
+        left -= take;
+    }
+    if( body )
+    {
+        body[ body_used ] = '\0';
+    }
+    return status;
+}
+
+/* 取状态页中的进程堆分配次数, 失败返回-1*/
+static long long heap_allocs( const char *status_path )
+{
+    static char page[ 65536 ];
+    if( request( status_path, page, sizeof( page ) ) != 200 )
+    {
+        return -1;
+    }
+    /* 要匹配行首, 不能匹配到"arena heap allocations"*/
+    const char *p = strstr( page, "\nheap allocations:" );
+    if( ! p )
+    {
+        fprintf( stderr, "no \"heap allocations\" in %s, was the server built with make ALLOC_COUNT=1?\n",
+                 status_path );
+        return -1;
+    }
+    return atoll( p + 18 );
+}
+
+static void usage( const char *prog )
+{
+    fprintf( stderr,
+             "usage: %s [options]\n"
+             "  -s ip       server address (127.0.0.1)\n"
+             "  -p port     server port (8000)\n"
+             "  -u path     request path (/index.html)\n"
+             "  -n number   requests to check (1000)\n"
+             "  -w number   warm-up requests (1000)\n"
+             "  -S path     status page path (/server-status)\n", prog );
+}
+
+int main( int argc, char *argv[] )
+{
+    const char *ip = "127.0.0.1";
+    int port = 8000;
+    const char *path = "/index.html";
+    int number = 1000;
+    int warmup = 1000;
+    const char *status_path = "/server-status";
+    int opt;
+    while( ( opt = getopt( argc, argv, "s:p:u:n:w:S:h" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 's': ip = optarg; break;
+            case 'p': port = atoi( optarg ); break;
+            case 'u': path = optarg; break;
+            case 'n': number = atoi( optarg ); break;
+            case 'w': warmup = atoi( optarg ); break;
+            case 'S': status_path = optarg; break;
+            default: usage( argv[ 0 ] ); return 1;
+        }
+    }
+
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    if( inet_pton( AF_INET, ip, &addr.sin_addr ) != 1 )
+    {
+        fprintf( stderr, "bad address %s\n", ip );
+        return 1;
+    }
+    g_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( g_fd < 0 || connect( g_fd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 )
+    {
+        perror( "connect" );
+        return 1;
+    }
+
+    for( int i = 0; i < warmup; ++i )
+    {
+        if( request( path, NULL, 0 ) < 0 )
+        {
+            fprintf( stderr, "warm-up request %d failed\n", i );
+            return 1;
+        }
+    }
+    long long first = heap_allocs( status_path );
+    if( first < 0 )
+    {
+        return 1;
+    }
+    long long before = heap_allocs( status_path );
+    if( before < 0 )
+    {
+        return 1;
+    }
+    int status = 0;
+    for( int i = 0; i < number; ++i )
+    {
+        status = request( path, NULL, 0 );
+        if( status < 0 )
+        {
+            fprintf( stderr, "request %d failed\n", i );
+            return 1;
+        }
+    }
+    long long after = heap_allocs( status_path );
+    if( after < 0 )
+    {
+        return 1;
+    }
+    close( g_fd );
+
+    long long per_status = before - first;
+    long long grown = after - before - per_status;
+    printf( "%d keep-alive requests for %s (status %d): heap allocations %lld -> %lld, "
+            "status page itself %lld, requests %lld\n",
+            number, path, status, before, after, per_status, grown );
+    if( grown != 0 )
+    {
+        printf( "FAIL: the requests allocated from the heap\n" );
+        return 1;
+    }
+    printf( "OK\n" );
+    return 0;
+}
@@ -0,0 +1,369 @@
+/*************************************************************************
+	> File Name: backend.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 15时12分08秒
+ ************************************************************************/
+
+/* 反向代理测试用的上游服务器桩: 每个连接一个线程, 支持HTTP/1.1长连接, 请求消息体可以是
+ * Content-Length或chunked编码的。任何请求都应答200, 消息体说明收到了什么(方法、路径、消息体长度、
+ * X-Forwarded-For), 再按-s补足长度; 应答头部带X-Backend, 可以看出请求被转发到了哪台服务器
+ *
+ * 用法: ./backend -p 9000                 //监听127.0.0.1:9000
+ *       ./backend -U /tmp/backend.sock     //监听unix域套接字
+ *       -d 毫秒: 应答前等待(模拟慢的上游)  -s 字节: 消息体至少这么长  -c: 应答后关闭连接
+ * 对应的web.cfg配置:
+ *   upstreams = ( { name="backend"; servers=[ "127.0.0.1:9000" ]; health_check="/health"; } );
+ *   routes = ( { match="prefix"; path="/api/"; handler="proxy"; upstream="backend"; }, ... );
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+/* 请求头部的最大长度*/
+static const int HEADER_MAX = 16384;
+
+static int g_delay_ms = 0;
+static int g_body_size = 0;
+static bool g_close = false;
+static char g_name[ 128 ];
+
+/* 从连接上读数据, 先用掉buf中已有的; 连接关闭或出错返回-1*/
+struct reader
+{
+    int fd;
+    char buf[ HEADER_MAX ];
+    int len;
+    int pos;
+
+    int fill()
+    {
+        if( pos > 0 )
+        {
+            memmove( buf, buf + pos, len - pos );
+            len -= pos;
+            pos = 0;
+        }
+        if( len == HEADER_MAX )
+        {
+            return -1;
+        }
+        ssize_t n;
+        do
+        {
+            n = recv( fd, buf + len, HEADER_MAX - len, 0 );
+        } while( n < 0 && errno == EINTR );
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        len += n;
+        return n;
+    }
+    /* 读一行(不含\r\n), 返回行首, 失败返回NULL*/
+    char* line()
+    {
+        while( true )
+        {
+            char *eol = ( char* )memchr( buf + pos, '\n', len - pos );
+            if( eol )
+            {
+                char *start = buf + pos;
+                pos = eol + 1 - buf;
+                *eol = '\0';
+                if( eol > start && eol[ -1 ] == '\r' )
+                {
+                    eol[ -1 ] = '\0';
+                }
+                return start;
+            }
+            if( fill() < 0 )
+            {
+                return NULL;
+            }
+        }
+    }
+    /* 跳过n个字节的消息体, 失败返回false*/
+    bool skip( long long n )
+    {
+        while( n > 0 )
+        {
+            if( pos == len && fill() < 0 )
+            {
+                return false;
+            }
+            long long take = len - pos < n ? len - pos : n;
+            pos += take;
+            n -= take;
+        }
+        return true;
+    }
+};
+
+static bool send_all( int fd, const char *data, int len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = send( fd, data, len, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 处理一个连接上的所有请求*/
+static void* serve( void *arg )
+{
+    reader *r = ( reader* )arg;
+    while( true )
+    {
+        char *request_line = r->line();
+        if( ! request_line || ! *request_line )
+        {
+            break;
+        }
+        char method[ 16 ] = "", path[ 1024 ] = "";
+        sscanf( request_line, "%15s %1023s", method, path );
+
+        long long content_length = 0;
+        bool chunked = false;
+        bool client_close = false;
+        char forwarded[ 256 ] = "-";
+        char *line;
+        while( ( line = r->line() ) && *line )
+        {
+            if( strncasecmp( line, "Content-Length:", 15 ) == 0 )
+            {
+                content_length = atoll( line + 15 );
+            }
+            else if( strncasecmp( line, "Transfer-Encoding:", 18 ) == 0 )
+            {
+                chunked = strcasestr( line + 18, "chunked" ) != NULL;
+            }
+            else if( strncasecmp( line, "Connection:", 11 ) == 0 )
+            {
+                client_close = strcasestr( line + 11, "close" ) != NULL;
+            }
+            else if( strncasecmp( line, "X-Forwarded-For:", 16 ) == 0 )
+            {
+                snprintf( forwarded, sizeof( forwarded ), "%s", line + 16 + strspn( line + 16, " " ) );
+            }
+        }
+        if( ! line )
+        {
+            break;
+        }
+
+        /* 读掉消息体, 只记长度*/
+        long long body_len = 0;
+        bool ok = true;
+        if( chunked )
+        {
+            while( ok )
+            {
+                char *size_line = r->line();
+                long long size = size_line ? strtoll( size_line, NULL, 16 ) : -1;
+                if( size < 0 )
+                {
+                    ok = false;
+                    break;
+                }
+                if( size == 0 )
+                {
+                    /* 尾部字段直到空行*/
+                    while( ( line = r->line() ) && *line )
+                    {
+                    }
+                    ok = line != NULL;
+                    break;
+                }
+                ok = r->skip( size ) && r->line() != NULL;
+                body_len += size;
+            }
+        }
+        else
+        {
+            ok = r->skip( content_length );
+            body_len = content_length;
+        }
+        if( ! ok )
+        {
+            break;
+        }
+
+        if( g_delay_ms > 0 )
+        {
+            usleep( g_delay_ms * 1000 );
+        }
+        char body[ 2048 ];
+        int body_used = snprintf( body, sizeof( body ), "%s %s %s body=%lld forwarded-for=%s\n",
+                                  g_name, method, path, body_len, forwarded );
+        if( body_used >= ( int )sizeof( body ) )
+        {
+            body_used = sizeof( body ) - 1;
+        }
+        long long total = body_used > g_body_size ? body_used : g_body_size;
+        bool close_after = g_close || client_close;
+        char head[ 512 ];
+        int head_len = snprintf( head, sizeof( head ),
+                                 "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %lld\r\n"
+                                 "X-Backend: %s\r\nConnection: %s\r\n\r\n",
+                                 total, g_name, close_after ? "close" : "keep-alive" );
+        if( ! send_all( r->fd, head, head_len ) )
+        {
+            break;
+        }
+        /* HEAD请求只有头部*/
+        if( strcmp( method, "HEAD" ) != 0 )
+        {
+            if( ! send_all( r->fd, body, body_used ) )
+            {
+                break;
+            }
+            char pad[ 4096 ];
+            memset( pad, '.', sizeof( pad ) );
+            long long left = total - body_used;
+            while( left > 0 )
+            {
+                int n = left < ( long long )sizeof( pad ) ? left : sizeof( pad );
+                if( ! send_all( r->fd, pad, n ) )
+                {
+                    left = -1;
+                    break;
+                }
+                left -= n;
+            }
+            if( left < 0 )
+            {
+                break;
+            }
+        }
+        if( close_after )
+        {
+            break;
+        }
+    }
+    close( r->fd );
+    delete r;
+    return NULL;
+}
+
+static void usage( const char *prog )
+{
+    fprintf( stderr, "usage: %s [-p port | -U unix_socket_path] [-d delay_ms] [-s body_size] [-c]\n", prog );
+}
+
+int main( int argc, char *argv[] )
+{
+    int port = 9000;
+    const char *unix_path = NULL;
+    int opt;
+    while( ( opt = getopt( argc, argv, "p:U:d:s:ch" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'p': port = atoi( optarg ); break;
+            case 'U': unix_path = optarg; break;
+            case 'd': g_delay_ms = atoi( optarg ); break;
+            case 's': g_body_size = atoi( optarg ); break;
+            case 'c': g_close = true; break;
+            default: usage( argv[ 0 ] ); return 1;
+        }
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    int listenfd;
+    if( unix_path )
+    {
+        struct sockaddr_un addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sun_family = AF_UNIX;
+        if( strlen( unix_path ) >= sizeof( addr.sun_path ) )
+        {
+            fprintf( stderr, "socket path too long\n" );
+            return 1;
+        }
+        strcpy( addr.sun_path, unix_path );
+        unlink( unix_path );
+        listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if( listenfd < 0 || bind( listenfd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 )
+        {
+            perror( "bind" );
+            return 1;
+        }
+        snprintf( g_name, sizeof( g_name ), "unix:%s", unix_path );
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( port );
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        listenfd = socket( AF_INET, SOCK_STREAM, 0 );
+        int on = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+        if( listenfd < 0 || bind( listenfd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 )
+        {
+            perror( "bind" );
+            return 1;
+        }
+        snprintf( g_name, sizeof( g_name ), "127.0.0.1:%d", port );
+    }
+    if( listen( listenfd, 1024 ) < 0 )
+    {
+        perror( "listen" );
+        return 1;
+    }
+    printf( "backend listening on %s\n", g_name );
+    fflush( stdout );
+
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    while( true )
+    {
+        int fd = accept( listenfd, NULL, NULL );
+        if( fd < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+            /* 描述符用完时等已有连接关闭一些*/
+            if( errno == EMFILE || errno == ENFILE )
+            {
+                usleep( 10000 );
+                continue;
+            }
+            perror( "accept" );
+            return 1;
+        }
+        reader *r = new reader;
+        r->fd = fd;
+        r->len = r->pos = 0;
+        pthread_t tid;
+        if( pthread_create( &tid, &attr, serve, r ) != 0 )
+        {
+            close( fd );
+            delete r;
+        }
+    }
+}
@@ -0,0 +1,1123 @@
+/*************************************************************************
+	> File Name: soak.cpp
+	> Author: WishSun
+	> Mail: WishSun_Cn@163.com
+	> Created Time: 2026年10月20日 星期二 13时05分27秒
+ ************************************************************************/
+
+/* 连接规模浸泡测试(C10K/C100K): 在本机上对bin/server建立并保持大量连接, 观察连接数逼近以至超过
+ * max_fd时内存、延迟和accept速度的变化
+ *
+ * 三类连接按限定的速度(-r)逐步建立, 断开的连接按同样的速度重新建立:
+ *   idle    : 发一个长连接请求, 收到应答后一直空闲地保持着
+ *   trickle : 慢速客户端, 每隔-T毫秒只发请求的一个字节, 收完应答后再慢慢发下一个
+ *   active  : 一小部分连接不停地发请求(收到应答立即发下一个), 测量请求延迟
+ * 测试期间另有一个线程每隔-i毫秒采样一次服务器: /proc/<pid>/status的VmRSS、/proc/<pid>/fd的描述符数,
+ * 以及状态页(-S)中的连接数和各反应堆事件循环的轮数、每轮处理时间、拒绝的连接数。
+ * 每个采样周期输出一行进度, 结束时输出完整报告(-o指定文件时同时写入文件)。
+ *
+ * 用法: ./soak -p 8000 -n 20000 -t 500 -a 32 -r 2000 -d 60 -P $(pidof server) -o report.txt
+ * 单个源地址到同一端口最多只有本地端口范围(net.ipv4.ip_local_port_range)那么多连接,
+ * 更多的连接用-b指定多个源地址(127.0.0.1、127.0.0.2、...)。本进程和服务器的RLIMIT_NOFILE
+ * 都要大于连接数; 服务器的状态页只统计接收请求的那个进程, prefork模式下要按工作进程分别看
+ */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+
+/* 连接的类型*/
+enum CONN_KIND
+{
+    KIND_IDLE = 0,
+    KIND_TRICKLE,
+    KIND_ACTIVE,
+    KIND_NUMBER
+};
+
+/* 连接的状态*/
+enum CONN_STATE
+{
+    ST_CLOSED = 0,      /* 等待(重新)建立*/
+    ST_CONNECTING,      /* 非阻塞connect进行中*/
+    ST_SENDING,         /* 正在发送请求*/
+    ST_TRICKLE,         /* 慢速发送请求, 每次一个字节*/
+    ST_READING,         /* 正在接收应答*/
+    ST_HOLD             /* 空闲的长连接*/
+};
+
+/* 一个测试连接; 连接数以万计, 只有正在接收应答头部时才分配头部缓冲区*/
+struct soak_conn
+{
+    int fd;
+    char kind;
+    char state;
+    short status;             /* 应答的状态码*/
+    int sent;                 /* 请求已经发出的字节数*/
+    int hdr_len;
+    char *hdr;                /* 应答头部, 收齐头部后释放*/
+    long long body_left;      /* 应答消息体还剩多少字节, -1表示读到连接关闭为止, -2表示还在收头部*/
+    bool close_after;         /* 应答带Connection: close*/
+    long long t_start;        /* connect开始或请求开始发送的时间(微秒)*/
+    long long t_next;         /* 慢速连接下一次发送的时间*/
+};
+
+/* 对数分桶的直方图(微秒): 64以下每个值一个桶, 之后每个2的幂分32个桶, 误差约3%*/
+struct histogram
+{
+    static const int BUCKETS = 64 + 40 * 32;
+    long long count[ BUCKETS ];
+    long long total;
+    long long max;
+
+    void reset() { memset( this, 0, sizeof( *this ) ); }
+    static int bucket_of( long long us )
+    {
+        if( us < 64 )
+        {
+            return us < 0 ? 0 : us;
+        }
+        int msb = 63 - __builtin_clzll( us );
+        int index = 64 + ( msb - 6 ) * 32 + ( int )( ( us >> ( msb - 5 ) ) - 32 );
+        return index < BUCKETS ? index : BUCKETS - 1;
+    }
+    static long long value_of( int index )
+    {
+        if( index < 64 )
+        {
+            return index;
+        }
+        int msb = ( index - 64 ) / 32 + 6;
+        return ( long long )( ( index - 64 ) % 32 + 32 ) << ( msb - 5 );
+    }
+    void add( long long us )
+    {
+        count[ bucket_of( us ) ]++;
+        total++;
+        if( us > max )
+        {
+            max = us;
+        }
+    }
+    void merge( const histogram &h )
+    {
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            count[ i ] += h.count[ i ];
+        }
+        total += h.total;
+        if( h.max > max )
+        {
+            max = h.max;
+        }
+    }
+    /* 百分位数(微秒), 没有数据时为0*/
+    long long percentile( double p ) const
+    {
+        if( total == 0 )
+        {
+            return 0;
+        }
+        long long rank = ( long long )( total * p / 100.0 );
+        if( rank >= total )
+        {
+            rank = total - 1;
+        }
+        long long seen = 0;
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            seen += count[ i ];
+            if( seen > rank )
+            {
+                long long v = value_of( i );
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+};
+
+/* 一个采样周期内客户端这边的统计*/
+struct client_sample
+{
+    double t;                         /* 距开始的秒数*/
+    int open[ KIND_NUMBER ];          /* 周期结束时已建立的各类连接数*/
+    long long connects;               /* 周期内建立成功的连接数*/
+    long long connect_errors;         /* connect失败的次数*/
+    long long dropped;                /* 被服务器关闭或出错断开的连接数*/
+    long long refused;                /* 应答503的次数(连接数超过max_fd时服务器直接应答503并关闭)*/
+    long long requests;               /* 收完的应答数(所有类型的连接)*/
+    long long bad_responses;          /* 无法解析的应答*/
+    long long connect_p99_us;
+    long long lat_p50_us;
+    long long lat_p99_us;
+    long long lat_p999_us;
+    long long lat_max_us;
+};
+
+/* 一次服务器采样*/
+struct server_sample
+{
+    double t;
+    long rss_kb;                      /* -1表示没有读到*/
+    int fds;
+    bool status_ok;                   /* 状态页是否取到了*/
+    int connections;
+    long long loops;                  /* 与上次采样相比增加的轮数*/
+    long long loop_avg_us;            /* 这段时间内每轮的平均处理时间*/
+    long long loop_max_us;            /* 这段时间内单轮的最长处理时间(状态页每次查看后清零)*/
+    long long accepted;
+    long long refused;
+};
+
+/* 命令行参数*/
+struct soak_options
+{
+    char host[ 64 ];
+    int port;
+    int conns[ KIND_NUMBER ];
+    int ramp_rate;                    /* 每秒最多建立的连接数*/
+    int duration_s;                   /* 连接都建立后再保持的秒数*/
+    int interval_ms;                  /* 采样周期*/
+    int trickle_ms;                   /* 慢速连接每次发送一个字节的间隔*/
+    int sources;                      /* 源地址个数*/
+    pid_t server_pid;
+    char url[ 256 ];
+    char status_url[ 256 ];
+    const char *report_file;
+};
+
+static soak_options g_opt;
+static volatile sig_atomic_t g_stop = 0;
+static long long g_t0;
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_sigint( int sig )
+{
+    g_stop = 1;
+}
+
+/* ---------------- 服务器采样线程 ---------------- */
+
+static pthread_mutex_t g_sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector< server_sample > g_server_samples;
+
+static long read_rss_kb( pid_t pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/status", pid );
+    FILE *fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        return -1;
+    }
+    char line[ 256 ];
+    long rss = -1;
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        if( strncmp( line, "VmRSS:", 6 ) == 0 )
+        {
+            rss = atol( line + 6 );
+            break;
+        }
+    }
+    fclose( fp );
+    return rss;
+}
+
+static int count_fds( pid_t pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/fd", pid );
+    DIR *dir = opendir( path );
+    if( ! dir )
+    {
+        return -1;
+    }
+    int n = 0;
+    struct dirent *ent;
+    while( ( ent = readdir( dir ) ) )
+    {
+        if( ent->d_name[ 0 ] != '.' )
+        {
+            n++;
+        }
+    }
+    closedir( dir );
+    return n;
+}
+
+/* 用一个短连接取状态页, 最多等2秒, 返回读到的长度, 失败返回-1*/
+static int fetch_status( char *buf, int size )
+{
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    struct timeval tv = { 2, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+    setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( g_opt.port );
+    inet_pton( AF_INET, g_opt.host, &addr.sin_addr );
+    if( connect( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 )
+    {
+        close( fd );
+        return -1;
+    }
+    char req[ 512 ];
+    int req_len = snprintf( req, sizeof( req ), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                            g_opt.status_url, g_opt.host );
+    if( send( fd, req, req_len, MSG_NOSIGNAL ) != req_len )
+    {
+        close( fd );
+        return -1;
+    }
+    int len = 0;
+    while( len < size - 1 )
+    {
+        ssize_t n = recv( fd, buf + len, size - 1 - len, 0 );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            break;
+        }
+        len += n;
+    }
+    close( fd );
+    buf[ len ] = '\0';
+    return strncmp( buf, "HTTP/1.1 200", 12 ) == 0 ? len : -1;
+}
+
+/* 从状态页中取出连接数和各反应堆的累计值(各反应堆求和, 最长处理时间取最大)*/
+static bool parse_status( const char *page, int *connections, long long *loops, long long *busy_us,
+                          long long *max_us, long long *accepted, long long *refused )
+{
+    const char *p = strstr( page, "\nconnections: " );
+    if( ! p )
+    {
+        return false;
+    }
+    *connections = atoi( p + 14 );
+    p = strstr( page, "\nreactor " );
+    if( ! p )
+    {
+        return false;
+    }
+    p = strchr( p + 1, '\n' );
+    *loops = *busy_us = *max_us = *accepted = *refused = 0;
+    while( p && *++p )
+    {
+        int id;
+        long long l, e, b, avg, m, a, r;
+        if( sscanf( p, "%d %lld %lld %lld %lld %lld %lld %lld", &id, &l, &e, &b, &avg, &m, &a, &r ) != 8 )
+        {
+            break;
+        }
+        *loops += l;
+        *busy_us += b;
+        *max_us = m > *max_us ? m : *max_us;
+        *accepted += a;
+        *refused += r;
+        p = strchr( p, '\n' );
+    }
+    return true;
+}
+
+static void* sampler_main( void *arg )
+{
+    static char page[ 65536 ];
+    long long prev_loops = -1, prev_busy = 0, prev_accepted = 0, prev_refused = 0;
+    long long next = g_t0;
+    /* 第一次采样在建立连接之前, 作为内存占用的基线*/
+    while( ! g_stop )
+    {
+        server_sample s;
+        memset( &s, 0, sizeof( s ) );
+        s.t = ( now_us() - g_t0 ) / 1e6;
+        s.rss_kb = g_opt.server_pid > 0 ? read_rss_kb( g_opt.server_pid ) : -1;
+        s.fds = g_opt.server_pid > 0 ? count_fds( g_opt.server_pid ) : -1;
+        long long loops, busy, max_us, accepted, refused;
+        if( fetch_status( page, sizeof( page ) ) > 0
+            && parse_status( page, &s.connections, &loops, &busy, &max_us, &accepted, &refused ) )
+        {
+            s.status_ok = true;
+            if( prev_loops >= 0 )
+            {
+                s.loops = loops - prev_loops;
+                s.loop_avg_us = s.loops > 0 ? ( busy - prev_busy ) / s.loops : 0;
+                s.accepted = accepted - prev_accepted;
+                s.refused = refused - prev_refused;
+            }
+            s.loop_max_us = max_us;
+            prev_loops = loops;
+            prev_busy = busy;
+            prev_accepted = accepted;
+            prev_refused = refused;
+        }
+        pthread_mutex_lock( &g_sample_lock );
+        g_server_samples.push_back( s );
+        pthread_mutex_unlock( &g_sample_lock );
+
+        next += g_opt.interval_ms * 1000LL;
+        long long wait = next - now_us();
+        if( wait > 0 )
+        {
+            usleep( wait );
+        }
+    }
+    return NULL;
+}
+
+/* ---------------- 客户端连接 ---------------- */
+
+static soak_conn *g_conns;
+static int g_total;
+static int g_epollfd;
+static std::vector< int > g_pending;      /* 等待建立的连接, 活跃连接优先*/
+static std::vector< int > g_trickle;      /* 慢速连接的下标*/
+static int g_open[ KIND_NUMBER ];
+static int g_next_source;
+static char g_request[ 512 ];
+static int g_request_len;
+
+/* 当前采样周期和整个测试的统计*/
+static client_sample g_cur;
+static histogram g_lat;
+static histogram g_lat_all;
+static histogram g_connect_lat;
+static histogram g_connect_lat_all;
+static long long g_connect_errno[ 256 ];
+
+static void set_events( soak_conn *c, int index, unsigned int events )
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u32 = index;
+    epoll_ctl( g_epollfd, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+/* 关闭连接并放回等待建立的队列*/
+static void drop_conn( int index, bool count )
+{
+    soak_conn *c = &g_conns[ index ];
+    if( c->state != ST_CONNECTING )
+    {
+        g_open[ ( int )c->kind ]--;
+    }
+    if( count )
+    {
+        g_cur.dropped++;
+    }
+    close( c->fd );
+    free( c->hdr );
+    c->hdr = NULL;
+    c->fd = -1;
+    c->state = ST_CLOSED;
+    g_pending.push_back( index );
+}
+
+static void start_response( soak_conn *c, long long now )
+{
+    c->state = ST_READING;
+    c->body_left = -2;
+    c->hdr_len = 0;
+    c->status = 0;
+    c->close_after = false;
+    c->t_start = now;
+}
+
+/* 发送请求的剩余部分, 出错返回false*/
+static bool send_request( int index, long long now )
+{
+    soak_conn *c = &g_conns[ index ];
+    while( c->sent < g_request_len )
+    {
+        ssize_t n = send( c->fd, g_request + c->sent, g_request_len - c->sent, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n < 0 && errno == EAGAIN )
+        {
+            set_events( c, index, EPOLLOUT );
+            return true;
+        }
+        if( n <= 0 )
+        {
+            return false;
+        }
+        c->sent += n;
+    }
+    long long t_begin = c->t_start;
+    start_response( c, now );
+    /* 延迟从开始发送请求算起*/
+    c->t_start = t_begin;
+    set_events( c, index, EPOLLIN | EPOLLRDHUP );
+    return true;
+}
+
+static void begin_request( int index, long long now )
+{
+    soak_conn *c = &g_conns[ index ];
+    c->sent = 0;
+    c->t_start = now;
+    if( c->kind == KIND_TRICKLE )
+    {
+        c->state = ST_TRICKLE;
+        c->t_next = now + g_opt.trickle_ms * 1000LL;
+        set_events( c, index, EPOLLIN | EPOLLRDHUP );
+        return;
+    }
+    c->state = ST_SENDING;
+    if( ! send_request( index, now ) )
+    {
+        drop_conn( index, true );
+    }
+}
+
+static void open_conn( int index, long long now )
+{
+    soak_conn *c = &g_conns[ index ];
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        g_cur.connect_errors++;
+        g_connect_errno[ errno & 255 ]++;
+        g_pending.push_back( index );
+        return;
+    }
+    /* 多个源地址时轮流使用, 端口到connect时才按四元组分配*/
+    if( g_opt.sources > 1 )
+    {
+        int on = 1;
+        setsockopt( fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof( on ) );
+        struct sockaddr_in local;
+        memset( &local, 0, sizeof( local ) );
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl( 0x7f000001 + g_next_source );
+        g_next_source = ( g_next_source + 1 ) % g_opt.sources;
+        bind( fd, ( struct sockaddr* )&local, sizeof( local ) );
+    }
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( g_opt.port );
+    inet_pton( AF_INET, g_opt.host, &addr.sin_addr );
+    if( connect( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 && errno != EINPROGRESS )
+    {
+        g_cur.connect_errors++;
+        g_connect_errno[ errno & 255 ]++;
+        close( fd );
+        g_pending.push_back( index );
+        return;
+    }
+    c->fd = fd;
+    c->state = ST_CONNECTING;
+    c->t_start = now;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.u32 = index;
+    epoll_ctl( g_epollfd, EPOLL_CTL_ADD, fd, &ev );
+}
+
+/* 收完一个应答*/
+static void finish_response( int index, long long now )
+{
+    soak_conn *c = &g_conns[ index ];
+    g_cur.requests++;
+    if( c->status == 503 )
+    {
+        g_cur.refused++;
+    }
+    if( c->kind == KIND_ACTIVE )
+    {
+        g_lat.add( now - c->t_start );
+    }
+    free( c->hdr );
+    c->hdr = NULL;
+    if( c->close_after || c->body_left == -1 )
+    {
+        drop_conn( index, false );
+        return;
+    }
+    if( c->kind == KIND_IDLE )
+    {
+        c->state = ST_HOLD;
+        return;
+    }
+    begin_request( index, now );
+}
+
+/* 解析应答头部, 格式不对返回false*/
+static bool parse_head( soak_conn *c )
+{
+    if( strncmp( c->hdr, "HTTP/1.", 7 ) != 0 || c->hdr_len < 12 )
+    {
+        return false;
+    }
+    c->status = atoi( c->hdr + 9 );
+    c->body_left = -1;
+    bool chunked = false;
+    for( char *line = strstr( c->hdr, "\r\n" ); line; line = strstr( line, "\r\n" ) )
+    {
+        line += 2;
+        if( strncasecmp( line, "Content-Length:", 15 ) == 0 )
+        {
+            c->body_left = atoll( line + 15 );
+        }
+        else if( strncasecmp( line, "Connection:", 11 ) == 0 )
+        {
+            c->close_after = strncasecmp( line + 11 + strspn( line + 11, " " ), "close", 5 ) == 0;
+        }
+        else if( strncasecmp( line, "Transfer-Encoding:", 18 ) == 0 )
+        {
+            chunked = true;
+        }
+    }
+    /* 没有Content-Length的应答只能读到连接关闭为止; chunked的应答不解析, 请求的URL应该是静态文件*/
+    return ! chunked && ( c->body_left >= 0 || c->close_after );
+}
+
+/* 处理收到的应答数据*/
+static void on_data( int index, const char *data, int len, long long now )
+{
+    soak_conn *c = &g_conns[ index ];
+    while( len > 0 && c->state == ST_READING )
+    {
+        if( c->body_left == -2 )
+        {
+            if( ! c->hdr )
+            {
+                c->hdr = ( char* )malloc( 4096 );
+            }
+            int n = len < 4095 - c->hdr_len ? len : 4095 - c->hdr_len;
+            int from = c->hdr_len > 3 ? c->hdr_len - 3 : 0;
+            memcpy( c->hdr + c->hdr_len, data, n );
+            c->hdr_len += n;
+            c->hdr[ c->hdr_len ] = '\0';
+            char *end = strstr( c->hdr + from, "\r\n\r\n" );
+            if( ! end )
+            {
+                if( c->hdr_len == 4095 )
+                {
+                    g_cur.bad_responses++;
+                    drop_conn( index, false );
+                    return;
+                }
+                data += n;
+                len -= n;
+                continue;
+            }
+            int used = end + 4 - c->hdr - ( c->hdr_len - n );
+            *end = '\0';
+            if( ! parse_head( c ) )
+            {
+                g_cur.bad_responses++;
+                drop_conn( index, false );
+                return;
+            }
+            data += used;
+            len -= used;
+            if( c->body_left == 0 )
+            {
+                finish_response( index, now );
+            }
+            continue;
+        }
+        if( c->body_left == -1 )
+        {
+            return;
+        }
+        int n = len < c->body_left ? len : c->body_left;
+        c->body_left -= n;
+        data += n;
+        len -= n;
+        if( c->body_left == 0 )
+        {
+            finish_response( index, now );
+        }
+    }
+}
+
+static void on_event( int index, unsigned int events, long long now )
+{
+    static char buf[ 65536 ];
+    soak_conn *c = &g_conns[ index ];
+    if( c->state == ST_CONNECTING )
+    {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+        if( err )
+        {
+            g_cur.connect_errors++;
+            g_connect_errno[ err & 255 ]++;
+            close( c->fd );
+            c->fd = -1;
+            c->state = ST_CLOSED;
+            g_pending.push_back( index );
+            return;
+        }
+        g_open[ ( int )c->kind ]++;
+        g_cur.connects++;
+        g_connect_lat.add( now - c->t_start );
+        begin_request( index, now );
+        return;
+    }
+    if( c->state == ST_SENDING )
+    {
+        if( ! send_request( index, now ) )
+        {
+            drop_conn( index, true );
+        }
+        return;
+    }
+
+    /* 一次读完内核中的数据, 读到关闭时结束读到关闭为止的应答或算作断开*/
+    while( true )
+    {
+        ssize_t n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if( n > 0 )
+        {
+            if( c->state == ST_READING )
+            {
+                on_data( index, buf, n, now );
+                if( c->state == ST_CLOSED )
+                {
+                    return;
+                }
+            }
+            continue;
+        }
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n < 0 && errno == EAGAIN )
+        {
+            return;
+        }
+        if( n == 0 && c->state == ST_READING && c->body_left == -1 )
+        {
+            finish_response( index, now );
+            return;
+        }
+        drop_conn( index, true );
+        return;
+    }
+}
+
+/* 慢速连接: 到时间的各发一个字节*/
+static void trickle_tick( long long now )
+{
+    for( size_t i = 0; i < g_trickle.size(); ++i )
+    {
+        int index = g_trickle[ i ];
+        soak_conn *c = &g_conns[ index ];
+        if( c->state != ST_TRICKLE || c->t_next > now )
+        {
+            continue;
+        }
+        ssize_t n = send( c->fd, g_request + c->sent, 1, MSG_NOSIGNAL );
+        if( n < 0 && errno == EAGAIN )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            drop_conn( index, true );
+            continue;
+        }
+        c->sent++;
+        c->t_next = now + g_opt.trickle_ms * 1000LL;
+        if( c->sent == g_request_len )
+        {
+            start_response( c, now );
+        }
+    }
+}
+
+/* 结束一个采样周期*/
+static client_sample take_sample( long long now )
+{
+    client_sample s = g_cur;
+    s.t = ( now - g_t0 ) / 1e6;
+    memcpy( s.open, g_open, sizeof( s.open ) );
+    s.connect_p99_us = g_connect_lat.percentile( 99 );
+    s.lat_p50_us = g_lat.percentile( 50 );
+    s.lat_p99_us = g_lat.percentile( 99 );
+    s.lat_p999_us = g_lat.percentile( 99.9 );
+    s.lat_max_us = g_lat.max;
+    g_lat_all.merge( g_lat );
+    g_connect_lat_all.merge( g_connect_lat );
+    g_lat.reset();
+    g_connect_lat.reset();
+    memset( &g_cur, 0, sizeof( g_cur ) );
+    return s;
+}
+
+/* ---------------- 报告 ---------------- */
+
+static void print_header( FILE *fp )
+{
+    fprintf( fp, "%7s %7s %7s %6s %7s %8s %6s %6s %7s %8s %8s %8s %8s %8s %7s %9s %10s %10s %8s\n",
+             "time_s", "idle", "trickle", "active", "conn/s", "cp99_ms", "errors", "503s", "req/s",
+             "p50_ms", "p99_ms", "p999_ms", "max_ms", "rss_MB", "fds", "srv_conns", "loop_avg", "loop_max",
+             "refused" );
+}
+
+/* 找到与客户端采样时间最接近的服务器采样*/
+static const server_sample* match_sample( double t )
+{
+    const server_sample *best = NULL;
+    for( size_t i = 0; i < g_server_samples.size(); ++i )
+    {
+        if( ! best || ( g_server_samples[ i ].t - t ) * ( g_server_samples[ i ].t - t )
+                      < ( best->t - t ) * ( best->t - t ) )
+        {
+            best = &g_server_samples[ i ];
+        }
+    }
+    return best;
+}
+
+static void print_row( FILE *fp, const client_sample &c, const server_sample *s )
+{
+    double secs = g_opt.interval_ms / 1000.0;
+    char rss[ 16 ] = "-", fds[ 16 ] = "-", conns[ 16 ] = "-", avg[ 16 ] = "-", max[ 16 ] = "-", refused[ 16 ] = "-";
+    if( s && s->rss_kb >= 0 )
+    {
+        snprintf( rss, sizeof( rss ), "%.1f", s->rss_kb / 1024.0 );
+        snprintf( fds, sizeof( fds ), "%d", s->fds );
+    }
+    if( s && s->status_ok )
+    {
+        snprintf( conns, sizeof( conns ), "%d", s->connections );
+        snprintf( avg, sizeof( avg ), "%lldus", s->loop_avg_us );
+        snprintf( max, sizeof( max ), "%lldus", s->loop_max_us );
+        snprintf( refused, sizeof( refused ), "%lld", s->refused );
+    }
+    fprintf( fp, "%7.1f %7d %7d %6d %7.0f %8.2f %6lld %6lld %7.0f %8.2f %8.2f %8.2f %8.2f %8s %7s %9s %10s %10s %8s\n",
+             c.t, c.open[ KIND_IDLE ], c.open[ KIND_TRICKLE ], c.open[ KIND_ACTIVE ], c.connects / secs,
+             c.connect_p99_us / 1000.0, c.connect_errors + c.dropped + c.bad_responses, c.refused,
+             c.requests / secs, c.lat_p50_us / 1000.0, c.lat_p99_us / 1000.0, c.lat_p999_us / 1000.0,
+             c.lat_max_us / 1000.0, rss, fds, conns, avg, max, refused );
+}
+
+static void print_report( FILE *fp, const std::vector< client_sample > &samples )
+{
+    fprintf( fp, "soak test against %s:%d, url %s\n", g_opt.host, g_opt.port, g_opt.url );
+    fprintf( fp, "target connections: idle %d, trickle %d (1 byte every %d ms), active %d; "
+             "ramp %d conn/s, hold %d s, %d source address(es)\n\n", g_opt.conns[ KIND_IDLE ],
+             g_opt.conns[ KIND_TRICKLE ], g_opt.trickle_ms, g_opt.conns[ KIND_ACTIVE ], g_opt.ramp_rate,
+             g_opt.duration_s, g_opt.sources );
+    print_header( fp );
+    pthread_mutex_lock( &g_sample_lock );
+    long long connects = 0, connect_errors = 0, dropped = 0, refused = 0, requests = 0, bad = 0;
+    int peak_open = 0;
+    for( size_t i = 0; i < samples.size(); ++i )
+    {
+        const client_sample &c = samples[ i ];
+        print_row( fp, c, match_sample( c.t ) );
+        connects += c.connects;
+        connect_errors += c.connect_errors;
+        dropped += c.dropped;
+        refused += c.refused;
+        requests += c.requests;
+        bad += c.bad_responses;
+        int open = c.open[ KIND_IDLE ] + c.open[ KIND_TRICKLE ] + c.open[ KIND_ACTIVE ];
+        peak_open = open > peak_open ? open : peak_open;
+    }
+
+    /* 服务器这边的峰值, 以及每个连接平均占用的内存(峰值RSS减去开始时的RSS, 除以峰值连接数)*/
+    long first_rss = -1, peak_rss = -1;
+    int peak_fds = -1, peak_conns = -1;
+    long long peak_loop = -1;
+    for( size_t i = 0; i < g_server_samples.size(); ++i )
+    {
+        const server_sample &s = g_server_samples[ i ];
+        if( s.rss_kb >= 0 && first_rss < 0 )
+        {
+            first_rss = s.rss_kb;
+        }
+        peak_rss = s.rss_kb > peak_rss ? s.rss_kb : peak_rss;
+        peak_fds = s.fds > peak_fds ? s.fds : peak_fds;
+        if( s.status_ok )
+        {
+            peak_conns = s.connections > peak_conns ? s.connections : peak_conns;
+            peak_loop = s.loop_max_us > peak_loop ? s.loop_max_us : peak_loop;
+        }
+    }
+    pthread_mutex_unlock( &g_sample_lock );
+
+    fprintf( fp, "\nsummary\n" );
+    fprintf( fp, "  peak open connections (client side): %d\n", peak_open );
+    fprintf( fp, "  connects: %lld ok, %lld failed; dropped by server/errors: %lld; 503 responses: %lld; "
+             "unparsable responses: %lld\n", connects, connect_errors, dropped, refused, bad );
+    for( int e = 0; e < 256; ++e )
+    {
+        if( g_connect_errno[ e ] )
+        {
+            fprintf( fp, "    connect error %s: %lld\n", strerror( e ), g_connect_errno[ e ] );
+        }
+    }
+    fprintf( fp, "  connect latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+             g_connect_lat_all.percentile( 50 ) / 1000.0, g_connect_lat_all.percentile( 99 ) / 1000.0,
+             g_connect_lat_all.max / 1000.0 );
+    fprintf( fp, "  requests: %lld; active latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, "
+             "max %.2f ms (%lld samples)\n", requests, g_lat_all.percentile( 50 ) / 1000.0,
+             g_lat_all.percentile( 90 ) / 1000.0, g_lat_all.percentile( 99 ) / 1000.0,
+             g_lat_all.percentile( 99.9 ) / 1000.0, g_lat_all.max / 1000.0, g_lat_all.total );
+    if( peak_rss >= 0 )
+    {
+        fprintf( fp, "  server RSS: start %.1f MB, peak %.1f MB", first_rss / 1024.0, peak_rss / 1024.0 );
+        if( peak_open > 0 )
+        {
+            fprintf( fp, " (~%.1f KB per connection)", ( peak_rss - first_rss ) / ( double )peak_open );
+        }
+        fprintf( fp, "; peak fds %d\n", peak_fds );
+    }
+    if( peak_conns >= 0 )
+    {
+        fprintf( fp, "  server status: peak connections %d, longest event loop iteration %lld us\n",
+                 peak_conns, peak_loop );
+    }
+    else
+    {
+        fprintf( fp, "  server status page %s was not available\n", g_opt.status_url );
+    }
+}
+
+static void usage( const char *prog )
+{
+    fprintf( stderr,
+             "usage: %s [options]\n"
+             "  -s host      server address (default 127.0.0.1)\n"
+             "  -p port      server port (default 8000)\n"
+             "  -n count     idle keep-alive connections (default 10000)\n"
+             "  -t count     slow-trickle connections (default 100)\n"
+             "  -a count     active connections measuring latency (default 16)\n"
+             "  -r rate      connections opened per second, also for reconnects (default 2000)\n"
+             "  -d seconds   how long to hold after the ramp (default 60)\n"
+             "  -i ms        sample interval (default 1000)\n"
+             "  -T ms        trickle connections send one byte every ms (default 1000)\n"
+             "  -b count     source addresses 127.0.0.1..count, for more than ~28k connections (default 1)\n"
+             "  -P pid       server pid, for RSS and fd count from /proc\n"
+             "  -u url       request path (default /), must answer with Content-Length\n"
+             "  -S url       status page path (default /server-status)\n"
+             "  -o file      also write the report to file\n", prog );
+}
+
+int main( int argc, char *argv[] )
+{
+    strcpy( g_opt.host, "127.0.0.1" );
+    g_opt.port = 8000;
+    g_opt.conns[ KIND_IDLE ] = 10000;
+    g_opt.conns[ KIND_TRICKLE ] = 100;
+    g_opt.conns[ KIND_ACTIVE ] = 16;
+    g_opt.ramp_rate = 2000;
+    g_opt.duration_s = 60;
+    g_opt.interval_ms = 1000;
+    g_opt.trickle_ms = 1000;
+    g_opt.sources = 1;
+    strcpy( g_opt.url, "/" );
+    strcpy( g_opt.status_url, "/server-status" );
+    int opt;
+    while( ( opt = getopt( argc, argv, "s:p:n:t:a:r:d:i:T:b:P:u:S:o:h" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 's': snprintf( g_opt.host, sizeof( g_opt.host ), "%s", optarg ); break;
+            case 'p': g_opt.port = atoi( optarg ); break;
+            case 'n': g_opt.conns[ KIND_IDLE ] = atoi( optarg ); break;
+            case 't': g_opt.conns[ KIND_TRICKLE ] = atoi( optarg ); break;
+            case 'a': g_opt.conns[ KIND_ACTIVE ] = atoi( optarg ); break;
+            case 'r': g_opt.ramp_rate = atoi( optarg ); break;
+            case 'd': g_opt.duration_s = atoi( optarg ); break;
+            case 'i': g_opt.interval_ms = atoi( optarg ); break;
+            case 'T': g_opt.trickle_ms = atoi( optarg ); break;
+            case 'b': g_opt.sources = atoi( optarg ); break;
+            case 'P': g_opt.server_pid = atoi( optarg ); break;
+            case 'u': snprintf( g_opt.url, sizeof( g_opt.url ), "%s", optarg ); break;
+            case 'S': snprintf( g_opt.status_url, sizeof( g_opt.status_url ), "%s", optarg ); break;
+            case 'o': g_opt.report_file = optarg; break;
+            default: usage( argv[ 0 ] ); return 1;
+        }
+    }
+    struct in_addr probe;
+    if( inet_pton( AF_INET, g_opt.host, &probe ) != 1 || g_opt.port <= 0 || g_opt.ramp_rate <= 0
+        || g_opt.interval_ms <= 0 || g_opt.trickle_ms <= 0 || g_opt.sources < 1 || g_opt.sources > 254
+        || g_opt.conns[ KIND_IDLE ] < 0 || g_opt.conns[ KIND_TRICKLE ] < 0 || g_opt.conns[ KIND_ACTIVE ] < 0 )
+    {
+        usage( argv[ 0 ] );
+        return 1;
+    }
+    g_total = g_opt.conns[ KIND_IDLE ] + g_opt.conns[ KIND_TRICKLE ] + g_opt.conns[ KIND_ACTIVE ];
+    g_request_len = snprintf( g_request, sizeof( g_request ),
+                              "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", g_opt.url, g_opt.host );
+
+    /* 描述符上限提到硬上限, 仍然不够时只能少建一些连接(connect错误里会看到EMFILE)*/
+    struct rlimit rl;
+    getrlimit( RLIMIT_NOFILE, &rl );
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &rl );
+    if( ( long long )rl.rlim_cur < g_total + 64 )
+    {
+        fprintf( stderr, "warning: RLIMIT_NOFILE is %lld, fewer than %d connections\n",
+                 ( long long )rl.rlim_cur, g_total );
+    }
+
+    g_conns = new soak_conn[ g_total ];
+    memset( g_conns, 0, sizeof( soak_conn ) * g_total );
+    /* 先建立活跃连接, 整个爬坡过程中都能测到延迟; 空闲连接和慢速连接按比例交错建立*/
+    int index = 0;
+    for( int i = 0; i < g_opt.conns[ KIND_ACTIVE ]; ++i, ++index )
+    {
+        g_conns[ index ].kind = KIND_ACTIVE;
+    }
+    int idle = 0, trickle = 0;
+    while( index < g_total )
+    {
+        bool pick_trickle = trickle < g_opt.conns[ KIND_TRICKLE ]
+                            && ( idle >= g_opt.conns[ KIND_IDLE ]
+                                 || ( long long )trickle * g_opt.conns[ KIND_IDLE ]
+                                    <= ( long long )idle * g_opt.conns[ KIND_TRICKLE ] );
+        g_conns[ index ].kind = pick_trickle ? KIND_TRICKLE : KIND_IDLE;
+        if( pick_trickle )
+        {
+            g_trickle.push_back( index );
+            trickle++;
+        }
+        else
+        {
+            idle++;
+        }
+        ++index;
+    }
+    /* 等待队列从尾部取, 倒序放入*/
+    for( int i = g_total - 1; i >= 0; --i )
+    {
+        g_conns[ i ].fd = -1;
+        g_pending.push_back( i );
+    }
+
+    g_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    signal( SIGPIPE, SIG_IGN );
+    signal( SIGINT, on_sigint );
+    signal( SIGTERM, on_sigint );
+
+    g_t0 = now_us();
+    pthread_t sampler;
+    pthread_create( &sampler, NULL, sampler_main, NULL );
+
+    /* 爬坡所需的时间加上保持的时间*/
+    long long end = g_t0 + ( long long )g_total * 1000000 / g_opt.ramp_rate + g_opt.duration_s * 1000000LL;
+    long long next_sample = g_t0 + g_opt.interval_ms * 1000LL;
+    long long next_trickle = g_t0;
+    long long last_refill = g_t0;
+    double tokens = 0;
+    std::vector< client_sample > samples;
+    struct epoll_event *events = new epoll_event[ 4096 ];
+    fprintf( stderr, "ramping to %d connections at %d/s, then holding for %d s; ctrl-c stops early\n",
+             g_total, g_opt.ramp_rate, g_opt.duration_s );
+    print_header( stderr );
+
+    while( ! g_stop )
+    {
+        long long now = now_us();
+        if( now >= end )
+        {
+            break;
+        }
+
+        /* 令牌桶限制建立连接的速度, 重新建立的连接也受它限制, 服务器拒绝连接时不会变成忙等重连*/
+        tokens += ( now - last_refill ) * g_opt.ramp_rate / 1e6;
+        tokens = tokens > g_opt.ramp_rate / 10.0 + 1 ? g_opt.ramp_rate / 10.0 + 1 : tokens;
+        last_refill = now;
+        while( tokens >= 1 && ! g_pending.empty() )
+        {
+            int next = g_pending.back();
+            g_pending.pop_back();
+            open_conn( next, now );
+            tokens -= 1;
+        }
+
+        if( now >= next_trickle )
+        {
+            trickle_tick( now );
+            next_trickle = now + 10000;
+        }
+
+        if( now >= next_sample )
+        {
+            client_sample s = take_sample( now );
+            samples.push_back( s );
+            pthread_mutex_lock( &g_sample_lock );
+            server_sample latest;
+            bool has_latest = ! g_server_samples.empty();
+            if( has_latest )
+            {
+                latest = g_server_samples.back();
+            }
+            pthread_mutex_unlock( &g_sample_lock );
+            print_row( stderr, s, has_latest ? &latest : NULL );
+            next_sample += g_opt.interval_ms * 1000LL;
+        }
+
+        int timeout = g_pending.empty() ? 10 : 1;
+        int n = epoll_wait( g_epollfd, events, 4096, timeout );
+        now = now_us();
+        for( int i = 0; i < n; ++i )
+        {
+            int idx = events[ i ].data.u32;
+            if( g_conns[ idx ].state != ST_CLOSED )
+            {
+                on_event( idx, events[ i ].events, now );
+            }
+        }
+    }
+    g_stop = 1;
+    pthread_join( sampler, NULL );
+
+    print_report( stdout, samples );
+    if( g_opt.report_file )
+    {
+        FILE *fp = fopen( g_opt.report_file, "w" );
+        if( ! fp )
+        {
+            fprintf( stderr, "open %s: %s\n", g_opt.report_file, strerror( errno ) );
+            return 1;
+        }
+        print_report( fp, samples );
+        fclose( fp );
+    }
+    return 0;
+}
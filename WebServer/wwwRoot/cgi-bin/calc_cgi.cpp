@@ -45,12 +45,13 @@ void getSum(char *sum, char *op1, char *op2)
     sprintf(sum, "%s%s", op1, op2);
 }
 
-void send_200_OK(int content_length)
+/* 输出CGI头部, 以空行结束
+ * 状态行、消息体长度和连接的管理都由web服务器负责(以chunked方式转发消息体), 这里只需给出状态和内容类型
+ */
+void send_200_OK()
 {
-    printf("HTTP/1.1 200 OK\r\n");
+    printf("Status: 200 OK\r\n");
     printf("Server: My Web Server\r\n");
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", content_length);
     printf("Content-type: text/html; charset=UTF-8\r\n\r\n");
 }
 
@@ -90,7 +91,7 @@ bool calc_arg(char *buff)
     char response[ BUFSIZ ] = "";
     sprintf(response, "<html><body> <h1> 计算 %s + %s 的结果？ </h1><h1> %s + %s = %s </h1></body><html>", op1, op2, op1, op2, sum );
 
-    send_200_OK(strlen(response));
+    send_200_OK();
     printf("%s", response);
 
     return true;